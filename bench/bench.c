@@ -0,0 +1,1142 @@
+/* limbo_bench: microbenchmarks of the code every packet goes through.
+ *
+ * Every benchmark runs its operation in a loop, doubling the iteration count
+ * until a run takes at least the minimum time, and reports the best of a few
+ * such runs. The binary is linked with --wrap for the allocator functions, so
+ * whatever the server code allocates while a benchmark runs is counted too.
+ *
+ * Results go to stdout as one JSON object per line:
+ *   {"bench":"varint_read","iters":...,"ns_per_op":...,"allocs_per_op":...,"bytes_per_op":...}
+ *
+ * With -b, the benchmarks named in a budget file are run instead and the exit
+ * status is 1 if one of them allocates more than the file allows, which is how
+ * bench/alloc_budgets.txt keeps the handshake, status, login and keep alive
+ * round trips from picking up allocations.
+ *
+ * Before anything is run, the dimension codec of every version that takes one
+ * is decoded and compared with the fields clients need from it, one
+ *   {"check":"regdata_codec","protover":...,"bytes":...,"pass":...}
+ * line per version; if one of them is wrong the run fails without benchmarks. */
+
+#include "protocol.h"
+#include "utf.h"
+#include "utils.h"
+#include "uuid.h"
+#include "list.h"
+#include "client.h"
+#include "event.h"
+#include "epoch.h"
+#include "preconn.h"
+#include "registry.h"
+#include "pktcache.h"
+#include "regdata.h"
+#include "nbt.h"
+#include "world.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/* allocation counting */
+
+void *__real_malloc(size_t sz);
+void *__real_calloc(size_t nmemb, size_t sz);
+void *__real_realloc(void *ptr, size_t sz);
+void __real_free(void *ptr);
+
+// only counted while a benchmark is being timed, and the benchmarks are all run on this thread
+bool bench_counting = false;
+uint64_t bench_allocs = 0;
+uint64_t bench_alloc_bytes = 0;
+
+void *__wrap_malloc(size_t sz) {
+    if (bench_counting) {
+        ++bench_allocs;
+        bench_alloc_bytes += sz;
+    }
+    return __real_malloc(sz);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t sz) {
+    if (bench_counting) {
+        ++bench_allocs;
+        bench_alloc_bytes += nmemb * sz;
+    }
+    return __real_calloc(nmemb, sz);
+}
+
+// a realloc is counted as an allocation of the new size, growing a buffer costs the same as a fresh one
+void *__wrap_realloc(void *ptr, size_t sz) {
+    if (bench_counting) {
+        ++bench_allocs;
+        bench_alloc_bytes += sz;
+    }
+    return __real_realloc(ptr, sz);
+}
+
+void __wrap_free(void *ptr) {
+    __real_free(ptr);
+}
+
+/* harness */
+
+// written by the benchmarks so the compiler can't throw away what they compute
+volatile uint64_t bench_sink;
+
+struct bench {
+    const char *name;
+    void (*run)(uint64_t iters);
+};
+
+#define BENCH_SAMPLES (3)
+#define BENCH_MAX_ITERS (1ull << 32)
+
+uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+struct bench_result {
+    uint64_t iters, ns, allocs, bytes;
+};
+
+void bench_time(const struct bench *b, uint64_t iters, struct bench_result *res) {
+    bench_allocs = bench_alloc_bytes = 0;
+    bench_counting = true;
+    uint64_t start = bench_now_ns();
+    (*b->run)(iters);
+    uint64_t end = bench_now_ns();
+    bench_counting = false;
+
+    res->iters = iters;
+    res->ns = end - start;
+    res->allocs = bench_allocs;
+    res->bytes = bench_alloc_bytes;
+}
+
+void bench_report(const struct bench *b, const struct bench_result *res) {
+    double iters = (double)res->iters;
+    printf("{\"bench\":\"%s\",\"iters\":%llu,\"ns_per_op\":%.2f,\"allocs_per_op\":%.3f,\"bytes_per_op\":%.1f}\n",
+        b->name, (unsigned long long)res->iters, (double)res->ns / iters,
+        (double)res->allocs / iters, (double)res->bytes / iters);
+    fflush(stdout);
+}
+
+void bench_run(const struct bench *b, uint64_t min_ns, struct bench_result *best) {
+    struct bench_result res;
+    uint64_t iters = 1;
+
+    // find an iteration count that takes long enough to time
+    for (;;) {
+        bench_time(b, iters, &res);
+        if (res.ns >= min_ns || iters >= BENCH_MAX_ITERS) break;
+
+        // aim a little past the minimum straight away once the run took measurable time
+        if (res.ns > 1000000) {
+            uint64_t want = (uint64_t)((double)iters * 1.2 * (double)min_ns / (double)res.ns);
+            iters = want > iters * 2 ? want : iters * 2;
+        } else {
+            iters *= 2;
+        }
+    }
+
+    *best = res;
+    for (int i = 1; i < BENCH_SAMPLES; ++i) {
+        bench_time(b, iters, &res);
+        if (res.ns < best->ns) *best = res;
+    }
+}
+
+/* protocol readers and writers */
+
+jmp_buf bench_errlbl;
+
+// fills buf with count encodings of values, returns how many bytes that took
+size_t bench_fill_varints(unsigned char *buf, size_t count) {
+    struct auto_buffer ab;
+    ab_init(&ab, 0, 0);
+    for (size_t i = 0; i < count; ++i) {
+        // a mix of lengths, the way packet ids, lengths and coordinates come in
+        int32_t val = (int32_t)((i * 2654435761u) >> (i % 5 * 7));
+        proto_write_varint(&ab, val);
+    }
+
+    size_t len = ab_getwrcur(&ab);
+    memcpy(buf, ab.buf, len);
+    ab_free(&ab);
+    return len;
+}
+
+#define BENCH_VARINTS (1024)
+
+void bench_varint_read(uint64_t iters) {
+    unsigned char buf[BENCH_VARINTS * 5];
+    size_t len = bench_fill_varints(buf, BENCH_VARINTS);
+
+    struct read_context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.errlbl = &bench_errlbl;
+    if (setjmp(bench_errlbl)) {
+        fprintf(stderr, "varint_read: %s\n", ctx.reason);
+        exit(1);
+    }
+
+    uint64_t acc = 0;
+    unsigned char *cur = buf;
+    ctx.remain = (int32_t)len;
+    for (uint64_t i = 0; i < iters; ++i) {
+        if (ctx.remain == 0) {
+            cur = buf;
+            ctx.remain = (int32_t)len;
+        }
+        acc += (uint32_t)proto_read_varint(&cur, &ctx);
+    }
+    bench_sink = acc;
+}
+
+void bench_varint_write(uint64_t iters) {
+    struct auto_buffer ab;
+    ab_init(&ab, 4096, 0);
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        if (ab.capacity - ab_getwrcur(&ab) < 5) ab_rewind(&ab, AB_REWIND_RDWR);
+        proto_write_varint(&ab, (int32_t)((i * 2654435761u) >> (i % 5 * 7)));
+    }
+    bench_sink = ab_getwrcur(&ab);
+    ab_free(&ab);
+}
+
+#define BENCH_FIXED_BYTES (4096)
+#define BENCH_FIXED_GROUP (1 + 2 + 4 + 8 + 8 + 4)
+
+void bench_fixed_read(uint64_t iters) {
+    unsigned char buf[BENCH_FIXED_BYTES];
+    for (size_t i = 0; i < sizeof(buf); ++i) buf[i] = (unsigned char)(i * 31);
+
+    struct read_context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.errlbl = &bench_errlbl;
+    if (setjmp(bench_errlbl)) {
+        fprintf(stderr, "fixed_read: %s\n", ctx.reason);
+        exit(1);
+    }
+
+    // one op is one of each: byte, short, int, long, double, float
+    uint64_t acc = 0;
+    unsigned char *cur = buf;
+    ctx.remain = 0;
+    for (uint64_t i = 0; i < iters; ++i) {
+        if (ctx.remain < BENCH_FIXED_GROUP) {
+            cur = buf;
+            ctx.remain = BENCH_FIXED_BYTES;
+        }
+        acc += (uint8_t)proto_read_byte(&cur, &ctx);
+        acc += (uint16_t)proto_read_short(&cur, &ctx);
+        acc += (uint32_t)proto_read_int(&cur, &ctx);
+        acc += (uint64_t)proto_read_long(&cur, &ctx);
+
+        // random bits make for NaNs and huge values, which can't be converted to integers
+        double dval = proto_read_double(&cur, &ctx);
+        float fval = proto_read_float(&cur, &ctx);
+        uint64_t dbits;
+        uint32_t fbits;
+        memcpy(&dbits, &dval, sizeof(dbits));
+        memcpy(&fbits, &fval, sizeof(fbits));
+        acc += dbits + fbits;
+    }
+    bench_sink = acc;
+}
+
+void bench_fixed_write(uint64_t iters) {
+    struct auto_buffer ab;
+    ab_init(&ab, 4096, 0);
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        if (ab.capacity - ab_getwrcur(&ab) < BENCH_FIXED_GROUP) ab_rewind(&ab, AB_REWIND_RDWR);
+        proto_write_byte(&ab, (int8_t)i);
+        proto_write_short(&ab, (int16_t)i);
+        proto_write_int(&ab, (int32_t)i);
+        proto_write_long(&ab, (int64_t)i);
+        proto_write_double(&ab, (double)i);
+        proto_write_float(&ab, (float)i);
+    }
+    bench_sink = ab_getwrcur(&ab);
+    ab_free(&ab);
+}
+
+// what a status response or a kick message typically looks like
+const wchar_t *const bench_text = L"{\"version\":{\"name\":\"1.8.9\",\"protocol\":47},\"players\":{\"max\":100,\"online\":0},\"description\":{\"text\":\"A limbo server §a✔\"}}";
+
+void bench_wlenstr(uint64_t iters) {
+    struct auto_buffer ab;
+    ab_init(&ab, 4096, 0);
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        ab_rewind(&ab, AB_REWIND_RDWR);
+        proto_write_wlenstr(&ab, bench_text, -1);
+    }
+    bench_sink = ab_getwrcur(&ab);
+    ab_free(&ab);
+}
+
+void bench_utf16be_lenstr(uint64_t iters) {
+    struct auto_buffer ab;
+    ab_init(&ab, 4096, 0);
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        ab_rewind(&ab, AB_REWIND_RDWR);
+        proto_write_utf16be_lenstr(&ab, bench_text, -1);
+    }
+    bench_sink = ab_getwrcur(&ab);
+    ab_free(&ab);
+}
+
+/* buffers */
+
+// one op is growing an empty buffer to 4 KiB, 16 bytes at a time
+void bench_ab_push_grow(uint64_t iters) {
+    unsigned char chunk[16];
+    memset(chunk, 0x5a, sizeof(chunk));
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        struct auto_buffer ab;
+        ab_init(&ab, 0, 0);
+        for (int j = 0; j < 4096 / 16; ++j) ab_push(&ab, chunk, sizeof(chunk));
+        bench_sink = ab_getwrcur(&ab);
+        ab_free(&ab);
+    }
+}
+
+// the same pushes into a buffer that is big enough from the start
+void bench_ab_push_reuse(uint64_t iters) {
+    unsigned char chunk[16];
+    memset(chunk, 0x5a, sizeof(chunk));
+
+    struct auto_buffer ab;
+    ab_init(&ab, 4096, 0);
+    for (uint64_t i = 0; i < iters; ++i) {
+        ab_rewind(&ab, AB_REWIND_RDWR);
+        for (int j = 0; j < 4096 / 16; ++j) ab_push(&ab, chunk, sizeof(chunk));
+        bench_sink = ab_getwrcur(&ab);
+    }
+    ab_free(&ab);
+}
+
+/* UUIDs */
+
+void bench_uuid_offline(uint64_t iters) {
+    char name[17];
+    struct uuid id;
+    uint64_t acc = 0;
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        snprintf(name, sizeof(name), "Player%llu", (unsigned long long)(i & 0xffff));
+        uuid_gen_name(&id, "OfflinePlayer:", name);
+        acc += id.mostsig ^ id.leastsig;
+    }
+    bench_sink = acc;
+}
+
+void bench_uuid_format(uint64_t iters) {
+    struct uuid id = { 0x0123456789abcdefull, 0xfedcba9876543210ull };
+    char str[UUID_STRLEN + 1];
+    uint64_t acc = 0;
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        id.leastsig += i;
+        uuid_format(&id, str, sizeof(str));
+        acc += (unsigned char)str[i % UUID_STRLEN];
+    }
+    bench_sink = acc;
+}
+
+/* lists */
+
+#define BENCH_LIST_LEN (1000)
+
+// one op is visiting one node, over a list of BENCH_LIST_LEN of them
+void bench_dllist_foreach(uint64_t iters) {
+    dllist_t *list = dll_create();
+    int values[BENCH_LIST_LEN];
+    for (int i = 0; i < BENCH_LIST_LEN; ++i) {
+        values[i] = i;
+        dll_addend(list, values + i);
+    }
+
+    uint64_t acc = 0;
+    for (uint64_t done = 0; done < iters; done += BENCH_LIST_LEN) {
+        DLLIST_FOREACH(list, node) {
+            acc += *(int *)node->ptr;
+        } DLLIST_FOREACH_DONE(list);
+    }
+    bench_sink = acc;
+
+    dll_free(list);
+}
+
+/* packets */
+
+client_t *bench_client = NULL;
+unsigned char bench_chunk[4096 + 256];
+struct game_profile bench_profile;
+
+// All the clientbound packets. The client writes to /dev/null, so what is timed is framing, encoding and the write.
+void bench_packets_init(void) {
+    int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open /dev/null");
+        exit(1);
+    }
+
+    sockaddrs addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.in.sin_family = AF_INET;
+    bench_client = client_init(fd, &addr.base, sizeof(addr.in));
+    bench_client->fd->state |= FD_CAN_WRITE;
+    bench_client->protocol_ver = PROTOVER_1_8;
+
+    for (size_t i = 0; i < sizeof(bench_chunk); ++i) bench_chunk[i] = (unsigned char)(i * 7);
+
+    memset(&bench_profile, 0, sizeof(bench_profile));
+    strcpy(bench_profile.name, "Player1234");
+    uuid_gen_name(&bench_profile.id, "OfflinePlayer:", bench_profile.name);
+}
+
+void bench_packets_free(void) {
+    if (!bench_client) return;
+
+    // it was never added to a loop, so there is nothing to take it out of
+    close(bench_client->fd->fd);
+    bench_client->fd->fd = -1;
+    client_free(bench_client);
+    bench_client = NULL;
+}
+
+void bench_write_pkt(unsigned protocol, void *pkt, uint64_t iters) {
+    bench_client->protocol = protocol;
+    for (uint64_t i = 0; i < iters; ++i) {
+        client_write_pkt(bench_client, pkt);
+    }
+}
+
+void bench_pkt_status_response(uint64_t iters) {
+    struct packet_status_response pkt = { .id = PKTID_WRITE_STATUS_RESPONSE, .text = bench_text };
+    bench_write_pkt(PROTOCOL_STATUS, &pkt, iters);
+}
+
+void bench_pkt_status_pong(uint64_t iters) {
+    struct packet_status_pong pkt = { .id = PKTID_WRITE_STATUS_PONG, .payload = 0x0123456789abcdefll };
+    bench_write_pkt(PROTOCOL_STATUS, &pkt, iters);
+}
+
+void bench_pkt_login_disconnect(uint64_t iters) {
+    struct packet_disconnect pkt = { .id = PKTID_WRITE_LOGIN_DISCONNECT, .wide = true, .text.w = L"{\"text\":\"You are already connected to this server!\"}" };
+    bench_write_pkt(PROTOCOL_LOGIN, &pkt, iters);
+}
+
+void bench_pkt_login_success(uint64_t iters) {
+    struct packet_login_success pkt = { .id = PKTID_WRITE_LOGIN_SUCCESS, .profile = &bench_profile };
+    bench_write_pkt(PROTOCOL_LOGIN, &pkt, iters);
+}
+
+void bench_pkt_play_keep_alive(uint64_t iters) {
+    struct packet_play_keep_alive pkt = { .id = PKTID_WRITE_PLAY_KEEP_ALIVE, .payload = 123456 };
+    bench_write_pkt(PROTOCOL_PLAY, &pkt, iters);
+}
+
+void bench_pkt_play_join_game(uint64_t iters) {
+    struct packet_play_join_game pkt = {
+        .id = PKTID_WRITE_PLAY_JOIN_GAME, .peid = 1, .gamemode = 3, .dimension = 0,
+        .difficulty = 0, .max_players = 100, .level_type = "flat", .reduced_dbg_info = false
+    };
+    bench_write_pkt(PROTOCOL_PLAY, &pkt, iters);
+}
+
+void bench_pkt_play_spawn_pos(uint64_t iters) {
+    struct packet_play_spawn_position pkt = { .id = PKTID_WRITE_PLAY_SPAWN_POS, .pos = { 8, 64, -8 } };
+    bench_write_pkt(PROTOCOL_PLAY, &pkt, iters);
+}
+
+void bench_pkt_play_pos_look(uint64_t iters) {
+    struct packet_play_player_position_look pkt = {
+        .id = PKTID_WRITE_PLAY_PLAYER_POS_LOOK, .x = 8.5, .y = 65.0, .z = -7.5, .yaw = 90.f, .pitch = 0.f, .flags = 0
+    };
+    bench_write_pkt(PROTOCOL_PLAY, &pkt, iters);
+}
+
+void bench_pkt_play_chunk_data(uint64_t iters) {
+    struct packet_play_chunk_data pkt = {
+        .id = PKTID_WRITE_PLAY_CHUNK_DATA, .x = 0, .z = 0, .full = true, .mask = 1,
+        .data = bench_chunk, .datalen = sizeof(bench_chunk)
+    };
+    bench_write_pkt(PROTOCOL_PLAY, &pkt, iters);
+}
+
+void bench_pkt_play_disconnect(uint64_t iters) {
+    struct packet_disconnect pkt = { .id = PKTID_WRITE_PLAY_DISCONNECT, .wide = false, .text.c = "{\"text\":\"Server closed\"}" };
+    bench_write_pkt(PROTOCOL_PLAY, &pkt, iters);
+}
+
+// framing alone, into a buffer that is reused, with nothing written anywhere
+void bench_frame_pos_look(uint64_t iters) {
+    struct packet_play_player_position_look pkt = {
+        .id = PKTID_WRITE_PLAY_PLAYER_POS_LOOK, .x = 8.5, .y = 65.0, .z = -7.5, .yaw = 90.f, .pitch = 0.f, .flags = 0
+    };
+    struct auto_buffer ab;
+    ab_init(&ab, 4096, 0);
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        ab_rewind(&ab, AB_REWIND_RDWR);
+        proto_frame_pkt(&ab, PROTOCOL_PLAY, NULL, &pkt);
+    }
+    bench_sink = ab_getwrcur(&ab);
+    ab_free(&ab);
+}
+
+/* dimension codec */
+
+// one op is encoding the 1.18.2 codec into a buffer that is reused, what regdata_codec does once per version
+void bench_regdata_codec(uint64_t iters) {
+    struct auto_buffer ab;
+    ab_init(&ab, 8192, 0);
+
+    for (uint64_t i = 0; i < iters; ++i) {
+        ab_rewind(&ab, AB_REWIND_RDWR);
+        if (regdata_encode_codec(&ab, PROTOVER_1_18_2) < 0) {
+            fprintf(stderr, "the dimension codec could not be encoded\n");
+            exit(1);
+        }
+    }
+    bench_sink = ab_getwrcur(&ab);
+    ab_free(&ab);
+}
+
+/* What the codec has to say, read back out of regdata_codec with the NBT
+ * reader the world loader uses. Each line is a field of an element of one of
+ * the registries, or of a compound inside it when sub is set, for the protocol
+ * versions from..until; a tag of NBT_END means the field must not be there. */
+struct bench_codec_field {
+    const char *registry, *entry, *field, *sub;
+    protover_t from, until;
+    uint8_t tag;
+    int64_t i;
+    double d;
+    const char *s;
+};
+
+#define BENCH_DIMS "minecraft:dimension_type"
+#define BENCH_BIOMES "minecraft:worldgen/biome"
+// both registries have three entries
+#define BENCH_CODEC_ENTRIES (3)
+
+const struct bench_codec_field bench_codec_fields[] = {
+    { BENCH_DIMS, "minecraft:overworld", "piglin_safe", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_BYTE, 0, 0, NULL },
+    { BENCH_DIMS, "minecraft:overworld", "natural", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_BYTE, 1, 0, NULL },
+    { BENCH_DIMS, "minecraft:overworld", "ambient_light", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_FLOAT, 0, 0.0f, NULL },
+    { BENCH_DIMS, "minecraft:overworld", "fixed_time", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_END, 0, 0, NULL },
+    { BENCH_DIMS, "minecraft:overworld", "infiniburn", NULL, PROTOVER_1_16_2, PROTOVER_1_18, NBT_STRING, 0, 0, "minecraft:infiniburn_overworld" },
+    { BENCH_DIMS, "minecraft:overworld", "infiniburn", NULL, PROTOVER_1_18_2, PROTOVER_1_18_2, NBT_STRING, 0, 0, "#minecraft:infiniburn_overworld" },
+    { BENCH_DIMS, "minecraft:overworld", "effects", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_STRING, 0, 0, "minecraft:overworld" },
+    { BENCH_DIMS, "minecraft:overworld", "min_y", NULL, PROTOVER_1_16_2, PROTOVER_1_17 - 1, NBT_END, 0, 0, NULL },
+    { BENCH_DIMS, "minecraft:overworld", "min_y", NULL, PROTOVER_1_17, PROTOVER_1_18_2, NBT_INT, 0, 0, NULL },
+    { BENCH_DIMS, "minecraft:overworld", "height", NULL, PROTOVER_1_16_2, PROTOVER_1_17 - 1, NBT_END, 0, 0, NULL },
+    { BENCH_DIMS, "minecraft:overworld", "height", NULL, PROTOVER_1_17, PROTOVER_1_18_2, NBT_INT, 256, 0, NULL },
+    { BENCH_DIMS, "minecraft:overworld", "logical_height", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_INT, 256, 0, NULL },
+    { BENCH_DIMS, "minecraft:overworld", "coordinate_scale", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_DOUBLE, 0, 1.0, NULL },
+    { BENCH_DIMS, "minecraft:overworld", "has_ceiling", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_BYTE, 0, 0, NULL },
+    { BENCH_DIMS, "minecraft:the_nether", "fixed_time", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_LONG, 18000, 0, NULL },
+    { BENCH_DIMS, "minecraft:the_nether", "ambient_light", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_FLOAT, 0, 0.1f, NULL },
+    { BENCH_DIMS, "minecraft:the_nether", "ultrawarm", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_BYTE, 1, 0, NULL },
+    { BENCH_DIMS, "minecraft:the_nether", "has_ceiling", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_BYTE, 1, 0, NULL },
+    { BENCH_DIMS, "minecraft:the_nether", "logical_height", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_INT, 128, 0, NULL },
+    { BENCH_DIMS, "minecraft:the_nether", "coordinate_scale", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_DOUBLE, 0, 8.0, NULL },
+    { BENCH_DIMS, "minecraft:the_end", "fixed_time", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_LONG, 6000, 0, NULL },
+    { BENCH_DIMS, "minecraft:the_end", "infiniburn", NULL, PROTOVER_1_18_2, PROTOVER_1_18_2, NBT_STRING, 0, 0, "#minecraft:infiniburn_end" },
+    { BENCH_BIOMES, "minecraft:plains", "precipitation", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_STRING, 0, 0, "rain" },
+    { BENCH_BIOMES, "minecraft:plains", "depth", NULL, PROTOVER_1_16_2, PROTOVER_1_18 - 1, NBT_FLOAT, 0, 0.125f, NULL },
+    { BENCH_BIOMES, "minecraft:plains", "depth", NULL, PROTOVER_1_18, PROTOVER_1_18_2, NBT_END, 0, 0, NULL },
+    { BENCH_BIOMES, "minecraft:plains", "scale", NULL, PROTOVER_1_18, PROTOVER_1_18_2, NBT_END, 0, 0, NULL },
+    { BENCH_BIOMES, "minecraft:plains", "temperature", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_FLOAT, 0, 0.8f, NULL },
+    { BENCH_BIOMES, "minecraft:plains", "downfall", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_FLOAT, 0, 0.4f, NULL },
+    { BENCH_BIOMES, "minecraft:plains", "category", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_STRING, 0, 0, "plains" },
+    { BENCH_BIOMES, "minecraft:plains", "effects", "sky_color", PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_INT, 7907327, 0, NULL },
+    { BENCH_BIOMES, "minecraft:plains", "effects", "water_fog_color", PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_INT, 329011, 0, NULL },
+    { BENCH_BIOMES, "minecraft:the_void", "precipitation", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_STRING, 0, 0, "none" },
+    { BENCH_BIOMES, "minecraft:the_end", "category", NULL, PROTOVER_1_16_2, PROTOVER_1_18_2, NBT_STRING, 0, 0, "theend" }
+};
+
+#define BENCH_CODEC_FIELD_COUNT (sizeof(bench_codec_fields) / sizeof(bench_codec_fields[0]))
+
+// Finds a field of a compound, false if it isn't there.
+bool bench_nbt_field(const struct nbt_reader *parent, const struct nbt_value *compound, const char *field, struct nbt_value *val) {
+    struct nbt_reader rd;
+    const char *name;
+    uint16_t namelen;
+
+    nbt_reader_at(&rd, parent, compound);
+    while (nbt_compound_next(&rd, &name, &namelen, val) == 1) {
+        if (nbt_name_eq(name, namelen, field)) return true;
+    }
+    return false;
+}
+
+/* Checks the shape of a registry: its type, and that its entries are named and
+ * numbered in order. Finds the element of entry on the way. */
+bool bench_codec_registry(const struct nbt_reader *rd, const struct nbt_value *root, const char *registry,
+    int32_t count, const char *entry, struct nbt_value *element) {
+    struct nbt_value reg, val, list, name, id;
+    bool found = false;
+
+    if (!bench_nbt_field(rd, root, registry, &reg) || reg.tag != NBT_COMPOUND) {
+        fprintf(stderr, "the codec has no %s compound\n", registry);
+        return false;
+    }
+    if (!bench_nbt_field(rd, &reg, "type", &val) || val.tag != NBT_STRING || !nbt_name_eq(val.v.s.str, val.v.s.len, registry)) {
+        fprintf(stderr, "%s has the wrong type\n", registry);
+        return false;
+    }
+    if (!bench_nbt_field(rd, &reg, "value", &list) || list.tag != NBT_LIST ||
+        list.v.nest.elemtag != NBT_COMPOUND || list.v.nest.len != count) {
+        fprintf(stderr, "%s should have a list of %d compounds\n", registry, count);
+        return false;
+    }
+
+    struct nbt_reader lrd;
+    int32_t remain = list.v.nest.len, idx = 0;
+    nbt_reader_at(&lrd, rd, &list);
+    while (nbt_list_next(&lrd, list.v.nest.elemtag, &remain, &val) == 1) {
+        if (!bench_nbt_field(rd, &val, "name", &name) || name.tag != NBT_STRING ||
+            !bench_nbt_field(rd, &val, "id", &id) || id.tag != NBT_INT || id.v.i != idx) {
+            fprintf(stderr, "entry %d of %s has no name or the wrong id\n", idx, registry);
+            return false;
+        }
+        if (nbt_name_eq(name.v.s.str, name.v.s.len, entry)) {
+            if (!bench_nbt_field(rd, &val, "element", element) || element->tag != NBT_COMPOUND) {
+                fprintf(stderr, "%s in %s has no element\n", entry, registry);
+                return false;
+            }
+            found = true;
+        }
+        ++idx;
+    }
+    if (lrd.error || idx != count) {
+        fprintf(stderr, "the entries of %s could not be read\n", registry);
+        return false;
+    }
+    if (!found) fprintf(stderr, "%s has no %s\n", registry, entry);
+    return found;
+}
+
+bool bench_codec_check_field(const struct nbt_reader *rd, const struct nbt_value *root, protover_t protover,
+    const struct bench_codec_field *f) {
+    struct nbt_value element, val;
+    if (!bench_codec_registry(rd, root, f->registry, BENCH_CODEC_ENTRIES, f->entry, &element)) return false;
+
+    bool there = bench_nbt_field(rd, &element, f->field, &val);
+    if (there && f->sub) {
+        struct nbt_value compound = val;
+        there = compound.tag == NBT_COMPOUND && bench_nbt_field(rd, &compound, f->sub, &val);
+    }
+    const char *what = f->sub ? f->sub : f->field;
+
+    if (f->tag == NBT_END) {
+        if (!there) return true;
+        fprintf(stderr, "protocol %u: %s of %s should not be there\n", protover, what, f->entry);
+        return false;
+    }
+    if (!there || val.tag != f->tag) {
+        fprintf(stderr, "protocol %u: %s of %s is missing or has tag %u instead of %u\n",
+            protover, what, f->entry, there ? val.tag : 0, f->tag);
+        return false;
+    }
+
+    bool ok;
+    switch (f->tag) {
+        case NBT_FLOAT:
+        case NBT_DOUBLE:
+            ok = val.v.d == f->d;
+            break;
+        case NBT_STRING:
+            ok = nbt_name_eq(val.v.s.str, val.v.s.len, f->s);
+            break;
+        default:
+            ok = val.v.i == f->i;
+            break;
+    }
+    if (!ok) fprintf(stderr, "protocol %u: %s of %s has the wrong value\n", protover, what, f->entry);
+    return ok;
+}
+
+/* Decodes the codec of every version that needs one and compares it with
+ * bench_codec_fields. The dimension sent beside the codec has to be the same
+ * bytes as the element of that dimension in it. */
+bool bench_check_codec(void) {
+    const struct { int dimension; const char *name; } dims[] = {
+        { WORLD_DIM_OVERWORLD, "minecraft:overworld" },
+        { WORLD_DIM_NETHER,    "minecraft:the_nether" },
+        { WORLD_DIM_END,       "minecraft:the_end" }
+    };
+    size_t len;
+    bool ok = true;
+
+    if (regdata_codec(PROTOVER_1_16_2 - 1, &len) || regdata_codec(PROTOVER_1_18_2 + 1, &len)) {
+        fprintf(stderr, "there is a codec for a version that doesn't take one\n");
+        ok = false;
+    }
+
+    struct auto_buffer dimbuf;
+    ab_init(&dimbuf, 1024, 0);
+    for (protover_t protover = PROTOVER_1_16_2; protover <= PROTOVER_1_18_2; ++protover) {
+        const unsigned char *codec = regdata_codec(protover, &len);
+        struct nbt_reader rd;
+        struct nbt_value root, val;
+        const char *name;
+        uint16_t namelen;
+        bool pass = false;
+        int res;
+
+        if (!codec) {
+            fprintf(stderr, "protocol %u: no codec\n", protover);
+            goto report;
+        }
+        nbt_reader_init(&rd, codec, len);
+        if (!nbt_read_root(&rd, &root)) {
+            fprintf(stderr, "protocol %u: the codec isn't a compound\n", protover);
+            goto report;
+        }
+
+        // skipping a field walks all of it, so this reads the whole codec
+        struct nbt_reader walk;
+        nbt_reader_at(&walk, &rd, &root);
+        while ((res = nbt_compound_next(&walk, &name, &namelen, &val)) == 1);
+        if (res < 0 || walk.cur != walk.end) {
+            fprintf(stderr, "protocol %u: the codec could not be read to its end\n", protover);
+            goto report;
+        }
+
+        pass = true;
+        for (size_t i = 0; i < BENCH_CODEC_FIELD_COUNT; ++i) {
+            const struct bench_codec_field *f = bench_codec_fields + i;
+            if (protover < f->from || protover > f->until) continue;
+            if (!bench_codec_check_field(&rd, &root, protover, f)) pass = false;
+        }
+
+        for (size_t i = 0; i < sizeof(dims) / sizeof(dims[0]); ++i) {
+            struct nbt_value element;
+            ab_rewind(&dimbuf, AB_REWIND_RDWR);
+            if (regdata_encode_dimension(&dimbuf, protover, dims[i].dimension) < 0 ||
+                !bench_codec_registry(&rd, &root, BENCH_DIMS, BENCH_CODEC_ENTRIES, dims[i].name, &element)) {
+                pass = false;
+                continue;
+            }
+
+            // the same fields, behind a root tag with an empty name
+            size_t dimlen = ab_getwrcur(&dimbuf) - 3;
+            if ((size_t)(codec + len - element.v.nest.payload) < dimlen ||
+                memcmp(dimbuf.buf + 3, element.v.nest.payload, dimlen) != 0) {
+                fprintf(stderr, "protocol %u: %s is not the same as its element in the codec\n", protover, dims[i].name);
+                pass = false;
+            }
+        }
+
+report:
+        printf("{\"check\":\"regdata_codec\",\"protover\":%u,\"bytes\":%lu,\"pass\":%s}\n",
+            protover, codec ? (unsigned long)len : 0ul, pass ? "true" : "false");
+        if (!pass) ok = false;
+    }
+    fflush(stdout);
+    ab_free(&dimbuf);
+    return ok;
+}
+
+/* round trips: whole connections through the server's real accept, read and
+ * write paths, over a socketpair, the way limbo_replay's socket mode runs them */
+
+client_registry_t *bench_registry = NULL;
+
+// what the player sends, built before anything is timed
+struct auto_buffer bench_rt_status_req, bench_rt_ping, bench_rt_handshake, bench_rt_login, bench_rt_ka_reply;
+
+#define BENCH_RT_KA_PAYLOAD (0x1234)
+
+// body is emptied again once it has been framed into out
+void bench_rt_frame(struct auto_buffer *out, struct auto_buffer *body) {
+    size_t len = ab_getwrcur(body);
+    proto_write_varint(out, (int32_t)len);
+    proto_write_bytes(out, body->buf, len);
+    ab_rewind(body, AB_REWIND_RDWR);
+}
+
+void bench_rt_write_handshake(struct auto_buffer *out, struct auto_buffer *body, int32_t nextproto) {
+    proto_write_varint(body, 0x00);
+    proto_write_varint(body, PROTOVER_1_8);
+    proto_write_lenstr(body, "localhost", -1);
+    proto_write_ushort(body, 25565);
+    proto_write_varint(body, nextproto);
+    bench_rt_frame(out, body);
+}
+
+void bench_rt_init(void) {
+    struct auto_buffer body;
+    ab_init(&body, 256, 0);
+    ab_init(&bench_rt_handshake, 256, 0);
+    ab_init(&bench_rt_status_req, 256, 0);
+    ab_init(&bench_rt_ping, 256, 0);
+    ab_init(&bench_rt_login, 256, 0);
+    ab_init(&bench_rt_ka_reply, 256, 0);
+
+    bench_rt_write_handshake(&bench_rt_handshake, &body, PROTOCOL_STATUS);
+
+    bench_rt_write_handshake(&bench_rt_status_req, &body, PROTOCOL_STATUS);
+    proto_write_varint(&body, 0x00); // Request
+    bench_rt_frame(&bench_rt_status_req, &body);
+
+    proto_write_varint(&body, 0x01); // Ping
+    proto_write_long(&body, 0x0123456789abcdefll);
+    bench_rt_frame(&bench_rt_ping, &body);
+
+    bench_rt_write_handshake(&bench_rt_login, &body, PROTOCOL_LOGIN);
+    proto_write_varint(&body, 0x00); // Login Start
+    proto_write_lenstr(&body, "BenchPlayer", -1);
+    bench_rt_frame(&bench_rt_login, &body);
+
+    proto_write_varint(&body, 0x00); // Keep Alive
+    proto_write_varint(&body, BENCH_RT_KA_PAYLOAD);
+    bench_rt_frame(&bench_rt_ka_reply, &body);
+
+    ab_free(&body);
+}
+
+void bench_rt_free(void) {
+    ab_free(&bench_rt_handshake);
+    ab_free(&bench_rt_status_req);
+    ab_free(&bench_rt_ping);
+    ab_free(&bench_rt_login);
+    ab_free(&bench_rt_ka_reply);
+}
+
+// Hands the server end to preconn_start as if it had just been accepted, returns the player's end.
+int bench_rt_connect(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) < 0) {
+        fprintf(stderr, "socketpair: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    sockaddrs addr;
+    struct admission_key nokey;
+    memset(&addr, 0, sizeof(addr));
+    memset(&nokey, 0, sizeof(nokey));
+    addr.in.sin_family = AF_INET;
+    addr.in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (!preconn_start(sv[0], &addr.base, sizeof(addr.in), bench_registry, NULL, &nokey)) {
+        fprintf(stderr, "preconn_start failed\n");
+        exit(1);
+    }
+    return sv[1];
+}
+
+/* Lets the server handle what is waiting for it and reads back what it said.
+ * A login takes two passes: the join is queued until the socket reports it
+ * can be written to. */
+#define BENCH_RT_PASSES (2)
+
+void bench_rt_settle(int peer) {
+    unsigned char buf[65536];
+    for (int i = 0; i < BENCH_RT_PASSES; ++i) {
+        event_loop_handle(0);
+        event_loop_drain();
+    }
+    while (recv(peer, buf, sizeof(buf), 0) > 0);
+}
+
+void bench_rt_send(int peer, struct auto_buffer *what) {
+    size_t len = ab_getwrcur(what);
+    if (send(peer, what->buf, len, MSG_NOSIGNAL) != (ssize_t)len) {
+        fprintf(stderr, "send: %s\n", strerror(errno));
+        exit(1);
+    }
+    bench_rt_settle(peer);
+}
+
+// Hangs up and waits for the server to have freed everything it had for the connection.
+void bench_rt_close(int peer) {
+    close(peer);
+    for (int i = 0; registry_count(bench_registry) > 0 || atomic_load_explicit(&bench_registry->npending, memory_order_relaxed) > 0; ++i) {
+        if (i == 100) {
+            fprintf(stderr, "the server did not notice a connection was closed\n");
+            exit(1);
+        }
+        event_loop_handle(0);
+        event_loop_drain();
+    }
+}
+
+void bench_rt_handshake_only(uint64_t iters) {
+    for (uint64_t i = 0; i < iters; ++i) {
+        int peer = bench_rt_connect();
+        bench_rt_send(peer, &bench_rt_handshake);
+        bench_rt_close(peer);
+    }
+}
+
+void bench_rt_status(uint64_t iters) {
+    for (uint64_t i = 0; i < iters; ++i) {
+        int peer = bench_rt_connect();
+        bench_rt_send(peer, &bench_rt_status_req);
+        bench_rt_send(peer, &bench_rt_ping);
+        bench_rt_close(peer);
+    }
+}
+
+void bench_rt_login_join(uint64_t iters) {
+    for (uint64_t i = 0; i < iters; ++i) {
+        int peer = bench_rt_connect();
+        bench_rt_send(peer, &bench_rt_login);
+        bench_rt_close(peer);
+    }
+}
+
+// One player logged in beforehand; each op is the tick's Keep Alive and the reply to it.
+void bench_rt_keepalive(uint64_t iters) {
+    bench_counting = false;
+    int peer = bench_rt_connect();
+    bench_rt_send(peer, &bench_rt_login);
+
+    struct registry_snapshot snap = { 0 };
+    if (registry_snapshot(bench_registry, &snap) != 1 || snap.clients[0]->protocol != PROTOCOL_PLAY) {
+        fprintf(stderr, "the benchmark player did not get to play\n");
+        exit(1);
+    }
+    client_t *cli = snap.clients[0];
+    bench_counting = true;
+
+    struct packet_play_keep_alive pkt = { .id = PKTID_WRITE_PLAY_KEEP_ALIVE, .payload = BENCH_RT_KA_PAYLOAD };
+    for (uint64_t i = 0; i < iters; ++i) {
+        client_write_pkt(cli, &pkt);
+        if (cli->fd->state & FD_CALL_COMPLETE) {
+            fprintf(stderr, "the server could not write a keep alive\n");
+            exit(1);
+        }
+        bench_rt_send(peer, &bench_rt_ka_reply);
+    }
+
+    bench_counting = false;
+    if (!cli->pingrespond) {
+        fprintf(stderr, "the server did not take the keep alive reply\n");
+        exit(1);
+    }
+    registry_snapshot_release(&snap);
+    registry_snapshot_free(&snap);
+    bench_rt_close(peer);
+    bench_counting = true;
+}
+
+const struct bench benches[] = {
+    { "varint_read",           &bench_varint_read },
+    { "varint_write",          &bench_varint_write },
+    { "fixed_read",            &bench_fixed_read },
+    { "fixed_write",           &bench_fixed_write },
+    { "wlenstr_write",         &bench_wlenstr },
+    { "utf16be_lenstr_write",  &bench_utf16be_lenstr },
+    { "ab_push_grow_4k",       &bench_ab_push_grow },
+    { "ab_push_reuse_4k",      &bench_ab_push_reuse },
+    { "uuid_gen_offline",      &bench_uuid_offline },
+    { "uuid_format",           &bench_uuid_format },
+    { "dllist_foreach",        &bench_dllist_foreach },
+    { "frame_play_pos_look",   &bench_frame_pos_look },
+    { "pkt_status_response",   &bench_pkt_status_response },
+    { "pkt_status_pong",       &bench_pkt_status_pong },
+    { "pkt_login_disconnect",  &bench_pkt_login_disconnect },
+    { "pkt_login_success",     &bench_pkt_login_success },
+    { "pkt_play_keep_alive",   &bench_pkt_play_keep_alive },
+    { "pkt_play_join_game",    &bench_pkt_play_join_game },
+    { "pkt_play_spawn_pos",    &bench_pkt_play_spawn_pos },
+    { "pkt_play_pos_look",     &bench_pkt_play_pos_look },
+    { "pkt_play_chunk_data",   &bench_pkt_play_chunk_data },
+    { "pkt_play_disconnect",   &bench_pkt_play_disconnect },
+    { "regdata_codec",         &bench_regdata_codec },
+    { "rt_handshake",          &bench_rt_handshake_only },
+    { "rt_status",             &bench_rt_status },
+    { "rt_login",              &bench_rt_login_join },
+    { "rt_keepalive",          &bench_rt_keepalive }
+};
+
+#define BENCH_COUNT (sizeof(benches) / sizeof(benches[0]))
+
+const struct bench *bench_find(const char *name) {
+    for (size_t i = 0; i < BENCH_COUNT; ++i) {
+        if (strcmp(benches[i].name, name) == 0) return benches + i;
+    }
+    return NULL;
+}
+
+/* The allocation gate. Each line of the budget file is a benchmark and the
+ * most allocations one of its operations may make; blank lines and lines
+ * starting with # are skipped. A benchmark over its budget fails the run, as
+ * does a budget naming a benchmark that doesn't exist. */
+#define BENCH_BUDGET_SLACK (0.01)
+
+int bench_check_budgets(const char *path, uint64_t min_ns) {
+    FILE *fp = fopen(path, "re");
+    if (!fp) {
+        fprintf(stderr, "unable to open %s: %s\n", path, strerror(errno));
+        return 2;
+    }
+
+    char line[256];
+    unsigned lineno = 0, checked = 0, failed = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        char name[128];
+        double budget;
+        ++lineno;
+
+        char *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\0') continue;
+        if (sscanf(start, "%127s %lf", name, &budget) != 2 || budget < 0) {
+            fprintf(stderr, "%s:%u: expected a benchmark name and a number of allocations\n", path, lineno);
+            ++failed;
+            continue;
+        }
+
+        const struct bench *b = bench_find(name);
+        if (!b) {
+            fprintf(stderr, "%s:%u: no benchmark is called %s\n", path, lineno, name);
+            ++failed;
+            continue;
+        }
+
+        struct bench_result res;
+        bench_run(b, min_ns, &res);
+        double allocs = (double)res.allocs / (double)res.iters;
+        bool pass = allocs <= budget + BENCH_BUDGET_SLACK;
+        printf("{\"budget\":\"%s\",\"iters\":%llu,\"allocs_per_op\":%.3f,\"max_allocs_per_op\":%g,\"bytes_per_op\":%.1f,\"pass\":%s}\n",
+            name, (unsigned long long)res.iters, allocs, budget, (double)res.bytes / (double)res.iters, pass ? "true" : "false");
+        fflush(stdout);
+
+        ++checked;
+        if (!pass) {
+            fprintf(stderr, "%s makes %.3f allocations per operation, over its budget of %g\n", name, allocs, budget);
+            ++failed;
+        }
+    }
+    fclose(fp);
+
+    if (failed) {
+        fprintf(stderr, "%u of the budgets in %s failed\n", failed, path);
+        return 1;
+    }
+    if (checked == 0) {
+        fprintf(stderr, "%s has no budgets in it\n", path);
+        return 2;
+    }
+    return 0;
+}
+
+void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-l] [-f filter] [-t min_ms] [-b budgets] [-w world] [-c cache]\n", argv0);
+    fprintf(stderr, "  -l          list the benchmarks and exit\n");
+    fprintf(stderr, "  -f filter   only run benchmarks whose name contains filter\n");
+    fprintf(stderr, "  -t min_ms   minimum time for one sample (default 200)\n");
+    fprintf(stderr, "  -b budgets  run the benchmarks of the budget file instead, fail if one allocates more than it may\n");
+    fprintf(stderr, "  -w path     world the join packets are made of (default world.schem)\n");
+    fprintf(stderr, "  -c path     packet cache (default limbo.pktcache)\n");
+}
+
+int main(int argc, char **argv) {
+    const char *filter = NULL, *budgets = NULL;
+    const char *worldpath = "world.schem", *cachepath = "limbo.pktcache";
+    uint64_t min_ns = 200000000ull;
+    int opt, ret = 0;
+
+    while ((opt = getopt(argc, argv, "lf:t:b:w:c:h")) != -1) {
+        switch (opt) {
+            case 'l':
+                for (size_t i = 0; i < BENCH_COUNT; ++i) puts(benches[i].name);
+                return 0;
+            case 'f':
+                filter = optarg;
+                break;
+            case 't': {
+                long ms = strtol(optarg, NULL, 10);
+                if (ms <= 0) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                min_ns = (uint64_t)ms * 1000000ull;
+                break;
+            }
+            case 'b':
+                budgets = optarg;
+                break;
+            case 'w':
+                worldpath = optarg;
+                break;
+            case 'c':
+                cachepath = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    // the bits of the server the client code expects to be there
+    signal(SIGPIPE, SIG_IGN);
+    log_setlevel(LOG_WARN);
+    pktcache_default = pktcache_open(cachepath, worldpath);
+    if (!pktcache_default) {
+        fprintf(stderr, "unable to prepare packets from %s\n", worldpath);
+        return 1;
+    }
+    bench_registry = registry_create(1);
+    if (!bench_registry || !event_loop_init(1)) {
+        fprintf(stderr, "unable to set up the server\n");
+        return 1;
+    }
+    event_loop_bind_thread(0);
+    if (!epoch_init(1)) return 1;
+    epoch_thread_register();
+    bench_packets_init();
+    bench_rt_init();
+
+    if (!bench_check_codec()) {
+        fprintf(stderr, "the dimension codec is not what clients expect\n");
+        ret = 1;
+    } else if (budgets) {
+        ret = bench_check_budgets(budgets, min_ns);
+    } else {
+        for (size_t i = 0; i < BENCH_COUNT; ++i) {
+            if (filter && !strstr(benches[i].name, filter)) continue;
+
+            struct bench_result res;
+            bench_run(benches + i, min_ns, &res);
+            bench_report(benches + i, &res);
+        }
+    }
+
+    bench_rt_free();
+    bench_packets_free();
+    preconn_close_all(bench_registry);
+    registry_free(bench_registry);
+    epoch_drain();
+    epoch_thread_unregister();
+    epoch_free();
+    event_loop_close();
+    pktcache_close(pktcache_default);
+    regdata_cleanup();
+    return ret;
+}
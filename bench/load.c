@@ -0,0 +1,851 @@
+/* limbo_load: a synthetic load generator that talks to a running server.
+ *
+ * Keeps up to N connections open against the server, starting a new one
+ * whenever one finishes, for the length of the run. Every connection is one
+ * kind of client, picked at random by the weights of the mix:
+ *
+ *   status     handshake, status request, ping, close
+ *   login      handshake, Login Start, wait for the first keep alive, close
+ *   play       the same, then stays and answers keep alives (-k seconds, or until the end)
+ *   slowloris  sends its handshake one byte at a time (-w), waits to be dropped
+ *   oversize   announces a packet far longer than the server allows
+ *   garbage    sends random bytes
+ *
+ * The last three should be closed by the server; they fail if they outlive
+ * the operation timeout (-T). Connections can be spread over 127.0.0.0/8
+ * source addresses (-s) so many thousands of them don't run out of ports.
+ *
+ * At the end it reports, as one JSON object per line, how every kind fared,
+ * connect/status/ping/login/join latency percentiles and the throughput seen
+ * from both sides, the server's from the difference of two scrapes of its
+ * metrics page (-M). */
+
+#include "protocol.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT (24) // linux/in.h, picks the port at connect time so binding the address doesn't reserve one
+#endif
+
+enum load_kind {
+    LOAD_STATUS,
+    LOAD_LOGIN,
+    LOAD_PLAY,
+    LOAD_SLOWLORIS,
+    LOAD_OVERSIZE,
+    LOAD_GARBAGE,
+    LOAD_KIND_COUNT
+};
+
+const char *const load_kind_names[LOAD_KIND_COUNT] = { "status", "login", "play", "slowloris", "oversize", "garbage" };
+
+enum load_state {
+    CONN_FREE,
+    CONN_CONNECTING,
+    CONN_STATUS_WAIT, // for the status response
+    CONN_PING_WAIT,   // for the pong
+    CONN_LOGIN_WAIT,  // for Login Success
+    CONN_JOIN_WAIT,   // for the first keep alive, which comes after everything the join sends
+    CONN_PLAY,
+    CONN_MISBEHAVING  // waiting to be closed
+};
+
+enum load_sample {
+    SAMPLE_CONNECT,
+    SAMPLE_STATUS, // status request to response
+    SAMPLE_PING,   // ping to pong
+    SAMPLE_LOGIN,  // Login Start to Login Success
+    SAMPLE_JOIN,   // Login Start to the first keep alive
+    SAMPLE_DROP,   // a misbehaving connection opened to closed by the server
+    SAMPLE_COUNT
+};
+
+const char *const load_sample_names[SAMPLE_COUNT] = { "connect", "status", "ping", "login", "join", "drop" };
+
+// latencies in microseconds
+struct load_samples {
+    uint32_t *val;
+    size_t count, capacity;
+};
+
+struct load_kind_stats {
+    uint64_t started, ok, failed, timeouts, connect_errors, unfinished;
+};
+
+struct load_conn {
+    int fd;
+    unsigned kind, state;
+    uint64_t started_ns, connected_ns, sent_ns;
+    uint64_t deadline_ns; // gives up, or for a play connection, leaves
+    uint64_t next_ns;     // next byte of a slowloris
+    struct auto_buffer in, out;
+    size_t slowpos;       // how much of out a slowloris has sent
+    uint64_t serial;      // names the player
+};
+
+struct load_config {
+    struct sockaddr_in target;
+    unsigned conns;
+    double duration;
+    double rate;       // new connections per second, 0 for as fast as they finish
+    unsigned sources;  // 127.x source addresses to use, 0 to let the kernel pick
+    unsigned mix[LOAD_KIND_COUNT];
+    double hold;       // seconds a play connection stays, 0 until the end
+    double optimeout;
+    double slowgap;    // seconds between the bytes of a slowloris
+    const char *metrics; // host:port, NULL for none
+};
+
+struct load_config load_cfg;
+struct load_conn *load_conns = NULL;
+unsigned *load_free = NULL; // stack of free slots
+unsigned load_nfree = 0, load_open = 0;
+int load_epfd = -1;
+
+struct load_kind_stats load_stats[LOAD_KIND_COUNT];
+struct load_samples load_samples[SAMPLE_COUNT];
+uint64_t load_bytes_in = 0, load_bytes_out = 0, load_keepalives = 0, load_connects = 0;
+uint64_t load_serial = 0; // names players and picks source addresses
+uint64_t load_rng = 0x9e3779b97f4a7c15ull;
+volatile sig_atomic_t load_stop = 0;
+
+uint64_t load_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t load_random(void) {
+    // xorshift64*, good enough to pick kinds and make garbage
+    load_rng ^= load_rng >> 12;
+    load_rng ^= load_rng << 25;
+    load_rng ^= load_rng >> 27;
+    return load_rng * 0x2545f4914f6cdd1dull;
+}
+
+void load_sample(unsigned which, uint64_t from_ns, uint64_t to_ns) {
+    struct load_samples *s = load_samples + which;
+    if (s->count == s->capacity) {
+        size_t newcap = s->capacity ? s->capacity * 2 : 1024;
+        uint32_t *newval = realloc(s->val, newcap * sizeof(uint32_t));
+        if (!newval) return;
+        s->val = newval;
+        s->capacity = newcap;
+    }
+
+    uint64_t us = (to_ns - from_ns) / 1000;
+    s->val[s->count++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+/* talking to the server */
+
+void load_write_handshake(struct auto_buffer *out, int32_t next) {
+    struct auto_buffer body;
+    ab_init(&body, 64, 0);
+    proto_write_varint(&body, 0x00);
+    proto_write_varint(&body, (int32_t)PROTOVER_1_8);
+    proto_write_lenstr(&body, "localhost", -1);
+    proto_write_ushort(&body, ntohs(load_cfg.target.sin_port));
+    proto_write_varint(&body, next);
+
+    proto_write_varint(out, (int32_t)ab_getwrcur(&body));
+    ab_push(out, body.buf, ab_getwrcur(&body));
+    ab_free(&body);
+}
+
+// a packet whose body is only its id and then the bytes given
+void load_write_simple(struct auto_buffer *out, int32_t id, const void *data, size_t len) {
+    struct auto_buffer idab;
+    ab_init(&idab, 5, 0);
+    proto_write_varint(&idab, id);
+
+    proto_write_varint(out, (int32_t)(ab_getwrcur(&idab) + len));
+    ab_push(out, idab.buf, ab_getwrcur(&idab));
+    if (len > 0) ab_push(out, data, len);
+    ab_free(&idab);
+}
+
+void load_write_login_start(struct auto_buffer *out, uint64_t serial) {
+    char name[17];
+    struct auto_buffer body;
+    snprintf(name, sizeof(name), "load%llu", (unsigned long long)(serial % 1000000000000ull));
+
+    ab_init(&body, 32, 0);
+    proto_write_lenstr(&body, name, -1);
+    load_write_simple(out, 0x00, body.buf, ab_getwrcur(&body));
+    ab_free(&body);
+}
+
+void load_close(struct load_conn *conn) {
+    if (conn->state == CONN_FREE) return;
+
+    close(conn->fd); // takes it out of the epoll set too
+    conn->fd = -1;
+    conn->state = CONN_FREE;
+    ab_free(&conn->in);
+    ab_free(&conn->out);
+
+    load_free[load_nfree++] = (unsigned)(conn - load_conns);
+    --load_open;
+}
+
+void load_finish(struct load_conn *conn, bool ok) {
+    if (ok) ++load_stats[conn->kind].ok;
+    else ++load_stats[conn->kind].failed;
+    load_close(conn);
+}
+
+// Sends what is in out (from the start, or up to limit for a slowloris). False if the connection is gone.
+bool load_flush(struct load_conn *conn, size_t limit) {
+    size_t pending = ab_getwrcur(&conn->out) - (size_t)(conn->out.readcur - conn->out.buf);
+    if (limit < pending) pending = limit;
+
+    while (pending > 0) {
+        ssize_t res = send(conn->fd, conn->out.readcur, pending, MSG_NOSIGNAL);
+        if (res < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (conn->state == CONN_MISBEHAVING) { // closed on us, which was the point
+                load_sample(SAMPLE_DROP, conn->connected_ns, load_now_ns());
+                load_finish(conn, true);
+            } else {
+                load_finish(conn, false);
+            }
+            return false;
+        }
+
+        load_bytes_out += (uint64_t)res;
+        conn->out.readcur += res;
+        pending -= (size_t)res;
+    }
+
+    if (conn->out.readcur == conn->out.writecur) ab_rewind(&conn->out, AB_REWIND_RDWR);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)(conn - load_conns) };
+    if (pending > 0) ev.events |= EPOLLOUT;
+    epoll_ctl(load_epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+    return true;
+}
+
+void load_connected(struct load_conn *conn, uint64_t now) {
+    conn->connected_ns = now;
+    load_sample(SAMPLE_CONNECT, conn->started_ns, now);
+    ++load_connects;
+
+    conn->deadline_ns = now + (uint64_t)(load_cfg.optimeout * 1e9);
+    conn->sent_ns = now;
+
+    switch (conn->kind) {
+        case LOAD_STATUS:
+            load_write_handshake(&conn->out, PROTOCOL_STATUS);
+            load_write_simple(&conn->out, 0x00, NULL, 0);
+            conn->state = CONN_STATUS_WAIT;
+            break;
+        case LOAD_LOGIN:
+        case LOAD_PLAY:
+            load_write_handshake(&conn->out, PROTOCOL_LOGIN);
+            load_write_login_start(&conn->out, conn->serial);
+            conn->state = CONN_LOGIN_WAIT;
+            break;
+        case LOAD_SLOWLORIS:
+            load_write_handshake(&conn->out, PROTOCOL_LOGIN);
+            conn->state = CONN_MISBEHAVING;
+            conn->slowpos = 1;
+            conn->next_ns = now + (uint64_t)(load_cfg.slowgap * 1e9);
+            load_flush(conn, 1);
+            return;
+        case LOAD_OVERSIZE: {
+            // a 16 MiB packet, and the start of it
+            unsigned char junk[32];
+            proto_write_varint(&conn->out, 1 << 24);
+            memset(junk, 0x41, sizeof(junk));
+            ab_push(&conn->out, junk, sizeof(junk));
+            conn->state = CONN_MISBEHAVING;
+            break;
+        }
+        case LOAD_GARBAGE: {
+            unsigned char junk[64];
+            for (size_t i = 0; i < sizeof(junk); ++i) junk[i] = (unsigned char)load_random();
+            ab_push(&conn->out, junk, sizeof(junk));
+            conn->state = CONN_MISBEHAVING;
+            break;
+        }
+    }
+
+    load_flush(conn, SIZE_MAX);
+}
+
+void load_start(uint64_t now) {
+    unsigned total = 0;
+    for (unsigned i = 0; i < LOAD_KIND_COUNT; ++i) total += load_cfg.mix[i];
+
+    unsigned pick = (unsigned)(load_random() % total), kind = 0;
+    while (pick >= load_cfg.mix[kind]) pick -= load_cfg.mix[kind++];
+
+    ++load_stats[kind].started;
+    ++load_serial;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        ++load_stats[kind].connect_errors;
+        return;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (load_cfg.sources > 0) {
+        struct sockaddr_in src;
+        memset(&src, 0, sizeof(src));
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = htonl(0x7f000001u + (uint32_t)(load_serial % load_cfg.sources));
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *)&src, sizeof(src)) < 0) {
+            close(fd);
+            ++load_stats[kind].connect_errors;
+            return;
+        }
+    }
+
+    unsigned slot = load_free[--load_nfree];
+    struct load_conn *conn = load_conns + slot;
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = fd;
+    conn->serial = load_serial;
+    conn->kind = kind;
+    conn->state = CONN_CONNECTING;
+    conn->started_ns = now;
+    conn->deadline_ns = now + (uint64_t)(load_cfg.optimeout * 1e9);
+    ab_init(&conn->in, 0, 0);
+    ab_init(&conn->out, 0, 0);
+    ++load_open;
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.u32 = slot };
+    if (epoll_ctl(load_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        --load_stats[kind].started; // counted as a connect error instead
+        ++load_stats[kind].connect_errors;
+        load_close(conn);
+        return;
+    }
+
+    if (connect(fd, (struct sockaddr *)&load_cfg.target, sizeof(load_cfg.target)) < 0 && errno != EINPROGRESS) {
+        --load_stats[kind].started;
+        ++load_stats[kind].connect_errors;
+        load_close(conn);
+        return;
+    }
+}
+
+// Reads a VarInt without going past end. 0 if it isn't all there yet, -1 if it is malformed, or its length.
+int load_peek_varint(const unsigned char *buf, const unsigned char *end, int32_t *out) {
+    uint32_t val = 0;
+    for (int i = 0; i < 5; ++i) {
+        if (buf + i >= end) return 0;
+        val |= (uint32_t)(buf[i] & 0x7f) << (7 * i);
+        if (!(buf[i] & 0x80)) {
+            *out = (int32_t)val;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+// Acts on one packet from the server. False if the connection is gone.
+bool load_packet(struct load_conn *conn, int32_t id, const unsigned char *body, size_t len, uint64_t now) {
+    switch (conn->state) {
+        case CONN_STATUS_WAIT:
+            if (id != 0x00) break;
+            load_sample(SAMPLE_STATUS, conn->sent_ns, now);
+            {
+                unsigned char payload[8];
+                memcpy(payload, &now, sizeof(payload));
+                load_write_simple(&conn->out, 0x01, payload, sizeof(payload));
+            }
+            conn->state = CONN_PING_WAIT;
+            conn->sent_ns = now;
+            return load_flush(conn, SIZE_MAX);
+
+        case CONN_PING_WAIT:
+            if (id != 0x01) break;
+            load_sample(SAMPLE_PING, conn->sent_ns, now);
+            load_finish(conn, true);
+            return false;
+
+        case CONN_LOGIN_WAIT:
+            if (id == 0x02) {
+                load_sample(SAMPLE_LOGIN, conn->sent_ns, now);
+                conn->state = CONN_JOIN_WAIT;
+            } else if (id == 0x00 || id == 0x03) { // kicked, or compression, which this doesn't speak
+                load_finish(conn, false);
+                return false;
+            }
+            break;
+
+        case CONN_JOIN_WAIT:
+        case CONN_PLAY:
+            if (id == 0x40) { // kicked
+                load_finish(conn, false);
+                return false;
+            }
+            if (id != 0x00) break;
+
+            if (conn->state == CONN_JOIN_WAIT) {
+                load_sample(SAMPLE_JOIN, conn->sent_ns, now);
+                if (conn->kind == LOAD_LOGIN) {
+                    load_finish(conn, true);
+                    return false;
+                }
+
+                conn->state = CONN_PLAY;
+                conn->deadline_ns = load_cfg.hold > 0 ? now + (uint64_t)(load_cfg.hold * 1e9) : UINT64_MAX;
+            }
+
+            ++load_keepalives;
+            load_write_simple(&conn->out, 0x00, body, len);
+            return load_flush(conn, SIZE_MAX);
+
+        default:
+            break; // whatever a misbehaving connection gets back doesn't matter
+    }
+    return true;
+}
+
+void load_readable(struct load_conn *conn, uint64_t now) {
+    unsigned char buf[65536];
+    bool eof = false;
+
+    for (;;) {
+        ssize_t res = recv(conn->fd, buf, sizeof(buf), 0);
+        if (res > 0) {
+            load_bytes_in += (uint64_t)res;
+            if (conn->state != CONN_MISBEHAVING) ab_push(&conn->in, buf, (size_t)res);
+            continue;
+        }
+        if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        eof = true; // closed or reset, either way the server is done with it
+        break;
+    }
+
+    // every complete packet
+    unsigned char *cur = conn->in.readcur, *end = conn->in.writecur;
+    for (;;) {
+        int32_t pktlen, id;
+        int lenlen = load_peek_varint(cur, end, &pktlen);
+        if (lenlen == 0) break;
+        if (lenlen < 0 || pktlen <= 0) {
+            load_finish(conn, false);
+            return;
+        }
+        if (end - (cur + lenlen) < pktlen) break;
+
+        unsigned char *body = cur + lenlen;
+        int idlen = load_peek_varint(body, body + pktlen, &id);
+        if (idlen <= 0) {
+            load_finish(conn, false);
+            return;
+        }
+
+        cur = body + pktlen;
+        conn->in.readcur = cur;
+        if (!load_packet(conn, id, body + idlen, (size_t)(pktlen - idlen), now)) return;
+    }
+
+    // keep only the partial packet
+    size_t remain = (size_t)(end - cur);
+    if (remain > 0 && cur != conn->in.buf) memmove(conn->in.buf, cur, remain);
+    conn->in.readcur = conn->in.buf;
+    conn->in.writecur = conn->in.buf + remain;
+
+    if (eof) {
+        if (conn->state == CONN_MISBEHAVING) {
+            load_sample(SAMPLE_DROP, conn->connected_ns, now);
+            load_finish(conn, true);
+        } else {
+            load_finish(conn, false);
+        }
+    }
+}
+
+void load_event(struct load_conn *conn, uint32_t events, uint64_t now) {
+    if (conn->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 || err != 0) {
+            --load_stats[conn->kind].started;
+            ++load_stats[conn->kind].connect_errors;
+            load_close(conn);
+            return;
+        }
+        if (!(events & (EPOLLOUT | EPOLLIN))) return;
+        load_connected(conn, now);
+        if (conn->state == CONN_FREE) return;
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        load_readable(conn, now);
+        if (conn->state == CONN_FREE) return;
+    }
+
+    if (events & EPOLLOUT) {
+        load_flush(conn, conn->kind == LOAD_SLOWLORIS ? conn->slowpos - (size_t)(conn->out.readcur - conn->out.buf) : SIZE_MAX);
+    }
+}
+
+// Timeouts, slowloris bytes and play connections that have stayed long enough.
+void load_timers(uint64_t now) {
+    for (unsigned i = 0; i < load_cfg.conns; ++i) {
+        struct load_conn *conn = load_conns + i;
+        if (conn->state == CONN_FREE) continue;
+
+        if (now >= conn->deadline_ns) {
+            if (conn->state == CONN_PLAY) {
+                load_finish(conn, true);
+            } else {
+                ++load_stats[conn->kind].timeouts;
+                load_finish(conn, false);
+            }
+            continue;
+        }
+
+        if (conn->kind == LOAD_SLOWLORIS && conn->state == CONN_MISBEHAVING && now >= conn->next_ns) {
+            if (conn->slowpos < ab_getwrcur(&conn->out)) ++conn->slowpos; // once it is all out it just sits there
+            conn->next_ns = now + (uint64_t)(load_cfg.slowgap * 1e9);
+            load_flush(conn, conn->slowpos - (size_t)(conn->out.readcur - conn->out.buf));
+        }
+    }
+}
+
+/* the server's side of things */
+
+enum load_server_metric {
+    SERVER_ACCEPTS,
+    SERVER_RECEIVED_BYTES,
+    SERVER_SENT_BYTES,
+    SERVER_RECEIVED_PACKETS,
+    SERVER_SENT_PACKETS,
+    SERVER_LOOP_WAKEUPS,
+    SERVER_METRIC_COUNT
+};
+
+const char *const load_server_metric_names[SERVER_METRIC_COUNT] = {
+    "limbo_accepts_total",
+    "limbo_received_bytes_total",
+    "limbo_sent_bytes_total",
+    "limbo_received_packets_total",
+    "limbo_sent_packets_total",
+    "limbo_event_loop_wakeups_total"
+};
+
+// Fetches the server's metrics page. False if there is none to be had.
+bool load_scrape(double out[SERVER_METRIC_COUNT]) {
+    if (!load_cfg.metrics) return false;
+
+    char host[64];
+    const char *colon = strrchr(load_cfg.metrics, ':');
+    size_t hostlen = colon ? (size_t)(colon - load_cfg.metrics) : 0;
+    if (!colon || hostlen >= sizeof(host)) return false;
+    memcpy(host, load_cfg.metrics, hostlen);
+    host[hostlen] = '\0';
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)atoi(colon + 1));
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) return false;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+
+    struct timeval tv = { .tv_sec = 5, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    const char *req = "GET /metrics HTTP/1.0\r\n\r\n";
+    struct auto_buffer page;
+    ab_init(&page, 8192, 0);
+
+    bool ok = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0
+        && send(fd, req, strlen(req), MSG_NOSIGNAL) == (ssize_t)strlen(req);
+    if (ok) {
+        char buf[4096];
+        ssize_t res;
+        while ((res = recv(fd, buf, sizeof(buf), 0)) > 0) ab_push(&page, buf, (size_t)res);
+        ab_push(&page, "", 1);
+    }
+    close(fd);
+
+    if (ok) {
+        for (unsigned i = 0; i < SERVER_METRIC_COUNT; ++i) {
+            size_t namelen = strlen(load_server_metric_names[i]);
+            out[i] = 0;
+            for (const char *line = (const char *)page.buf; line; line = strchr(line, '\n')) {
+                if (*line == '\n') ++line;
+                if (strncmp(line, load_server_metric_names[i], namelen) == 0 && line[namelen] == ' ') {
+                    out[i] = strtod(line + namelen + 1, NULL);
+                    break;
+                }
+            }
+        }
+        ok = strstr((const char *)page.buf, "200 OK") != NULL;
+    }
+
+    ab_free(&page);
+    return ok;
+}
+
+/* report */
+
+int load_cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+uint32_t load_percentile(const struct load_samples *s, double q) {
+    size_t idx = (size_t)(q * (double)(s->count - 1) + 0.5);
+    return s->val[idx];
+}
+
+void load_report(double elapsed, bool have_server, const double before[SERVER_METRIC_COUNT], const double after[SERVER_METRIC_COUNT]) {
+    for (unsigned i = 0; i < LOAD_KIND_COUNT; ++i) {
+        const struct load_kind_stats *k = load_stats + i;
+        if (k->started == 0 && k->connect_errors == 0) continue;
+        printf("{\"load\":\"kind\",\"kind\":\"%s\",\"started\":%llu,\"ok\":%llu,\"failed\":%llu,\"timeouts\":%llu,\"connect_errors\":%llu,\"unfinished\":%llu}\n",
+            load_kind_names[i], (unsigned long long)k->started, (unsigned long long)k->ok, (unsigned long long)k->failed,
+            (unsigned long long)k->timeouts, (unsigned long long)k->connect_errors, (unsigned long long)k->unfinished);
+    }
+
+    for (unsigned i = 0; i < SAMPLE_COUNT; ++i) {
+        struct load_samples *s = load_samples + i;
+        if (s->count == 0) continue;
+        qsort(s->val, s->count, sizeof(uint32_t), &load_cmp_u32);
+        printf("{\"load\":\"latency\",\"what\":\"%s\",\"count\":%zu,\"p50_us\":%u,\"p90_us\":%u,\"p99_us\":%u,\"p999_us\":%u,\"max_us\":%u}\n",
+            load_sample_names[i], s->count, load_percentile(s, 0.5), load_percentile(s, 0.9),
+            load_percentile(s, 0.99), load_percentile(s, 0.999), s->val[s->count - 1]);
+    }
+
+    printf("{\"load\":\"client\",\"seconds\":%.3f,\"connects_per_sec\":%.1f,\"bytes_in_per_sec\":%.1f,\"bytes_out_per_sec\":%.1f,\"keepalives\":%llu}\n",
+        elapsed, (double)load_connects / elapsed, (double)load_bytes_in / elapsed, (double)load_bytes_out / elapsed,
+        (unsigned long long)load_keepalives);
+
+    if (have_server) {
+        printf("{\"load\":\"server\",\"seconds\":%.3f", elapsed);
+        for (unsigned i = 0; i < SERVER_METRIC_COUNT; ++i) {
+            // limbo_accepts_total -> accepts_per_sec
+            const char *name = load_server_metric_names[i] + strlen("limbo_");
+            int namelen = (int)(strlen(name) - strlen("_total"));
+            printf(",\"%.*s_per_sec\":%.1f", namelen, name, (after[i] - before[i]) / elapsed);
+        }
+        printf("}\n");
+    }
+    fflush(stdout);
+}
+
+/* main */
+
+// Parses a mix like "status:50,play:30,garbage:20". Kinds left out get no weight.
+bool load_parse_mix(const char *spec, unsigned mix[LOAD_KIND_COUNT]) {
+    memset(mix, 0, LOAD_KIND_COUNT * sizeof(unsigned));
+    unsigned total = 0;
+
+    while (*spec) {
+        const char *colon = strchr(spec, ':');
+        if (!colon) return false;
+
+        unsigned kind;
+        for (kind = 0; kind < LOAD_KIND_COUNT; ++kind) {
+            if (strlen(load_kind_names[kind]) == (size_t)(colon - spec) && !strncmp(spec, load_kind_names[kind], (size_t)(colon - spec))) break;
+        }
+        if (kind == LOAD_KIND_COUNT) return false;
+
+        char *next;
+        unsigned long weight = strtoul(colon + 1, &next, 10);
+        if (next == colon + 1 || weight > 1000000) return false;
+        mix[kind] = (unsigned)weight;
+        total += (unsigned)weight;
+
+        if (*next == ',') ++next;
+        else if (*next) return false;
+        spec = next;
+    }
+
+    return total > 0;
+}
+
+void load_handle_signal(int sig) {
+    (void)sig;
+    load_stop = 1;
+}
+
+void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [options]\n", argv0);
+    fprintf(stderr, "  -H host       server address (default 127.0.0.1)\n");
+    fprintf(stderr, "  -p port       server port (default 25566)\n");
+    fprintf(stderr, "  -n conns      connections kept open at once (default 1000)\n");
+    fprintf(stderr, "  -d seconds    length of the run (default 10)\n");
+    fprintf(stderr, "  -r rate       new connections per second, 0 for no limit (default 2000)\n");
+    fprintf(stderr, "  -s sources    spread connections over this many 127.x addresses (default 0, off)\n");
+    fprintf(stderr, "  -m mix        weights of the kinds of client (default status:40,login:30,play:20,slowloris:4,oversize:3,garbage:3)\n");
+    fprintf(stderr, "  -k seconds    how long play connections stay, 0 for the whole run (default 0)\n");
+    fprintf(stderr, "  -T seconds    operation timeout (default 20)\n");
+    fprintf(stderr, "  -w ms         time between the bytes of a slowloris (default 1000)\n");
+    fprintf(stderr, "  -M host:port  the server's metrics page, - for none (default 127.0.0.1:9225)\n");
+}
+
+int main(int argc, char **argv) {
+    const char *host = "127.0.0.1";
+    int port = 25566;
+    int opt;
+
+    memset(&load_cfg, 0, sizeof(load_cfg));
+    load_cfg.conns = 1000;
+    load_cfg.duration = 10;
+    load_cfg.rate = 2000;
+    load_cfg.optimeout = 20;
+    load_cfg.slowgap = 1;
+    load_cfg.metrics = "127.0.0.1:9225";
+    load_parse_mix("status:40,login:30,play:20,slowloris:4,oversize:3,garbage:3", load_cfg.mix);
+
+    while ((opt = getopt(argc, argv, "H:p:n:d:r:s:m:k:T:w:M:h")) != -1) {
+        switch (opt) {
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'n': load_cfg.conns = (unsigned)strtoul(optarg, NULL, 10); break;
+            case 'd': load_cfg.duration = strtod(optarg, NULL); break;
+            case 'r': load_cfg.rate = strtod(optarg, NULL); break;
+            case 's': load_cfg.sources = (unsigned)strtoul(optarg, NULL, 10); break;
+            case 'm':
+                if (!load_parse_mix(optarg, load_cfg.mix)) {
+                    fprintf(stderr, "bad mix: %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'k': load_cfg.hold = strtod(optarg, NULL); break;
+            case 'T': load_cfg.optimeout = strtod(optarg, NULL); break;
+            case 'w': load_cfg.slowgap = strtod(optarg, NULL) / 1000.; break;
+            case 'M': load_cfg.metrics = strcmp(optarg, "-") ? optarg : NULL; break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (load_cfg.conns == 0 || load_cfg.duration <= 0 || load_cfg.optimeout <= 0 || load_cfg.slowgap <= 0
+        || port <= 0 || port > 65535 || load_cfg.sources > (1u << 24) - 2) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    load_cfg.target.sin_family = AF_INET;
+    load_cfg.target.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &load_cfg.target.sin_addr) != 1) {
+        fprintf(stderr, "bad address: %s\n", host);
+        return 2;
+    }
+
+    // every connection is a descriptor
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+        if (lim.rlim_cur != RLIM_INFINITY && lim.rlim_cur < (rlim_t)load_cfg.conns + 16) {
+            fprintf(stderr, "warning: only %llu descriptors allowed, not all %u connections will open\n",
+                (unsigned long long)lim.rlim_cur, load_cfg.conns);
+        }
+    }
+
+    load_conns = calloc(load_cfg.conns, sizeof(struct load_conn));
+    load_free = malloc(load_cfg.conns * sizeof(unsigned));
+    load_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (!load_conns || !load_free || load_epfd < 0) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (unsigned i = 0; i < load_cfg.conns; ++i) {
+        load_conns[i].fd = -1;
+        load_free[load_nfree++] = load_cfg.conns - 1 - i;
+    }
+
+    signal(SIGINT, &load_handle_signal);
+    signal(SIGTERM, &load_handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+    load_rng ^= load_now_ns();
+
+    double before[SERVER_METRIC_COUNT], after[SERVER_METRIC_COUNT];
+    bool have_server = load_scrape(before);
+    if (load_cfg.metrics && !have_server) fprintf(stderr, "warning: no metrics from %s, server throughput won't be reported\n", load_cfg.metrics);
+
+    uint64_t start = load_now_ns(), end = start + (uint64_t)(load_cfg.duration * 1e9);
+    uint64_t lasttimers = start;
+    double credit = 0; // connections the rate allows to start
+    uint64_t lastcredit = start;
+
+    struct epoll_event events[1024];
+    while (!load_stop) {
+        uint64_t now = load_now_ns();
+        if (now >= end) break;
+
+        if (load_cfg.rate > 0) {
+            credit += (double)(now - lastcredit) * load_cfg.rate / 1e9;
+            if (credit > load_cfg.rate / 10 + 1) credit = load_cfg.rate / 10 + 1; // at most a tenth of a second's worth at once
+            lastcredit = now;
+        }
+        while (load_nfree > 0 && (load_cfg.rate <= 0 || credit >= 1)) {
+            load_start(now);
+            credit -= 1;
+        }
+
+        int n = epoll_wait(load_epfd, events, sizeof(events) / sizeof(events[0]), 10);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+
+        now = load_now_ns();
+        for (int i = 0; i < n; ++i) {
+            struct load_conn *conn = load_conns + events[i].data.u32;
+            if (conn->state == CONN_FREE) continue; // closed by an earlier event of this batch
+            load_event(conn, events[i].events, now);
+        }
+
+        if (now - lasttimers >= 100000000ull) {
+            load_timers(now);
+            lasttimers = now;
+        }
+    }
+
+    double elapsed = (double)(load_now_ns() - start) / 1e9;
+    have_server = have_server && load_scrape(after);
+
+    for (unsigned i = 0; i < load_cfg.conns; ++i) {
+        struct load_conn *conn = load_conns + i;
+        if (conn->state == CONN_FREE) continue;
+
+        // play connections that were still playing did what they were meant to
+        if (conn->state == CONN_PLAY) ++load_stats[conn->kind].ok;
+        else ++load_stats[conn->kind].unfinished;
+        load_close(conn);
+    }
+
+    load_report(elapsed, have_server, before, after);
+
+    for (unsigned i = 0; i < SAMPLE_COUNT; ++i) free(load_samples[i].val);
+    free(load_conns);
+    free(load_free);
+    close(load_epfd);
+    return 0;
+}
@@ -0,0 +1,406 @@
+/* limbo_replay: feeds a capture (see capture.h) back through the server's read path.
+ *
+ * The whole capture is loaded into memory first, then played back against
+ * the server code linked into this binary, on this thread:
+ *
+ *   direct  every connection is a client on /dev/null, and what it sent goes
+ *           straight into client_feed: packet framing, proto_handle_incoming
+ *           and the handlers, with nothing else in the way
+ *   socket  every connection is a socketpair, whose server end starts out as a
+ *           preconn on a real event loop, like an accepted connection would
+ *
+ * By default the records are played as fast as they go; -s plays them at
+ * their recorded pace, divided by the scale. Everything runs on this thread,
+ * so a replay does the same work in the same order every time. Every pass (-n) prints one JSON object per line. */
+
+#include "capture.h"
+#include "client.h"
+#include "preconn.h"
+#include "registry.h"
+#include "event.h"
+#include "epoch.h"
+#include "pktcache.h"
+#include "regdata.h"
+#include "metrics.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+enum replay_mode {
+    REPLAY_DIRECT,
+    REPLAY_SOCKET
+};
+
+// one record of the capture, its bytes are in replay_data
+struct replay_record {
+    unsigned type;
+    uint32_t conn;
+    uint64_t time_us;
+    size_t off, len;
+};
+
+// what a captured connection is during a pass
+struct replay_conn {
+    client_t *cli;  // direct: one reference is ours, so the pointer stays good whoever frees it
+    int peer;       // socket: our end of the socketpair, -1 once closed
+    bool open;
+};
+
+struct replay_record *replay_records = NULL;
+size_t replay_nrecords = 0;
+unsigned char *replay_data = NULL;
+size_t replay_datalen = 0;
+uint32_t replay_maxconn = 0;
+
+struct replay_conn *replay_conns = NULL;
+client_registry_t *replay_registry = NULL;
+
+uint64_t replay_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+bool replay_load(const char *path) {
+    capture_reader_t *rd = capture_reader_open(path);
+    if (!rd) return false;
+
+    size_t reccap = 0, datacap = 0;
+    struct capture_record rec;
+    int res;
+    while ((res = capture_read(rd, &rec)) > 0) {
+        if (replay_nrecords == reccap) {
+            reccap = reccap ? reccap * 2 : 4096;
+            struct replay_record *newrecs = realloc(replay_records, reccap * sizeof(struct replay_record));
+            if (!newrecs) break;
+            replay_records = newrecs;
+        }
+        if (replay_datalen + rec.len > datacap) {
+            while (replay_datalen + rec.len > datacap) datacap = datacap ? datacap * 2 : 65536;
+            unsigned char *newdata = realloc(replay_data, datacap);
+            if (!newdata) break;
+            replay_data = newdata;
+        }
+
+        struct replay_record *out = replay_records + replay_nrecords++;
+        out->type = rec.type;
+        out->conn = rec.conn;
+        out->time_us = rec.time_us;
+        out->off = replay_datalen;
+        out->len = rec.len;
+        if (rec.len > 0) memcpy(replay_data + replay_datalen, rec.data, rec.len);
+        replay_datalen += rec.len;
+        if (rec.conn > replay_maxconn) replay_maxconn = rec.conn;
+    }
+    capture_reader_close(rd);
+
+    if (res < 0) {
+        fprintf(stderr, "%s is damaged after %zu records, replaying those\n", path, replay_nrecords);
+    } else if (res > 0) {
+        fprintf(stderr, "out of memory loading %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+// the address every replayed connection seems to come from
+void replay_addr(sockaddrs *addr, uint32_t conn) {
+    memset(addr, 0, sizeof(*addr));
+    addr->in.sin_family = AF_INET;
+    addr->in.sin_addr.s_addr = htonl(0x7f000001u);
+    addr->in.sin_port = htons((uint16_t)(conn & 0xffff));
+}
+
+/* direct */
+
+// Lets go of a client the server is done with. ours is whether freeing it is up to us (it disconnected while being fed).
+void replay_direct_drop(struct replay_conn *rc, bool ours) {
+    if (ours) client_free(rc->cli);
+    client_release(rc->cli);
+    rc->cli = NULL;
+    rc->open = false;
+}
+
+// Runs whatever was posted (kicks of a duplicate login).
+void replay_direct_settle(void) {
+    event_loop_drain();
+}
+
+void replay_direct_record(const struct replay_record *rec) {
+    struct replay_conn *rc = replay_conns + rec->conn;
+
+    switch (rec->type) {
+        case CAPTURE_OPEN: {
+            int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+            if (fd < 0) return;
+
+            sockaddrs addr;
+            replay_addr(&addr, rec->conn);
+            client_t *cli = client_init(fd, &addr.base, sizeof(addr.in));
+            cli->fd->state |= FD_CAN_WRITE;
+            registry_add(replay_registry, cli);
+            client_retain(cli);
+
+            rc->cli = cli;
+            rc->open = true;
+            break;
+        }
+        case CAPTURE_DATA:
+            if (!rc->open) return;
+            if (rc->cli->fd->fd == -1) { // disconnected from the mailbox in the meantime
+                replay_direct_drop(rc, false);
+                return;
+            }
+            client_feed(rc->cli, replay_data + rec->off, rec->len);
+            if (rc->cli->fd->state & FD_CALL_COMPLETE) replay_direct_drop(rc, true);
+            break;
+        case CAPTURE_CLOSE:
+            if (!rc->open) return;
+            if (rc->cli->fd->fd != -1) client_dc_reason(rc->cli, METRICS_DC_CLOSED);
+            replay_direct_drop(rc, rc->cli->fd->fd != -1);
+            break;
+    }
+
+    replay_direct_settle();
+}
+
+void replay_direct_finish(void) {
+    replay_direct_settle();
+    for (uint32_t i = 0; i <= replay_maxconn; ++i) {
+        struct replay_conn *rc = replay_conns + i;
+        if (!rc->open) continue;
+        // one kicked from the mailbox was freed by whoever disconnected it
+        replay_direct_drop(rc, rc->cli->fd->fd != -1);
+    }
+}
+
+/* socket */
+
+uint64_t replay_bytes_back = 0; // what the server sent, read back and thrown away
+
+void replay_socket_read_back(struct replay_conn *rc) {
+    unsigned char buf[65536];
+    ssize_t res;
+    while ((res = recv(rc->peer, buf, sizeof(buf), 0)) > 0) replay_bytes_back += (uint64_t)res;
+}
+
+void replay_socket_close(struct replay_conn *rc) {
+    close(rc->peer);
+    rc->peer = -1;
+    rc->open = false;
+}
+
+void replay_socket_record(const struct replay_record *rec) {
+    struct replay_conn *rc = replay_conns + rec->conn;
+
+    switch (rec->type) {
+        case CAPTURE_OPEN: {
+            int sv[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) < 0) {
+                fprintf(stderr, "socketpair: %s\n", strerror(errno));
+                return;
+            }
+
+            sockaddrs addr;
+            struct admission_key nokey;
+            memset(&nokey, 0, sizeof(nokey));
+            replay_addr(&addr, rec->conn);
+            if (!preconn_start(sv[0], &addr.base, sizeof(addr.in), replay_registry, NULL, &nokey)) {
+                close(sv[1]);
+                return;
+            }
+
+            rc->peer = sv[1];
+            rc->open = true;
+            break;
+        }
+        case CAPTURE_DATA: {
+            if (!rc->open) return;
+            const unsigned char *buf = replay_data + rec->off;
+            size_t len = rec->len;
+            while (len > 0) {
+                ssize_t res = send(rc->peer, buf, len, MSG_NOSIGNAL);
+                if (res < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) { // the server has hung up on it
+                        replay_socket_close(rc);
+                        return;
+                    }
+                    event_loop_handle(0); // let the server catch up
+                    replay_socket_read_back(rc);
+                    continue;
+                }
+                buf += res;
+                len -= (size_t)res;
+            }
+            break;
+        }
+        case CAPTURE_CLOSE:
+            if (!rc->open) return;
+            replay_socket_close(rc);
+            break;
+    }
+
+    event_loop_handle(0);
+    event_loop_drain(); // kicks posted while handling it
+    if (rc->open) replay_socket_read_back(rc);
+}
+
+void replay_socket_finish(void) {
+    for (uint32_t i = 0; i <= replay_maxconn; ++i) {
+        if (replay_conns[i].open) replay_socket_close(replay_conns + i);
+    }
+
+    // until the server has noticed every one of them is gone
+    uint64_t giveup = replay_now_ns() + 5000000000ull;
+    while ((registry_count(replay_registry) > 0 || atomic_load_explicit(&replay_registry->npending, memory_order_relaxed) > 0)
+           && replay_now_ns() < giveup) {
+        event_loop_handle(10);
+        event_loop_drain();
+    }
+}
+
+/* main */
+
+void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [options] capture\n", argv0);
+    fprintf(stderr, "  -m mode     direct or socket (default direct)\n");
+    fprintf(stderr, "  -s scale    play at the recorded pace divided by scale, 0 for as fast as possible (default 0)\n");
+    fprintf(stderr, "  -n passes   times to replay the capture (default 1)\n");
+    fprintf(stderr, "  -w path     world the join packets are made of (default world.schem)\n");
+    fprintf(stderr, "  -c path     packet cache (default limbo.pktcache)\n");
+    fprintf(stderr, "  -v          keep the server's info logs\n");
+}
+
+int main(int argc, char **argv) {
+    unsigned mode = REPLAY_DIRECT;
+    double scale = 0;
+    unsigned passes = 1;
+    const char *worldpath = "world.schem", *cachepath = "limbo.pktcache";
+    bool verbose = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:s:n:w:c:vh")) != -1) {
+        switch (opt) {
+            case 'm':
+                if (!strcmp(optarg, "direct")) mode = REPLAY_DIRECT;
+                else if (!strcmp(optarg, "socket")) mode = REPLAY_SOCKET;
+                else {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 's': scale = strtod(optarg, NULL); break;
+            case 'n': passes = (unsigned)strtoul(optarg, NULL, 10); break;
+            case 'w': worldpath = optarg; break;
+            case 'c': cachepath = optarg; break;
+            case 'v': verbose = true; break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (optind != argc - 1 || scale < 0 || passes == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    setlocale(LC_ALL, "");
+    signal(SIGPIPE, SIG_IGN);
+    log_setlevel(verbose ? LOG_INFO : LOG_WARN);
+
+    if (!replay_load(argv[optind])) return 1;
+    if (replay_nrecords == 0) {
+        fprintf(stderr, "%s has nothing to replay\n", argv[optind]);
+        return 1;
+    }
+
+    pktcache_default = pktcache_open(cachepath, worldpath);
+    if (!pktcache_default) {
+        fprintf(stderr, "unable to prepare packets from %s\n", worldpath);
+        return 1;
+    }
+
+    if (!epoch_init(1)) return 1;
+    epoch_thread_register();
+    replay_registry = registry_create(1);
+    replay_conns = calloc((size_t)replay_maxconn + 1, sizeof(struct replay_conn));
+    if (!replay_registry || !replay_conns || !event_loop_init(1)) {
+        fprintf(stderr, "unable to set up the server\n");
+        return 1;
+    }
+    event_loop_bind_thread(0);
+
+    uint32_t nconns = 0;
+    for (size_t i = 0; i < replay_nrecords; ++i) nconns += replay_records[i].type == CAPTURE_OPEN;
+    uint64_t span_us = replay_records[replay_nrecords - 1].time_us - replay_records[0].time_us;
+
+    for (unsigned pass = 0; pass < passes; ++pass) {
+        for (uint32_t i = 0; i <= replay_maxconn; ++i) {
+            replay_conns[i].open = false;
+            replay_conns[i].cli = NULL;
+            replay_conns[i].peer = -1;
+        }
+        replay_bytes_back = 0;
+
+        uint64_t start = replay_now_ns();
+        for (size_t i = 0; i < replay_nrecords; ++i) {
+            const struct replay_record *rec = replay_records + i;
+
+            if (scale > 0) {
+                uint64_t due = start + (uint64_t)((double)(rec->time_us - replay_records[0].time_us) * 1000. / scale);
+                uint64_t now;
+                while ((now = replay_now_ns()) < due) {
+                    if (mode == REPLAY_SOCKET) {
+                        uint64_t wait_ms = (due - now) / 1000000u;
+                        event_loop_handle(wait_ms > 100 ? 100 : (int)wait_ms);
+                        event_loop_drain();
+                    } else {
+                        struct timespec ts = { .tv_sec = (time_t)((due - now) / 1000000000u), .tv_nsec = (long)((due - now) % 1000000000u) };
+                        nanosleep(&ts, NULL);
+                    }
+                }
+            }
+
+            if (mode == REPLAY_DIRECT) replay_direct_record(rec);
+            else replay_socket_record(rec);
+        }
+
+        if (mode == REPLAY_DIRECT) replay_direct_finish();
+        else replay_socket_finish();
+        double secs = (double)(replay_now_ns() - start) / 1e9;
+
+        printf("{\"replay\":\"%s\",\"pass\":%u,\"scale\":%g,\"records\":%zu,\"conns\":%u,\"bytes\":%zu,\"captured_secs\":%.3f,"
+               "\"secs\":%.6f,\"conns_per_sec\":%.1f,\"records_per_sec\":%.1f,\"mbytes_per_sec\":%.3f,\"bytes_back\":%llu}\n",
+            mode == REPLAY_DIRECT ? "direct" : "socket", pass + 1, scale, replay_nrecords, nconns, replay_datalen,
+            (double)span_us / 1e6, secs, (double)nconns / secs, (double)replay_nrecords / secs,
+            (double)replay_datalen / secs / 1e6, (unsigned long long)replay_bytes_back);
+        fflush(stdout);
+    }
+
+    event_loop_drain();
+
+    preconn_close_all(replay_registry);
+    registry_free(replay_registry);
+    epoch_drain();
+    epoch_thread_unregister();
+    epoch_free();
+    event_loop_close();
+    pktcache_close(pktcache_default);
+    regdata_cleanup();
+
+    free(replay_conns);
+    free(replay_records);
+    free(replay_data);
+    return 0;
+}
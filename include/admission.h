@@ -0,0 +1,65 @@
+#ifndef LIMBO_ADMISSION_H_INCLUDED
+#define LIMBO_ADMISSION_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+// IPv4 addresses are tracked one by one, IPv6 ones by /64 (what a single host usually gets)
+struct admission_key {
+    uint64_t addr;
+    uint8_t family; // AF_INET or AF_INET6, 0 for an untracked peer
+};
+
+enum admission_result {
+    ADMISSION_OK = 0,
+    ADMISSION_RATE,  // connecting too fast
+    ADMISSION_CONNS  // too many connections open at once
+};
+
+struct admission_entry {
+    struct admission_key key; // family 0 if the way is free
+    uint16_t conns;
+    uint32_t tokens;   // thousandths of a connection
+    uint64_t last_ms;  // last refill
+    uint32_t rejected; // since the last report
+    uint8_t reason;    // of the last rejection
+};
+
+#define ADMISSION_WAYS (8)
+
+struct admission_bucket {
+    pthread_mutex_t lock;
+    struct admission_entry ways[ADMISSION_WAYS];
+};
+
+/* Fixed-size, set-associative table of token buckets. When every way of a
+ * bucket has connections open, new peers that hash there are let in untracked
+ * rather than turned away. */
+typedef struct tag_admission {
+    struct admission_bucket *buckets;
+    size_t nbuckets; // power of two
+
+    uint32_t rate;  // connections per second (also thousandths per millisecond)
+    uint32_t burst; // connections allowed back to back
+    uint16_t maxconns;
+    bool limit_loopback; // off by default, a proxy on the same host connects from there for every player
+
+    atomic_ulong untracked;
+    uint64_t last_report_ms;
+} admission_t;
+
+admission_t *admission_create(size_t entries, uint32_t rate, uint32_t burst, uint16_t maxconns);
+void admission_free(admission_t *adm);
+
+// Called right after accept. Fills key, pass it to admission_release once the connection is closed.
+enum admission_result admission_admit(admission_t *adm, const struct sockaddr *saddr, struct admission_key *key);
+void admission_release(admission_t *adm, const struct admission_key *key);
+
+// Logs the peers that were turned away most since the last report, at most once every interval seconds.
+void admission_report(admission_t *adm, unsigned interval);
+
+#endif // include guard
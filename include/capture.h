@@ -0,0 +1,75 @@
+#ifndef LIMBO_CAPTURE_H_INCLUDED
+#define LIMBO_CAPTURE_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/* Records what players send, connection by connection, so limbo_replay can
+ * feed it back through the read path later. Only connections accepted by this
+ * process are recorded, from their very first byte; ones handed over by a
+ * proxy or an older process start in the middle and are left out.
+ *
+ * The file is a series of sessions, one per time the server opened it:
+ *   session: "LIMBOCAP" CAPTURE_VERSION, then records until the next session or the end
+ *   record:  type (byte), connection (VarLong), microseconds since the previous record (VarLong)
+ *            and for CAPTURE_DATA, the length (VarLong) and the bytes
+ * VarLongs here are unsigned LEB128, like the protocol's. Connection numbers
+ * start at 1 in every session. */
+#define CAPTURE_MAGIC   "LIMBOCAP"
+#define CAPTURE_VERSION (1)
+
+enum capture_record_type {
+    CAPTURE_OPEN = 1,
+    CAPTURE_DATA,
+    CAPTURE_CLOSE
+};
+
+typedef struct tag_capture {
+    pthread_mutex_t lock; // IO threads record at the same time
+    FILE *fp;
+    uint64_t last_us;
+    uint32_t next_conn;
+    bool failed; // a write failed, nothing more is recorded
+} capture_t;
+
+// NULL unless the server is capturing
+extern capture_t *capture_default;
+
+// Starts a new session at the end of path.
+capture_t *capture_open(const char *path);
+void capture_close(capture_t *cap);
+void capture_flush(capture_t *cap);
+
+// Numbers a new connection, 0 (which the other calls ignore) if cap is NULL.
+uint32_t capture_conn_open(capture_t *cap);
+void capture_data(capture_t *cap, uint32_t conn, const void *buf, size_t len);
+void capture_conn_close(capture_t *cap, uint32_t conn);
+
+/* Reading one back. Connection numbers are made unique across sessions, and
+ * the time keeps going from one session to the next. */
+struct capture_record {
+    unsigned type;
+    uint32_t conn;
+    uint64_t time_us; // since the first record of the file
+    const unsigned char *data; // valid until the next capture_read
+    size_t len;
+};
+
+typedef struct tag_capture_reader {
+    FILE *fp;
+    unsigned char *buf;
+    size_t bufsz;
+    uint64_t now_us;
+    uint32_t conn_base, conn_max; // connections of the sessions before, the highest of this one
+} capture_reader_t;
+
+capture_reader_t *capture_reader_open(const char *path);
+void capture_reader_close(capture_reader_t *rd);
+
+// 1 for a record, 0 at the end of the file, -1 if it is damaged.
+int capture_read(capture_reader_t *rd, struct capture_record *rec);
+
+#endif // include guard
@@ -6,12 +6,15 @@
 #include "server.h"
 #include "list.h"
 #include "player.h"
+#include "registry.h"
+#include "epoch.h"
 
 #include <netinet/in.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <stdatomic.h>
 #include <time.h>
 
 struct tag_client;
@@ -20,13 +23,23 @@ typedef struct tag_client client_t;
 #include "protocol.h"
 
 struct tag_client {
-    file_descriptor_t *fd;
-    pthread_mutex_t evtmutex;
+    // kept together at the front so a registry sweep touches a single cache line per client
+    struct list_hook reghook;
+    atomic_uint refs; // one reference belongs to the connection, registry snapshots hold the rest
+    struct registry_shard *_Atomic shard; // NULL once removed from the registry
+    client_registry_t *registry;
+
+    struct epoch_entry retire; // freed through this once the last reference is gone
+
+    file_descriptor_t *fd; // fd->loop is the IO thread that owns the client, see client_kick_remote_w
 
     sockaddrs saddr;
     socklen_t saddrlen;
     char *saddrstr;
 
+    admission_t *admission;
+    struct admission_key admkey;
+
     unsigned char *recvpartial;
     size_t recvpartsz, recvpartcur, recvpartexsz;
 
@@ -47,17 +60,38 @@ struct tag_client {
 
     bool dc_on_write;
     bool should_delete;
-
-    dllist_t *clients;
-    struct list_dlnode *mypos;
+    uint8_t dcreason; // enum metrics_dc_reason
+    uint32_t capid;   // the connection's number in the capture, 0 if not recorded
 };
 
 client_t *client_init(int fd, struct sockaddr *saddr, socklen_t saddrlen);
 void client_free(client_t *cli);
+void client_start(client_t *client, unsigned char *pending, size_t pendinglen);
+
+/* Handles len bytes as if the client had just sent them, without going near
+ * its socket (limbo_replay feeds captures through this). Like in a read
+ * handler, the caller frees the client if FD_CALL_COMPLETE is set afterwards. */
+void client_feed(client_t *client, unsigned char *buf, size_t len);
+
+void client_retain(client_t *cli);
+void client_release(client_t *cli);
+
+// Pins a client found without holding a reference (inside an epoch section), false if it is on its way out.
+bool client_tryretain(client_t *cli);
+
+// Moves the client to another protocol phase (keeps the connection counts right).
+void client_set_protocol(client_t *cli, unsigned protocol);
+
+// Records why the client is about to be disconnected (enum metrics_dc_reason), unless that is known already.
+void client_dc_reason(client_t *cli, unsigned reason);
 
 void client_disconnect(client_t *cli, const char *fmt, ...);
 void client_disconnect_w(client_t *cli, const wchar_t *fmt, ...);
 void client_kick_w(client_t *cli, const wchar_t *fmt, ...);
+
+/* The only way other threads may act on a client: the kick is posted to the
+ * owning IO thread, which carries it out unless the client is gone by then. */
+void client_kick_remote_w(client_t *cli, const wchar_t *reason);
 void client_write(client_t *client, const unsigned char *buf, size_t length);
 void client_write_pkt(client_t *client, void *pkt);
 
@@ -0,0 +1,31 @@
+#ifndef LIMBO_CPU_H_INCLUDED
+#define LIMBO_CPU_H_INCLUDED
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// highest CPU number looked at
+#define CPU_MAX (1024)
+
+/* The CPUs this process may run on, in placement order: one hardware thread of
+ * every physical core first, then the SMT siblings. The first ncores entries
+ * never share a core. */
+struct cpu_topology {
+    unsigned ncpus, ncores;
+    int *cpus;
+    unsigned *core; // core index (< ncores) of each entry of cpus
+};
+
+bool cpu_topology_detect(struct cpu_topology *topo);
+void cpu_topology_free(struct cpu_topology *topo);
+
+// Restricts thread tid (0 for the calling one) to the n CPUs given. Returns false and sets errno on failure.
+bool cpu_pin(pid_t tid, const int *cpus, unsigned n);
+
+// the CPU the calling thread is running on right now, -1 if unknown
+int cpu_current(void);
+
+// Formats a CPU list like "0,2,4" into buf (truncated to fit).
+void cpu_format_list(char *buf, size_t len, const int *cpus, unsigned n);
+
+#endif // include guard
@@ -0,0 +1,38 @@
+#ifndef LIMBO_EPOCH_H_INCLUDED
+#define LIMBO_EPOCH_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Epoch-based reclamation. Readers walk shared structures inside an
+ * epoch_enter/epoch_exit section without taking any lock, and whatever is
+ * unlinked while they might be looking at it is handed to epoch_retire instead
+ * of being freed. It is freed once every thread that was inside a section at
+ * the time has left it. Sections nest, and must not block: an IO thread is in
+ * one while it handles a batch of events, never while it waits for one. */
+struct epoch_entry {
+    struct epoch_entry *next;
+    uint64_t epoch;
+    void (*free)(struct epoch_entry *ent);
+};
+
+/* Makes room for nthreads threads registered at once, before any registers.
+ * epoch_free gives it back once the last one has unregistered. */
+bool epoch_init(unsigned nthreads);
+void epoch_free(void);
+
+/* Every thread that enters a section or retires anything must be registered.
+ * Entries the thread retired and could not free yet outlive it. */
+bool epoch_thread_register(void);
+void epoch_thread_unregister(void);
+
+void epoch_enter(void);
+void epoch_exit(void);
+
+// Call after ent's object has been unlinked from everything readers walk.
+void epoch_retire(struct epoch_entry *ent, void (*freefn)(struct epoch_entry *ent));
+
+// Frees everything retired, due or not. Only once no other thread is registered (at exit).
+void epoch_drain(void);
+
+#endif // include guard
@@ -10,17 +10,31 @@
 
 #define FD_WANT_ALL (FD_WANT_READ | FD_WANT_WRITE)
 
-#include <pthread.h>
+#include <stdbool.h>
 
-void event_loop_init();
-void event_loop_handle(int timeout);
+/* There is one event loop per IO thread, and everything registered with a loop
+ * (see file_descriptor_t.loop) is only ever touched by the thread running it.
+ * Other threads talk to it by posting messages to the loop's mailbox. */
+bool event_loop_init(unsigned nloops);
 void event_loop_close();
 
+// Makes the calling thread the one that runs loop idx (modulo the loop count).
+void event_loop_bind_thread(unsigned idx);
+
+// Runs the calling thread's loop once.
+void event_loop_handle(int timeout);
+
+unsigned event_loop_count(void);
+
+// the calling thread's loop, or the next one round robin for threads that don't run one
+unsigned event_loop_current(void);
+unsigned event_loop_next(void);
+
 // Represents a single file descriptor, paired with whether it can be read to or written from
 typedef struct tag_file_descriptor {
     int fd;
     unsigned state;
-    pthread_mutex_t *handler_mutex;
+    unsigned loop; // index of the loop that owns the fd, fixed once it has been added
 
     void *handler_data;
     void (*read_handler)(struct tag_file_descriptor *fd, void *handler_data);
@@ -38,4 +52,22 @@ typedef struct tag_file_descriptor {
 void event_loop_want(file_descriptor_t *fd, unsigned flags);
 void event_loop_delfd(file_descriptor_t *fd);
 
+/* A message for the thread running a loop, embedded in whatever the sender
+ * wants to pass along. run is called on that thread once the events it polled
+ * are all handled, so it may free anything owned by the loop, and the message
+ * belongs to run from then on. */
+struct event_msg {
+    struct event_msg *next;
+    void (*run)(struct event_msg *msg);
+};
+
+// Lock-free, safe from any thread. Messages run in the order each sender posted them.
+void event_loop_post(unsigned loop, struct event_msg *msg);
+
+// Wakes every loop, e.g. so their threads notice a shutdown.
+void event_loop_wake_all(void);
+
+// Runs every message still waiting in any mailbox. Only once no loop is running (e.g. at shutdown).
+void event_loop_drain(void);
+
 #endif // include guard
@@ -0,0 +1,54 @@
+#ifndef LIMBO_HANDOFF_H_INCLUDED
+#define LIMBO_HANDOFF_H_INCLUDED
+
+#include <stdbool.h>
+
+#include "server.h"
+#include "registry.h"
+
+// Set in the environment of the new process, holds the fd of its end of the handoff socket
+#define HANDOFF_ENV "LIMBO_HANDOFF_FD"
+
+/* Hot restart. The old process execs exepath and passes it every listener and
+ * connection (with the client state needed to carry on) over a Unix socket.
+ * proxyserver (the proxy handoff listener) may be NULL. Must be called with the
+ * IO and tick threads stopped. Returns true once the new process has taken over:
+ * the sockets are closed here without a goodbye and the caller should exit,
+ * except for the connections the new process could not take, which are left
+ * open in the registry for the caller to kick. On false nothing was touched and
+ * the server can go on. */
+bool handoff_restart(const char *exepath, server_t *server, server_t *proxyserver, client_registry_t *registry);
+
+/* The new process's half. Adopts everything the old process sends over sockfd
+ * into registry and new servers, and closes sockfd. The event loop must be up.
+ * proxyserver is left NULL if the old process had no proxy handoff listener. */
+bool handoff_receive(int sockfd, client_registry_t *registry, server_t **server, server_t **proxyserver);
+
+/* Proxy handoff. A front proxy on the same host connects to the proxy handoff
+ * listener and, for every player it parks here, sends a record header
+ *   u32 kind (HANDOFF_PROXY_CLIENT), u32 payload length (both host endian)
+ * with the player's socket attached (SCM_RIGHTS), followed by the payload
+ *   Int protocol version, UByte phase (0 handshake, 1 status, 2 login, 3 play),
+ *   Bool has profile, [Long uuid most, Long uuid least, String name],
+ *   VarInt length + bytes the proxy read from the player but did not handle.
+ * A player handed over in play needs a profile, it is sent everything that
+ * follows Login Success. Every record is answered with one byte, 0 if the
+ * player was adopted; otherwise the proxy still has the player to itself. No
+ * more than 64 sockets may be sent ahead of their records, a proxy that goes
+ * past that is disconnected and keeps every player not yet answered.
+ *
+ * The proxy is trusted with players' identities, so it must run as the same user
+ * as limbo: the socket file is only accessible to that user (mode 0600), and a
+ * connection from any other uid (SO_PEERCRED) is closed right away. */
+#define HANDOFF_PROXY_CLIENT (16)
+
+// Largest proxy record payload accepted
+#define HANDOFF_PROXY_MAXREC (65536)
+
+// Takes an accepted connection on the proxy handoff listener.
+void handoff_proxy_accept(int sockfd, client_registry_t *registry);
+
+// Closes every proxy connection, at shutdown once the IO threads are done.
+void handoff_proxy_close_all(void);
+
+#endif // include guard
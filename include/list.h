@@ -46,4 +46,46 @@ do { dll_lock(_list); for (struct list_dlnode *_curnode = (_list)->tail, *_prev
 #define DLLIST_FOREACH_DONE(_list) \
 dll_unlock(_list); } while (0)
 
+/* Intrusive doubly linked list: the hook is embedded in the element, so linking
+ * allocates nothing and walking the list never leaves the elements themselves.
+ * The list head is a sentinel, an empty list points at itself. Not synchronized. */
+struct list_hook {
+    struct list_hook *prev;
+    struct list_hook *next;
+};
+
+typedef struct tag_ilist {
+    size_t length;
+    struct list_hook head;
+} ilist_t;
+
+#define LIST_CONTAINER(_hook, _type, _member) ((_type *)((char *)(_hook) - offsetof(_type, _member)))
+
+void ilist_init(ilist_t *list);
+
+// static initializer, for lists that can't be set up with ilist_init
+#define ILIST_INITIALIZER(_list) { 0, { &(_list).head, &(_list).head } }
+
+void ilist_addend(ilist_t *list, struct list_hook *hook);
+void ilist_addstart(ilist_t *list, struct list_hook *hook);
+void ilist_remove(ilist_t *list, struct list_hook *hook);
+
+// true if hook is currently linked into a list (hooks must be zeroed or removed first)
+#define ilist_linked(_hook) ((_hook)->next != NULL)
+
+// removing _cur while iterating is fine
+#define ILIST_FOREACH(_list, _cur) \
+for (struct list_hook *_cur = (_list)->head.next, *_inext = _cur->next; _cur != &(_list)->head; _cur = _inext, _inext = _cur->next)
+
+/* Lists that are read without their lock. Writers still exclude each other,
+ * readers only ever follow next and must be inside an epoch section (see
+ * epoch.h). A removed hook keeps its next pointer, so a reader standing on it
+ * finds its way back, and the element may only be reclaimed through
+ * epoch_retire. ilist_linked does not work on these hooks. */
+void ilist_addend_rcu(ilist_t *list, struct list_hook *hook);
+void ilist_remove_rcu(ilist_t *list, struct list_hook *hook);
+
+#define ILIST_FOREACH_RCU(_list, _cur) \
+for (struct list_hook *_cur = __atomic_load_n(&(_list)->head.next, __ATOMIC_ACQUIRE); _cur != &(_list)->head; _cur = __atomic_load_n(&_cur->next, __ATOMIC_ACQUIRE))
+
 #endif // include guard
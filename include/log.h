@@ -10,13 +10,62 @@
 
 typedef unsigned log_level_t;
 
+#include <stdbool.h>
+
+/* Starts the writer thread. Until then (and after log_stop) records are written
+ * synchronously. log_stop writes out whatever is still queued, and leaves the
+ * per-thread rings allocated for threads that are still running. */
+bool log_start(void);
+void log_stop(void);
+
 void log_log(log_level_t level, const char *fmt, ...);
 log_level_t log_getlevel();
 log_level_t log_setlevel(log_level_t newlevel);
 
+/* Rate limiting for call sites that fire once per connection. A site lets
+ * LOG_SITE_BURST records through per LOG_SITE_WINDOW seconds, the rest are
+ * counted and summed up in one line when the window ends. */
+#define LOG_SITE_BURST  (20)
+#define LOG_SITE_WINDOW (10)
+
+#include <stdatomic.h>
+
+struct log_site {
+    const char *label; // summaries use the text before the first '%', '(' or ':'
+    atomic_uint count;
+    atomic_ulong suppressed;
+    atomic_bool listed;
+    struct log_site *next;
+};
+
+#define LOG_SITE_INIT(_label) { .label = (_label) }
+
+// true if a record of level should be logged from site right now
+bool log_admit(struct log_site *site, log_level_t level);
+
+#define log_limit(_level, _fmt, ...)                                  \
+do {                                                                  \
+    static struct log_site _logsite = LOG_SITE_INIT(_fmt);            \
+    if (log_admit(&_logsite, (_level))) log_log((_level), (_fmt), ## __VA_ARGS__); \
+} while (0)
+
+// debug logging is only compiled into debug builds (or with ENABLE_DEBUG_LOGS)
+#if defined(BUILD_DEBUG) || defined(BUILD_LOG_DEBUG)
+#define LOG_DEBUG_COMPILED (1)
 #define log_debug(fmt, ...) log_log(LOG_DEBUG, (fmt), ## __VA_ARGS__)
+#define log_debug_limit(fmt, ...) log_limit(LOG_DEBUG, (fmt), ## __VA_ARGS__)
+#else
+#define LOG_DEBUG_COMPILED (0)
+// still type checked, never emitted
+#define log_debug(fmt, ...) do { if (0) log_log(LOG_DEBUG, (fmt), ## __VA_ARGS__); } while (0)
+#define log_debug_limit(fmt, ...) log_debug((fmt), ## __VA_ARGS__)
+#endif
+
 #define log_info(fmt, ...)  log_log(LOG_INFO , (fmt), ## __VA_ARGS__)
 #define log_warn(fmt, ...)  log_log(LOG_WARN , (fmt), ## __VA_ARGS__)
 #define log_error(fmt, ...) log_log(LOG_ERROR, (fmt), ## __VA_ARGS__)
 
+#define log_info_limit(fmt, ...) log_limit(LOG_INFO, (fmt), ## __VA_ARGS__)
+#define log_warn_limit(fmt, ...) log_limit(LOG_WARN, (fmt), ## __VA_ARGS__)
+
 #endif // include guard
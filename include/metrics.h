@@ -0,0 +1,100 @@
+#ifndef LIMBO_METRICS_H_INCLUDED
+#define LIMBO_METRICS_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "utils.h"
+
+/* Server-wide counters, kept per thread. Every thread only ever writes its own
+ * shard (a plain load and store, no lock and no shared cache line), and a
+ * scrape adds all the shards up. Gauges are counted the same way, as the sum of
+ * what every thread added and took away. */
+enum metrics_counter {
+    METRIC_ACCEPTS,
+    METRIC_ADMISSION_REJECTS,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_PACKETS_IN,
+    METRIC_PACKETS_OUT,
+    METRIC_SENDQ_BYTES,      // gauge
+    METRIC_RECVBUF_BYTES,    // gauge
+    METRIC_LOOP_WAKEUPS,
+    METRIC_LOOP_EVENTS,
+    METRIC_HANDOFF_LOST,     // connections a hot restart could not take over
+    METRIC_CONNECTIONS,      // gauge, + the phase (see protocol.h) for the rest of them
+    METRIC_DISCONNECTS = METRIC_CONNECTIONS + 4, // + the reason
+    METRIC_RTT_BUCKETS = METRIC_DISCONNECTS + 9, // + the bucket
+    METRIC_RTT_SUM = METRIC_RTT_BUCKETS + 10,
+    METRIC_COUNT
+};
+
+// why a connection was closed, first one wins
+enum metrics_dc_reason {
+    METRICS_DC_OTHER,
+    METRICS_DC_CLOSED,   // by the peer, or after a status ping
+    METRICS_DC_TIMEOUT,
+    METRICS_DC_KICKED,
+    METRICS_DC_PROTOCOL,
+    METRICS_DC_IO,
+    METRICS_DC_SENDQ,
+    METRICS_DC_REJECTED, // turned away on login (bad name, duplicate...)
+    METRICS_DC_SHUTDOWN
+};
+
+// a phase of -1 is no connection: metrics_phase(-1, p) opens one, metrics_phase(p, -1) closes it
+#define METRICS_PHASE_NONE (-1)
+
+void metrics_add(unsigned counter, int64_t n);
+void metrics_phase(int from, int to);
+void metrics_disconnect(unsigned reason);
+
+// keep-alive round trip in milliseconds
+void metrics_rtt(int64_t ms);
+
+/* Per packet type: how many, how many bytes, and how long the handler took
+ * (for outgoing packets, encoding and writing it). Handler times go into a
+ * log-linear histogram, 4 buckets per power of two of nanoseconds, so any
+ * quantile read from it is within 25% of the truth. */
+#define METRICS_PKT_IN  (0)
+#define METRICS_PKT_OUT (1)
+
+#define METRICS_PKT_IDS     (256) // higher ids are counted with the last one
+#define METRICS_HIST_BUCKETS (124) // up to 2^32 ns, longer is counted in the last one
+
+struct metrics_packet_stat {
+    _Atomic uint64_t count, bytes, timed;
+    _Atomic uint64_t hist[METRICS_HIST_BUCKETS];
+};
+
+uint64_t metrics_now_ns(void);
+
+/* Counts one packet, and metrics_packet_time adds how long it took since
+ * start_ns (from metrics_now_ns). They are separate so a packet whose handler
+ * bails out with a protocol error is still counted. */
+void metrics_packet(unsigned phase, int32_t id, unsigned dir, size_t bytes);
+void metrics_packet_time(unsigned phase, int32_t id, unsigned dir, uint64_t start_ns);
+
+// Adds every thread's numbers for one packet type into out (zeroed first). False if it was never seen.
+bool metrics_packet_merge(unsigned phase, int32_t id, unsigned dir, struct metrics_packet_stat *out);
+
+// The handler time (ns) below which the fraction q of the timed packets fall.
+uint64_t metrics_hist_quantile(const struct metrics_packet_stat *stat, double q);
+
+// Logs a line for every packet type seen so far (the console's "packets" command).
+void metrics_packet_dump(void);
+
+// Lets another thread use the calling thread's shard once it is gone (the counts stay).
+void metrics_thread_release(void);
+
+// Appends the Prometheus text exposition of everything counted so far.
+int metrics_format(struct auto_buffer *out);
+
+// Takes a connection accepted on a SERVER_METRICS listener and answers it on the calling thread's loop.
+void metrics_http_accept(int sockfd);
+
+// Drops every scrape still in progress, the IO threads must be stopped.
+void metrics_http_close_all(void);
+
+#endif // include guard
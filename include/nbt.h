@@ -0,0 +1,93 @@
+#ifndef LIMBO_NBT_H_INCLUDED
+#define LIMBO_NBT_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+enum nbt_tag {
+    NBT_END = 0,
+    NBT_BYTE,
+    NBT_SHORT,
+    NBT_INT,
+    NBT_LONG,
+    NBT_FLOAT,
+    NBT_DOUBLE,
+    NBT_BYTE_ARRAY,
+    NBT_STRING,
+    NBT_LIST,
+    NBT_COMPOUND,
+    NBT_INT_ARRAY,
+    NBT_LONG_ARRAY
+};
+
+#define NBT_TAG_MAX NBT_LONG_ARRAY
+
+/* Zero-copy NBT reader. Nothing is allocated: strings and arrays point into the
+ * source buffer (big-endian, not NUL-terminated) and compounds/lists remember
+ * where their payload starts so they can be walked later with nbt_reader_at. */
+struct nbt_reader {
+    const unsigned char *cur, *end;
+    bool error;
+};
+
+struct nbt_value {
+    uint8_t tag;
+    union {
+        int64_t i;
+        double d;
+        struct {
+            const char *str;
+            uint16_t len;
+        } s;
+        struct {
+            const unsigned char *data; // raw big-endian elements
+            int32_t len;               // element count
+        } arr;
+        struct {
+            const unsigned char *payload;
+            uint8_t elemtag; // only for lists
+            int32_t len;     // only for lists
+        } nest;
+    } v;
+};
+
+void nbt_reader_init(struct nbt_reader *rd, const void *buf, size_t len);
+
+// Reads the root tag (type + name). Returns false if the root is not a compound.
+bool nbt_read_root(struct nbt_reader *rd, struct nbt_value *root);
+
+/* Positions sub at the payload of a compound or list value. The reader must
+ * share the bounds of the buffer the value was read from. */
+void nbt_reader_at(struct nbt_reader *sub, const struct nbt_reader *parent, const struct nbt_value *val);
+
+// Returns 1 when a field was read, 0 at the end of the compound, -1 on error.
+int nbt_compound_next(struct nbt_reader *rd, const char **name, uint16_t *namelen, struct nbt_value *val);
+
+// Returns 1 when an element was read, 0 at the end of the list, -1 on error. remain tracks the elements left.
+int nbt_list_next(struct nbt_reader *rd, uint8_t elemtag, int32_t *remain, struct nbt_value *val);
+
+bool nbt_name_eq(const char *name, uint16_t namelen, const char *str);
+int64_t nbt_array_get(const struct nbt_value *val, int32_t idx);
+
+/* Streaming NBT writer. Values are appended straight to an auto_buffer; pass a
+ * name for compound fields and NULL for list elements. Every compound begun
+ * must be closed with nbt_write_end. All functions return 0 or an ab_push error. */
+struct auto_buffer;
+
+// network NBT (1.20.2+) drops the name of the root tag
+int nbt_write_root(struct auto_buffer *buf, const char *name, bool network);
+
+int nbt_write_compound(struct auto_buffer *buf, const char *name);
+int nbt_write_list(struct auto_buffer *buf, const char *name, uint8_t elemtag, int32_t len);
+int nbt_write_end(struct auto_buffer *buf);
+
+int nbt_write_byte(struct auto_buffer *buf, const char *name, int8_t val);
+int nbt_write_short(struct auto_buffer *buf, const char *name, int16_t val);
+int nbt_write_int(struct auto_buffer *buf, const char *name, int32_t val);
+int nbt_write_long(struct auto_buffer *buf, const char *name, int64_t val);
+int nbt_write_float(struct auto_buffer *buf, const char *name, float val);
+int nbt_write_double(struct auto_buffer *buf, const char *name, double val);
+int nbt_write_string(struct auto_buffer *buf, const char *name, const char *str);
+
+#endif // include guard
@@ -0,0 +1,57 @@
+#ifndef LIMBO_PKTCACHE_H_INCLUDED
+#define LIMBO_PKTCACHE_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "types.h"
+
+// Bump when the layout below changes
+#define PKTCACHE_FORMAT (1)
+
+enum pktcache_kind {
+    PKTCACHE_STATUS = 0, // Status Response
+    PKTCACHE_JOIN,       // everything sent between Login Success and the first keep alive
+    PKTCACHE_LEGACY,     // reply to a 1.4-1.6 legacy ping, the same for every version
+    PKTCACHE_LEGACY_BETA // reply to a beta 1.8-1.3 legacy ping
+};
+
+#define PKTCACHE_KINDS (PKTCACHE_LEGACY_BETA + 1)
+
+/* The cache file is the header, then the entry table, then the blobs. Every blob
+ * is a run of complete, length-prefixed packets. Integers are host endian, the
+ * file only ever lives next to the binary that wrote it. */
+struct pktcache_header {
+    char magic[8];
+    uint32_t format;
+    uint32_t count;
+    unsigned char digest[16]; // md5 of every input the blobs were built from
+};
+
+struct pktcache_entry {
+    uint32_t protover;
+    uint32_t kind;
+    uint64_t offset; // from the start of the file
+    uint64_t len;
+};
+
+typedef struct tag_pktcache {
+    const unsigned char *base;
+    size_t len;
+    bool mapped; // false if the file could not be written and base is malloc'd
+
+    const struct pktcache_header *hdr;
+    const struct pktcache_entry *entries;
+} pktcache_t;
+
+extern pktcache_t *pktcache_default;
+
+// Maps the cache at path, rebuilding it first if it is missing or any input changed. worldpath may not exist.
+pktcache_t *pktcache_open(const char *path, const char *worldpath);
+void pktcache_close(pktcache_t *cache);
+
+// Returns the blob of kind for protover (falling back to the default version), or NULL.
+const unsigned char *pktcache_get(pktcache_t *cache, unsigned kind, protover_t protover, size_t *len);
+
+#endif // include guard
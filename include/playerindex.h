@@ -0,0 +1,47 @@
+#ifndef LIMBO_PLAYERINDEX_H_INCLUDED
+#define LIMBO_PLAYERINDEX_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "player.h"
+
+struct tag_client;
+
+// open addressing with linear probing and backward-shift deletion, so there are no tombstones
+struct playerindex_slot {
+    uint64_t hash; // 0 if the slot is empty
+    player_t *player;
+};
+
+struct playerindex_table {
+    struct playerindex_slot *slots;
+    size_t cap, len; // cap is a power of two
+};
+
+/* Online players keyed by uuid and by lowercase name. Readers share the lock;
+ * only logins and disconnects take it exclusively. */
+typedef struct tag_player_index {
+    pthread_rwlock_t lock;
+    struct playerindex_table byid, byname;
+} player_index_t;
+
+int playerindex_init(player_index_t *idx);
+void playerindex_destroy(player_index_t *idx);
+
+/* Indexes player under its uuid and name. Clients already online under either
+ * key are replaced, pinned and stored in evicted. Returns how many were
+ * evicted (0-2), or -1 if the index could not grow. */
+int playerindex_claim(player_index_t *idx, player_t *player, struct tag_client *evicted[2]);
+
+// Does nothing if player has been replaced by a newer login in the meantime.
+void playerindex_remove(player_index_t *idx, player_t *player);
+
+// Return the client pinned (release it with client_release), or NULL if nobody is online under that key.
+struct tag_client *playerindex_find_id(player_index_t *idx, const struct uuid *id);
+struct tag_client *playerindex_find_name(player_index_t *idx, const char *name);
+
+size_t playerindex_count(player_index_t *idx);
+
+#endif // include guard
@@ -0,0 +1,58 @@
+#ifndef LIMBO_PRECONN_H_INCLUDED
+#define LIMBO_PRECONN_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "types.h"
+#include "event.h"
+#include "list.h"
+#include "registry.h"
+#include "admission.h"
+
+// big enough for any vanilla handshake, longer first frames (ip forwarding) get a full client right away
+#define PRECONN_BUF_SIZE (256)
+
+/* What a connection costs before it asks to log in: a single allocation with
+ * the fd, the address and a small receive buffer. Status requests are answered
+ * from here; a login intent promotes it to a client_t. It is only ever touched
+ * by the thread handling its event, so it needs no mutex. */
+typedef struct tag_preconn {
+    file_descriptor_t fd;
+    struct list_hook hook; // in the pending list of shard
+    struct registry_shard *shard;
+    client_registry_t *registry;
+
+    admission_t *admission;
+    struct admission_key admkey;
+
+    sockaddrs saddr;
+    socklen_t saddrlen;
+
+    uint64_t born_ms;
+    atomic_bool legacy_wait; // all it sent is 0xFE (0x01), which may yet be a modern frame
+    atomic_bool timed_out;   // the sweep shut it down, it is closed as a timeout whatever the owner saw
+    uint32_t capid; // the connection's number in the capture, 0 if not recorded
+    protover_t protover;
+    uint8_t protocol; // PROTOCOL_HANDSHAKE or PROTOCOL_STATUS
+    uint16_t len;
+    unsigned char buf[PRECONN_BUF_SIZE];
+} preconn_t;
+
+// Takes ownership of sockfd (and of admkey's slot) and starts waiting for the handshake.
+preconn_t *preconn_start(int sockfd, const struct sockaddr *saddr, socklen_t saddrlen, client_registry_t *registry,
+                         admission_t *admission, const struct admission_key *admkey);
+
+/* A peer that sent a bare 0xFE or 0xFE 0x01 and nothing more for this long is
+ * taken for an old client waiting on its legacy ping reply. */
+#define PRECONN_LEGACY_QUIET_MS (500)
+
+/* Shuts down connections that have been pending for longer than timeout seconds,
+ * and stops reading from the ones done waiting for a legacy ping to finish. */
+void preconn_sweep(client_registry_t *registry, unsigned timeout);
+
+// Closes every pending connection, the IO threads must be stopped.
+void preconn_close_all(client_registry_t *registry);
+
+#endif // include guard
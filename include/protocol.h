@@ -107,6 +107,7 @@ PROTO_WRITE_DEF(blockpos, const struct block_position *);
 #define PKTID_WRITE_PLAY_JOIN_GAME  (0x01)
 #define PKTID_WRITE_PLAY_SPAWN_POS  (0x05)
 #define PKTID_WRITE_PLAY_PLAYER_POS_LOOK (0x08)
+#define PKTID_WRITE_PLAY_CHUNK_DATA (0x21)
 #define PKTID_WRITE_PLAY_DISCONNECT (0x40)
 
 // clientbound packet definitions
@@ -120,6 +121,26 @@ struct packet_base {
 typedef void (packet_write_proc)(void * /*client*/, struct auto_buffer * /*buffer*/, struct packet_base * /*pkt*/);
 extern packet_write_proc *const *client_write_protos[PROTOCOL_COUNT];
 
+// Appends pkt to dest as a length-prefixed frame. client may be NULL for packets which do not touch client state.
+int proto_frame_pkt(struct auto_buffer *dest, unsigned protocol, void *client, void *pkt);
+
+// Protocol versions with their own pre-encoded packets; the first one is used for everything else
+extern const protover_t proto_versions[];
+extern const size_t proto_version_count;
+
+// Everything the encoders below depend on besides the world, for keying packet caches
+int proto_cache_inputs(struct auto_buffer *out);
+
+int proto_encode_status(struct auto_buffer *out, protover_t protover);
+int proto_encode_join(struct auto_buffer *out, protover_t protover, world_t *world);
+
+/* Makes the client the named player and sends everything up to the first keep
+ * alive, Login Success included if login_success. Returns NULL, or why it failed. */
+const char *proto_join_player(struct tag_client *sender, const struct uuid *id, const char *name, bool login_success);
+
+// The 0xFF kick old clients expect in reply to a legacy (0xFE) server list ping. beta is for pings without the 0x01.
+int proto_encode_legacy_ping(struct auto_buffer *out, bool beta);
+
 // Clientbound Status packets
 
 struct packet_status_response {
@@ -188,6 +209,15 @@ struct packet_play_player_position_look {
     uint8_t flags;
 };
 
+struct packet_play_chunk_data {
+    PACKET_COMMON_FIELDS
+    int32_t x, z;
+    bool full;
+    uint16_t mask;
+    const unsigned char *data;
+    size_t datalen;
+};
+
 #define packet_play_disconnect packet_disconnect
 
 #endif // include guard
@@ -0,0 +1,26 @@
+#ifndef LIMBO_REGDATA_H_INCLUDED
+#define LIMBO_REGDATA_H_INCLUDED
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "types.h"
+
+struct auto_buffer;
+
+// true if the Join Game packet of protover carries a dimension codec
+bool regdata_needed(protover_t protover);
+
+// Encodes the dimension codec (dimension types and biomes) for protover as NBT.
+int regdata_encode_codec(struct auto_buffer *out, protover_t protover);
+
+// Encodes the dimension type element players spawn into (sent beside the codec in 1.16.2-1.18.2).
+int regdata_encode_dimension(struct auto_buffer *out, protover_t protover, int dimension);
+
+/* Returns the codec for protover, encoded on first use and shared by every
+ * client after that. NULL if the version needs none or encoding failed. */
+const unsigned char *regdata_codec(protover_t protover, size_t *len);
+
+void regdata_cleanup(void);
+
+#endif // include guard
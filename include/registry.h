@@ -0,0 +1,61 @@
+#ifndef LIMBO_REGISTRY_H_INCLUDED
+#define LIMBO_REGISTRY_H_INCLUDED
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "list.h"
+#include "playerindex.h"
+
+struct tag_client;
+
+/* A client lives in the shard of the event loop that owns it, so only that
+ * loop's thread ever inserts into or removes from a shard. Readers take no lock
+ * at all: the client lists are walked inside an epoch section (see epoch.h),
+ * and a client is only reclaimed once nobody can be standing on it. */
+struct registry_shard {
+    pthread_mutex_t mutex; // writers, and the pending list
+    ilist_t clients; // of client_t, through reghook, see ILIST_FOREACH_RCU
+    ilist_t pending; // of preconn_t, connections that have not asked to log in yet
+} __attribute__((aligned(64)));
+
+typedef struct tag_client_registry {
+    struct registry_shard *shards;
+    unsigned nshards;
+
+    atomic_size_t count;
+    atomic_size_t npending;
+
+    player_index_t players; // clients that reached PLAY
+} client_registry_t;
+
+struct registry_snapshot {
+    struct tag_client **clients;
+    size_t len, cap;
+};
+
+client_registry_t *registry_create(unsigned nshards);
+void registry_free(client_registry_t *reg);
+
+// the shard of everything owned by event loop idx
+#define registry_shard(_reg, _idx) ((_reg)->shards + (_idx) % (_reg)->nshards)
+
+void registry_add(client_registry_t *reg, struct tag_client *cli);
+
+// Safe to call more than once, and from any thread.
+void registry_remove(struct tag_client *cli);
+
+#define registry_count(_reg) atomic_load_explicit(&(_reg)->count, memory_order_relaxed)
+
+/* Fills snap with a pinned reference to every registered client, for work that
+ * can't be done inside an epoch section. The buffer is reused between calls;
+ * release the pins with registry_snapshot_release. */
+size_t registry_snapshot(client_registry_t *reg, struct registry_snapshot *snap);
+
+// Same, but only the clients of shard idx.
+size_t registry_snapshot_shard(client_registry_t *reg, unsigned idx, struct registry_snapshot *snap);
+void registry_snapshot_release(struct registry_snapshot *snap);
+void registry_snapshot_free(struct registry_snapshot *snap);
+
+#endif // include guard
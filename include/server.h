@@ -5,23 +5,46 @@
 #include <stdbool.h>
 #include "event.h"
 #include "types.h"
-#include "list.h"
+#include "registry.h"
+#include "admission.h"
 
-#define SERVER_IPV6ONLY (1 << 0)
+#define SERVER_IPV6ONLY  (1 << 0)
+#define SERVER_STEER_CPU (1 << 1) // steer each connection to listener (CPU % listeners)
+#define SERVER_PROXY_HANDOFF (1 << 2) // unix only: peers are proxies handing over players, see handoff.h
+#define SERVER_METRICS   (1 << 3) // peers are scrapers, see metrics.h
 
 typedef struct tag_server {
-    file_descriptor_t *fd;
+    file_descriptor_t *fds; // one listener per IO thread, sharing the address with SO_REUSEPORT
+    unsigned nfds;
     sockaddrs saddr;
     socklen_t saddrlen;
 
-    dllist_t *clients;
+    client_registry_t *clients;
+    admission_t *admission; // optional
+
+    bool proxy_handoff; // SERVER_PROXY_HANDOFF
+    bool metrics;       // SERVER_METRICS
+    bool handed_off;    // the listeners live on in another process, leave the socket file alone
 } server_t;
 
 // handle unix domain socket or something also?
 // sockaddr_storage exists
-bool server_init(const char *host, unsigned short port, unsigned flags, server_t **target);
-bool server_init_unix(const char *path, unsigned flags, server_t **target);
+bool server_init(const char *host, unsigned short port, unsigned flags, unsigned nlisteners, int backlog, server_t **target);
+/* The socket file is created with mode 0600: only this user may connect, which is
+ * what a proxy handoff listener relies on (see handoff.h). */
+bool server_init_unix(const char *path, unsigned flags, int backlog, server_t **target);
+
+// Wraps listening sockets opened elsewhere (all bound to the same address), e.g. by a hot restart.
+server_t *server_adopt(const int *sockfds, unsigned nfds);
+
+/* Replaces the CPU % listeners steering with one where listener i gets the
+ * connections received on cpus[i] (one entry per listener). */
+bool server_steer_to_cpus(server_t *server, const int *cpus);
 
 void server_free(server_t *server);
 
+// Adds every listener to the event loop, or removes them.
+void server_start(server_t *server);
+void server_stop(server_t *server);
+
 #endif // include guard
@@ -0,0 +1,47 @@
+#ifndef LIMBO_TRACE_H_INCLUDED
+#define LIMBO_TRACE_H_INCLUDED
+
+/* Static tracepoints (USDT) for bpftrace, perf and friends, under the provider
+ * "limbo". Built with BUILD_USDT (CMake turns it on when it finds sys/sdt.h) a
+ * probe is a single nop until something attaches to it, but its arguments are
+ * still worked out every time, so keep them cheap. Without it, they compile
+ * to nothing.
+ *
+ * Every probe starts with the connection's fd and its address (a struct
+ * sockaddr *), so whatever is measured can be put down to one connection:
+ *   bpftrace -e 'usdt:./limbo:limbo:dispatch { @[arg2, arg3] = count(); }'
+ *
+ *   accept      fd, addr                        a player's connection was accepted
+ *   frame       fd, addr, len                   a whole frame was read, about to be handled
+ *   dispatch    fd, addr, phase, id, len        a packet goes to its handler (phase as in protocol.h)
+ *   write       fd, addr, written, queued       client_write wrote to the socket, queued the rest
+ *                                               (a preconn has no queue, what it couldn't write is dropped with it)
+ *   flush       fd, addr, written, left         client_write_handler flushed the sendq
+ *   sendq_grow  fd, addr, oldsz, newsz          the sendq had to get bigger
+ *   disconnect  fd, addr, reason                (enum metrics_dc_reason) */
+
+#ifdef BUILD_USDT
+#include <sys/sdt.h>
+
+#define TRACE_ACCEPT(_fd, _addr)                           DTRACE_PROBE2(limbo, accept, _fd, _addr)
+#define TRACE_FRAME(_fd, _addr, _len)                      DTRACE_PROBE3(limbo, frame, _fd, _addr, _len)
+#define TRACE_DISPATCH(_fd, _addr, _phase, _id, _len)      DTRACE_PROBE5(limbo, dispatch, _fd, _addr, _phase, _id, _len)
+#define TRACE_WRITE(_fd, _addr, _written, _queued)         DTRACE_PROBE4(limbo, write, _fd, _addr, _written, _queued)
+#define TRACE_FLUSH(_fd, _addr, _written, _left)           DTRACE_PROBE4(limbo, flush, _fd, _addr, _written, _left)
+#define TRACE_SENDQ_GROW(_fd, _addr, _oldsz, _newsz)       DTRACE_PROBE4(limbo, sendq_grow, _fd, _addr, _oldsz, _newsz)
+#define TRACE_DISCONNECT(_fd, _addr, _reason)              DTRACE_PROBE3(limbo, disconnect, _fd, _addr, _reason)
+
+#else
+
+// the arguments are only looked at so the ones kept for a probe don't turn into unused variables
+#define TRACE_ACCEPT(_fd, _addr)                           ((void)(_fd), (void)(_addr))
+#define TRACE_FRAME(_fd, _addr, _len)                      ((void)(_fd), (void)(_addr), (void)(_len))
+#define TRACE_DISPATCH(_fd, _addr, _phase, _id, _len)      ((void)(_fd), (void)(_addr), (void)(_phase), (void)(_id), (void)(_len))
+#define TRACE_WRITE(_fd, _addr, _written, _queued)         ((void)(_fd), (void)(_addr), (void)(_written), (void)(_queued))
+#define TRACE_FLUSH(_fd, _addr, _written, _left)           ((void)(_fd), (void)(_addr), (void)(_written), (void)(_left))
+#define TRACE_SENDQ_GROW(_fd, _addr, _oldsz, _newsz)       ((void)(_fd), (void)(_addr), (void)(_oldsz), (void)(_newsz))
+#define TRACE_DISCONNECT(_fd, _addr, _reason)              ((void)(_fd), (void)(_addr), (void)(_reason))
+
+#endif
+
+#endif // include guard
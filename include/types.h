@@ -14,6 +14,11 @@ typedef union {
 } sockaddrs;
 
 typedef uint32_t protover_t;
-#define PROTOVER_UNSET (protover_t)(-1)
+#define PROTOVER_UNSET  (protover_t)(-1)
+#define PROTOVER_1_8    (protover_t)(47)
+#define PROTOVER_1_16_2 (protover_t)(751)
+#define PROTOVER_1_17   (protover_t)(755)
+#define PROTOVER_1_18   (protover_t)(757)
+#define PROTOVER_1_18_2 (protover_t)(758)
 
 #endif // include guard
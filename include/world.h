@@ -2,9 +2,79 @@
 #define LIMBO_WORLD_H_INCLUDED
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "types.h"
 
 struct block_position {
     int32_t x, y, z;
 };
 
+#define WORLD_SECTION_BLOCKS (4096)
+#define WORLD_SECTIONS       (16) // y 0-255, the range every supported version understands
+#define WORLD_HEIGHT         (WORLD_SECTIONS * 16)
+
+#define WORLD_DIM_NETHER    (-1)
+#define WORLD_DIM_OVERWORLD (0)
+#define WORLD_DIM_END       (1)
+
+// block state 0 of every world is air
+#define WORLD_STATE_AIR (0)
+
+/* A 16x16x16 section stored as a palette of world block states plus
+ * bit-packed indices into that palette (yzx order, entries never span longs).
+ * A section with a single palette entry has bits == 0 and no data. */
+struct world_section {
+    uint8_t bits;
+    uint16_t palette_len;
+    uint16_t nonair;
+    uint16_t *palette;
+    uint64_t *data;
+};
+
+struct world_chunk {
+    int32_t x, z;
+    uint16_t mask; // bit n set if sections[n] holds blocks
+    struct world_section sections[WORLD_SECTIONS];
+
+    uint16_t *dense[WORLD_SECTIONS]; // only used while loading
+};
+
+/* Every chunk packet goes out with the join in a single write, and what the
+ * socket doesn't take at once has to fit in the client's send queue (1 MB, see
+ * CLIENT_MAX_SENDQ). So only the chunks within WORLD_VIEW_RADIUS of spawn are
+ * kept, nearest first, and the packets of a version stop short of
+ * WORLD_PACKETS_MAX bytes. */
+#define WORLD_VIEW_RADIUS (8)
+#define WORLD_PACKETS_MAX (768ul * 1024)
+
+// pre-framed Chunk Data packets for one protocol version
+struct world_packets {
+    protover_t protover;
+    unsigned char *buf;
+    size_t len;
+};
+
+typedef struct tag_world {
+    char **states; // block state names, e.g. "minecraft:stone"
+    size_t nstates, statecap;
+
+    struct world_chunk *chunks;
+    size_t nchunks, chunkcap;
+
+    struct block_position spawn;
+
+    struct world_packets *packets;
+    size_t npackets;
+} world_t;
+
+world_t *world_load(const char *path);
+void world_free(world_t *world);
+
+uint16_t world_get_block(world_t *world, int32_t x, int32_t y, int32_t z);
+
+// Returns the Chunk Data packets for protover, or NULL if that version has no chunk encoder.
+const struct world_packets *world_get_packets(world_t *world, protover_t protover);
+
 #endif // include guard
@@ -0,0 +1,211 @@
+#include "admission.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define ADMISSION_REPORT_TOP (5)
+
+uint64_t admission_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts); // no syscall, a few ms of jitter is fine here
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+bool admission_make_key(const admission_t *adm, const struct sockaddr *saddr, struct admission_key *key) {
+    memset(key, 0, sizeof(struct admission_key));
+
+    if (saddr->sa_family == AF_INET) {
+        key->family = AF_INET;
+        key->addr = ntohl(((const struct sockaddr_in *)saddr)->sin_addr.s_addr);
+        return adm->limit_loopback || (key->addr >> 24) != 127;
+    }
+
+    if (saddr->sa_family == AF_INET6) {
+        const uint8_t *bytes = ((const struct sockaddr_in6 *)saddr)->sin6_addr.s6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&((const struct sockaddr_in6 *)saddr)->sin6_addr)) {
+            key->family = AF_INET;
+            for (int i = 12; i < 16; ++i) key->addr = (key->addr << 8) | bytes[i];
+            return adm->limit_loopback || (key->addr >> 24) != 127;
+        }
+
+        if (!adm->limit_loopback && IN6_IS_ADDR_LOOPBACK(&((const struct sockaddr_in6 *)saddr)->sin6_addr)) return false;
+        key->family = AF_INET6;
+        for (int i = 0; i < 8; ++i) key->addr = (key->addr << 8) | bytes[i];
+        return true;
+    }
+
+    return false; // unix sockets come from a local proxy
+}
+
+size_t admission_bucket_of(const admission_t *adm, const struct admission_key *key) {
+    uint64_t x = key->addr ^ ((uint64_t)key->family << 56);
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    return (size_t)x & (adm->nbuckets - 1);
+}
+
+admission_t *admission_create(size_t entries, uint32_t rate, uint32_t burst, uint16_t maxconns) {
+    size_t nbuckets = 1;
+    while (nbuckets * ADMISSION_WAYS < entries) nbuckets *= 2;
+
+    admission_t *adm = malloc(sizeof(admission_t));
+    if (!adm) return NULL;
+    memset(adm, 0, sizeof(admission_t));
+
+    adm->buckets = calloc(nbuckets, sizeof(struct admission_bucket));
+    if (!adm->buckets) {
+        free(adm);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < nbuckets; ++i) pthread_mutex_init(&adm->buckets[i].lock, NULL);
+
+    adm->nbuckets = nbuckets;
+    adm->rate = rate;
+    adm->burst = burst;
+    adm->maxconns = maxconns;
+    atomic_init(&adm->untracked, 0);
+    adm->last_report_ms = admission_now_ms();
+    return adm;
+}
+
+void admission_free(admission_t *adm) {
+    if (!adm) return;
+
+    for (size_t i = 0; i < adm->nbuckets; ++i) pthread_mutex_destroy(&adm->buckets[i].lock);
+    free(adm->buckets);
+    free(adm);
+}
+
+struct admission_entry *admission_find(struct admission_bucket *bucket, const struct admission_key *key) {
+    for (int i = 0; i < ADMISSION_WAYS; ++i) {
+        struct admission_entry *ent = bucket->ways + i;
+        if (ent->key.family == key->family && ent->key.addr == key->addr) return ent;
+    }
+    return NULL;
+}
+
+enum admission_result admission_admit(admission_t *adm, const struct sockaddr *saddr, struct admission_key *key) {
+    if (!admission_make_key(adm, saddr, key)) {
+        key->family = 0;
+        return ADMISSION_OK;
+    }
+
+    uint64_t now = admission_now_ms();
+    struct admission_bucket *bucket = adm->buckets + admission_bucket_of(adm, key);
+    enum admission_result res = ADMISSION_OK;
+
+    pthread_mutex_lock(&bucket->lock);
+    struct admission_entry *ent = admission_find(bucket, key);
+    if (!ent) {
+        // take a free way, or else the idle one that has been quiet the longest
+        for (int i = 0; i < ADMISSION_WAYS; ++i) {
+            struct admission_entry *cand = bucket->ways + i;
+            if (cand->key.family == 0) {
+                ent = cand;
+                break;
+            }
+            if (cand->conns == 0 && (!ent || cand->last_ms < ent->last_ms)) ent = cand;
+        }
+
+        if (!ent) {
+            pthread_mutex_unlock(&bucket->lock);
+            atomic_fetch_add_explicit(&adm->untracked, 1, memory_order_relaxed);
+            key->family = 0; // nothing to release later
+            return ADMISSION_OK;
+        }
+
+        memset(ent, 0, sizeof(struct admission_entry));
+        ent->key = *key;
+        ent->tokens = adm->burst * 1000u;
+        ent->last_ms = now;
+    }
+
+    uint64_t refill = (now - ent->last_ms) * adm->rate;
+    ent->tokens = refill >= adm->burst * 1000u - ent->tokens ? adm->burst * 1000u : ent->tokens + (uint32_t)refill;
+    ent->last_ms = now;
+
+    if (ent->conns >= adm->maxconns) res = ADMISSION_CONNS;
+    else if (ent->tokens < 1000u) res = ADMISSION_RATE;
+
+    if (res == ADMISSION_OK) {
+        ent->tokens -= 1000u;
+        ++ent->conns;
+    } else {
+        ++ent->rejected;
+        ent->reason = (uint8_t)res;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+
+    return res;
+}
+
+void admission_release(admission_t *adm, const struct admission_key *key) {
+    if (!adm || key->family == 0) return;
+
+    struct admission_bucket *bucket = adm->buckets + admission_bucket_of(adm, key);
+    pthread_mutex_lock(&bucket->lock);
+    struct admission_entry *ent = admission_find(bucket, key);
+    if (ent && ent->conns > 0) --ent->conns;
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+void admission_format_key(const struct admission_key *key, char *buf, size_t len) {
+    if (key->family == AF_INET) {
+        struct in_addr addr = { .s_addr = htonl((uint32_t)key->addr) };
+        inet_ntop(AF_INET, &addr, buf, (socklen_t)len);
+    } else {
+        snprintf(buf, len, "%x:%x:%x:%x::/64", (unsigned)(key->addr >> 48), (unsigned)(key->addr >> 32) & 0xffff,
+                 (unsigned)(key->addr >> 16) & 0xffff, (unsigned)key->addr & 0xffff);
+    }
+}
+
+void admission_report(admission_t *adm, unsigned interval) {
+    uint64_t now = admission_now_ms();
+    if (now - adm->last_report_ms < interval * 1000ull) return;
+    adm->last_report_ms = now;
+
+    struct admission_entry top[ADMISSION_REPORT_TOP];
+    size_t ntop = 0;
+    unsigned long total = 0;
+
+    for (size_t b = 0; b < adm->nbuckets; ++b) {
+        struct admission_bucket *bucket = adm->buckets + b;
+        pthread_mutex_lock(&bucket->lock);
+        for (int i = 0; i < ADMISSION_WAYS; ++i) {
+            struct admission_entry *ent = bucket->ways + i;
+            if (ent->rejected == 0) continue;
+            total += ent->rejected;
+
+            // keep the worst offenders sorted, most rejections first
+            size_t pos = ntop;
+            while (pos > 0 && top[pos - 1].rejected < ent->rejected) --pos;
+            if (pos < ADMISSION_REPORT_TOP) {
+                size_t last = ntop < ADMISSION_REPORT_TOP ? ntop : ADMISSION_REPORT_TOP - 1;
+                memmove(top + pos + 1, top + pos, (last - pos) * sizeof(struct admission_entry));
+                top[pos] = *ent;
+                if (ntop < ADMISSION_REPORT_TOP) ++ntop;
+            }
+            ent->rejected = 0;
+        }
+        pthread_mutex_unlock(&bucket->lock);
+    }
+
+    unsigned long untracked = atomic_exchange_explicit(&adm->untracked, 0, memory_order_relaxed);
+    if (untracked > 0) log_warn("Admission table full: let %lu connections in untracked in the last %us", untracked, interval);
+    if (total == 0) return;
+
+    log_warn("Turned away %lu connections in the last %us, worst offenders:", total, interval);
+    for (size_t i = 0; i < ntop; ++i) {
+        char addr[64];
+        admission_format_key(&top[i].key, addr, sizeof(addr));
+        log_warn("  %s: %u rejected (%s), %u open", addr, top[i].rejected,
+                 top[i].reason == ADMISSION_CONNS ? "too many connections" : "connecting too fast", top[i].conns);
+    }
+}
@@ -0,0 +1,198 @@
+#include "capture.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+capture_t *capture_default = NULL;
+
+// the most a record's header can take: a type and three VarLongs
+#define CAPTURE_HEADER_MAX (1 + 3 * 10)
+
+// the most a single record may carry, a bigger one means the file is damaged
+#define CAPTURE_DATA_MAX (1u << 24)
+
+uint64_t capture_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+size_t capture_put_varlong(unsigned char *out, uint64_t val) {
+    size_t n = 0;
+    do {
+        unsigned char b = val & 0x7f;
+        val >>= 7;
+        out[n++] = b | (val ? 0x80 : 0);
+    } while (val);
+    return n;
+}
+
+capture_t *capture_open(const char *path) {
+    capture_t *cap = malloc(sizeof(capture_t));
+    if (!cap) return NULL;
+    memset(cap, 0, sizeof(capture_t));
+
+    cap->fp = fopen(path, "abe");
+    if (!cap->fp) {
+        log_error("capture_open: unable to open %s: %s", path, strerror(errno));
+        free(cap);
+        return NULL;
+    }
+
+    unsigned char version = CAPTURE_VERSION;
+    if (fwrite(CAPTURE_MAGIC, strlen(CAPTURE_MAGIC), 1, cap->fp) != 1 || fwrite(&version, 1, 1, cap->fp) != 1) {
+        log_error("capture_open: unable to write to %s: %s", path, strerror(errno));
+        fclose(cap->fp);
+        free(cap);
+        return NULL;
+    }
+
+    pthread_mutex_init(&cap->lock, NULL);
+    cap->last_us = capture_now_us();
+    cap->next_conn = 1;
+    return cap;
+}
+
+void capture_close(capture_t *cap) {
+    if (!cap) return;
+
+    if (fclose(cap->fp) != 0) log_warn("capture_close: %s", strerror(errno));
+    pthread_mutex_destroy(&cap->lock);
+    free(cap);
+}
+
+void capture_flush(capture_t *cap) {
+    if (!cap) return;
+
+    pthread_mutex_lock(&cap->lock);
+    fflush(cap->fp);
+    pthread_mutex_unlock(&cap->lock);
+}
+
+// The time is taken under the lock, so the records of the file are in order.
+void capture_record(capture_t *cap, unsigned type, uint32_t conn, const void *buf, size_t len) {
+    unsigned char hdr[CAPTURE_HEADER_MAX + 10];
+
+    pthread_mutex_lock(&cap->lock);
+    if (cap->failed) {
+        pthread_mutex_unlock(&cap->lock);
+        return;
+    }
+
+    uint64_t now = capture_now_us();
+    size_t n = 0;
+    hdr[n++] = (unsigned char)type;
+    n += capture_put_varlong(hdr + n, conn);
+    n += capture_put_varlong(hdr + n, now - cap->last_us);
+    if (type == CAPTURE_DATA) n += capture_put_varlong(hdr + n, len);
+    cap->last_us = now;
+
+    if (fwrite(hdr, n, 1, cap->fp) != 1 || (len > 0 && fwrite(buf, len, 1, cap->fp) != 1)) {
+        log_error("Unable to write the capture, no longer recording: %s", strerror(errno));
+        cap->failed = true;
+    }
+    pthread_mutex_unlock(&cap->lock);
+}
+
+uint32_t capture_conn_open(capture_t *cap) {
+    if (!cap) return 0;
+
+    pthread_mutex_lock(&cap->lock);
+    uint32_t conn = cap->next_conn++;
+    if (cap->next_conn == 0) cap->next_conn = 1;
+    pthread_mutex_unlock(&cap->lock);
+
+    capture_record(cap, CAPTURE_OPEN, conn, NULL, 0);
+    return conn;
+}
+
+void capture_data(capture_t *cap, uint32_t conn, const void *buf, size_t len) {
+    if (!cap || conn == 0 || len == 0) return;
+    capture_record(cap, CAPTURE_DATA, conn, buf, len);
+}
+
+void capture_conn_close(capture_t *cap, uint32_t conn) {
+    if (!cap || conn == 0) return;
+    capture_record(cap, CAPTURE_CLOSE, conn, NULL, 0);
+}
+
+capture_reader_t *capture_reader_open(const char *path) {
+    capture_reader_t *rd = malloc(sizeof(capture_reader_t));
+    if (!rd) return NULL;
+    memset(rd, 0, sizeof(capture_reader_t));
+
+    rd->fp = fopen(path, "rbe");
+    if (!rd->fp) {
+        log_error("capture_reader_open: unable to open %s: %s", path, strerror(errno));
+        free(rd);
+        return NULL;
+    }
+    return rd;
+}
+
+void capture_reader_close(capture_reader_t *rd) {
+    if (!rd) return;
+
+    fclose(rd->fp);
+    free(rd->buf);
+    free(rd);
+}
+
+bool capture_get_varlong(FILE *fp, uint64_t *out) {
+    uint64_t val = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(fp);
+        if (c == EOF) return false;
+        val |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *out = val;
+            return true;
+        }
+    }
+    return false;
+}
+
+int capture_read(capture_reader_t *rd, struct capture_record *rec) {
+    int type;
+    while ((type = fgetc(rd->fp)) == CAPTURE_MAGIC[0]) { // a session starts here
+        char magic[sizeof(CAPTURE_MAGIC)];
+        magic[0] = (char)type;
+        if (fread(magic + 1, strlen(CAPTURE_MAGIC), 1, rd->fp) != 1 || memcmp(magic, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) != 0) return -1;
+        if ((unsigned char)magic[strlen(CAPTURE_MAGIC)] != CAPTURE_VERSION) {
+            log_error("capture_read: unsupported capture version %u", (unsigned char)magic[strlen(CAPTURE_MAGIC)]);
+            return -1;
+        }
+
+        rd->conn_base += rd->conn_max;
+        rd->conn_max = 0;
+    }
+    if (type == EOF) return 0;
+    if (type < CAPTURE_OPEN || type > CAPTURE_CLOSE) return -1;
+
+    uint64_t conn, delta, len = 0;
+    if (!capture_get_varlong(rd->fp, &conn) || !capture_get_varlong(rd->fp, &delta)) return -1;
+    if (conn == 0 || conn > UINT32_MAX - rd->conn_base) return -1;
+    if (type == CAPTURE_DATA) {
+        if (!capture_get_varlong(rd->fp, &len) || len == 0 || len > CAPTURE_DATA_MAX) return -1;
+        if (len > rd->bufsz) {
+            unsigned char *newbuf = realloc(rd->buf, len);
+            if (!newbuf) return -1;
+            rd->buf = newbuf;
+            rd->bufsz = len;
+        }
+        if (fread(rd->buf, len, 1, rd->fp) != 1) return -1;
+    }
+
+    if (conn > rd->conn_max) rd->conn_max = (uint32_t)conn;
+    rd->now_us += delta;
+
+    rec->type = (unsigned)type;
+    rec->conn = rd->conn_base + (uint32_t)conn;
+    rec->time_us = rd->now_us;
+    rec->data = rd->buf;
+    rec->len = (size_t)len;
+    return 1;
+}
@@ -4,6 +4,9 @@
 #include "protocol.h"
 #include "macros.h"
 #include "sched.h"
+#include "metrics.h"
+#include "capture.h"
+#include "trace.h"
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -11,11 +14,13 @@
 #include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
+#include <wchar.h>
 #include <arpa/inet.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
 #include <time.h>
 
-void client_disconnect_internal(client_t *client, const char *fmt, ...);
+void client_disconnect_internal(client_t *client, unsigned reason, const char *fmt, ...);
 
 void client_read_handler(file_descriptor_t *fd, void *handler_data);
 void client_write_handler(file_descriptor_t *fd, void *handler_data);
@@ -29,13 +34,8 @@ client_t *client_init(int sockfd, struct sockaddr *saddr, socklen_t saddrlen) {
     memset(fd, 0, sizeof(file_descriptor_t));
     memset(client, 0, sizeof(client_t));
 
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-    pthread_mutex_init(&client->evtmutex, &attr);
-
     fd->fd = sockfd;
-    fd->handler_mutex = &client->evtmutex;
+    fd->loop = event_loop_current(); // the client never leaves this thread
     fd->handler_data = client;
     fd->read_handler = &client_read_handler;
     fd->write_handler = &client_write_handler;
@@ -85,6 +85,7 @@ client_t *client_init(int sockfd, struct sockaddr *saddr, socklen_t saddrlen) {
 
     client->protocol_ver = PROTOVER_UNSET;
     client->protocol = PROTOCOL_HANDSHAKE;
+    metrics_phase(METRICS_PHASE_NONE, PROTOCOL_HANDSHAKE);
 
     if (sched_timer_wgettime(CLOCK_MONOTONIC, &client->lastping) < 0) {
         log_error("client_init(%s): sched_timer_wgettime failed when setting lastping: %s", strerror(errno));
@@ -92,24 +93,18 @@ client_t *client_init(int sockfd, struct sockaddr *saddr, socklen_t saddrlen) {
     client->pingrespond = true;
     client->latency_ms = -1;
 
+    atomic_init(&client->refs, 1);
+    atomic_init(&client->shard, NULL);
+
     // initialize more stuff here
     return client;
 }
 
-void client_free(client_t *cli) {
-    if (!cli) return;
-
-    if (cli->fd) {
-        if (cli->fd->fd != -1) client_disconnect_internal(cli, "Client destroyed");
-        free(cli->fd);
-    }
-
-    if (cli->mypos) {
-        dll_removenode(cli->clients, cli->mypos);
-        cli->mypos = NULL;
-    }
+void client_destroy(client_t *cli) {
+    metrics_add(METRIC_SENDQ_BYTES, -(int64_t)cli->sendqcur);
+    metrics_add(METRIC_RECVBUF_BYTES, -(int64_t)cli->recvpartsz);
 
-    pthread_mutex_destroy(&cli->evtmutex);
+    free(cli->fd);
     free(cli->saddrstr);
     free(cli->recvpartial);
     free(cli->sendq);
@@ -119,23 +114,68 @@ void client_free(client_t *cli) {
     free(cli);
 }
 
+// Drops the connection's reference. The memory goes away once nothing pins the client either.
+void client_free(client_t *cli) {
+    if (!cli) return;
+
+    if (cli->fd && cli->fd->fd != -1) client_disconnect_internal(cli, METRICS_DC_OTHER, "Client destroyed");
+    registry_remove(cli);
+    client_release(cli);
+}
+
+void client_retain(client_t *cli) {
+    atomic_fetch_add_explicit(&cli->refs, 1, memory_order_relaxed);
+}
+
+bool client_tryretain(client_t *cli) {
+    unsigned refs = atomic_load_explicit(&cli->refs, memory_order_relaxed);
+    do {
+        if (refs == 0) return false;
+    } while (!atomic_compare_exchange_weak_explicit(&cli->refs, &refs, refs + 1, memory_order_relaxed, memory_order_relaxed));
+    return true;
+}
+
+void client_destroy_retired(struct epoch_entry *ent) {
+    client_destroy(LIST_CONTAINER(ent, client_t, retire));
+}
+
+// Readers in an epoch section may still be looking at the client, it goes away once they are all done.
+void client_release(client_t *cli) {
+    if (atomic_fetch_sub_explicit(&cli->refs, 1, memory_order_acq_rel) == 1) epoch_retire(&cli->retire, &client_destroy_retired);
+}
+
 void client_actually_disconnect_for_real(client_t *cli) {
-    pthread_mutex_lock(&cli->evtmutex);
     if (cli->fd && cli->fd->fd != -1) {
         event_loop_delfd(cli->fd);
         close(cli->fd->fd);
         cli->fd->fd = -1;
+        admission_release(cli->admission, &cli->admkey);
+        capture_conn_close(capture_default, cli->capid);
+
+        metrics_phase((int)cli->protocol, METRICS_PHASE_NONE);
+        metrics_disconnect(cli->dcreason);
     }
-    pthread_mutex_unlock(&cli->evtmutex);
 }
 
+void client_dc_reason(client_t *cli, unsigned reason) {
+    if (cli->dcreason == METRICS_DC_OTHER) cli->dcreason = (uint8_t)reason;
+}
+
+void client_set_protocol(client_t *cli, unsigned protocol) {
+    metrics_phase((int)cli->protocol, (int)protocol);
+    cli->protocol = protocol;
+}
+
+// shared by both disconnect paths, floods of these are what a bot attack looks like
+struct log_site client_dc_logsite = LOG_SITE_INIT("Disconnecting client");
+
 void client_disconnect_vw(client_t *cli, const wchar_t *fmt, va_list va) {
-    if (fmt) {
+    unsigned level = (cli->protocol > PROTOCOL_STATUS) ? LOG_INFO : LOG_DEBUG;
+    if (fmt && log_admit(&client_dc_logsite, level)) { // don't even format the message if it will be dropped
         wchar_t *dcmsg = NULL;
 
         int res = vswprintf_alloc(&dcmsg, fmt, va);
 
-        unsigned level = (cli->protocol > PROTOCOL_STATUS) ? LOG_INFO : LOG_DEBUG;
         if (res < 0) {
             log_log(level, "Disconnecting client (%s) (%s): (client_disconnect_vw: vsprintf_alloc returned %d)", cli->saddrstr, protocol_names[cli->protocol], res);
         } else {
@@ -148,12 +188,12 @@ void client_disconnect_vw(client_t *cli, const wchar_t *fmt, va_list va) {
 }
 
 void client_disconnect_v(client_t *cli, const char *fmt, va_list va) {
-    if (fmt) {
+    unsigned level = (cli->protocol > PROTOCOL_STATUS) ? LOG_INFO : LOG_DEBUG;
+    if (fmt && log_admit(&client_dc_logsite, level)) {
         char *dcmsg = NULL;
 
         int res = vsprintf_alloc(&dcmsg, fmt, va);
 
-        unsigned level = (cli->protocol > PROTOCOL_STATUS) ? LOG_INFO : LOG_DEBUG;
         if (res < 0) {
             log_log(level, "Disconnecting client (%s) (%s): (client_disconnect_v: vsprintf_alloc returned %d)", cli->saddrstr, protocol_names[cli->protocol], res);
         } else {
@@ -190,6 +230,7 @@ void client_kick_w(client_t *cli, const wchar_t *fmt, ...) {
     if (res >= 0 && reason) {
         res = swprintf_alloc(&reason_com, L"{\"text\":\"%ls\"}", reason);
     }
+    client_dc_reason(cli, METRICS_DC_KICKED);
 
     if (res >= 0 && reason_com) {
         unsigned proto = cli->protocol;
@@ -231,10 +272,45 @@ void client_kick_w(client_t *cli, const wchar_t *fmt, ...) {
     free(reason);
 }
 
-void client_disconnect_internal(client_t *cli, const char *fmt, ...) {
-    va_list va;
+struct client_kick_msg {
+    struct event_msg base;
+    client_t *cli; // pinned until the owner has run the message
+    wchar_t reason[];
+};
+
+void client_kick_msg_run(struct event_msg *msg) {
+    struct client_kick_msg *kick = (struct client_kick_msg *)msg;
+    client_t *cli = kick->cli;
+
+    if (cli->fd->fd != -1) { // otherwise it is already gone, and was freed by whoever disconnected it
+        client_kick_w(cli, L"%ls", kick->reason);
+        client_free(cli);
+    }
+
+    client_release(cli);
+    free(kick);
+}
+
+void client_kick_remote_w(client_t *cli, const wchar_t *reason) {
+    size_t len = wcslen(reason) + 1;
+    struct client_kick_msg *kick = malloc(sizeof(struct client_kick_msg) + len * sizeof(wchar_t));
+    if (!kick) {
+        log_error("client_kick_remote_w(%s): unable to allocate the message: malloc returned NULL", cli->saddrstr);
+        return;
+    }
 
-    pthread_mutex_lock(&cli->evtmutex);
+    kick->base.run = &client_kick_msg_run;
+    kick->cli = cli;
+    memcpy(kick->reason, reason, len * sizeof(wchar_t));
+
+    client_retain(cli);
+    event_loop_post(cli->fd->loop, &kick->base);
+}
+
+void client_disconnect_internal(client_t *cli, unsigned reason, const char *fmt, ...) {
+    va_list va;
+    TRACE_DISCONNECT(cli->fd ? cli->fd->fd : -1, &cli->saddr.base, reason);
+    client_dc_reason(cli, reason);
 
     va_start(va, fmt);
     client_disconnect_v(cli, fmt, va);
@@ -244,12 +320,7 @@ void client_disconnect_internal(client_t *cli, const char *fmt, ...) {
         cli->fd->state |= FD_CALL_COMPLETE;
     }
 
-    if (cli->mypos) { // remove the client from the clients list
-        dll_removenode(cli->clients, cli->mypos);
-        cli->mypos = NULL;
-    }
-
-    pthread_mutex_unlock(&cli->evtmutex);
+    registry_remove(cli);
 }
 
 #define CLIENT_READBUF_SZ (4096)
@@ -257,11 +328,85 @@ void client_disconnect_internal(client_t *cli, const char *fmt, ...) {
 // may need to be bigger
 #define CLIENT_PKTLEN_MAX (65536)
 
-void client_read_handler(file_descriptor_t *fd, void *handler_data) {
-    client_t *const client = handler_data;
+/* Handles readcnt bytes freshly read from the client (or handed over by its preconn).
+ * Returns false if the client was disconnected. */
+bool client_consume(client_t *client, unsigned char *buf, ssize_t readcnt, struct read_context *readctx) {
+    unsigned char *bufcur = buf;
+    ssize_t remain;
+
+    if (client->recvpartexsz > 0) { // we are expecting the rest of a packet
+        ssize_t partremain = client->recvpartexsz - client->recvpartcur;
+        if (partremain > readcnt) { // this packet is expecting more than could be read
+            memcpy(client->recvpartial + client->recvpartcur, buf, readcnt);
+            client->recvpartcur += readcnt;
+            return true; // we have already consumed the entire read buffer
+        } else {
+            memcpy(client->recvpartial + client->recvpartcur, buf, partremain);
+            bufcur += partremain;
+            readctx->remain = (int32_t)client->recvpartexsz;
+            client->recvpartexsz = client->recvpartcur = 0; // packet complete
+
+            TRACE_FRAME(client->fd->fd, &client->saddr.base, readctx->remain);
+            metrics_add(METRIC_PACKETS_IN, 1);
+            proto_handle_incoming(client, client->recvpartial, readctx);
+        }
+    }
+
+    // the remain variable MUST be updated after a set of reads, if it is to be used again
+    for (remain = readcnt - (bufcur - buf); remain > 0; remain = readcnt - (bufcur - buf)) { // there are bytes to process
+        readctx->remain = remain;
+        int32_t pktlen = proto_read_varint(&bufcur, readctx);
+        remain = readcnt - (bufcur - buf);
+
+        // TODO: Protocol compression
+        if (pktlen <= 0) {
+            client_disconnect_internal(client, METRICS_DC_PROTOCOL, "Protocol error: Suspicious packet length: %d <= 0", pktlen);
+            return false;
+        } else if (pktlen > CLIENT_PKTLEN_MAX) {
+            client_disconnect_internal(client, METRICS_DC_PROTOCOL, "Protocol error: Packet is too long: %d > %d", pktlen, CLIENT_PKTLEN_MAX);
+            return false;
+        }
+
+        if (pktlen > remain) {
+            // oh no partial read DDDDDD:
+            if ((size_t)pktlen > client->recvpartsz) {
+                log_debug_limit("Resizing client recvq (%s): from %lu to %d", client->saddrstr, client->recvpartsz, pktlen);
+                void *newalloc = realloc(client->recvpartial, (size_t)pktlen);
+                if (!newalloc) {
+                    client_disconnect_internal(client, METRICS_DC_OTHER, "Protocol error: Failed to increase recvpartial length (realloc returned NULL)");
+                    return false;
+                }
+                metrics_add(METRIC_RECVBUF_BYTES, (int64_t)pktlen - (int64_t)client->recvpartsz);
+                client->recvpartial = newalloc;
+                client->recvpartsz = (size_t)pktlen;
+            }
+
+            client->recvpartexsz = pktlen;
+
+            memcpy(client->recvpartial, bufcur, remain);
+            client->recvpartcur = remain;
+            break;
+        } else {
+            readctx->remain = pktlen;
+            TRACE_FRAME(client->fd->fd, &client->saddr.base, pktlen);
+            metrics_add(METRIC_PACKETS_IN, 1);
+            proto_handle_incoming(client, bufcur, readctx);
+            if (readctx->remain > 0) {
+                client_disconnect_internal(client, METRICS_DC_PROTOCOL, "Protocol error: Not all packet bytes consumed: %d > 0 (len %d)", readctx->remain, pktlen);
+                return false;
+            }
+            bufcur += pktlen;
+        }
+    }
+
+    return true;
+}
+
+// Processes the pending bytes first, then (if readsock) reads from the socket until it would block.
+void client_read_common(client_t *client, unsigned char *pending, size_t pendinglen, bool readsock) {
+    file_descriptor_t *const fd = client->fd;
     unsigned char buf[CLIENT_READBUF_SZ];
-    unsigned char *bufcur;
-    ssize_t readcnt, remain;
+    ssize_t readcnt;
 
     volatile struct read_context readctx;
 
@@ -281,9 +426,9 @@ void client_read_handler(file_descriptor_t *fd, void *handler_data) {
 
     if (setjmp(exlbl)) {
         if (readctx.reason)
-            client_disconnect_internal(client, "Protocol error: %s", readctx.reason);
+            client_disconnect_internal(client, METRICS_DC_PROTOCOL, "Protocol error: %s", readctx.reason);
         else
-            client_disconnect_internal(client, NULL);
+            client_disconnect_internal(client, METRICS_DC_PROTOCOL, NULL);
         free(readctx.reason);
         return;
     }
@@ -296,116 +441,84 @@ void client_read_handler(file_descriptor_t *fd, void *handler_data) {
         return;
     }
 
-    while ((readcnt = read(fd->fd, buf, CLIENT_READBUF_SZ)) > 0) {
-        bufcur = buf;
-        if (client->recvpartexsz > 0) { // we are expecting the rest of a packet
-            ssize_t partremain = client->recvpartexsz - client->recvpartcur;
-            if (partremain > readcnt) { // this packet is expecting more than could be read
-                memcpy(client->recvpartial + client->recvpartcur, buf, readcnt);
-                client->recvpartcur += readcnt;
-                continue; // we have already consumed the entire read buffer
-            } else {
-                memcpy(client->recvpartial + client->recvpartcur, buf, partremain);
-                bufcur += partremain;
-                readctx.remain = (int32_t)client->recvpartexsz;
-                client->recvpartexsz = client->recvpartcur = 0; // packet complete
-
-                // cast away the volatile qualifier (it is ok because trust me)
-                proto_handle_incoming(client, client->recvpartial, readctx_ptr);
-            }
-        }
-
-        // the remain variable MUST be updated after a set of reads, if it is to be used again
-        for (remain = readcnt - (bufcur - buf); remain > 0; remain = readcnt - (bufcur - buf)) { // there are bytes to process
-            readctx.remain = remain;
-            // check for FE 01 FA (legacy ping) here
-            int32_t pktlen = proto_read_varint(&bufcur, readctx_ptr);
-            remain = readcnt - (bufcur - buf);
-
-            // TODO: Protocol compression
-            if (pktlen <= 0) {
-                client_disconnect_internal(client, "Protocol error: Suspicious packet length: %d <= 0", pktlen);
-                return;
-            } else if (pktlen > CLIENT_PKTLEN_MAX) {
-                client_disconnect_internal(client, "Protocol error: Packet is too long: %d > %d", pktlen, CLIENT_PKTLEN_MAX);
-                return;
-            }
+    if (pendinglen > 0 && !client_consume(client, pending, (ssize_t)pendinglen, readctx_ptr)) return;
+    if (!readsock) return;
 
-            if (pktlen > remain) {
-                // oh no partial read DDDDDD:
-                if ((size_t)pktlen > client->recvpartsz) {
-                    log_debug("Resizing client recvq (%s): from %lu to %d", client->saddrstr, client->recvpartsz, pktlen);
-                    client->recvpartsz = (size_t)pktlen;
-                    void *newalloc = realloc(client->recvpartial, client->recvpartsz);
-                    if (!newalloc) {
-                        client_disconnect_internal(client, "Protocol error: Failed to increase recvpartial length (realloc returned NULL)");
-                        return;
-                    }
-                    client->recvpartial = newalloc;
-                }
-
-                client->recvpartexsz = pktlen;
-
-                memcpy(client->recvpartial, bufcur, remain);
-                client->recvpartcur = remain;
-                break;
-            } else {
-                readctx.remain = pktlen;
-                proto_handle_incoming(client, bufcur, readctx_ptr);
-                if (readctx.remain > 0) {
-                    client_disconnect_internal(client, "Protocol error: Not all packet bytes consumed: %d > 0 (len %d)", readctx.remain, pktlen);
-                    return;
-                }
-                bufcur += pktlen;
-            }
-        }
+    while ((readcnt = read(fd->fd, buf, CLIENT_READBUF_SZ)) > 0) {
+        metrics_add(METRIC_BYTES_IN, readcnt);
+        capture_data(capture_default, client->capid, buf, (size_t)readcnt);
+        if (!client_consume(client, buf, readcnt, readctx_ptr)) return;
     }
 
     if (readcnt == 0) {
-        client_disconnect_internal(client, "Disconnected");
+        client_disconnect_internal(client, METRICS_DC_CLOSED, "Disconnected");
         return;
     } else if (readcnt == -1) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) fd->state &= ~FD_CAN_READ;
         else {
-            client_disconnect_internal(client, "Read error: %s", strerror(errno));
+            client_disconnect_internal(client, METRICS_DC_IO, "Read error: %s", strerror(errno));
             return;
         }
     }
 }
 
+void client_read_handler(file_descriptor_t *fd, void *handler_data) {
+    UNUSED(fd);
+    client_read_common(handler_data, NULL, 0, true);
+}
+
+/* Takes over a connection from its preconn: pending holds whatever the preconn
+ * read past the frames it handled itself. Frees the client if that was already
+ * enough to disconnect it, otherwise hands it to the event loop. */
+void client_start(client_t *client, unsigned char *pending, size_t pendinglen) {
+    client_read_common(client, pending, pendinglen, true);
+
+    if (client->fd->state & FD_CALL_COMPLETE) client_free(client);
+    else event_loop_want(client->fd, FD_WANT_READ | FD_WANT_WRITE);
+}
+
+void client_feed(client_t *client, unsigned char *buf, size_t len) {
+    client_read_common(client, buf, len, false);
+}
+
 // 1 MB max SendQ
 #define CLIENT_MAX_SENDQ (1000000ul)
 
 void client_add_sendq(client_t *client, const unsigned char *buf, size_t length) {
     if (client->sendqcur + length > client->sendqsz) {
-        log_debug("Resizing client sendq (%s): from %lu to %lu", client->saddrstr, client->sendqsz, client->sendqcur + length);
+        size_t oldsz = client->sendqsz;
+        log_debug_limit("Resizing client sendq (%s): from %lu to %lu", client->saddrstr, client->sendqsz, client->sendqcur + length);
         client->sendqsz = client->sendqcur + length;
 
         if (client->sendqsz > CLIENT_MAX_SENDQ) {
-            client_disconnect_internal(client, "Max send queue exceeded (%lu > %lu)", client->sendqsz, CLIENT_MAX_SENDQ);
+            client_disconnect_internal(client, METRICS_DC_SENDQ, "Max send queue exceeded (%lu > %lu)", client->sendqsz, CLIENT_MAX_SENDQ);
             return;
         }
 
         void *newsendq = realloc(client->sendq, client->sendqsz);
         if (!newsendq) {
-            client_disconnect_internal(client, "Protocol error: Failed to increase sendq length (realloc returned NULL)");
+            client_disconnect_internal(client, METRICS_DC_OTHER, "Protocol error: Failed to increase sendq length (realloc returned NULL)");
             return;
         }
         client->sendq = newsendq;
+        TRACE_SENDQ_GROW(client->fd->fd, &client->saddr.base, oldsz, client->sendqsz);
     }
     memcpy(client->sendq + client->sendqcur, buf, length);
     client->sendqcur += length;
+    metrics_add(METRIC_SENDQ_BYTES, (int64_t)length);
 }
 
 void client_write(client_t *client, const unsigned char *buf, size_t length) {
-    pthread_mutex_lock(&client->evtmutex);
     if (client->fd->state & FD_CAN_WRITE) {
         ssize_t writecnt;
+        size_t total = length;
         while (length > 0 && (writecnt = write(client->fd->fd, buf, length)) > 0) {
+            metrics_add(METRIC_BYTES_OUT, writecnt);
             buf += writecnt;
             length -= writecnt;
             if (writecnt == 0) log_debug("client_write: write returned 0");
         }
+        TRACE_WRITE(client->fd->fd, &client->saddr.base, total - length, length);
 
         if (writecnt < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -415,52 +528,50 @@ void client_write(client_t *client, const unsigned char *buf, size_t length) {
                 event_loop_want(client->fd, client->fd->state);
                 if (length > 0) client_add_sendq(client, buf, length);
             } else {
-                client_disconnect_internal(client, "Write error: %s", strerror(errno));
-                goto writedone;
+                client_disconnect_internal(client, METRICS_DC_IO, "Write error: %s", strerror(errno));
+                return;
             }
         }
     } else {
+        TRACE_WRITE(client->fd->fd, &client->saddr.base, (size_t)0, length);
         client_add_sendq(client, buf, length);
     }
 
     if (client->dc_on_write && client->sendqcur == 0) {
-        client_disconnect_internal(client, NULL);
-        log_debug("Disconnecting client %s, dc_on_write was set.", client->saddrstr);
+        client_disconnect_internal(client, METRICS_DC_OTHER, NULL);
+        log_debug_limit("Disconnecting client %s, dc_on_write was set.", client->saddrstr);
     }
-
-writedone:
-    pthread_mutex_unlock(&client->evtmutex);
 }
 
 void client_write_pkt(client_t *client, void *pkt) {
     struct packet_base *bpkt = pkt;
-    packet_write_proc *proc = client_write_protos[client->protocol][bpkt->id];
-    if (!proc) {
+    struct auto_buffer frame;
+    uint64_t start = metrics_now_ns();
+    unsigned phase = client->protocol;
+    ab_init(&frame, 0, 0);
+
+    if (proto_frame_pkt(&frame, client->protocol, client, bpkt) < 0) {
         log_error("BUG: Attempted to write a %s packet to %s with unsupported ID %d!", protocol_names[client->protocol], client->saddrstr, bpkt->id);
 #ifdef BUILD_DEBUG
         abort();
 #endif
+        ab_free(&frame);
         return;
     }
 
-    struct auto_buffer pkt_writebuf, pkt_writebuf2;
-    ab_init(&pkt_writebuf, 0, 0);
-    proto_write_varint(&pkt_writebuf, bpkt->id);
-    (*proc)(client, &pkt_writebuf, bpkt);
-
-    size_t pktlen = ab_getwrcur(&pkt_writebuf);
-    ab_init(&pkt_writebuf2, pktlen + 7, 0);
-    proto_write_varint(&pkt_writebuf2, (int32_t)pktlen);
-    ab_push2(&pkt_writebuf2, pkt_writebuf.buf, pktlen);
-    client_write(client, pkt_writebuf2.buf, ab_getwrcur(&pkt_writebuf2));
+    metrics_add(METRIC_PACKETS_OUT, 1);
+    metrics_packet(phase, bpkt->id, METRICS_PKT_OUT, ab_getwrcur(&frame));
+    client_write(client, frame.buf, ab_getwrcur(&frame));
+    metrics_packet_time(phase, bpkt->id, METRICS_PKT_OUT, start);
 
-    for (size_t i = 0, max = ab_getwrcur(&pkt_writebuf2); i < max; ++i) {
-        printf("%2.2hhx ", pkt_writebuf2.buf[i]);
+#ifdef BUILD_DEBUG
+    for (size_t i = 0, max = ab_getwrcur(&frame); i < max; ++i) {
+        printf("%2.2hhx ", frame.buf[i]);
     }
     putchar('\n');
+#endif
 
-    ab_free(&pkt_writebuf2);
-    ab_free(&pkt_writebuf);
+    ab_free(&frame);
 }
 
 void client_write_handler(file_descriptor_t *fd, void *handler_data) {
@@ -472,21 +583,24 @@ void client_write_handler(file_descriptor_t *fd, void *handler_data) {
     while (client->sendqcur > 0 && (writecnt = write(fd->fd, writecur, client->sendqcur)) > 0) {
         writecur += writecnt;
         client->sendqcur -= writecnt;
+        metrics_add(METRIC_BYTES_OUT, writecnt);
+        metrics_add(METRIC_SENDQ_BYTES, -writecnt);
         if (writecnt == 0) log_debug("client_write_handler: write returned 0"); // how does this happen?
     }
+    TRACE_FLUSH(fd->fd, &client->saddr.base, (size_t)(writecur - client->sendq), client->sendqcur);
 
     if (writecnt < 0) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             if (client->sendqcur == 0) {
                 if (client->dc_on_write) {
-                    log_debug("Disconnecting client %s, dc_on_write was set.", client->saddrstr);
-                    client_disconnect_internal(client, NULL);
+                    log_debug_limit("Disconnecting client %s, dc_on_write was set.", client->saddrstr);
+                    client_disconnect_internal(client, METRICS_DC_OTHER, NULL);
                 }
                 return;
             }
             memmove(client->sendq, writecur, client->sendqsz - (writecur - client->sendq));
         } else {
-            client_disconnect_internal(client, "Write error: %s", strerror(errno));
+            client_disconnect_internal(client, METRICS_DC_IO, "Write error: %s", strerror(errno));
             return;
         }
     }
@@ -496,8 +610,8 @@ void client_error_handler(file_descriptor_t *fd, int error, void *handler_data)
     client_t *client = handler_data;
     UNUSED(fd);
 
-    if (error == 0) client_disconnect_internal(client, "Disconnected");
-    else client_disconnect_internal(client, "Error on socket: %s", strerror(error));
+    if (error == 0) client_disconnect_internal(client, METRICS_DC_CLOSED, "Disconnected");
+    else client_disconnect_internal(client, METRICS_DC_IO, "Error on socket: %s", strerror(error));
 }
 
 void client_handle_complete(file_descriptor_t *fd, void *handler_data) {
@@ -0,0 +1,133 @@
+#include "cpu.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// cpu_set_t would need _GNU_SOURCE, which our sched.h keeps from working, so the syscalls are used directly
+#define CPU_MASK_WORDS (CPU_MAX / (8 * sizeof(unsigned long)))
+#define CPU_MASK_BITS  (8 * sizeof(unsigned long))
+
+// Reads a single number from a sysfs file, -1 if there is none.
+long cpu_read_sysfs(int cpu, const char *what) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, what);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+
+    long val;
+    if (fscanf(fp, "%ld", &val) != 1) val = -1;
+    fclose(fp);
+    return val;
+}
+
+bool cpu_topology_detect(struct cpu_topology *topo) {
+    memset(topo, 0, sizeof(*topo));
+
+    unsigned long mask[CPU_MASK_WORDS];
+    memset(mask, 0, sizeof(mask));
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask) < 0) {
+        log_warn("cpu_topology_detect: sched_getaffinity: %s", strerror(errno));
+        return false;
+    }
+
+    int allowed[CPU_MAX];
+    long key[CPU_MAX];
+    unsigned n = 0;
+    for (int cpu = 0; cpu < CPU_MAX; ++cpu) {
+        if (!(mask[cpu / CPU_MASK_BITS] & (1ul << (cpu % CPU_MASK_BITS)))) continue;
+
+        // cores are only unique within a package; no topology in sysfs means no known siblings
+        long pkg = cpu_read_sysfs(cpu, "physical_package_id");
+        long core = cpu_read_sysfs(cpu, "core_id");
+        key[n] = (pkg < 0 || core < 0) ? -1 - cpu : (pkg << 20 | core);
+        allowed[n++] = cpu;
+    }
+    if (n == 0) return false;
+
+    topo->cpus = malloc(n * sizeof(int));
+    topo->core = malloc(n * sizeof(unsigned));
+    unsigned *coreof = malloc(n * sizeof(unsigned));
+    bool *placed = calloc(n, sizeof(bool));
+    if (!topo->cpus || !topo->core || !coreof || !placed) {
+        free(coreof);
+        free(placed);
+        cpu_topology_free(topo);
+        return false;
+    }
+
+    // number the cores in order of their first CPU
+    for (unsigned i = 0; i < n; ++i) {
+        coreof[i] = topo->ncores;
+        for (unsigned j = 0; j < i; ++j) {
+            if (key[j] == key[i]) {
+                coreof[i] = coreof[j];
+                break;
+            }
+        }
+        if (coreof[i] == topo->ncores) ++topo->ncores;
+    }
+
+    // one CPU per core, then the siblings the same way round until none are left
+    while (topo->ncpus < n) {
+        unsigned next_core = 0;
+        bool *taken = calloc(topo->ncores, sizeof(bool));
+        if (!taken) break;
+
+        for (unsigned i = 0; i < n; ++i) {
+            if (placed[i] || taken[coreof[i]]) continue;
+            taken[coreof[i]] = true;
+            placed[i] = true;
+            topo->cpus[topo->ncpus] = allowed[i];
+            topo->core[topo->ncpus] = coreof[i];
+            ++topo->ncpus;
+            ++next_core;
+        }
+        free(taken);
+        if (next_core == 0) break;
+    }
+
+    free(coreof);
+    free(placed);
+    return topo->ncpus > 0;
+}
+
+void cpu_topology_free(struct cpu_topology *topo) {
+    free(topo->cpus);
+    free(topo->core);
+    memset(topo, 0, sizeof(*topo));
+}
+
+bool cpu_pin(pid_t tid, const int *cpus, unsigned n) {
+    unsigned long mask[CPU_MASK_WORDS];
+    memset(mask, 0, sizeof(mask));
+    for (unsigned i = 0; i < n; ++i) {
+        if (cpus[i] < 0 || cpus[i] >= CPU_MAX) continue;
+        mask[cpus[i] / CPU_MASK_BITS] |= 1ul << (cpus[i] % CPU_MASK_BITS);
+    }
+
+    return syscall(SYS_sched_setaffinity, tid, sizeof(mask), mask) == 0;
+}
+
+int cpu_current(void) {
+    unsigned cpu;
+    if (syscall(SYS_getcpu, &cpu, NULL, NULL) < 0) return -1;
+    return (int)cpu;
+}
+
+void cpu_format_list(char *buf, size_t len, const int *cpus, unsigned n) {
+    size_t off = 0;
+    if (len == 0) return;
+    buf[0] = '\0';
+
+    for (unsigned i = 0; i < n && off < len; ++i) {
+        int res = snprintf(buf + off, len - off, i ? ",%d" : "%d", cpus[i]);
+        if (res < 0) break;
+        off += (size_t)res;
+    }
+}
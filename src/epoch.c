@@ -0,0 +1,204 @@
+#include "epoch.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* The global epoch only moves forward once every thread inside a section has
+ * seen its current value, so a thread is never more than one epoch behind.
+ * Something retired in epoch e was unlinked before any thread could enter
+ * e + 1; once the global epoch is at e + 2, nobody who could still see it is
+ * left inside a section. */
+struct epoch_slot {
+    _Atomic uint64_t state; // epoch << 1, | 1 while inside a section
+    atomic_bool used;
+} __attribute__((aligned(64)));
+
+struct epoch_slot *epoch_slots = NULL;
+unsigned epoch_nslots = 0;
+_Atomic uint64_t epoch_global = 0;
+
+struct epoch_thread {
+    struct epoch_slot *slot;
+    unsigned depth;
+    uint64_t local;
+    struct epoch_entry *limbo, *limbo_tail; // oldest first
+};
+
+_Thread_local struct epoch_thread epoch_self;
+
+// left behind by threads that have unregistered, freed by whoever collects next
+pthread_mutex_t epoch_orphans_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct epoch_entry *epoch_orphans = NULL;
+atomic_bool epoch_have_orphans = false;
+
+bool epoch_init(unsigned nthreads) {
+    void *slots;
+    if (nthreads == 0 || posix_memalign(&slots, 64, nthreads * sizeof(struct epoch_slot)) != 0) {
+        log_error("epoch_init: unable to allocate %u slots", nthreads);
+        return false;
+    }
+    memset(slots, 0, nthreads * sizeof(struct epoch_slot));
+
+    epoch_slots = slots;
+    epoch_nslots = nthreads;
+    return true;
+}
+
+void epoch_free(void) {
+    free(epoch_slots);
+    epoch_slots = NULL;
+    epoch_nslots = 0;
+}
+
+bool epoch_thread_register(void) {
+    if (epoch_self.slot) return true;
+
+    for (unsigned i = 0; i < epoch_nslots; ++i) {
+        bool expect = false;
+        if (atomic_compare_exchange_strong(&epoch_slots[i].used, &expect, true)) {
+            atomic_store(&epoch_slots[i].state, 0);
+            epoch_self.slot = epoch_slots + i;
+            return true;
+        }
+    }
+
+    log_error("epoch_thread_register: more than the %u threads epoch_init made room for", epoch_nslots);
+    return false;
+}
+
+void epoch_free_list(struct epoch_entry *ent) {
+    while (ent) {
+        struct epoch_entry *next = ent->next;
+        (*ent->free)(ent);
+        ent = next;
+    }
+}
+
+void epoch_thread_unregister(void) {
+    if (!epoch_self.slot) return;
+
+    if (epoch_self.limbo) {
+        pthread_mutex_lock(&epoch_orphans_mutex);
+        epoch_self.limbo_tail->next = epoch_orphans;
+        epoch_orphans = epoch_self.limbo;
+        atomic_store(&epoch_have_orphans, true);
+        pthread_mutex_unlock(&epoch_orphans_mutex);
+    }
+
+    atomic_store(&epoch_self.slot->state, 0);
+    atomic_store(&epoch_self.slot->used, false);
+    epoch_self.slot = NULL;
+    epoch_self.depth = 0;
+    epoch_self.limbo = epoch_self.limbo_tail = NULL;
+}
+
+void epoch_try_advance(void) {
+    uint64_t global = atomic_load(&epoch_global);
+
+    for (unsigned i = 0; i < epoch_nslots; ++i) {
+        if (!atomic_load_explicit(&epoch_slots[i].used, memory_order_relaxed)) continue;
+
+        uint64_t state = atomic_load(&epoch_slots[i].state);
+        if ((state & 1) && (state >> 1) != global) return; // still reading in the previous epoch
+    }
+
+    atomic_compare_exchange_strong(&epoch_global, &global, global + 1);
+}
+
+// Frees what is due from the calling thread's limbo, and from the orphans if nobody else is at it.
+void epoch_collect(void) {
+    bool orphans = atomic_load_explicit(&epoch_have_orphans, memory_order_relaxed);
+    if (!epoch_self.limbo && !orphans) return;
+
+    epoch_try_advance();
+    uint64_t global = atomic_load(&epoch_global);
+
+    while (epoch_self.limbo && epoch_self.limbo->epoch + 2 <= global) {
+        struct epoch_entry *ent = epoch_self.limbo;
+        epoch_self.limbo = ent->next;
+        (*ent->free)(ent);
+    }
+    if (!epoch_self.limbo) epoch_self.limbo_tail = NULL;
+
+    if (orphans && pthread_mutex_trylock(&epoch_orphans_mutex) == 0) {
+        struct epoch_entry **link = &epoch_orphans, *due = NULL;
+        while (*link) {
+            struct epoch_entry *ent = *link;
+            if (ent->epoch + 2 <= global) {
+                *link = ent->next;
+                ent->next = due;
+                due = ent;
+            } else {
+                link = &ent->next;
+            }
+        }
+        atomic_store(&epoch_have_orphans, epoch_orphans != NULL);
+        pthread_mutex_unlock(&epoch_orphans_mutex);
+
+        epoch_free_list(due);
+    }
+}
+
+void epoch_enter(void) {
+    if (epoch_self.depth++ > 0) return;
+
+    if (!epoch_self.slot && !epoch_thread_register()) {
+        log_error("epoch_enter: this thread can't be registered, aborting.");
+        abort();
+    }
+
+    // the epoch must not have moved on before this thread showed up as reading in it
+    uint64_t global;
+    do {
+        global = atomic_load(&epoch_global);
+        atomic_store(&epoch_self.slot->state, global << 1 | 1);
+        atomic_thread_fence(memory_order_seq_cst);
+    } while (atomic_load(&epoch_global) != global);
+
+    epoch_self.local = global;
+}
+
+void epoch_exit(void) {
+    if (--epoch_self.depth > 0) return;
+
+    atomic_store_explicit(&epoch_self.slot->state, epoch_self.local << 1, memory_order_release);
+    epoch_collect();
+}
+
+void epoch_retire(struct epoch_entry *ent, void (*freefn)(struct epoch_entry *ent)) {
+    ent->free = freefn;
+    ent->next = NULL;
+    ent->epoch = atomic_load(&epoch_global); // seq_cst, so it is read after the unlink
+
+    if (!epoch_self.slot) { // an unregistered thread can't collect, someone else will
+        pthread_mutex_lock(&epoch_orphans_mutex);
+        ent->next = epoch_orphans;
+        epoch_orphans = ent;
+        atomic_store(&epoch_have_orphans, true);
+        pthread_mutex_unlock(&epoch_orphans_mutex);
+        return;
+    }
+
+    if (epoch_self.limbo_tail) epoch_self.limbo_tail->next = ent;
+    else epoch_self.limbo = ent;
+    epoch_self.limbo_tail = ent;
+
+    if (epoch_self.depth == 0) epoch_collect();
+}
+
+void epoch_drain(void) {
+    struct epoch_entry *mine = epoch_self.limbo;
+    epoch_self.limbo = epoch_self.limbo_tail = NULL;
+    epoch_free_list(mine);
+
+    pthread_mutex_lock(&epoch_orphans_mutex);
+    struct epoch_entry *orphans = epoch_orphans;
+    epoch_orphans = NULL;
+    atomic_store(&epoch_have_orphans, false);
+    pthread_mutex_unlock(&epoch_orphans_mutex);
+
+    epoch_free_list(orphans);
+}
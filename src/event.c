@@ -1,6 +1,12 @@
 #include "event.h"
 #include "log.h"
+#include "macros.h"
+#include "epoch.h"
+#include "metrics.h"
 
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <string.h> // for memset
 #include <unistd.h> // for close
 #include <sys/types.h>
@@ -9,44 +15,143 @@
 
 #ifdef SOCKET_ENGINE_EPOLL
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 typedef struct epoll_event fd_event_t;
 #endif
 
 #define MAX_EVENTS (16)
 
-int sefd;
-fd_event_t events[MAX_EVENTS];
+struct event_loop {
+    int sefd;
+    fd_event_t events[MAX_EVENTS];
 
-void event_loop_init() {
-    memset(events, 0, sizeof(events));
+    /* Senders push onto the head, the owner takes the whole stack at once and
+     * reverses it. Nothing is ever popped singly, so there is no ABA. */
+    struct event_msg *_Atomic mailbox;
+    file_descriptor_t wakefd; // eventfd, written when a message lands in an empty mailbox
+} __attribute__((aligned(64)));
+
+struct event_loop *loops = NULL;
+unsigned nloops = 0;
+atomic_uint next_loop;
+
+_Thread_local unsigned event_thread_loop = (unsigned)-1;
+
+void event_wake_read_handler(file_descriptor_t *fd, void *handler_data);
+
+bool event_loop_init(unsigned count) {
+    if (count == 0) count = 1;
+
+    loops = aligned_alloc(64, count * sizeof(struct event_loop));
+    if (!loops) return false;
+    memset(loops, 0, count * sizeof(struct event_loop));
+    atomic_init(&next_loop, 0);
+
+    unsigned i;
+    for (i = 0; i < count; ++i) {
+        struct event_loop *loop = loops + i;
+        atomic_init(&loop->mailbox, NULL);
 
 #ifdef SOCKET_ENGINE_EPOLL
-    sefd = epoll_create1(0);
+        loop->sefd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->sefd < 0) {
+            log_error("event_loop_init: epoll_create1: %s", strerror(errno));
+            goto fail;
+        }
+
+        loop->wakefd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->wakefd.fd < 0) {
+            log_error("event_loop_init: eventfd: %s", strerror(errno));
+            close(loop->sefd);
+            goto fail;
+        }
 #endif
+
+        loop->wakefd.loop = i;
+        loop->wakefd.read_handler = &event_wake_read_handler;
+    }
+
+    nloops = count;
+    for (i = 0; i < count; ++i) event_loop_want(&loops[i].wakefd, FD_WANT_READ);
+    return true;
+
+fail:
+    nloops = i; // the ones that were set up
+    event_loop_close();
+    return false;
+}
+
+void event_loop_bind_thread(unsigned idx) {
+    event_thread_loop = idx % nloops;
+}
+
+unsigned event_loop_count(void) {
+    return nloops;
+}
+
+unsigned event_loop_next(void) {
+    return atomic_fetch_add_explicit(&next_loop, 1, memory_order_relaxed) % nloops;
+}
+
+unsigned event_loop_current(void) {
+    return event_thread_loop < nloops ? event_thread_loop : event_loop_next();
+}
+
+void event_wake_read_handler(file_descriptor_t *fd, void *handler_data) {
+    UNUSED(handler_data);
+    uint64_t cnt;
+    while (read(fd->fd, &cnt, sizeof(cnt)) > 0); // the mailbox itself is checked after every batch
+    fd->state &= ~FD_CAN_READ;
+}
+
+void event_loop_wake(struct event_loop *loop) {
+    uint64_t one = 1;
+    if (write(loop->wakefd.fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        log_warn("event_loop_wake: unable to wake loop %u: %s", loop->wakefd.loop, strerror(errno));
+    }
+}
+
+// Runs every message in the loop's mailbox, oldest first.
+void event_loop_run_mailbox(struct event_loop *loop) {
+    if (!atomic_load_explicit(&loop->mailbox, memory_order_relaxed)) return;
+
+    struct event_msg *msg = atomic_exchange_explicit(&loop->mailbox, NULL, memory_order_acquire);
+    struct event_msg *fifo = NULL;
+    while (msg) {
+        struct event_msg *next = msg->next;
+        msg->next = fifo;
+        fifo = msg;
+        msg = next;
+    }
+
+    while (fifo) {
+        struct event_msg *next = fifo->next; // run owns the message
+        (*fifo->run)(fifo);
+        fifo = next;
+    }
 }
 
 void event_loop_handle(int timeout) {
+    struct event_loop *loop = loops + (event_thread_loop < nloops ? event_thread_loop : 0);
+
 #ifdef SOCKET_ENGINE_EPOLL
-    int numevt = epoll_wait(sefd, events, MAX_EVENTS, timeout);
+    int numevt = epoll_wait(loop->sefd, loop->events, MAX_EVENTS, timeout);
     if (numevt < 0) {
-        log_error("epoll_wait error: %s", strerror(errno));
+        if (errno != EINTR) log_error("epoll_wait error: %s", strerror(errno));
         return;
     }
 #endif
 
-    fd_event_t *evt = events;
+    metrics_add(METRIC_LOOP_WAKEUPS, 1);
+    metrics_add(METRIC_LOOP_EVENTS, numevt);
+
+    // the whole batch is one epoch section, nothing a handler sees is freed under it
+    epoch_enter();
+
+    fd_event_t *evt = loop->events;
     for (int i = 0; i < numevt; ++i, ++evt) {
 #ifdef SOCKET_ENGINE_EPOLL
         file_descriptor_t *fd = (file_descriptor_t *)(evt->data.ptr);
-        if (fd->handler_mutex) pthread_mutex_lock(fd->handler_mutex);
-
-#if 0
-        // not sure if I should ignore the event if the client is disconnected...
-        if (fd->fd == -1) { // the socket was made invalid while we were waiting for it
-            if (fd->handler_mutex) pthread_mutex_unlock(fd->handler_mutex);
-            continue;
-        }
-#endif
 
         if (evt->events & EPOLLERR) {
             int error;
@@ -86,16 +191,43 @@ void event_loop_handle(int timeout) {
 
 evtcomplete:
         if (fd->state & FD_CALL_COMPLETE && fd->handle_complete) (*fd->handle_complete)(fd, fd->handler_data);
-        else {
-            event_loop_want(fd, fd->state); // rearm fd
-            if (fd->handler_mutex) pthread_mutex_unlock(fd->handler_mutex);
-        }
+        else event_loop_want(fd, fd->state); // rearm fd
 #endif
     }
+
+    // only now, a message may free something that still has an event further up in this batch
+    event_loop_run_mailbox(loop);
+    epoch_exit();
+}
+
+void event_loop_post(unsigned idx, struct event_msg *msg) {
+    struct event_loop *loop = loops + idx % nloops;
+
+    struct event_msg *head = atomic_load_explicit(&loop->mailbox, memory_order_relaxed);
+    do {
+        msg->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&loop->mailbox, &head, msg, memory_order_release, memory_order_relaxed));
+
+    // a non-empty mailbox has already woken the owner, and it takes everything at once
+    if (!head) event_loop_wake(loop);
+}
+
+void event_loop_wake_all(void) {
+    for (unsigned i = 0; i < nloops; ++i) event_loop_wake(loops + i);
+}
+
+void event_loop_drain(void) {
+    for (unsigned i = 0; i < nloops; ++i) event_loop_run_mailbox(loops + i);
 }
 
 void event_loop_close() {
-    close(sefd);
+    for (unsigned i = 0; i < nloops; ++i) {
+        close(loops[i].wakefd.fd);
+        close(loops[i].sefd);
+    }
+    free(loops);
+    loops = NULL;
+    nloops = 0;
 }
 
 #ifdef SOCKET_ENGINE_EPOLL
@@ -120,13 +252,14 @@ void event_loop_want(file_descriptor_t *fd, unsigned flags) {
     } else {
         op = EPOLL_CTL_ADD;
         fd->state |= FD_INTEREST;
+        fd->loop %= nloops;
     }
 
     struct epoll_event evt;
     memset(&evt, 0, sizeof(evt));
     evt.events = gen_epoll_flags(fd->state);
     evt.data.ptr = (void *)fd;
-    epoll_ctl(sefd, op, fd->fd, &evt);
+    epoll_ctl(loops[fd->loop].sefd, op, fd->fd, &evt);
 #endif
 }
 
@@ -136,7 +269,7 @@ void event_loop_delfd(file_descriptor_t *fd) {
 #ifdef SOCKET_ENGINE_EPOLL
     struct epoll_event evt; // older kernels want evt to be non-NULL
     memset(&evt, 0, sizeof(evt));
-    epoll_ctl(sefd, EPOLL_CTL_DEL, fd->fd, &evt);
+    epoll_ctl(loops[fd->loop].sefd, EPOLL_CTL_DEL, fd->fd, &evt);
 #endif
 
     fd->state &= ~FD_INTEREST;
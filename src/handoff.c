@@ -0,0 +1,1009 @@
+#include "handoff.h"
+#include "client.h"
+#include "preconn.h"
+#include "protocol.h"
+#include "utils.h"
+#include "log.h"
+#include "macros.h"
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#define PROTOCOL_ERROR(_ctx, reasonfmt, ...)                   \
+do {                                                           \
+    sprintf_alloc(&(_ctx)->reason, reasonfmt, ## __VA_ARGS__); \
+    longjmp(*(_ctx)->errlbl, 1);                               \
+} while (0)
+
+// Bump when the records below change, a new binary refuses a handoff it can't read
+#define HANDOFF_FORMAT (3)
+
+// Seconds the old process waits on the new one before giving up and carrying on
+#define HANDOFF_TIMEOUT (10)
+
+/* The new process's answer, followed by a uint32 count and that many uint32
+ * indices (host endian, counting client records in the order they were sent)
+ * of the connections it could not take over. */
+#define HANDOFF_ACK ('K')
+
+enum handoff_kind {
+    HANDOFF_HELLO = 0, // payload: format
+    HANDOFF_LISTENER,  // fd: a listening socket, payload: Bool for the proxy handoff listener
+    HANDOFF_CLIENT,    // fd: a connection, payload: its state
+    HANDOFF_END
+};
+
+/* Every record is this header, carrying the fd if there is one, followed by len
+ * bytes of payload. Both ends run on the same machine so the header is host
+ * endian; payloads are written with the protocol encoders. */
+struct handoff_record {
+    uint32_t kind;
+    uint32_t len;
+};
+
+bool handoff_write_full(int sockfd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(sockfd, buf, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            log_error("handoff_write_full: send: %s", strerror(errno));
+            return false;
+        }
+        buf += sent;
+        len -= (size_t)sent;
+    }
+    return true;
+}
+
+bool handoff_read_full(int sockfd, unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t got = recv(sockfd, buf, len, 0);
+        if (got <= 0) {
+            if (got < 0 && errno == EINTR) continue;
+            log_error("handoff_read_full: recv: %s", got == 0 ? "unexpected end of stream" : strerror(errno));
+            return false;
+        }
+        buf += got;
+        len -= (size_t)got;
+    }
+    return true;
+}
+
+bool handoff_send_record(int sockfd, uint32_t kind, int passfd, const unsigned char *payload, size_t len) {
+    struct handoff_record rec = { .kind = kind, .len = (uint32_t)len };
+    struct iovec iov = { .iov_base = &rec, .iov_len = sizeof(rec) };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (passfd >= 0) {
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &passfd, sizeof(int));
+    }
+
+    ssize_t sent;
+    while ((sent = sendmsg(sockfd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    if (sent != (ssize_t)sizeof(rec)) { // the header is tiny, a short send only happens if something broke
+        log_error("handoff_send_record: sendmsg: %s", sent < 0 ? strerror(errno) : "short send");
+        return false;
+    }
+
+    return handoff_write_full(sockfd, payload, len);
+}
+
+// Reads a record header and the fd that came with it (-1 if there was none).
+bool handoff_recv_record(int sockfd, struct handoff_record *rec, int *passfd) {
+    struct iovec iov = { .iov_base = rec, .iov_len = sizeof(*rec) };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    *passfd = -1;
+
+    ssize_t got;
+    while ((got = recvmsg(sockfd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len >= CMSG_LEN(sizeof(int))) {
+            memcpy(passfd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    if (got != (ssize_t)sizeof(*rec)) {
+        log_error("handoff_recv_record: recvmsg: %s", got < 0 ? strerror(errno) : "unexpected end of stream");
+        if (*passfd >= 0) close(*passfd);
+        return false;
+    }
+    return true;
+}
+
+/* The old process's side */
+
+int handoff_write_str(struct auto_buffer *out, const char *str) {
+    if (!str) return proto_write_varint(out, -1);
+    return proto_write_lenstr(out, str, -1);
+}
+
+int handoff_encode_client(struct auto_buffer *out, const client_t *cli) {
+    int res;
+    if ((res = proto_write_int(out, (int32_t)cli->protocol_ver)) < 0) return res;
+    if ((res = proto_write_ubyte(out, (uint8_t)cli->protocol)) < 0) return res;
+
+    // the address may have been replaced by a proxy's forwarded one, so it is not taken from the socket
+    if ((res = proto_write_varint(out, (int32_t)cli->saddrlen)) < 0) return res;
+    if ((res = proto_write_bytes(out, &cli->saddr, cli->saddrlen)) < 0) return res;
+
+    if ((res = proto_write_bool(out, cli->pingrespond)) < 0) return res;
+    if ((res = proto_write_int(out, cli->pingid)) < 0) return res;
+    if ((res = proto_write_long(out, cli->latency_ms)) < 0) return res;
+    if ((res = proto_write_bool(out, cli->dc_on_write)) < 0) return res;
+
+    if ((res = proto_write_bytes(out, &cli->spoofed_id, sizeof(cli->spoofed_id))) < 0) return res;
+    if ((res = handoff_write_str(out, cli->textures)) < 0) return res;
+    if ((res = handoff_write_str(out, cli->texsig)) < 0) return res;
+
+    if ((res = proto_write_bool(out, cli->player != NULL)) < 0) return res;
+    if (cli->player) {
+        const player_t *player = cli->player;
+        if ((res = proto_write_bytes(out, &player->profile.id, sizeof(player->profile.id))) < 0) return res;
+        if ((res = proto_write_bytes(out, player->profile.name, sizeof(player->profile.name))) < 0) return res;
+        if ((res = proto_write_uint(out, player->abilities)) < 0) return res;
+    }
+
+    // a packet that has only partly arrived
+    if ((res = proto_write_varint(out, (int32_t)cli->recvpartexsz)) < 0) return res;
+    if ((res = proto_write_varint(out, (int32_t)cli->recvpartcur)) < 0) return res;
+    if ((res = proto_write_bytes(out, cli->recvpartial, cli->recvpartcur)) < 0) return res;
+
+    // unparsed bytes (only preconns have them), then whatever the client has not been sent yet
+    if ((res = proto_write_varint(out, 0)) < 0) return res;
+    if ((res = proto_write_varint(out, (int32_t)cli->sendqcur)) < 0) return res;
+    return proto_write_bytes(out, cli->sendq, cli->sendqcur);
+}
+
+// A preconn goes over as a client that has not parsed what it read yet.
+int handoff_encode_preconn(struct auto_buffer *out, const preconn_t *pre) {
+    struct uuid noid;
+    memset(&noid, 0, sizeof(noid));
+
+    int res;
+    if ((res = proto_write_int(out, (int32_t)pre->protover)) < 0) return res;
+    if ((res = proto_write_ubyte(out, pre->protocol)) < 0) return res;
+    if ((res = proto_write_varint(out, (int32_t)pre->saddrlen)) < 0) return res;
+    if ((res = proto_write_bytes(out, &pre->saddr, pre->saddrlen)) < 0) return res;
+
+    if ((res = proto_write_bool(out, true)) < 0) return res;
+    if ((res = proto_write_int(out, 0)) < 0) return res;
+    if ((res = proto_write_long(out, -1)) < 0) return res;
+    if ((res = proto_write_bool(out, false)) < 0) return res;
+
+    if ((res = proto_write_bytes(out, &noid, sizeof(noid))) < 0) return res;
+    if ((res = handoff_write_str(out, NULL)) < 0) return res;
+    if ((res = handoff_write_str(out, NULL)) < 0) return res;
+    if ((res = proto_write_bool(out, false)) < 0) return res;
+
+    if ((res = proto_write_varint(out, 0)) < 0) return res;
+    if ((res = proto_write_varint(out, 0)) < 0) return res;
+
+    if ((res = proto_write_varint(out, pre->len)) < 0) return res;
+    if ((res = proto_write_bytes(out, pre->buf, pre->len)) < 0) return res;
+    return proto_write_varint(out, 0);
+}
+
+bool handoff_send_listeners(int sockfd, server_t *server, bool proxy) {
+    unsigned char isproxy = proxy;
+    for (unsigned i = 0; i < server->nfds; ++i) {
+        if (!handoff_send_record(sockfd, HANDOFF_LISTENER, server->fds[i].fd, &isproxy, 1)) return false;
+    }
+    return true;
+}
+
+// nsent is the number of client records sent, the indices in the ACK count up to it.
+bool handoff_send_all(int sockfd, server_t *server, server_t *proxyserver, client_registry_t *registry, size_t *nsent) {
+    struct auto_buffer payload;
+    ab_init(&payload, 0, 0);
+    bool success = false;
+
+    if (proto_write_int(&payload, HANDOFF_FORMAT) < 0) goto done;
+    if (!handoff_send_record(sockfd, HANDOFF_HELLO, -1, payload.buf, ab_getwrcur(&payload))) goto done;
+
+    if (!handoff_send_listeners(sockfd, server, false)) goto done;
+    if (proxyserver && !handoff_send_listeners(sockfd, proxyserver, true)) goto done;
+
+    size_t nclients = 0, npending = 0;
+    for (unsigned i = 0; i < registry->nshards; ++i) {
+        struct registry_shard *shard = registry->shards + i;
+
+        ILIST_FOREACH(&shard->clients, hook) {
+            client_t *cli = LIST_CONTAINER(hook, client_t, reghook);
+            if (cli->fd->fd == -1) continue;
+
+            ab_rewind(&payload, AB_REWIND_RDWR);
+            if (handoff_encode_client(&payload, cli) < 0) goto done;
+            if (!handoff_send_record(sockfd, HANDOFF_CLIENT, cli->fd->fd, payload.buf, ab_getwrcur(&payload))) goto done;
+            ++nclients;
+        }
+
+        ILIST_FOREACH(&shard->pending, hook) {
+            preconn_t *pre = LIST_CONTAINER(hook, preconn_t, hook);
+            if (pre->fd.fd == -1) continue;
+
+            ab_rewind(&payload, AB_REWIND_RDWR);
+            if (handoff_encode_preconn(&payload, pre) < 0) goto done;
+            if (!handoff_send_record(sockfd, HANDOFF_CLIENT, pre->fd.fd, payload.buf, ab_getwrcur(&payload))) goto done;
+            ++npending;
+        }
+    }
+
+    *nsent = nclients + npending;
+    success = handoff_send_record(sockfd, HANDOFF_END, -1, NULL, 0);
+    if (success) log_info("Sent %u listeners, %lu clients and %lu pending connections.", server->nfds, nclients, npending);
+
+done:
+    ab_free(&payload);
+    return success;
+}
+
+// Reads the ACK and the list of connections the new process lost (sorted, each below nsent).
+bool handoff_read_ack(int sockfd, size_t nsent, uint32_t **lost, size_t *nlost) {
+    unsigned char ack = 0;
+    uint32_t count = 0;
+    *lost = NULL;
+    *nlost = 0;
+
+    if (!handoff_read_full(sockfd, &ack, 1) || ack != HANDOFF_ACK) return false;
+    if (!handoff_read_full(sockfd, (unsigned char *)&count, sizeof(count))) return false;
+    if (count == 0) return true;
+    if (count > nsent) {
+        log_error("handoff_read_ack: %u connections lost of %lu sent", count, nsent);
+        return false;
+    }
+
+    uint32_t *list = malloc(count * sizeof(uint32_t));
+    if (!list) {
+        log_error("handoff_read_ack: unable to allocate the lost connection list: malloc returned NULL");
+        return false;
+    }
+    if (!handoff_read_full(sockfd, (unsigned char *)list, count * sizeof(uint32_t))) {
+        free(list);
+        return false;
+    }
+
+    *lost = list;
+    *nlost = count;
+    return true;
+}
+
+/* The new process owns the sockets now. Closing our copies sends nothing to the peers.
+ * The ones it lost stay open, the clients among them are kicked on the way out. */
+void handoff_release_all(server_t *server, server_t *proxyserver, client_registry_t *registry, const uint32_t *lost, size_t nlost) {
+    size_t seq = 0, l = 0; // walks the records in the order handoff_send_all sent them
+    for (unsigned i = 0; i < registry->nshards; ++i) {
+        struct registry_shard *shard = registry->shards + i;
+
+        ILIST_FOREACH(&shard->clients, hook) {
+            client_t *cli = LIST_CONTAINER(hook, client_t, reghook);
+            if (cli->fd->fd == -1) continue;
+            if (l < nlost && lost[l] == seq) {
+                log_warn("The new process could not take over %s.", cli->saddrstr);
+                ++seq, ++l;
+                continue;
+            }
+            ++seq;
+            event_loop_delfd(cli->fd);
+            close(cli->fd->fd);
+            cli->fd->fd = -1;
+        }
+
+        ILIST_FOREACH(&shard->pending, hook) {
+            preconn_t *pre = LIST_CONTAINER(hook, preconn_t, hook);
+            if (pre->fd.fd == -1) continue;
+            if (l < nlost && lost[l] == seq) {
+                ++seq, ++l;
+                continue;
+            }
+            ++seq;
+            event_loop_delfd(&pre->fd);
+            close(pre->fd.fd);
+            pre->fd.fd = -1;
+        }
+    }
+
+    server->handed_off = true;
+    if (proxyserver) proxyserver->handed_off = true;
+}
+
+bool handoff_restart(const char *exepath, server_t *server, server_t *proxyserver, client_registry_t *registry) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        log_error("handoff_restart: socketpair: %s", strerror(errno));
+        return false;
+    }
+
+    // the new process's end must survive the exec
+    if (fcntl(sv[1], F_SETFD, 0) < 0) {
+        log_error("handoff_restart: fcntl: %s", strerror(errno));
+        goto fail;
+    }
+
+    // a new process that hangs must not hang this one too
+    struct timeval tv = { .tv_sec = HANDOFF_TIMEOUT, .tv_usec = 0 };
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    char fdstr[16];
+    snprintf(fdstr, sizeof(fdstr), "%d", sv[1]);
+    setenv(HANDOFF_ENV, fdstr, 1); // set before forking, setenv is not safe between fork and exec
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl(exepath, exepath, (char *)NULL);
+        _exit(127);
+    }
+
+    unsetenv(HANDOFF_ENV);
+    if (pid < 0) {
+        log_error("handoff_restart: fork: %s", strerror(errno));
+        goto fail;
+    }
+
+    close(sv[1]);
+    sv[1] = -1;
+    log_info("Started %s (pid %d), handing over.", exepath, (int)pid);
+
+    size_t nsent = 0, nlost = 0;
+    uint32_t *lost = NULL;
+    if (!handoff_send_all(sv[0], server, proxyserver, registry, &nsent) || !handoff_read_ack(sv[0], nsent, &lost, &nlost)) {
+        log_error("handoff_restart: the new process did not take over");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        goto fail;
+    }
+
+    close(sv[0]);
+    handoff_release_all(server, proxyserver, registry, lost, nlost);
+    free(lost);
+    log_info("Process %d has taken over.", (int)pid);
+    return true;
+
+fail:
+    close(sv[0]);
+    if (sv[1] >= 0) close(sv[1]);
+    return false;
+}
+
+/* The new process's side */
+
+struct handoff_adopted {
+    client_t *cli;
+    unsigned char *pending, *sendq;
+    size_t pendinglen, sendqlen;
+};
+
+char *handoff_read_str(unsigned char **buf, struct read_context *ctx) {
+    int32_t len = proto_read_varint(buf, ctx);
+    if (len < 0) return NULL;
+
+    unsigned char *str = malloc((size_t)len + 1);
+    if (!str) PROTOCOL_ERROR(ctx, "Unable to allocate a string (len %d): malloc returned NULL", len);
+    proto_read_bytes(buf, str, (size_t)len, ctx);
+    str[len] = '\0';
+    return (char *)str;
+}
+
+unsigned char *handoff_read_blob(unsigned char **buf, size_t *len, struct read_context *ctx) {
+    int32_t blen = proto_read_varint(buf, ctx);
+    if (blen < 0) PROTOCOL_ERROR(ctx, "Suspicious length: %d < 0", blen);
+
+    *len = (size_t)blen;
+    if (blen == 0) return NULL;
+
+    unsigned char *blob = malloc((size_t)blen);
+    if (!blob) PROTOCOL_ERROR(ctx, "Unable to allocate %d bytes: malloc returned NULL", blen);
+    proto_read_bytes(buf, blob, (size_t)blen, ctx);
+    return blob;
+}
+
+// Builds the client, without starting it. Takes ownership of sockfd only on success.
+bool handoff_decode_client(int sockfd, unsigned char *buf, size_t len, struct handoff_adopted *out) {
+    volatile struct read_context ctx;
+    struct read_context *ctxp = (struct read_context *)&ctx; // see client_read_common
+    jmp_buf errlbl;
+    client_t *volatile cli = NULL;
+
+    memset(out, 0, sizeof(*out));
+    ctx.remain = (int32_t)len;
+    ctx.protover = -1;
+    ctx.reason = NULL;
+    ctx.reasonw = NULL;
+    ctx.errlbl = ctx.dclbl = &errlbl;
+
+    if (setjmp(errlbl)) {
+        log_error("handoff_decode_client: %s", ctx.reason ? ctx.reason : "bad record");
+        free(ctx.reason);
+        if (cli) {
+            cli->fd->fd = -1; // not ours to close yet
+            client_release(cli);
+        }
+        free(out->pending);
+        free(out->sendq);
+        return false;
+    }
+
+    protover_t protover = (protover_t)proto_read_int(&buf, ctxp);
+    unsigned protocol = proto_read_ubyte(&buf, ctxp);
+    if (protocol >= PROTOCOL_COUNT) PROTOCOL_ERROR(ctxp, "Invalid protocol %u", protocol);
+
+    sockaddrs saddr;
+    int32_t saddrlen = proto_read_varint(&buf, ctxp);
+    if (saddrlen < 0 || (size_t)saddrlen > sizeof(saddr)) PROTOCOL_ERROR(ctxp, "Invalid address length %d", saddrlen);
+    proto_read_bytes(&buf, (unsigned char *)&saddr, (size_t)saddrlen, ctxp);
+
+    cli = client_init(sockfd, &saddr.base, (socklen_t)saddrlen);
+    cli->protocol_ver = protover;
+    client_set_protocol(cli, protocol);
+
+    cli->pingrespond = proto_read_bool(&buf, ctxp);
+    cli->pingid = proto_read_int(&buf, ctxp);
+    cli->latency_ms = proto_read_long(&buf, ctxp);
+    cli->dc_on_write = proto_read_bool(&buf, ctxp);
+
+    proto_read_bytes(&buf, (unsigned char *)&cli->spoofed_id, sizeof(cli->spoofed_id), ctxp);
+    cli->textures = handoff_read_str(&buf, ctxp);
+    cli->texsig = handoff_read_str(&buf, ctxp);
+
+    if (proto_read_bool(&buf, ctxp)) {
+        player_t *player = calloc(1, sizeof(player_t));
+        if (!player) PROTOCOL_ERROR(ctxp, "Unable to allocate player_t object: malloc returned NULL");
+        cli->player = player;
+
+        player->conn = cli;
+        proto_read_bytes(&buf, (unsigned char *)&player->profile.id, sizeof(player->profile.id), ctxp);
+        proto_read_bytes(&buf, (unsigned char *)player->profile.name, sizeof(player->profile.name), ctxp);
+        player->profile.name[sizeof(player->profile.name) - 1] = '\0';
+        player->abilities = proto_read_uint(&buf, ctxp);
+    }
+
+    int32_t partexsz = proto_read_varint(&buf, ctxp);
+    size_t partlen;
+    unsigned char *part = handoff_read_blob(&buf, &partlen, ctxp);
+    if (partexsz < 0 || partlen > (size_t)partexsz) {
+        free(part);
+        PROTOCOL_ERROR(ctxp, "Invalid partial packet: %lu of %d bytes", partlen, partexsz);
+    }
+    if (partexsz > 0) {
+        unsigned char *newalloc = realloc(part, (size_t)partexsz);
+        if (!newalloc) {
+            free(part);
+            PROTOCOL_ERROR(ctxp, "Unable to allocate a partial packet: realloc returned NULL");
+        }
+        cli->recvpartial = newalloc;
+        metrics_add(METRIC_RECVBUF_BYTES, partexsz - (int64_t)cli->recvpartsz);
+        cli->recvpartsz = cli->recvpartexsz = (size_t)partexsz;
+        cli->recvpartcur = partlen;
+    } else {
+        free(part);
+    }
+
+    out->pending = handoff_read_blob(&buf, &out->pendinglen, ctxp);
+    out->sendq = handoff_read_blob(&buf, &out->sendqlen, ctxp);
+    if (ctx.remain != 0) PROTOCOL_ERROR(ctxp, "%d bytes left over", ctx.remain);
+
+    out->cli = cli;
+    return true;
+}
+
+// Adds an adopted client to the registry and the event loop.
+void handoff_start_client(client_registry_t *registry, struct handoff_adopted *ad) {
+    client_t *cli = ad->cli;
+    registry_add(registry, cli);
+
+    if (cli->player) {
+        client_t *evicted[2];
+        int nevicted = playerindex_claim(&registry->players, cli->player, evicted);
+        if (nevicted < 0) log_warn("Unable to index player %s: out of memory", cli->player->profile.name);
+        for (int i = 0; i < nevicted; ++i) { // can't happen unless the old process had a duplicate
+            client_kick_remote_w(evicted[i], L"You logged in from another location");
+            client_release(evicted[i]);
+        }
+    }
+
+    // queued until the socket reports it is writable
+    if (ad->sendqlen > 0) client_write(cli, ad->sendq, ad->sendqlen);
+    client_start(cli, ad->pending, ad->pendinglen);
+
+    free(ad->pending);
+    free(ad->sendq);
+}
+
+// Logs and counts a connection the old process sent that could not be taken over.
+void handoff_lost(int sockfd) {
+    sockaddrs saddr;
+    socklen_t saddrlen = sizeof(saddr);
+    char addrbuf[128] = "unknown";
+
+    if (getpeername(sockfd, &saddr.base, &saddrlen) == 0) {
+        if (saddr.base.sa_family == AF_INET) inet_ntop(AF_INET, &saddr.in.sin_addr, addrbuf, sizeof(addrbuf));
+        else if (saddr.base.sa_family == AF_INET6) inet_ntop(AF_INET6, &saddr.in6.sin6_addr, addrbuf, sizeof(addrbuf));
+    }
+
+    log_warn("Unable to take over the connection from %s, the old process will kick it.", addrbuf);
+    metrics_add(METRIC_HANDOFF_LOST, 1);
+}
+
+bool handoff_receive(int sockfd, client_registry_t *registry, server_t **server, server_t **proxyserver) {
+    struct handoff_adopted *adopted = NULL;
+    size_t nadopted = 0, adoptedsz = 0;
+    uint32_t *lost = NULL, nclientrecs = 0, nlost = 0; // client records seen, and the ones that couldn't be taken
+    int *listeners[2] = { NULL, NULL }; // game, proxy handoff
+    unsigned nlisteners[2] = { 0, 0 };
+    unsigned char *payload = NULL;
+    bool success = false, hello = false;
+    *server = *proxyserver = NULL;
+
+    while (true) {
+        struct handoff_record rec;
+        int passfd;
+        if (!handoff_recv_record(sockfd, &rec, &passfd)) goto done;
+
+        free(payload);
+        payload = NULL;
+        if (rec.len > 0) {
+            payload = malloc(rec.len);
+            if (!payload || !handoff_read_full(sockfd, payload, rec.len)) {
+                if (passfd >= 0) close(passfd);
+                goto done;
+            }
+        }
+
+        if (!hello && rec.kind != HANDOFF_HELLO) {
+            log_error("handoff_receive: expected a hello, got record %u", rec.kind);
+            if (passfd >= 0) close(passfd);
+            goto done;
+        }
+
+        switch (rec.kind) {
+            case HANDOFF_HELLO: {
+                int32_t format = -1;
+                if (rec.len == 4) format = (int32_t)(((uint32_t)payload[0] << 24) | ((uint32_t)payload[1] << 16) | ((uint32_t)payload[2] << 8) | payload[3]);
+                if (format != HANDOFF_FORMAT) {
+                    log_error("handoff_receive: unsupported handoff format %d (expected %d)", format, HANDOFF_FORMAT);
+                    goto done;
+                }
+                hello = true;
+                break;
+            }
+            case HANDOFF_LISTENER: {
+                if (passfd < 0) break;
+                unsigned which = rec.len > 0 && payload[0];
+                int *newalloc = realloc(listeners[which], (nlisteners[which] + 1) * sizeof(int));
+                if (!newalloc) {
+                    close(passfd);
+                    goto done;
+                }
+                listeners[which] = newalloc;
+                listeners[which][nlisteners[which]++] = passfd;
+                break;
+            }
+            case HANDOFF_CLIENT: {
+                uint32_t seq = nclientrecs++;
+                if (passfd < 0) break;
+                if (nadopted == adoptedsz) {
+                    size_t newsz = adoptedsz ? adoptedsz * 2 : 64;
+                    struct handoff_adopted *newalloc = realloc(adopted, newsz * sizeof(struct handoff_adopted));
+                    if (!newalloc) {
+                        close(passfd);
+                        goto done;
+                    }
+                    adopted = newalloc;
+                    adoptedsz = newsz;
+                }
+
+                if (!handoff_decode_client(passfd, payload, rec.len, adopted + nadopted)) {
+                    // this one is lost, the rest can still be saved. The old process still has it and says goodbye
+                    handoff_lost(passfd);
+                    close(passfd);
+
+                    uint32_t *newlost = realloc(lost, (nlost + 1) * sizeof(uint32_t));
+                    if (!newlost) goto done;
+                    lost = newlost;
+                    lost[nlost++] = seq;
+                    break;
+                }
+                ++nadopted;
+                break;
+            }
+            case HANDOFF_END:
+                success = true;
+                goto done;
+            default:
+                log_warn("handoff_receive: skipping unknown record %u", rec.kind);
+                if (passfd >= 0) close(passfd);
+        }
+    }
+
+done:
+    free(payload);
+
+    if (success && nlisteners[0] == 0) {
+        log_error("handoff_receive: no listeners were handed over");
+        success = false;
+    }
+
+    if (success) {
+        *server = server_adopt(listeners[0], nlisteners[0]);
+        if (nlisteners[1] > 0) {
+            *proxyserver = server_adopt(listeners[1], nlisteners[1]);
+            (*proxyserver)->proxy_handoff = true;
+        }
+    }
+
+    // from here on the old process stops touching the sockets
+    unsigned char ack = HANDOFF_ACK;
+    if (success && (!handoff_write_full(sockfd, &ack, 1)
+                    || !handoff_write_full(sockfd, (unsigned char *)&nlost, sizeof(nlost))
+                    || !handoff_write_full(sockfd, (unsigned char *)lost, nlost * sizeof(uint32_t)))) {
+        success = false;
+    }
+    close(sockfd);
+    free(lost);
+
+    if (success) {
+        for (size_t i = 0; i < nadopted; ++i) handoff_start_client(registry, adopted + i);
+        log_info("Took over %u listeners and %lu connections (%u lost).", nlisteners[0] + nlisteners[1], nadopted, nlost);
+    } else {
+        server_t *servers[2] = { *server, *proxyserver };
+        for (unsigned w = 0; w < 2; ++w) {
+            if (servers[w]) {
+                servers[w]->handed_off = true; // a unix socket file still belongs to the old process
+                server_free(servers[w]);
+            } else {
+                for (unsigned i = 0; i < nlisteners[w]; ++i) close(listeners[w][i]);
+            }
+        }
+        *server = *proxyserver = NULL;
+
+        // the old process carries on with these
+        for (size_t i = 0; i < nadopted; ++i) {
+            client_t *cli = adopted[i].cli;
+            close(cli->fd->fd);
+            cli->fd->fd = -1;
+            client_release(cli);
+            free(adopted[i].pending);
+            free(adopted[i].sendq);
+        }
+    }
+
+    free(listeners[0]);
+    free(listeners[1]);
+    free(adopted);
+    return success;
+}
+
+/* Proxy handoff */
+
+// fds received ahead of the records they belong to
+#define HANDOFF_PROXY_MAXFDS (64)
+
+struct handoff_proxy {
+    file_descriptor_t fd;
+    struct list_hook hook;
+    client_registry_t *registry;
+
+    unsigned char *buf;
+    size_t len, sz;
+
+    int fds[HANDOFF_PROXY_MAXFDS];
+    unsigned nfds;
+};
+
+pthread_mutex_t handoff_proxies_mutex = PTHREAD_MUTEX_INITIALIZER;
+ilist_t handoff_proxies = ILIST_INITIALIZER(handoff_proxies);
+
+void handoff_proxy_read_handler(file_descriptor_t *fd, void *handler_data);
+void handoff_proxy_error_handler(file_descriptor_t *fd, int error, void *handler_data);
+void handoff_proxy_handle_complete(file_descriptor_t *fd, void *handler_data);
+
+// struct ucred, which glibc only declares under _GNU_SOURCE (see server_accept4)
+struct handoff_peercred {
+    pid_t pid;
+    uid_t uid;
+    gid_t gid;
+};
+
+void handoff_proxy_accept(int sockfd, client_registry_t *registry) {
+    struct handoff_peercred cred;
+    socklen_t credlen = sizeof(cred);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0 || credlen != sizeof(cred)) {
+        log_error("handoff_proxy_accept: getsockopt(SOL_SOCKET, SO_PEERCRED): %s", credlen != sizeof(cred) ? "short answer" : strerror(errno));
+        close(sockfd);
+        return;
+    }
+    if (cred.uid != geteuid()) {
+        log_warn("Refusing a proxy connection from uid %u (pid %d), only uid %u may hand players over.", (unsigned)cred.uid, (int)cred.pid, (unsigned)geteuid());
+        close(sockfd);
+        return;
+    }
+
+    struct handoff_proxy *px = registry ? calloc(1, sizeof(struct handoff_proxy)) : NULL;
+    if (!px) {
+        log_error("handoff_proxy_accept: unable to take proxy connection %d", sockfd);
+        close(sockfd);
+        return;
+    }
+
+    px->fd.fd = sockfd;
+    px->fd.loop = event_loop_next(); // its players live on that thread, a busy proxy can open a few connections
+    px->fd.handler_data = px;
+    px->fd.read_handler = &handoff_proxy_read_handler;
+    px->fd.error_handler = &handoff_proxy_error_handler;
+    px->fd.handle_complete = &handoff_proxy_handle_complete;
+    px->registry = registry;
+
+    pthread_mutex_lock(&handoff_proxies_mutex);
+    ilist_addend(&handoff_proxies, &px->hook);
+    pthread_mutex_unlock(&handoff_proxies_mutex);
+
+    log_info("A proxy connected to the handoff socket.");
+    event_loop_want(&px->fd, FD_WANT_READ);
+}
+
+void handoff_proxy_close(struct handoff_proxy *px) {
+    if (px->fd.fd != -1) {
+        event_loop_delfd(&px->fd);
+        close(px->fd.fd);
+        px->fd.fd = -1;
+    }
+
+    // players the proxy passed without a record stay with the proxy
+    for (unsigned i = 0; i < px->nfds; ++i) close(px->fds[i]);
+    px->nfds = 0;
+
+    px->fd.state |= FD_CALL_COMPLETE;
+}
+
+void handoff_proxy_free(struct handoff_proxy *px) {
+    pthread_mutex_lock(&handoff_proxies_mutex);
+    ilist_remove(&handoff_proxies, &px->hook);
+    pthread_mutex_unlock(&handoff_proxies_mutex);
+
+    handoff_proxy_close(px);
+    free(px->buf);
+    free(px);
+}
+
+// Adopts one player. Takes ownership of sockfd whatever the outcome.
+bool handoff_proxy_adopt(client_registry_t *registry, int sockfd, unsigned char *buf, size_t len) {
+    volatile struct read_context ctx;
+    struct read_context *ctxp = (struct read_context *)&ctx; // see client_read_common
+    jmp_buf errlbl;
+
+    ctx.remain = (int32_t)len;
+    ctx.protover = -1;
+    ctx.reason = NULL;
+    ctx.reasonw = NULL;
+    ctx.errlbl = ctx.dclbl = &errlbl;
+
+    if (setjmp(errlbl)) {
+        log_warn_limit("Refusing a player from the proxy: %s", ctx.reason ? ctx.reason : "bad record");
+        free(ctx.reason);
+        close(sockfd);
+        return false;
+    }
+
+    protover_t protover = (protover_t)proto_read_int(&buf, ctxp);
+    unsigned phase = proto_read_ubyte(&buf, ctxp);
+    if (phase >= PROTOCOL_COUNT) PROTOCOL_ERROR(ctxp, "Invalid phase %u", phase);
+
+    bool hasprofile = proto_read_bool(&buf, ctxp);
+    struct uuid id;
+    char name[17];
+    memset(name, 0, sizeof(name));
+    if (hasprofile) {
+        id.mostsig = proto_read_ulong(&buf, ctxp);
+        id.leastsig = proto_read_ulong(&buf, ctxp);
+
+        char *rdname;
+        int32_t namelen = 16;
+        proto_read_lenstr(&buf, &rdname, &namelen, ctxp);
+        memcpy(name, rdname, (size_t)namelen);
+        free(rdname);
+    } else if (phase == PROTOCOL_PLAY) {
+        PROTOCOL_ERROR(ctxp, "A player in play needs a profile");
+    }
+
+    int32_t pendinglen = proto_read_varint(&buf, ctxp);
+    if (pendinglen < 0) PROTOCOL_ERROR(ctxp, "Suspicious length: %d < 0", pendinglen);
+    unsigned char *pending = buf;
+    proto_read_bytes(&buf, NULL, (size_t)pendinglen, ctxp);
+    if (ctx.remain != 0) PROTOCOL_ERROR(ctxp, "%d bytes left over", ctx.remain);
+
+    sockaddrs saddr;
+    socklen_t saddrlen = sizeof(saddr);
+    if (getpeername(sockfd, &saddr.base, &saddrlen) < 0) PROTOCOL_ERROR(ctxp, "getpeername: %s", strerror(errno));
+
+    // the proxy's socket may well be blocking
+    int flags = fcntl(sockfd, F_GETFL);
+    if (flags < 0 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0) PROTOCOL_ERROR(ctxp, "fcntl: %s", strerror(errno));
+
+    client_t *cli = client_init(sockfd, &saddr.base, saddrlen);
+    cli->protocol_ver = protover;
+    client_set_protocol(cli, phase == PROTOCOL_PLAY ? PROTOCOL_LOGIN : phase);
+    registry_add(registry, cli);
+
+    if (phase == PROTOCOL_PLAY) {
+        // queued until the socket reports it is writable
+        const char *err = proto_join_player(cli, &id, name, false);
+
+        if (err) {
+            log_warn_limit("Refusing player %s from the proxy: %s", name, err);
+            client_free(cli);
+            return false;
+        }
+    }
+
+    log_info_limit("Adopted %s (%s) from the proxy in %s", hasprofile ? name : "a player", cli->saddrstr, protocol_names[phase]);
+    client_start(cli, pending, (size_t)pendinglen);
+    return true;
+}
+
+// Handles every complete record. Returns false if the proxy broke the protocol.
+bool handoff_proxy_process(struct handoff_proxy *px) {
+    size_t off = 0;
+    bool ok = true;
+
+    while (px->len - off >= sizeof(struct handoff_record)) {
+        struct handoff_record rec;
+        memcpy(&rec, px->buf + off, sizeof(rec));
+        if (rec.kind != HANDOFF_PROXY_CLIENT || rec.len > HANDOFF_PROXY_MAXREC) {
+            log_warn("The proxy sent a bad record (kind %u, len %u), dropping it.", rec.kind, rec.len);
+            ok = false;
+            break;
+        }
+
+        size_t reclen = sizeof(rec) + rec.len;
+        if (px->len - off < reclen) break;
+
+        // the fd arrives with the first byte of its record, it is here by now
+        if (px->nfds == 0) {
+            log_warn("The proxy sent a record without a socket, dropping it.");
+            ok = false;
+            break;
+        }
+
+        int sockfd = px->fds[0];
+        memmove(px->fds, px->fds + 1, --px->nfds * sizeof(int));
+
+        unsigned char status = handoff_proxy_adopt(px->registry, sockfd, px->buf + off + sizeof(rec), rec.len) ? 0 : 1;
+        send(px->fd.fd, &status, 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+        off += reclen;
+    }
+
+    memmove(px->buf, px->buf + off, px->len - off);
+    px->len -= off;
+    return ok;
+}
+
+void handoff_proxy_read_handler(file_descriptor_t *fd, void *handler_data) {
+    struct handoff_proxy *px = handler_data;
+
+    while (true) {
+        if (px->sz - px->len < 4096) {
+            size_t newsz = px->sz ? px->sz * 2 : 8192;
+            if (newsz > 2 * (sizeof(struct handoff_record) + HANDOFF_PROXY_MAXREC)) { // larger than any valid record
+                handoff_proxy_close(px);
+                return;
+            }
+            unsigned char *newalloc = realloc(px->buf, newsz);
+            if (!newalloc) {
+                handoff_proxy_close(px);
+                return;
+            }
+            px->buf = newalloc;
+            px->sz = newsz;
+        }
+
+        struct iovec iov = { .iov_base = px->buf + px->len, .iov_len = px->sz - px->len };
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(HANDOFF_PROXY_MAXFDS * sizeof(int))];
+        } ctl;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+
+        ssize_t got = recvmsg(fd->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+
+        /* Records are paired with fds in the order they came, so once one is lost every
+         * later record would get the wrong player. Rather than that, the proxy connection
+         * goes, and the proxy keeps every player it has not had an answer for. */
+        bool overflow = false;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); got >= 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+            size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < n; ++i) {
+                int passfd;
+                memcpy(&passfd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (px->nfds < HANDOFF_PROXY_MAXFDS) px->fds[px->nfds++] = passfd;
+                else {
+                    close(passfd);
+                    overflow = true;
+                }
+            }
+        }
+
+        if (got >= 0 && ((msg.msg_flags & MSG_CTRUNC) || overflow)) {
+            log_error("The proxy sent more than %d sockets ahead of their records, closing its handoff connection.", HANDOFF_PROXY_MAXFDS);
+            handoff_proxy_close(px);
+            return;
+        }
+
+        if (got == 0) {
+            log_info("The proxy disconnected from the handoff socket.");
+            handoff_proxy_close(px);
+            return;
+        } else if (got < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) fd->state &= ~FD_CAN_READ;
+            else handoff_proxy_close(px);
+            return;
+        }
+
+        px->len += (size_t)got;
+        if (!handoff_proxy_process(px)) {
+            handoff_proxy_close(px);
+            return;
+        }
+    }
+}
+
+void handoff_proxy_error_handler(file_descriptor_t *fd, int error, void *handler_data) {
+    UNUSED(fd); UNUSED(error);
+    handoff_proxy_close(handler_data);
+}
+
+void handoff_proxy_handle_complete(file_descriptor_t *fd, void *handler_data) {
+    UNUSED(fd);
+    handoff_proxy_free(handler_data);
+}
+
+void handoff_proxy_close_all(void) {
+    ILIST_FOREACH(&handoff_proxies, hook) {
+        struct handoff_proxy *px = LIST_CONTAINER(hook, struct handoff_proxy, hook);
+        handoff_proxy_free(px);
+    }
+}
@@ -184,3 +184,47 @@ void dll_free(dllist_t *list) {
 
     free(list);
 }
+
+void ilist_init(ilist_t *list) {
+    list->length = 0;
+    list->head.prev = list->head.next = &list->head;
+}
+
+void ilist_link(ilist_t *list, struct list_hook *hook, struct list_hook *prev, struct list_hook *next) {
+    hook->prev = prev;
+    hook->next = next;
+    prev->next = hook;
+    next->prev = hook;
+    ++list->length;
+}
+
+void ilist_addend(ilist_t *list, struct list_hook *hook) {
+    ilist_link(list, hook, list->head.prev, &list->head);
+}
+
+void ilist_addstart(ilist_t *list, struct list_hook *hook) {
+    ilist_link(list, hook, &list->head, list->head.next);
+}
+
+void ilist_remove(ilist_t *list, struct list_hook *hook) {
+    hook->prev->next = hook->next;
+    hook->next->prev = hook->prev;
+    hook->prev = hook->next = NULL;
+    --list->length;
+}
+
+void ilist_addend_rcu(ilist_t *list, struct list_hook *hook) {
+    struct list_hook *prev = list->head.prev;
+    hook->prev = prev;
+    hook->next = &list->head;
+    __atomic_store_n(&prev->next, hook, __ATOMIC_RELEASE); // readers see the hook only once it is filled in
+    list->head.prev = hook;
+    ++list->length;
+}
+
+void ilist_remove_rcu(ilist_t *list, struct list_hook *hook) {
+    hook->next->prev = hook->prev;
+    __atomic_store_n(&hook->prev->next, hook->next, __ATOMIC_RELEASE);
+    hook->prev = NULL;
+    --list->length;
+}
@@ -1,66 +1,356 @@
 #include "log.h"
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <time.h>
+#include <errno.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <semaphore.h>
 
-log_level_t log_level = LOG_INFO;
+atomic_uint log_level = LOG_INFO;
 
-#define TIMEBUF_SIZE (64)
-char timebuf[TIMEBUF_SIZE];
+/* Every thread that logs gets its own single-producer ring of fixed-size
+ * records. The writer thread is the only consumer: it merges the rings by
+ * timestamp and writes them out in batches. A full ring drops the record and
+ * counts it instead of making the IO thread wait. */
+#define LOG_RECORD_SIZE (512)
+#define LOG_RING_SIZE   (256) // records, must be a power of two
+
+// above this fill level only warnings and errors are still queued
+#define LOG_RING_LOWPRIO_MAX (LOG_RING_SIZE - LOG_RING_SIZE / 8)
+
+struct log_record {
+    struct timespec ts;
+    uint16_t len;
+    uint8_t level;
+    char text[LOG_RECORD_SIZE - sizeof(struct timespec) - 4];
+};
+
+struct log_ring {
+    _Atomic size_t head __attribute__((aligned(64))); // written by the owner
+    _Atomic size_t tail __attribute__((aligned(64))); // written by the writer thread
+
+    atomic_ulong dropped;
+    atomic_bool owned; // false once the owning thread exits, the next new thread adopts the ring
+    struct log_ring *next;
+
+    struct log_record records[LOG_RING_SIZE];
+};
+
+_Atomic(struct log_ring *) log_rings = NULL;
+_Thread_local struct log_ring *log_my_ring = NULL;
+pthread_key_t log_ring_key;
 
+_Atomic(struct log_site *) log_sites = NULL;
+
+atomic_bool log_running = false;
+atomic_bool log_wake_pending = false;
+sem_t log_wakeup;
+pthread_t log_writer;
+
+// only used while the writer thread is not running
 pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+#define TIMEBUF_SIZE (64)
+
+// the timestamp only changes once a second, so it is only formatted that often
+struct log_timecache {
+    time_t sec;
+    char str[TIMEBUF_SIZE];
+};
+
+const char *log_timestr(struct log_timecache *cache, time_t sec) {
+    if (sec != cache->sec || !cache->str[0]) {
+        struct tm info;
+        localtime_r(&sec, &info);
+        strftime(cache->str, TIMEBUF_SIZE, "%H:%M:%S", &info);
+        cache->sec = sec;
+    }
+    return cache->str;
+}
+
+const char *const log_level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+size_t log_format_line(char *out, size_t outsz, struct log_timecache *tc, time_t sec, log_level_t level, const char *text, size_t textlen) {
+    int prefix = snprintf(out, outsz, "[%s] [%s] ", log_timestr(tc, sec), log_level_names[level]);
+    if (prefix < 0) return 0;
+
+    size_t len = (size_t)prefix < outsz ? (size_t)prefix : outsz - 1;
+    if (textlen > outsz - len - 1) textlen = outsz - len - 1;
+    memcpy(out + len, text, textlen);
+    len += textlen;
+    if (len < outsz) out[len++] = '\n';
+    return len;
+}
+
+void log_write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return; // nowhere left to complain
+        }
+        buf += written;
+        len -= (size_t)written;
+    }
+}
+
+void log_ring_release(void *ring) {
+    atomic_store_explicit(&((struct log_ring *)ring)->owned, false, memory_order_release);
+}
+
+struct log_ring *log_thread_ring(void) {
+    if (log_my_ring) return log_my_ring;
+
+    // adopt the ring of a thread that exited before allocating a new one
+    struct log_ring *ring;
+    for (ring = atomic_load_explicit(&log_rings, memory_order_acquire); ring; ring = ring->next) {
+        bool owned = false;
+        if (atomic_compare_exchange_strong(&ring->owned, &owned, true)) goto found;
+    }
+
+    ring = aligned_alloc(64, sizeof(struct log_ring));
+    if (!ring) return NULL;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->owned, true);
+
+    ring->next = atomic_load_explicit(&log_rings, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&log_rings, &ring->next, ring, memory_order_release, memory_order_relaxed));
+
+found:
+    pthread_setspecific(log_ring_key, ring);
+    log_my_ring = ring;
+    return ring;
+}
+
+#define LOG_BATCH_SIZE (65536)
+
+struct log_batch {
+    int fd;
+    size_t len;
+    char buf[LOG_BATCH_SIZE];
+};
+
+void log_batch_push(struct log_batch *batch, const char *line, size_t len) {
+    if (batch->len + len > LOG_BATCH_SIZE) {
+        log_write_all(batch->fd, batch->buf, batch->len);
+        batch->len = 0;
+    }
+    memcpy(batch->buf + batch->len, line, len);
+    batch->len += len;
+}
+
+// Writes out everything queued so far, oldest record first. Returns the number of records written.
+size_t log_drain(struct log_batch *out, struct log_batch *err, struct log_timecache *tc) {
+    char line[LOG_RECORD_SIZE + TIMEBUF_SIZE + 16];
+    size_t count = 0;
+
+    while (true) {
+        struct log_ring *oldest = NULL;
+        struct log_record *oldrec = NULL;
+
+        for (struct log_ring *ring = atomic_load_explicit(&log_rings, memory_order_acquire); ring; ring = ring->next) {
+            size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            if (tail == atomic_load_explicit(&ring->head, memory_order_acquire)) continue;
+
+            struct log_record *rec = ring->records + (tail & (LOG_RING_SIZE - 1));
+            if (!oldrec || rec->ts.tv_sec < oldrec->ts.tv_sec
+                || (rec->ts.tv_sec == oldrec->ts.tv_sec && rec->ts.tv_nsec < oldrec->ts.tv_nsec)) {
+                oldest = ring;
+                oldrec = rec;
+            }
+        }
+
+        if (!oldest) break;
+
+        size_t len = log_format_line(line, sizeof(line), tc, oldrec->ts.tv_sec, oldrec->level, oldrec->text, oldrec->len);
+        log_batch_push(oldrec->level == LOG_ERROR ? err : out, line, len);
+        atomic_store_explicit(&oldest->tail, atomic_load_explicit(&oldest->tail, memory_order_relaxed) + 1, memory_order_release);
+        ++count;
+    }
+
+    unsigned long dropped = 0;
+    for (struct log_ring *ring = atomic_load_explicit(&log_rings, memory_order_acquire); ring; ring = ring->next) {
+        dropped += atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    }
+
+    if (dropped > 0) {
+        char text[64];
+        int textlen = snprintf(text, sizeof(text), "%lu log messages were dropped (logging too fast)", dropped);
+        size_t len = log_format_line(line, sizeof(line), tc, time(NULL), LOG_WARN, text, (size_t)textlen);
+        log_batch_push(out, line, len);
+    }
+
+    if (out->len) log_write_all(out->fd, out->buf, out->len);
+    if (err->len) log_write_all(err->fd, err->buf, err->len);
+    out->len = err->len = 0;
+    return count;
+}
+
+// ends the rate limiting window of every site, summing up what each one held back
+void log_sites_sweep(void) {
+    for (struct log_site *site = atomic_load_explicit(&log_sites, memory_order_acquire); site; site = site->next) {
+        unsigned long suppressed = atomic_exchange_explicit(&site->suppressed, 0, memory_order_relaxed);
+        atomic_store_explicit(&site->count, 0, memory_order_relaxed);
+        if (suppressed == 0) continue;
+
+        size_t len = strcspn(site->label, "%(:");
+        while (len > 0 && site->label[len - 1] == ' ') --len;
+        log_log(LOG_INFO, "Suppressed %lu '%.*s' messages in the last %ds", suppressed, (int)len, site->label, LOG_SITE_WINDOW);
+    }
+}
+
+bool log_admit(struct log_site *site, log_level_t level) {
+    if (level == LOG_DEBUG && !LOG_DEBUG_COMPILED) return false;
+    if (level < atomic_load_explicit(&log_level, memory_order_relaxed)) return false;
+
+    // windows are ended by the writer thread, without it nothing is limited
+    if (!atomic_load_explicit(&log_running, memory_order_relaxed)) return true;
+
+    if (!atomic_load_explicit(&site->listed, memory_order_relaxed) && !atomic_exchange(&site->listed, true)) {
+        site->next = atomic_load_explicit(&log_sites, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&log_sites, &site->next, site, memory_order_release, memory_order_relaxed));
+    }
+
+    if (atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed) < LOG_SITE_BURST) return true;
+    atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+    return false;
+}
+
+void *log_writer_main(void *arg) {
+    (void)arg;
+
+    static struct log_batch out, err;
+    struct log_timecache tc;
+    memset(&tc, 0, sizeof(tc));
+    out.fd = STDOUT_FILENO;
+    err.fd = STDERR_FILENO;
+
+    struct timespec lastsweep, now;
+    clock_gettime(CLOCK_MONOTONIC, &lastsweep);
+
+    while (atomic_load_explicit(&log_running, memory_order_acquire)) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec - lastsweep.tv_sec >= LOG_SITE_WINDOW) {
+            log_sites_sweep();
+            lastsweep = now;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100000000l; // also wake up now and then to report drops
+        if (deadline.tv_nsec >= 1000000000l) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000l;
+        }
+
+        sem_timedwait(&log_wakeup, &deadline);
+        atomic_store_explicit(&log_wake_pending, false, memory_order_release);
+        log_drain(&out, &err, &tc);
+    }
+
+    log_sites_sweep();
+    log_drain(&out, &err, &tc);
+    return NULL;
+}
+
+bool log_start(void) {
+    if (atomic_load(&log_running)) return true;
+
+    fflush(stdout); // anything printed synchronously so far goes first
+    fflush(stderr);
+
+    if (pthread_key_create(&log_ring_key, &log_ring_release) != 0) return false;
+    if (sem_init(&log_wakeup, 0, 0) < 0) {
+        pthread_key_delete(log_ring_key);
+        return false;
+    }
+
+    atomic_store(&log_running, true);
+    if (pthread_create(&log_writer, NULL, &log_writer_main, NULL) != 0) {
+        atomic_store(&log_running, false);
+        sem_destroy(&log_wakeup);
+        pthread_key_delete(log_ring_key);
+        return false;
+    }
+    return true;
+}
+
+/* Threads nobody joins (the metrics and tick threads, a task still running)
+ * may be logging while the process exits, so the rings, their key and the
+ * semaphore are left allocated: only the writer is stopped, once it has drained
+ * everything. A record that lands in a ring after that is lost. */
+void log_stop(void) {
+    if (!atomic_exchange(&log_running, false)) return;
+
+    sem_post(&log_wakeup);
+    pthread_join(log_writer, NULL);
+}
+
+void log_log_sync(log_level_t level, const char *fmt, va_list va) {
+    static struct log_timecache tc;
+    char text[LOG_RECORD_SIZE], line[LOG_RECORD_SIZE + TIMEBUF_SIZE + 16];
+
+    int textlen = vsnprintf(text, sizeof(text), fmt, va);
+    if (textlen < 0) return;
+    if ((size_t)textlen >= sizeof(text)) textlen = sizeof(text) - 1;
+
+    pthread_mutex_lock(&log_mutex);
+    size_t len = log_format_line(line, sizeof(line), &tc, time(NULL), level, text, (size_t)textlen);
+    FILE *target = level == LOG_ERROR ? stderr : stdout;
+    fwrite(line, 1, len, target);
+    pthread_mutex_unlock(&log_mutex);
+}
+
 void log_log(log_level_t level, const char *fmt, ...) {
     va_list va;
 
-    pthread_mutex_lock(&log_mutex);
-    if (level < log_level) goto log_done;
+    if (level > LOG_MAX) return; // drop logs with invalid levels
+    if (level == LOG_DEBUG && !LOG_DEBUG_COMPILED) return;
+    if (level < atomic_load_explicit(&log_level, memory_order_relaxed)) return;
 
-    FILE *target = level == LOG_ERROR ? stderr : stdout;
-    time_t ts = time(NULL);
-    struct tm info;
-    localtime_r(&ts, &info);
-    strftime(timebuf, TIMEBUF_SIZE, "%H:%M:%S", &info);
-
-    switch (level) {
-#define LL(_lev)                                                 \
-        case _lev:                                               \
-            fprintf(target, "[%s] [%s] ", timebuf, (#_lev) + 4); \
-            break;
-
-        LL(LOG_DEBUG)
-        LL(LOG_INFO)
-        LL(LOG_WARN)
-        LL(LOG_ERROR)
-
-#undef LL
-        default:
-            goto log_done; // drop logs with invalid levels
+    struct log_ring *ring = NULL;
+    if (!atomic_load_explicit(&log_running, memory_order_acquire) || !(ring = log_thread_ring())) {
+        va_start(va, fmt);
+        log_log_sync(level, fmt, va);
+        va_end(va);
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t used = head - atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (used >= LOG_RING_SIZE || (used >= LOG_RING_LOWPRIO_MAX && level < LOG_WARN)) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
     }
 
+    struct log_record *rec = ring->records + (head & (LOG_RING_SIZE - 1));
+    clock_gettime(CLOCK_REALTIME, &rec->ts);
+    rec->level = (uint8_t)level;
+
     va_start(va, fmt);
-    vfprintf(target, fmt, va);
+    int len = vsnprintf(rec->text, sizeof(rec->text), fmt, va);
     va_end(va);
-    fputc('\n', target);
+    if (len < 0) len = 0;
+    rec->len = (uint16_t)((size_t)len < sizeof(rec->text) ? (size_t)len : sizeof(rec->text) - 1);
 
-log_done:
-    pthread_mutex_unlock(&log_mutex);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    // one wakeup per batch, not one per record
+    if (!atomic_exchange_explicit(&log_wake_pending, true, memory_order_acq_rel)) sem_post(&log_wakeup);
 }
 
 log_level_t log_getlevel() {
-    pthread_mutex_lock(&log_mutex);
-    log_level_t level = log_level;
-    pthread_mutex_unlock(&log_mutex);
-    return level;
+    return atomic_load_explicit(&log_level, memory_order_relaxed);
 }
 
 log_level_t log_setlevel(log_level_t level) {
     if (level > LOG_MAX) return log_getlevel();
-
-    pthread_mutex_lock(&log_mutex);
-    log_level_t old = log_level;
-    log_level = level;
-    pthread_mutex_unlock(&log_mutex);
-    return old;
+    return atomic_exchange_explicit(&log_level, level, memory_order_relaxed);
 }
@@ -7,13 +7,22 @@
 #include "build_config.h"
 #include "event.h"
 #include "server.h"
-#include "list.h"
+#include "registry.h"
+#include "preconn.h"
 #include "client.h"
 #include "macros.h"
 #include "sched.h"
 #include "protocol.h"
+#include "pktcache.h"
+#include "regdata.h"
+#include "handoff.h"
+#include "epoch.h"
+#include "cpu.h"
+#include "metrics.h"
+#include "capture.h"
 
 #include <stdio.h>
+#include <limits.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
@@ -27,10 +36,10 @@
     - Protocol compression
     - Handle bungeecord ip forwarding
     - Stop naively handling minecraft's encoding (iconv does not have java's fancy utf-8 thing)
-    - Make all handler threads listen on a pipe so they can be woken up
 */
 
 volatile bool shutdown_server = false;
+volatile bool restart_server = false;
 
 void con_read_handler(file_descriptor_t *fd, void *d) {
     char buf[4096];
@@ -52,8 +61,18 @@ void con_read_handler(file_descriptor_t *fd, void *d) {
                 shutdown_server = true;
                 event_loop_delfd(fd);
                 close(fd->fd);
-                log_info("Shutdown flag set. The program should be ending in <5 seconds.");
+                event_loop_wake_all();
+                log_info("Shutdown flag set. The program should be ending in <1 second.");
                 break;
+            } else if (!strncmp(buf, "restart", 7)) {
+                // the console stays in the loop, in case the new process can't take over
+                restart_server = true;
+                shutdown_server = true;
+                event_loop_wake_all();
+                log_info("Restart flag set. Connections will be handed to a new process in <1 second.");
+                break;
+            } else if (!strncmp(buf, "packets", 7)) {
+                metrics_packet_dump();
             }
         }
     }
@@ -63,10 +82,38 @@ void con_error_handler(file_descriptor_t *fd, int error, void *d) {
     log_warn("Error: %d", error);
 }
 
+// IO threads, each running its own event loop (0 for one per CPU this process may run on)
+#define CONFIG_IO_THREADS (0)
+
+/* Pin every IO thread to a CPU of its own, taking one hardware thread of each
+ * physical core before doubling up on SMT siblings. The tick and log threads
+ * then stay on whatever CPUs are left over, if any are. */
+#define CONFIG_PIN_IO_THREADS (false)
+
+client_registry_t *clients = NULL;
+
+unsigned io_threads = 0;
+int *io_cpus = NULL; // CPU of each IO thread, NULL unless pinned
+
+// CPUs left for the tick and log threads
+int *housekeeping_cpus = NULL;
+unsigned housekeeping_ncpus = 0;
+
 void *io_worker(void *arg) {
+    unsigned idx = (unsigned)(unsigned long long)arg;
+    event_loop_bind_thread(idx);
+    if (!epoch_thread_register()) abort();
+
+    if (io_cpus && !cpu_pin(0, io_cpus + idx, 1)) {
+        log_warn("Unable to pin IO thread %u to CPU %d: %s", idx, io_cpus[idx], strerror(errno));
+    }
+    log_debug("IO thread %u running on CPU %d", idx, cpu_current());
+
     while (!shutdown_server) {
         event_loop_handle(5000);
     }
+    epoch_thread_unregister();
+    metrics_thread_release();
     log_debug("handle complete on thread %d", (int)(unsigned long long)arg);
     return NULL;
 }
@@ -80,8 +127,125 @@ void *io_worker(void *arg) {
 // Player keep-alive frequency (should be < 20)
 #define CONFIG_PING_FREQ     (5)
 
+// World shown to players (Sponge schematic or anvil region file), an empty world is used if it does not exist
+#define CONFIG_WORLD_PATH    "world.schem"
+
+// Pre-encoded packets, rebuilt whenever the world or the protocol tables change
+#define CONFIG_PKTCACHE_PATH "limbo.pktcache"
+
+// Per address (IPv4) or /64 (IPv6): connections per second, back to back connections allowed, and open connections
+#define CONFIG_ADMISSION_RATE     (2)
+#define CONFIG_ADMISSION_BURST    (10)
+#define CONFIG_ADMISSION_MAXCONNS (8)
+
+// Addresses tracked at once (fixed memory) and seconds between reports of the worst offenders
+#define CONFIG_ADMISSION_ENTRIES  (16384)
+#define CONFIG_ADMISSION_REPORT   (30)
+
+// Also limit 127.0.0.0/8 and ::1 (off, a local proxy connects from there for every player)
+#define CONFIG_ADMISSION_LOOPBACK (false)
+
+admission_t *admission = NULL;
+
+// Listening sockets (0 for one per IO thread, which spreads the accept load) and the accept backlog of each
+#define CONFIG_LISTENERS      (0)
+#define CONFIG_LISTEN_BACKLOG (1024)
+
+// Hand each connection to the listener of the CPU that received it (needs CONFIG_LISTENERS > 1)
+#define CONFIG_LISTEN_STEER   (true)
+
+// Unix socket a proxy on this host passes player connections over (see handoff.h), NULL to disable
+#define CONFIG_PROXY_HANDOFF_PATH "limbo-handoff.sock"
+
+// Where Prometheus scrapes /metrics from (keep it local, there is no authentication), NULL to disable
+#define CONFIG_METRICS_HOST "127.0.0.1"
+#define CONFIG_METRICS_PORT (9225)
+
+// Records what every new connection sends to this file, for limbo_replay (see capture.h), NULL to disable
+#define CONFIG_CAPTURE_PATH NULL
+
+// The metrics listener, which is not handed over on restart: the new process opens its own.
+server_t *metrics_listen(void) {
+    const char *host = CONFIG_METRICS_HOST;
+    server_t *metricsserv = NULL;
+    if (!host) return NULL;
+
+    if (!server_init(host, CONFIG_METRICS_PORT, SERVER_METRICS, 1, 16, &metricsserv)) {
+        log_warn("Unable to serve metrics on %s port %d.", host, CONFIG_METRICS_PORT);
+        return NULL;
+    }
+    server_start(metricsserv);
+    return metricsserv;
+}
+
+void metrics_unlisten(server_t *metricsserv) {
+    if (!metricsserv) return;
+    server_stop(metricsserv);
+    server_free(metricsserv);
+}
+
+/* The tick thread never touches a client itself. Every tick it posts one of
+ * these to each IO thread, which then times out and pings the clients it owns. */
+struct io_tick {
+    struct event_msg msg;
+    atomic_bool queued; // an IO thread that falls behind is not sent another one
+    unsigned idx;
+    struct registry_snapshot snap;
+};
+
+struct io_tick *io_ticks = NULL;
+
+void io_tick_run(struct event_msg *msg) {
+    struct io_tick *tick = (struct io_tick *)msg;
+    client_t *curcli;
+    struct timespec now, diff;
+
+    if (sched_timer_wgettime(CLOCK_MONOTONIC, &now) < 0) {
+        log_error("io_tick_run: sched_timer_wgettime(&now) failed (funny stuff is about to occur): %s", strerror(errno));
+#ifdef BUILD_DEBUG
+        abort();
+#endif
+    }
+
+    // pinned, so a client disconnected halfway through stays readable until the sweep is over
+    registry_snapshot_shard(clients, tick->idx, &tick->snap);
+    for (size_t i = 0; i < tick->snap.len; ++i) {
+        curcli = tick->snap.clients[i];
+        if (curcli->fd->fd == -1) continue; // disconnected earlier in this sweep
+
+        sched_timespec_sub(&now, &curcli->lastping, &diff);
+        if (curcli->protocol < PROTOCOL_PLAY && diff.tv_sec >= CONFIG_NPLAY_TIMEOUT) {
+            client_dc_reason(curcli, METRICS_DC_TIMEOUT);
+            client_disconnect(curcli, "Ping timeout: %ld seconds", diff.tv_sec);
+            client_free(curcli);
+        } else if (curcli->protocol == PROTOCOL_PLAY) {
+            if (curcli->pingrespond && diff.tv_sec >= CONFIG_PING_FREQ) {
+                int64_t mil = sched_rt_millis();
+                if (mil < 0) log_warn("io_tick_run: sched_rt_millis failed: %s", strerror(-mil));
+                struct packet_play_keep_alive pkt = {
+                    .id = PKTID_WRITE_PLAY_KEEP_ALIVE,
+                    .payload = (int32_t)mil
+                };
+                client_write_pkt(curcli, &pkt);
+                if (curcli->fd->state & FD_CALL_COMPLETE) client_free(curcli); // the write failed
+            } else if (!curcli->pingrespond && diff.tv_sec >= CONFIG_PLAY_TIMEOUT) {
+                client_dc_reason(curcli, METRICS_DC_TIMEOUT);
+                client_disconnect(curcli, "Ping timeout: %ld seconds", diff.tv_sec);
+                client_free(curcli);
+            }
+        }
+    }
+    registry_snapshot_release(&tick->snap);
+
+    atomic_store_explicit(&tick->queued, false, memory_order_release);
+}
+
 void *tick_worker(void *cl) {
-    dllist_t *clients = cl;
+    client_registry_t *registry = cl;
+
+    if (housekeeping_ncpus > 0 && !cpu_pin(0, housekeeping_cpus, housekeeping_ncpus)) {
+        log_warn("Unable to keep the tick thread off the IO threads' CPUs: %s", strerror(errno));
+    }
 
     timer_state_t ts;
     if (sched_timer_init(&ts, 0, 500000000l) < 0) {
@@ -90,53 +254,17 @@ void *tick_worker(void *cl) {
         abort();
     }
 
-    client_t *curcli;
-    struct timespec now, diff;
     while (!shutdown_server) {
-        if (sched_timer_wgettime(CLOCK_MONOTONIC, &now) < 0) {
-            log_error("tick_worker: sched_timer_wgettime(&now) failed (funny stuff is about to occur): %s", strerror(errno));
-#ifdef BUILD_DEBUG
-            abort();
-#endif
+        for (unsigned i = 0; i < io_threads; ++i) {
+            struct io_tick *tick = io_ticks + i;
+            if (atomic_exchange_explicit(&tick->queued, true, memory_order_acq_rel)) continue;
+            event_loop_post(i, &tick->msg);
         }
 
-// helper macro to disconnect a client without breaking stuff
-#define CLIENT_DISCONNECT(_cli, _fmt, ...)         \
-client_disconnect((_cli), (_fmt), ## __VA_ARGS__); \
-                                                   \
-pthread_mutex_unlock(&(_cli)->evtmutex);           \
-pthread_mutex_lock(&(_cli)->evtmutex);             \
-pthread_mutex_unlock(&(_cli)->evtmutex);           \
-                                                   \
-client_free((_cli));
-
-        DLLIST_FOREACH(clients, cur) {
-            curcli = cur->ptr;
-            pthread_mutex_lock(&curcli->evtmutex);
-
-            sched_timespec_sub(&now, &curcli->lastping, &diff);
-            if (curcli->protocol < PROTOCOL_PLAY && diff.tv_sec >= CONFIG_NPLAY_TIMEOUT) {
-                CLIENT_DISCONNECT(curcli, "Ping timeout: %ld seconds", diff.tv_sec);
-                continue;
-            } else if (curcli->protocol == PROTOCOL_PLAY) {
-                if (curcli->pingrespond && diff.tv_sec >= CONFIG_PING_FREQ) {
-                    int64_t mil = sched_rt_millis();
-                    if (mil < 0) log_warn("tick_worker: sched_rt_millis failed: %s", strerror(-mil));
-                    struct packet_play_keep_alive pkt = {
-                        .id = PKTID_WRITE_PLAY_KEEP_ALIVE,
-                        .payload = (int32_t)mil
-                    };
-                    client_write_pkt(curcli, &pkt);
-                } else if (!curcli->pingrespond && diff.tv_sec >= CONFIG_PLAY_TIMEOUT) {
-                    CLIENT_DISCONNECT(curcli, "Ping timeout: %ld seconds", diff.tv_sec);
-                    continue;
-                }
-            }
-
-            pthread_mutex_unlock(&curcli->evtmutex);
-        } DLLIST_FOREACH_DONE(clients);
+        // connections that never got past the handshake have no client_t to time out
+        preconn_sweep(registry, CONFIG_NPLAY_TIMEOUT);
 
-#undef CLIENT_DISCONNECT
+        if (admission) admission_report(admission, CONFIG_ADMISSION_REPORT);
 
         if (sched_timer_wait(&ts) < 0) {
             log_error("tick_worker: sched_timer_wait failed: %s", strerror(errno));
@@ -146,33 +274,173 @@ client_free((_cli));
         }
     }
 
+    epoch_thread_unregister(); // its snapshots registered it, a tick thread started after a failed restart needs the slot
     log_debug("tick_worker complete");
     return NULL;
 }
 
+/* Gives IO thread i the i-th CPU of the placement order, and leaves the tick
+ * and log threads the CPUs on cores that run no IO thread, or failing that
+ * the unused siblings of ones that do. */
+void io_place(const struct cpu_topology *topo) {
+    io_cpus = malloc(io_threads * sizeof(int));
+    housekeeping_cpus = malloc(topo->ncpus * sizeof(int));
+    bool *busy = calloc(topo->ncores, sizeof(bool));
+    if (!io_cpus || !housekeeping_cpus || !busy) {
+        log_warn("Unable to allocate the CPU placement, the IO threads are not pinned.");
+        free(io_cpus);
+        free(housekeeping_cpus);
+        free(busy);
+        io_cpus = housekeeping_cpus = NULL;
+        return;
+    }
+
+    for (unsigned i = 0; i < io_threads; ++i) {
+        io_cpus[i] = topo->cpus[i % topo->ncpus];
+        busy[topo->core[i % topo->ncpus]] = true;
+    }
+
+    for (unsigned i = io_threads; i < topo->ncpus; ++i) {
+        if (!busy[topo->core[i]]) housekeeping_cpus[housekeeping_ncpus++] = topo->cpus[i];
+    }
+    if (housekeeping_ncpus == 0) {
+        for (unsigned i = io_threads; i < topo->ncpus; ++i) {
+            housekeeping_cpus[housekeeping_ncpus++] = topo->cpus[i];
+        }
+    }
+    free(busy);
+}
+
 // TODO: Handle (ignore) SIGPIPE and handle SIGINT
 int main(void) {
     setlocale(LC_ALL, "");
 
     log_setlevel(LOG_DEBUG);
+
+    struct cpu_topology topo;
+    if (!cpu_topology_detect(&topo)) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        topo.ncpus = ncpu > 0 ? (unsigned)ncpu : 1;
+        topo.ncores = topo.ncpus;
+    }
+
+    io_threads = CONFIG_IO_THREADS > 0 ? CONFIG_IO_THREADS : topo.ncpus;
+    if (CONFIG_PIN_IO_THREADS && topo.cpus) io_place(&topo);
+
+    // the log writer is started with the main thread's affinity, which is put back right after
+    bool pinned_main = housekeeping_ncpus > 0 && cpu_pin(0, housekeeping_cpus, housekeeping_ncpus);
+    if (log_start()) atexit(&log_stop);
+    else fprintf(stderr, "Unable to start the log writer, logging synchronously.\n");
+    if (pinned_main) cpu_pin(0, topo.cpus, topo.ncpus);
     log_info("Running " PROJECT_NAME " version " VERSION_NAME);
 
-    dllist_t *clients = dll_create_sync();
+    log_info("%u IO threads, %u CPUs on %u cores available.", io_threads, topo.ncpus, topo.ncores);
+    if (io_cpus) {
+        char cpulist[256];
+        cpu_format_list(cpulist, sizeof(cpulist), io_cpus, io_threads);
+        log_info("IO threads pinned to CPUs %s (in thread order).", cpulist);
+        if (housekeeping_ncpus > 0) {
+            cpu_format_list(cpulist, sizeof(cpulist), housekeeping_cpus, housekeeping_ncpus);
+            log_info("Tick and log threads kept on CPUs %s.", cpulist);
+        } else {
+            log_warn("Every CPU runs an IO thread, the tick and log threads share them.");
+        }
+    }
 
-    event_loop_init();
-    server_t *serv = NULL;
-    if (!server_init("::", 25566, 0, &serv)) {
-        log_error("Failed to bind serv.");
+    pktcache_default = pktcache_open(CONFIG_PKTCACHE_PATH, CONFIG_WORLD_PATH);
+    if (!pktcache_default) {
+        log_error("Unable to prepare packets.");
         return 1;
     }
 
+    // the path, not /proc/self/exe, so a restart runs whatever binary has been put there since
+    char exepath[PATH_MAX];
+    ssize_t exelen = readlink("/proc/self/exe", exepath, sizeof(exepath) - 1);
+    if (exelen < 0) {
+        log_warn("Unable to find the executable (%s), hot restart is unavailable.", strerror(errno));
+        exelen = 0;
+    }
+    exepath[exelen] = '\0';
+
+    // the IO threads, the tick thread and this one read the registry
+    if (!epoch_init(io_threads + 2)) return 1;
+    epoch_thread_register();
+    clients = registry_create(io_threads);
+    io_ticks = calloc(io_threads, sizeof(struct io_tick));
+    if (!clients || !io_ticks) {
+        log_error("Unable to allocate the client registry.");
+        return 1;
+    }
+    for (unsigned i = 0; i < io_threads; ++i) {
+        io_ticks[i].msg.run = &io_tick_run;
+        atomic_init(&io_ticks[i].queued, false);
+        io_ticks[i].idx = i;
+    }
+
+    if (!event_loop_init(io_threads)) {
+        log_error("Unable to set up the event loops.");
+        return 1;
+    }
+
+    const char *capturepath = CONFIG_CAPTURE_PATH;
+    if (capturepath) {
+        capture_default = capture_open(capturepath);
+        if (capture_default) log_info("Recording what players send to %s.", capturepath);
+        else log_warn("Unable to open the capture file %s, nothing will be recorded.", capturepath);
+    }
+
+    server_t *serv = NULL, *proxyserv = NULL;
+    const char *handoff = getenv(HANDOFF_ENV);
+    if (handoff) {
+        int handofffd = atoi(handoff);
+        unsetenv(HANDOFF_ENV);
+        if (!handoff_receive(handofffd, clients, &serv, &proxyserv)) {
+            log_error("Unable to take over from the old process.");
+            return 1;
+        }
+    } else {
+        unsigned listenflags = CONFIG_LISTEN_STEER ? SERVER_STEER_CPU : 0;
+        unsigned nlisteners = CONFIG_LISTENERS > 0 ? CONFIG_LISTENERS : io_threads;
+        if (!server_init("::", 25566, listenflags, nlisteners, CONFIG_LISTEN_BACKLOG, &serv)) {
+            log_error("Failed to bind serv.");
+            return 1;
+        }
+
+        const char *proxypath = CONFIG_PROXY_HANDOFF_PATH;
+        if (proxypath && !server_init_unix(proxypath, SERVER_PROXY_HANDOFF, CONFIG_LISTEN_BACKLOG, &proxyserv)) {
+            log_warn("Unable to open the proxy handoff socket %s, proxies will have to connect like players.", proxypath);
+        }
+    }
+
     serv->clients = clients;
 
-    event_loop_want(serv->fd, FD_WANT_READ);
+    // listener i feeds loop i % io_threads, so its connections should come from that loop's CPU
+    if (CONFIG_LISTEN_STEER && io_cpus && serv->nfds > 1) {
+        int *listencpus = malloc(serv->nfds * sizeof(int));
+        if (listencpus) {
+            for (unsigned i = 0; i < serv->nfds; ++i) listencpus[i] = io_cpus[i % io_threads];
+            if (!server_steer_to_cpus(serv, listencpus)) {
+                log_warn("Unable to steer connections to the IO threads' CPUs: %s", strerror(errno));
+            }
+            free(listencpus);
+        }
+    }
+
+    admission = admission_create(CONFIG_ADMISSION_ENTRIES, CONFIG_ADMISSION_RATE, CONFIG_ADMISSION_BURST, CONFIG_ADMISSION_MAXCONNS);
+    if (!admission) log_warn("Unable to allocate the admission table, connections will not be rate limited.");
+    else admission->limit_loopback = CONFIG_ADMISSION_LOOPBACK;
+    serv->admission = admission;
+
+    server_start(serv);
+    if (proxyserv) {
+        proxyserv->clients = clients;
+        server_start(proxyserv);
+    }
+    server_t *metricsserv = metrics_listen();
 
     file_descriptor_t fd;
     memset(&fd, 0, sizeof(fd));
-    int newfd = dup(STDIN_FILENO);
+    int newfd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
     fd.fd = newfd;
     fd.read_handler = &con_read_handler;
     fd.error_handler = &con_error_handler;
@@ -181,29 +449,86 @@ int main(void) {
     }
     event_loop_want(&fd, FD_WANT_READ);
 
-#define THREAD_CNT (10)
-    pthread_t pt[THREAD_CNT + 1];
-    for (int i = 0; i < THREAD_CNT; ++i) {
-        pthread_create(pt + i, NULL, &io_worker, (void *)(unsigned long long)i);
+    pthread_t *pt = malloc((io_threads + 1) * sizeof(pthread_t));
+    if (!pt) {
+        log_error("Unable to allocate the IO threads.");
+        return 1;
     }
-    pthread_create(pt + THREAD_CNT, NULL, &tick_worker, clients);
+    bool handed_off = false;
+    while (true) {
+        for (unsigned i = 0; i < io_threads; ++i) {
+            pthread_create(pt + i, NULL, &io_worker, (void *)(unsigned long long)i);
+        }
+        pthread_create(pt + io_threads, NULL, &tick_worker, clients);
 
-    for (int i = 0; i < THREAD_CNT+1; ++i) {
-        pthread_join(pt[i], NULL);
+        for (unsigned i = 0; i < io_threads + 1; ++i) {
+            pthread_join(pt[i], NULL);
+        }
+        //(void)io_worker(NULL);
+
+        // with every loop stopped, whatever was posted last can run here
+        event_loop_drain();
+
+        if (!restart_server) break;
+        restart_server = false;
+
+        // nothing runs now, so every connection can be handed over as it is
+        metrics_unlisten(metricsserv);
+        metricsserv = NULL;
+        capture_flush(capture_default); // the new process goes on in a session of its own
+        if (exelen > 0 && handoff_restart(exepath, serv, proxyserv, clients)) {
+            handed_off = true;
+            break;
+        }
+        metricsserv = metrics_listen();
+
+        log_error("Hot restart failed, carrying on.");
+        shutdown_server = false;
     }
-    //(void)io_worker(NULL);
 
-    event_loop_delfd(serv->fd);
-    server_free(serv);
+    free(pt);
 
-    DLLIST_FOREACH(clients, cur) {
-        client_t *cli = cur->ptr;
-        client_disconnect(cli, "Shutting down");
-        client_free(cli);
-    } DLLIST_FOREACH_DONE(clients);
-    dll_free(clients);
+    server_stop(serv);
+    server_free(serv);
+    if (proxyserv) {
+        server_stop(proxyserv);
+        server_free(proxyserv);
+    }
+    handoff_proxy_close_all();
+    metrics_unlisten(metricsserv);
+    metrics_http_close_all();
+
+    struct registry_snapshot snap;
+    memset(&snap, 0, sizeof(snap));
+    registry_snapshot(clients, &snap);
+    for (size_t i = 0; i < snap.len; ++i) {
+        if (!handed_off) {
+            client_dc_reason(snap.clients[i], METRICS_DC_SHUTDOWN);
+            client_disconnect(snap.clients[i], "Shutting down");
+        } else if (snap.clients[i]->fd->fd != -1) { // the new process could not take this one over
+            client_kick_w(snap.clients[i], L"The server restarted and lost your connection, please reconnect");
+        }
+        client_free(snap.clients[i]);
+    }
+    registry_snapshot_free(&snap);
+    for (unsigned i = 0; i < io_threads; ++i) registry_snapshot_free(&io_ticks[i].snap);
+    free(io_ticks);
+    preconn_close_all(clients);
+    capture_close(capture_default); // every connection has had its close recorded by now
+    capture_default = NULL;
+    registry_free(clients);
+    epoch_drain(); // the IO threads are gone, no reader is left
+    epoch_thread_unregister();
+    epoch_free();
+    admission_free(admission);
 
     event_loop_close();
+    pktcache_close(pktcache_default);
+    regdata_cleanup();
+
+    free(io_cpus);
+    free(housekeeping_cpus);
+    cpu_topology_free(&topo);
 
     return 0;
 }
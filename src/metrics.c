@@ -0,0 +1,472 @@
+#include "metrics.h"
+#include "event.h"
+#include "list.h"
+#include "log.h"
+#include "macros.h"
+#include "protocol.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+// threads with a shard of their own, any beyond that share the overflow shard
+#define METRICS_MAX_THREADS (128)
+
+#define METRICS_PKT_SLOTS (PROTOCOL_COUNT * METRICS_PKT_IDS * 2)
+
+struct metrics_shard {
+    _Atomic int64_t val[METRIC_COUNT];
+    struct metrics_packet_stat *_Atomic *_Atomic packets; // METRICS_PKT_SLOTS of them, each allocated when first seen
+    atomic_bool used;
+} __attribute__((aligned(64)));
+
+struct metrics_shard metrics_shards[METRICS_MAX_THREADS];
+struct metrics_shard metrics_overflow; // written with atomic adds, unlike the others
+
+_Thread_local struct metrics_shard *metrics_self = NULL;
+
+const char *const metrics_phase_names[] = { "handshake", "status", "login", "play" };
+
+const char *const metrics_dc_names[] = {
+    "other", "closed", "timeout", "kicked", "protocol", "io", "sendq", "rejected", "shutdown"
+};
+
+// upper bounds of the keep-alive round trip buckets (ms), the last one is +Inf
+const int64_t metrics_rtt_bounds[] = { 5, 10, 25, 50, 100, 250, 500, 1000, 2500 };
+#define METRICS_RTT_NBUCKETS (sizeof(metrics_rtt_bounds) / sizeof(metrics_rtt_bounds[0]) + 1)
+
+struct metrics_shard *metrics_claim(void) {
+    for (unsigned i = 0; i < METRICS_MAX_THREADS; ++i) {
+        bool expect = false;
+        if (atomic_compare_exchange_strong(&metrics_shards[i].used, &expect, true)) {
+            return metrics_self = metrics_shards + i;
+        }
+    }
+
+    return metrics_self = &metrics_overflow;
+}
+
+void metrics_add(unsigned counter, int64_t n) {
+    struct metrics_shard *shard = metrics_self ? metrics_self : metrics_claim();
+    _Atomic int64_t *val = shard->val + counter;
+
+    if (shard == &metrics_overflow) atomic_fetch_add_explicit(val, n, memory_order_relaxed);
+    else atomic_store_explicit(val, atomic_load_explicit(val, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void metrics_phase(int from, int to) {
+    if (from == to) return;
+    if (from != METRICS_PHASE_NONE) metrics_add(METRIC_CONNECTIONS + (unsigned)from, -1);
+    if (to != METRICS_PHASE_NONE) metrics_add(METRIC_CONNECTIONS + (unsigned)to, 1);
+}
+
+void metrics_disconnect(unsigned reason) {
+    metrics_add(METRIC_DISCONNECTS + reason, 1);
+}
+
+void metrics_rtt(int64_t ms) {
+    unsigned bucket = 0;
+    while (bucket < METRICS_RTT_NBUCKETS - 1 && ms > metrics_rtt_bounds[bucket]) ++bucket;
+
+    metrics_add(METRIC_RTT_BUCKETS + bucket, 1);
+    metrics_add(METRIC_RTT_SUM, ms);
+}
+
+// Only the owner writes, a plain add is enough.
+void metrics_bump(_Atomic uint64_t *val, uint64_t n) {
+    atomic_store_explicit(val, atomic_load_explicit(val, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+unsigned metrics_hist_bucket(uint64_t ns) {
+    if (ns < 4) return (unsigned)ns;
+
+    unsigned e = 63u - (unsigned)__builtin_clzll(ns); // floor(log2(ns)), and the next two bits pick the quarter
+    unsigned bucket = (e - 1) * 4 + (unsigned)((ns >> (e - 2)) & 3);
+    return bucket < METRICS_HIST_BUCKETS ? bucket : METRICS_HIST_BUCKETS - 1;
+}
+
+uint64_t metrics_hist_lower(unsigned bucket) {
+    if (bucket < 4) return bucket;
+    return (uint64_t)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+// The calling thread's record for a packet type, NULL for threads that share the overflow shard.
+struct metrics_packet_stat *metrics_packet_slot(unsigned phase, int32_t id, unsigned dir) {
+    struct metrics_shard *shard = metrics_self ? metrics_self : metrics_claim();
+    if (shard == &metrics_overflow || phase >= PROTOCOL_COUNT) return NULL;
+
+    if (id < 0 || id >= METRICS_PKT_IDS) id = METRICS_PKT_IDS - 1;
+    unsigned slot = (phase * METRICS_PKT_IDS + (unsigned)id) * 2 + dir;
+
+    struct metrics_packet_stat *_Atomic *table = atomic_load_explicit(&shard->packets, memory_order_relaxed);
+    if (!table) {
+        table = calloc(METRICS_PKT_SLOTS, sizeof(*table));
+        if (!table) return NULL;
+        atomic_store_explicit(&shard->packets, table, memory_order_release);
+    }
+
+    struct metrics_packet_stat *stat = atomic_load_explicit(table + slot, memory_order_relaxed);
+    if (!stat) {
+        stat = calloc(1, sizeof(struct metrics_packet_stat));
+        if (!stat) return NULL;
+        atomic_store_explicit(table + slot, stat, memory_order_release);
+    }
+    return stat;
+}
+
+void metrics_packet(unsigned phase, int32_t id, unsigned dir, size_t bytes) {
+    struct metrics_packet_stat *stat = metrics_packet_slot(phase, id, dir);
+    if (!stat) return;
+
+    metrics_bump(&stat->count, 1);
+    metrics_bump(&stat->bytes, bytes);
+}
+
+void metrics_packet_time(unsigned phase, int32_t id, unsigned dir, uint64_t start_ns) {
+    uint64_t now = metrics_now_ns();
+    struct metrics_packet_stat *stat = metrics_packet_slot(phase, id, dir);
+    if (!stat) return;
+
+    metrics_bump(&stat->timed, 1);
+    metrics_bump(stat->hist + metrics_hist_bucket(now > start_ns ? now - start_ns : 0), 1);
+}
+
+bool metrics_packet_merge(unsigned phase, int32_t id, unsigned dir, struct metrics_packet_stat *out) {
+    memset(out, 0, sizeof(*out));
+    if (phase >= PROTOCOL_COUNT) return false;
+    if (id < 0 || id >= METRICS_PKT_IDS) id = METRICS_PKT_IDS - 1;
+    unsigned slot = (phase * METRICS_PKT_IDS + (unsigned)id) * 2 + dir;
+
+    bool found = false;
+    for (unsigned i = 0; i < METRICS_MAX_THREADS; ++i) {
+        struct metrics_packet_stat *_Atomic *table = atomic_load_explicit(&metrics_shards[i].packets, memory_order_acquire);
+        if (!table) continue;
+        struct metrics_packet_stat *stat = atomic_load_explicit(table + slot, memory_order_acquire);
+        if (!stat) continue;
+
+        found = true;
+        metrics_bump(&out->count, atomic_load_explicit(&stat->count, memory_order_relaxed));
+        metrics_bump(&out->bytes, atomic_load_explicit(&stat->bytes, memory_order_relaxed));
+        metrics_bump(&out->timed, atomic_load_explicit(&stat->timed, memory_order_relaxed));
+        for (unsigned b = 0; b < METRICS_HIST_BUCKETS; ++b) {
+            metrics_bump(out->hist + b, atomic_load_explicit(stat->hist + b, memory_order_relaxed));
+        }
+    }
+    return found;
+}
+
+uint64_t metrics_hist_quantile(const struct metrics_packet_stat *stat, double q) {
+    uint64_t timed = atomic_load_explicit(&stat->timed, memory_order_relaxed);
+    if (timed == 0) return 0;
+
+    uint64_t rank = (uint64_t)(q * (double)timed + 0.5), seen = 0;
+    if (rank < 1) rank = 1;
+    if (rank > timed) rank = timed;
+
+    for (unsigned b = 0; b < METRICS_HIST_BUCKETS - 1; ++b) {
+        seen += atomic_load_explicit(stat->hist + b, memory_order_relaxed);
+        if (seen >= rank) return metrics_hist_lower(b + 1); // the bucket's upper end
+    }
+    return metrics_hist_lower(METRICS_HIST_BUCKETS - 1);
+}
+
+void metrics_format_ns(char *buf, size_t len, uint64_t ns) {
+    if (ns < 1000) snprintf(buf, len, "%lluns", (unsigned long long)ns);
+    else if (ns < 1000000) snprintf(buf, len, "%.1fus", (double)ns / 1e3);
+    else if (ns < 1000000000) snprintf(buf, len, "%.1fms", (double)ns / 1e6);
+    else snprintf(buf, len, "%.2fs", (double)ns / 1e9);
+}
+
+void metrics_packet_dump(void) {
+    static const char *const dirnames[] = { "in", "out" };
+    struct metrics_packet_stat stat;
+    unsigned lines = 0;
+
+    log_info("Packets by phase, direction and id (times are what handling one took):");
+    for (unsigned phase = 0; phase < PROTOCOL_COUNT; ++phase) {
+        for (unsigned dir = 0; dir < 2; ++dir) {
+            for (int32_t id = 0; id < METRICS_PKT_IDS; ++id) {
+                if (!metrics_packet_merge(phase, id, dir, &stat)) continue;
+
+                char times[64] = "untimed";
+                if (atomic_load(&stat.timed) > 0) {
+                    char p50[16], p99[16], p999[16];
+                    metrics_format_ns(p50, sizeof(p50), metrics_hist_quantile(&stat, 0.5));
+                    metrics_format_ns(p99, sizeof(p99), metrics_hist_quantile(&stat, 0.99));
+                    metrics_format_ns(p999, sizeof(p999), metrics_hist_quantile(&stat, 0.999));
+                    snprintf(times, sizeof(times), "p50 %s, p99 %s, p99.9 %s", p50, p99, p999);
+                }
+
+                log_info("  %-9s %-3s 0x%02x%s: %llu packets, %llu bytes, %s",
+                         protocol_names[phase], dirnames[dir], (unsigned)id, id == METRICS_PKT_IDS - 1 ? "+" : "",
+                         (unsigned long long)atomic_load(&stat.count), (unsigned long long)atomic_load(&stat.bytes), times);
+                ++lines;
+            }
+        }
+    }
+    if (lines == 0) log_info("  (none yet)");
+}
+
+void metrics_thread_release(void) {
+    if (!metrics_self) return;
+    if (metrics_self != &metrics_overflow) atomic_store(&metrics_self->used, false);
+    metrics_self = NULL;
+}
+
+// Adds up every shard, released ones included: what they counted still happened.
+void metrics_sum(int64_t *totals) {
+    memset(totals, 0, METRIC_COUNT * sizeof(int64_t));
+    for (unsigned i = 0; i < METRICS_MAX_THREADS; ++i) {
+        for (unsigned c = 0; c < METRIC_COUNT; ++c) {
+            totals[c] += atomic_load_explicit(&metrics_shards[i].val[c], memory_order_relaxed);
+        }
+    }
+    for (unsigned c = 0; c < METRIC_COUNT; ++c) {
+        totals[c] += atomic_load_explicit(&metrics_overflow.val[c], memory_order_relaxed);
+    }
+}
+
+int metrics_printf(struct auto_buffer *out, const char *fmt, ...) {
+    char line[256];
+    va_list va;
+
+    va_start(va, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, va);
+    va_end(va);
+
+    if (len < 0) return len;
+    if ((size_t)len >= sizeof(line)) len = sizeof(line) - 1;
+    return ab_push(out, line, (size_t)len);
+}
+
+#define METRICS_HEADER(_out, _name, _type, _help) \
+    metrics_printf((_out), "# HELP " _name " " _help "\n# TYPE " _name " " _type "\n")
+
+int metrics_format(struct auto_buffer *out) {
+    int64_t t[METRIC_COUNT];
+    metrics_sum(t);
+    int res = 0;
+
+    res |= METRICS_HEADER(out, "limbo_connections", "gauge", "Open connections by protocol phase.");
+    for (unsigned i = 0; i < 4; ++i) {
+        res |= metrics_printf(out, "limbo_connections{phase=\"%s\"} %lld\n", metrics_phase_names[i], (long long)t[METRIC_CONNECTIONS + i]);
+    }
+
+    res |= METRICS_HEADER(out, "limbo_accepts_total", "counter", "Connections accepted from players.");
+    res |= metrics_printf(out, "limbo_accepts_total %lld\n", (long long)t[METRIC_ACCEPTS]);
+    res |= METRICS_HEADER(out, "limbo_admission_rejects_total", "counter", "Connections turned away by the admission limits.");
+    res |= metrics_printf(out, "limbo_admission_rejects_total %lld\n", (long long)t[METRIC_ADMISSION_REJECTS]);
+
+    res |= METRICS_HEADER(out, "limbo_disconnects_total", "counter", "Connections closed, by reason.");
+    for (unsigned i = 0; i < sizeof(metrics_dc_names) / sizeof(metrics_dc_names[0]); ++i) {
+        res |= metrics_printf(out, "limbo_disconnects_total{reason=\"%s\"} %lld\n", metrics_dc_names[i], (long long)t[METRIC_DISCONNECTS + i]);
+    }
+
+    res |= METRICS_HEADER(out, "limbo_received_bytes_total", "counter", "Bytes read from players.");
+    res |= metrics_printf(out, "limbo_received_bytes_total %lld\n", (long long)t[METRIC_BYTES_IN]);
+    res |= METRICS_HEADER(out, "limbo_sent_bytes_total", "counter", "Bytes written to players.");
+    res |= metrics_printf(out, "limbo_sent_bytes_total %lld\n", (long long)t[METRIC_BYTES_OUT]);
+    res |= METRICS_HEADER(out, "limbo_received_packets_total", "counter", "Packets read from players.");
+    res |= metrics_printf(out, "limbo_received_packets_total %lld\n", (long long)t[METRIC_PACKETS_IN]);
+    res |= METRICS_HEADER(out, "limbo_sent_packets_total", "counter", "Packets written to players.");
+    res |= metrics_printf(out, "limbo_sent_packets_total %lld\n", (long long)t[METRIC_PACKETS_OUT]);
+
+    res |= METRICS_HEADER(out, "limbo_sendq_bytes", "gauge", "Bytes waiting in send queues.");
+    res |= metrics_printf(out, "limbo_sendq_bytes %lld\n", (long long)t[METRIC_SENDQ_BYTES]);
+    res |= METRICS_HEADER(out, "limbo_recv_buffer_bytes", "gauge", "Bytes allocated for partially received packets.");
+    res |= metrics_printf(out, "limbo_recv_buffer_bytes %lld\n", (long long)t[METRIC_RECVBUF_BYTES]);
+
+    res |= METRICS_HEADER(out, "limbo_keepalive_rtt_ms", "histogram", "Keep-alive round trip time in milliseconds.");
+    int64_t cumulative = 0;
+    for (unsigned i = 0; i < METRICS_RTT_NBUCKETS; ++i) {
+        cumulative += t[METRIC_RTT_BUCKETS + i];
+        if (i < METRICS_RTT_NBUCKETS - 1) {
+            res |= metrics_printf(out, "limbo_keepalive_rtt_ms_bucket{le=\"%lld\"} %lld\n", (long long)metrics_rtt_bounds[i], (long long)cumulative);
+        } else {
+            res |= metrics_printf(out, "limbo_keepalive_rtt_ms_bucket{le=\"+Inf\"} %lld\n", (long long)cumulative);
+        }
+    }
+    res |= metrics_printf(out, "limbo_keepalive_rtt_ms_sum %lld\n", (long long)t[METRIC_RTT_SUM]);
+    res |= metrics_printf(out, "limbo_keepalive_rtt_ms_count %lld\n", (long long)cumulative);
+
+    res |= METRICS_HEADER(out, "limbo_event_loop_wakeups_total", "counter", "Times an IO thread woke up from waiting for events.");
+    res |= metrics_printf(out, "limbo_event_loop_wakeups_total %lld\n", (long long)t[METRIC_LOOP_WAKEUPS]);
+    res |= METRICS_HEADER(out, "limbo_event_loop_events_total", "counter", "Events handled by the IO threads.");
+    res |= metrics_printf(out, "limbo_event_loop_events_total %lld\n", (long long)t[METRIC_LOOP_EVENTS]);
+    res |= METRICS_HEADER(out, "limbo_handoff_lost_total", "counter", "Connections a hot restart could not take over.");
+    res |= metrics_printf(out, "limbo_handoff_lost_total %lld\n", (long long)t[METRIC_HANDOFF_LOST]);
+
+    return res < 0 ? -1 : 0;
+}
+
+// big enough for any request line a scraper sends, the rest of the request is ignored
+#define METRICS_REQ_MAX (2048)
+
+/* One scrape: the request is read until its blank line, then the answer is
+ * written out and the connection closed. */
+struct metrics_conn {
+    file_descriptor_t fd;
+    struct list_hook hook;
+
+    struct auto_buffer resp;
+    size_t sent;
+
+    size_t reqlen;
+    char req[METRICS_REQ_MAX + 1];
+};
+
+pthread_mutex_t metrics_conns_mutex = PTHREAD_MUTEX_INITIALIZER;
+ilist_t metrics_conns = ILIST_INITIALIZER(metrics_conns);
+
+void metrics_http_read_handler(file_descriptor_t *fd, void *handler_data);
+void metrics_http_write_handler(file_descriptor_t *fd, void *handler_data);
+void metrics_http_error_handler(file_descriptor_t *fd, int error, void *handler_data);
+void metrics_http_handle_complete(file_descriptor_t *fd, void *handler_data);
+
+void metrics_http_accept(int sockfd) {
+    struct metrics_conn *conn = calloc(1, sizeof(struct metrics_conn));
+    if (!conn) {
+        log_error("metrics_http_accept: unable to take connection %d", sockfd);
+        close(sockfd);
+        return;
+    }
+
+    conn->fd.fd = sockfd;
+    conn->fd.loop = event_loop_current();
+    conn->fd.handler_data = conn;
+    conn->fd.read_handler = &metrics_http_read_handler;
+    conn->fd.write_handler = &metrics_http_write_handler;
+    conn->fd.error_handler = &metrics_http_error_handler;
+    conn->fd.handle_complete = &metrics_http_handle_complete;
+    ab_init(&conn->resp, 0, 0);
+
+    pthread_mutex_lock(&metrics_conns_mutex);
+    ilist_addend(&metrics_conns, &conn->hook);
+    pthread_mutex_unlock(&metrics_conns_mutex);
+
+    event_loop_want(&conn->fd, FD_WANT_READ);
+}
+
+void metrics_http_close(struct metrics_conn *conn) {
+    if (conn->fd.fd != -1) {
+        event_loop_delfd(&conn->fd);
+        close(conn->fd.fd);
+        conn->fd.fd = -1;
+    }
+    conn->fd.state |= FD_CALL_COMPLETE;
+}
+
+void metrics_http_free(struct metrics_conn *conn) {
+    pthread_mutex_lock(&metrics_conns_mutex);
+    ilist_remove(&metrics_conns, &conn->hook);
+    pthread_mutex_unlock(&metrics_conns_mutex);
+
+    metrics_http_close(conn);
+    ab_free(&conn->resp);
+    free(conn);
+}
+
+void metrics_http_flush(struct metrics_conn *conn) {
+    size_t len = ab_getwrcur(&conn->resp);
+    while (conn->sent < len) {
+        ssize_t written = write(conn->fd.fd, conn->resp.buf + conn->sent, len - conn->sent);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn->fd.state &= ~FD_CAN_WRITE;
+                event_loop_want(&conn->fd, FD_WANT_WRITE);
+                return;
+            }
+            break;
+        }
+        conn->sent += (size_t)written;
+    }
+
+    metrics_http_close(conn);
+}
+
+void metrics_http_respond(struct metrics_conn *conn) {
+    const char *status = "200 OK";
+    struct auto_buffer body;
+    ab_init(&body, 4096, 0);
+
+    if (strncmp(conn->req, "GET ", 4) != 0) {
+        status = "405 Method Not Allowed";
+    } else if (strncmp(conn->req + 4, "/metrics ", 9) != 0 && strncmp(conn->req + 4, "/metrics?", 9) != 0) {
+        status = "404 Not Found";
+    } else if (metrics_format(&body) < 0) {
+        status = "500 Internal Server Error";
+    }
+
+    size_t bodylen = ab_getwrcur(&body);
+    if (strcmp(status, "200 OK") != 0) bodylen = 0;
+
+    metrics_printf(&conn->resp, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+                   status, (unsigned long)bodylen);
+    if (bodylen > 0) ab_push(&conn->resp, body.buf, bodylen);
+    ab_free(&body);
+
+    conn->fd.state |= FD_CAN_WRITE; // a fresh connection has room, and if not the loop says so
+    metrics_http_flush(conn);
+}
+
+void metrics_http_read_handler(file_descriptor_t *fd, void *handler_data) {
+    struct metrics_conn *conn = handler_data;
+
+    while (true) {
+        ssize_t readcnt = read(fd->fd, conn->req + conn->reqlen, METRICS_REQ_MAX - conn->reqlen);
+        if (readcnt == 0) {
+            metrics_http_close(conn);
+            return;
+        } else if (readcnt < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) fd->state &= ~FD_CAN_READ;
+            else metrics_http_close(conn);
+            return;
+        }
+
+        conn->reqlen += (size_t)readcnt;
+        conn->req[conn->reqlen] = '\0';
+
+        // no need to wait for the headers once they can't fit anyway, the request line is all we look at
+        if (strstr(conn->req, "\r\n\r\n") || strstr(conn->req, "\n\n") || conn->reqlen == METRICS_REQ_MAX) {
+            fd->state &= ~FD_WANT_READ;
+            metrics_http_respond(conn);
+            return;
+        }
+    }
+}
+
+void metrics_http_write_handler(file_descriptor_t *fd, void *handler_data) {
+    UNUSED(fd);
+    struct metrics_conn *conn = handler_data;
+    if (ab_getwrcur(&conn->resp) > 0) metrics_http_flush(conn);
+}
+
+void metrics_http_error_handler(file_descriptor_t *fd, int error, void *handler_data) {
+    UNUSED(fd); UNUSED(error);
+    metrics_http_close(handler_data);
+}
+
+void metrics_http_handle_complete(file_descriptor_t *fd, void *handler_data) {
+    UNUSED(fd);
+    metrics_http_free(handler_data);
+}
+
+void metrics_http_close_all(void) {
+    ILIST_FOREACH(&metrics_conns, hook) {
+        struct metrics_conn *conn = LIST_CONTAINER(hook, struct metrics_conn, hook);
+        metrics_http_free(conn);
+    }
+}
@@ -0,0 +1,287 @@
+#include "nbt.h"
+#include "endianutils.h"
+#include "protocol.h"
+
+#include <string.h>
+
+// Deeper nesting than this is refused (same limit as the vanilla reader)
+#define NBT_MAX_DEPTH (512)
+
+void nbt_reader_init(struct nbt_reader *rd, const void *buf, size_t len) {
+    rd->cur = buf;
+    rd->end = rd->cur + len;
+    rd->error = false;
+}
+
+bool nbt_need(struct nbt_reader *rd, size_t len) {
+    if (rd->error || (size_t)(rd->end - rd->cur) < len) {
+        rd->error = true;
+        return false;
+    }
+    return true;
+}
+
+uint16_t nbt_rd16(struct nbt_reader *rd) {
+    uint16_t val;
+    memcpy(&val, rd->cur, sizeof(val));
+    rd->cur += sizeof(val);
+    return eu_betohu16(val);
+}
+
+uint32_t nbt_rd32(struct nbt_reader *rd) {
+    uint32_t val;
+    memcpy(&val, rd->cur, sizeof(val));
+    rd->cur += sizeof(val);
+    return eu_betohu32(val);
+}
+
+uint64_t nbt_rd64(struct nbt_reader *rd) {
+    uint64_t val;
+    memcpy(&val, rd->cur, sizeof(val));
+    rd->cur += sizeof(val);
+    return eu_betohu64(val);
+}
+
+const size_t nbt_elemsz[] = {
+    [NBT_BYTE_ARRAY] = 1,
+    [NBT_INT_ARRAY]  = 4,
+    [NBT_LONG_ARRAY] = 8
+};
+
+bool nbt_skip_compound(struct nbt_reader *rd, int depth);
+bool nbt_skip_list(struct nbt_reader *rd, uint8_t elemtag, int32_t len, int depth);
+
+// reads the payload of a tag; compounds and lists are skipped but their payload is recorded
+bool nbt_read_payload(struct nbt_reader *rd, uint8_t tag, struct nbt_value *val, int depth) {
+    val->tag = tag;
+    switch (tag) {
+        case NBT_BYTE:
+            if (!nbt_need(rd, 1)) return false;
+            val->v.i = (int8_t)*(rd->cur++);
+            return true;
+        case NBT_SHORT:
+            if (!nbt_need(rd, 2)) return false;
+            val->v.i = (int16_t)nbt_rd16(rd);
+            return true;
+        case NBT_INT:
+            if (!nbt_need(rd, 4)) return false;
+            val->v.i = (int32_t)nbt_rd32(rd);
+            return true;
+        case NBT_LONG:
+            if (!nbt_need(rd, 8)) return false;
+            val->v.i = (int64_t)nbt_rd64(rd);
+            return true;
+        case NBT_FLOAT: {
+            if (!nbt_need(rd, 4)) return false;
+            union { uint32_t raw; float f; } con;
+            con.raw = nbt_rd32(rd);
+            val->v.d = con.f;
+            return true;
+        }
+        case NBT_DOUBLE: {
+            if (!nbt_need(rd, 8)) return false;
+            union { uint64_t raw; double d; } con;
+            con.raw = nbt_rd64(rd);
+            val->v.d = con.d;
+            return true;
+        }
+        case NBT_STRING:
+            if (!nbt_need(rd, 2)) return false;
+            val->v.s.len = nbt_rd16(rd);
+            if (!nbt_need(rd, val->v.s.len)) return false;
+            val->v.s.str = (const char *)rd->cur;
+            rd->cur += val->v.s.len;
+            return true;
+        case NBT_BYTE_ARRAY:
+        case NBT_INT_ARRAY:
+        case NBT_LONG_ARRAY: {
+            if (!nbt_need(rd, 4)) return false;
+            int32_t len = (int32_t)nbt_rd32(rd);
+            if (len < 0 || (size_t)len > (size_t)(rd->end - rd->cur) / nbt_elemsz[tag]) {
+                rd->error = true;
+                return false;
+            }
+            val->v.arr.len = len;
+            val->v.arr.data = rd->cur;
+            rd->cur += (size_t)len * nbt_elemsz[tag];
+            return true;
+        }
+        case NBT_LIST:
+            if (!nbt_need(rd, 5)) return false;
+            val->v.nest.elemtag = *(rd->cur++);
+            val->v.nest.len = (int32_t)nbt_rd32(rd);
+            val->v.nest.payload = rd->cur;
+            if (val->v.nest.len < 0 || val->v.nest.elemtag > NBT_TAG_MAX) {
+                rd->error = true;
+                return false;
+            }
+            return nbt_skip_list(rd, val->v.nest.elemtag, val->v.nest.len, depth + 1);
+        case NBT_COMPOUND:
+            val->v.nest.payload = rd->cur;
+            val->v.nest.elemtag = NBT_END;
+            val->v.nest.len = 0;
+            return nbt_skip_compound(rd, depth + 1);
+        default:
+            rd->error = true;
+            return false;
+    }
+}
+
+bool nbt_skip_list(struct nbt_reader *rd, uint8_t elemtag, int32_t len, int depth) {
+    struct nbt_value dummy;
+    if (depth > NBT_MAX_DEPTH) {
+        rd->error = true;
+        return false;
+    }
+
+    if (elemtag == NBT_END) return true; // empty lists may be typed as TAG_End
+    for (int32_t i = 0; i < len; ++i) {
+        if (!nbt_read_payload(rd, elemtag, &dummy, depth)) return false;
+    }
+    return true;
+}
+
+bool nbt_skip_compound(struct nbt_reader *rd, int depth) {
+    struct nbt_value dummy;
+    if (depth > NBT_MAX_DEPTH) {
+        rd->error = true;
+        return false;
+    }
+
+    while (true) {
+        if (!nbt_need(rd, 1)) return false;
+        uint8_t tag = *(rd->cur++);
+        if (tag == NBT_END) return true;
+
+        if (!nbt_need(rd, 2)) return false;
+        uint16_t namelen = nbt_rd16(rd);
+        if (!nbt_need(rd, namelen)) return false;
+        rd->cur += namelen;
+
+        if (!nbt_read_payload(rd, tag, &dummy, depth)) return false;
+    }
+}
+
+bool nbt_read_root(struct nbt_reader *rd, struct nbt_value *root) {
+    if (!nbt_need(rd, 3)) return false;
+    uint8_t tag = *(rd->cur++);
+    if (tag != NBT_COMPOUND) {
+        rd->error = true;
+        return false;
+    }
+
+    uint16_t namelen = nbt_rd16(rd);
+    if (!nbt_need(rd, namelen)) return false;
+    rd->cur += namelen;
+
+    return nbt_read_payload(rd, tag, root, 0);
+}
+
+void nbt_reader_at(struct nbt_reader *sub, const struct nbt_reader *parent, const struct nbt_value *val) {
+    sub->cur = val->v.nest.payload;
+    sub->end = parent->end;
+    sub->error = false;
+}
+
+int nbt_compound_next(struct nbt_reader *rd, const char **name, uint16_t *namelen, struct nbt_value *val) {
+    if (!nbt_need(rd, 1)) return -1;
+    uint8_t tag = *(rd->cur++);
+    if (tag == NBT_END) return 0;
+
+    if (!nbt_need(rd, 2)) return -1;
+    *namelen = nbt_rd16(rd);
+    if (!nbt_need(rd, *namelen)) return -1;
+    *name = (const char *)rd->cur;
+    rd->cur += *namelen;
+
+    return nbt_read_payload(rd, tag, val, 0) ? 1 : -1;
+}
+
+int nbt_list_next(struct nbt_reader *rd, uint8_t elemtag, int32_t *remain, struct nbt_value *val) {
+    if (rd->error) return -1;
+    if (*remain <= 0 || elemtag == NBT_END) return 0;
+
+    --*remain;
+    return nbt_read_payload(rd, elemtag, val, 0) ? 1 : -1;
+}
+
+bool nbt_name_eq(const char *name, uint16_t namelen, const char *str) {
+    return strlen(str) == namelen && !memcmp(name, str, namelen);
+}
+
+int64_t nbt_array_get(const struct nbt_value *val, int32_t idx) {
+    const unsigned char *p = val->v.arr.data + (size_t)idx * nbt_elemsz[val->tag];
+    switch (val->tag) {
+        case NBT_BYTE_ARRAY:
+            return (int8_t)*p;
+        case NBT_INT_ARRAY: {
+            uint32_t raw;
+            memcpy(&raw, p, sizeof(raw));
+            return (int32_t)eu_betohu32(raw);
+        }
+        case NBT_LONG_ARRAY: {
+            uint64_t raw;
+            memcpy(&raw, p, sizeof(raw));
+            return (int64_t)eu_betohu64(raw);
+        }
+        default:
+            return 0;
+    }
+}
+
+int nbt_write_name(struct auto_buffer *buf, const char *name) {
+    size_t len = strlen(name);
+    int res = proto_write_ushort(buf, (uint16_t)len);
+    if (res == 0) res = ab_push(buf, name, len);
+    return res;
+}
+
+// tag header for a compound field, nothing for list elements
+int nbt_write_header(struct auto_buffer *buf, uint8_t tag, const char *name) {
+    if (!name) return 0;
+    int res = proto_write_ubyte(buf, tag);
+    if (res == 0) res = nbt_write_name(buf, name);
+    return res;
+}
+
+int nbt_write_root(struct auto_buffer *buf, const char *name, bool network) {
+    if (network) return proto_write_ubyte(buf, NBT_COMPOUND);
+    return nbt_write_header(buf, NBT_COMPOUND, name ? name : "");
+}
+
+int nbt_write_compound(struct auto_buffer *buf, const char *name) {
+    return nbt_write_header(buf, NBT_COMPOUND, name);
+}
+
+int nbt_write_list(struct auto_buffer *buf, const char *name, uint8_t elemtag, int32_t len) {
+    int res = nbt_write_header(buf, NBT_LIST, name);
+    if (res == 0) res = proto_write_ubyte(buf, len > 0 ? elemtag : NBT_END);
+    if (res == 0) res = proto_write_int(buf, len);
+    return res;
+}
+
+int nbt_write_end(struct auto_buffer *buf) {
+    return proto_write_ubyte(buf, NBT_END);
+}
+
+#define NBT_WRITE_F(_tname, _type, _tag, _wname)                                   \
+int nbt_write_ ## _tname(struct auto_buffer *buf, const char *name, _type val) { \
+    int res = nbt_write_header(buf, _tag, name);                                 \
+    if (res == 0) res = proto_write_ ## _wname(buf, val);                        \
+    return res;                                                                  \
+}
+
+NBT_WRITE_F(byte, int8_t, NBT_BYTE, byte)
+NBT_WRITE_F(short, int16_t, NBT_SHORT, short)
+NBT_WRITE_F(int, int32_t, NBT_INT, int)
+NBT_WRITE_F(long, int64_t, NBT_LONG, long)
+NBT_WRITE_F(float, float, NBT_FLOAT, float)
+NBT_WRITE_F(double, double, NBT_DOUBLE, double)
+
+#undef NBT_WRITE_F
+
+int nbt_write_string(struct auto_buffer *buf, const char *name, const char *str) {
+    int res = nbt_write_header(buf, NBT_STRING, name);
+    if (res == 0) res = nbt_write_name(buf, str); // same encoding as a name: ushort length + bytes
+    return res;
+}
@@ -6,6 +6,9 @@
 #include "uuid.h"
 #include "sched.h"
 #include "utf.h"
+#include "world.h"
+#include "pktcache.h"
+#include "metrics.h"
 
 #include "jansson.h"
 
@@ -67,7 +70,7 @@ void proto_handshake_set_protocol(void *client, int32_t pktid, unsigned char *bu
     proto_read_lenstr(&buf, (char **)&hostname, &len, ctx);
     port = proto_read_ushort(&buf, ctx);
     nextproto = (unsigned)proto_read_varint(&buf, ctx);
-    log_debug("Received handshake from %s: pvn %d, host %.*s, port %hu, nextproto: %d", sender->saddrstr, sender->protocol_ver, len, hostname, port, nextproto);
+    log_debug_limit("Received handshake from %s: pvn %d, host %.*s, port %hu, nextproto: %d", sender->saddrstr, sender->protocol_ver, len, hostname, port, nextproto);
 
     PROTO_CATCH_CLEANUP(ctx, 1);
     free(hostname);
@@ -75,10 +78,10 @@ void proto_handshake_set_protocol(void *client, int32_t pktid, unsigned char *bu
     // TODO: IP forwarding
     switch (nextproto) {
         case PROTOCOL_STATUS:
-            sender->protocol = PROTOCOL_STATUS;
+            client_set_protocol(sender, PROTOCOL_STATUS);
             break;
         case PROTOCOL_LOGIN:
-            sender->protocol = PROTOCOL_LOGIN;
+            client_set_protocol(sender, PROTOCOL_LOGIN);
             break;
         default:
             PROTOCOL_ERROR(ctx, "(Handshake) Invalid next protocol %u - should be 1 (Status) or 2 (Login)", nextproto);
@@ -87,11 +90,11 @@ void proto_handshake_set_protocol(void *client, int32_t pktid, unsigned char *bu
 
 void proto_status_request(void *client, int32_t pktid, unsigned char *buf, struct read_context *ctx) {
     UNUSED(pktid); UNUSED(buf); UNUSED(ctx);
+    client_t *sender = client;
 
-    struct packet_status_response res;
-    res.id = PKTID_WRITE_STATUS_RESPONSE;
-    res.text = L"{\"version\":{\"name\":\"TODO\",\"protocol\":47},\"players\":{\"max\":20,\"online\":0,\"sample\":[]},\"description\":{\"text\":\"\u00A7ehello \u2022 world\"},\"favicon\":\"data:image/png;base64,iVBORw0KGgoAAAANSUhEUgAAAEAAAABACAIAAAAlC+aJAAABhGlDQ1BJQ0MgcHJvZmlsZQAAKJF9kT1Iw0AcxV9TS0UqDhYRdchQnSyIijhKFYtgobQVWnUwufQLmjQkKS6OgmvBwY/FqoOLs64OroIg+AHi6OSk6CIl/i8ptIjx4Lgf7+497t4BQqPCVLNrAlA1y0jFY2I2tyoGXxHAAAQMY0Bipp5IL2bgOb7u4ePrXZRneZ/7c/QqeZMBPpF4jumGRbxBPLNp6Zz3icOsJCnE58TjBl2Q+JHrsstvnIsOCzwzbGRS88RhYrHYwXIHs5KhEk8TRxRVo3wh67LCeYuzWqmx1j35C0N5bSXNdZojiGMJCSQhQkYNZVRgIUqrRoqJFO3HPPxDjj9JLplcZTByLKAKFZLjB/+D392ahalJNykUAwIvtv0xCgR3gWbdtr+Pbbt5AvifgSut7a82gNlP0uttLXIE9G0DF9dtTd4DLneAwSddMiRH8tMUCgXg/Yy+KQf03wI9a25vrX2cPgAZ6mr5Bjg4BMaKlL3u8e7uzt7+PdPq7wdSPnKaY03N2AAAAAlwSFlzAAAuIwAALiMBeKU/dgAAAAd0SU1FB+YFFgIcA82hDYUAAAAZdEVYdENvbW1lbnQAQ3JlYXRlZCB3aXRoIEdJTVBXgQ4XAAACY0lEQVRo3u2ZTUhUURTHfzPlWDFki8SsGC2ECAqZwI1ENTCV6yhKgkiiRR9bIWjdpkXQKqJltLBFH4tMkCAigjKTVn1ROSVoi0CjQAfq3yIGfNz3xifWnXl0Dm/1f+ce7o97zzvn3peSRJItTcLNAAzAAAzAAAzAAAzgfwZYHs+tDJPwDB7AGHyDXxX+LGyGrbADOqEVMj4BUmHt9FcYhVFogQ4owQDcixFtN5yFvdDkj0AhdkvaI6WlRqlZYpHPCakkXxYKcEpKLX7e85+8NChNewAITeKfsMRj2hich+e1SuJshHM7FKAbcrACgFmYgnfwFJ7AjyBDP9yBnOccmJOKzpbYLw1X3RLT0qCUdwae858D42F7+nq8aCWpzxnrOwdeh63Tp3jLmYPTNa/EpTC3iXjRJuBCUMn7B5gNc7sN92GmaqgZuAJ3g+Ih/4XsavTXvSDdkMalOSfvR6ReKR3075Be+U/ioYWKVLd0rYLxZ+onpazj1iBddFD/vrm9UAnaY6zcBtgOwGP47rxdBmegHzb6b+bK0Li0mKvgEhzx09K5SZwJq53rYwdsgcveZh91oFnrKMdhGHphTXSoBjgKD+GYz3Y6tBfaBC+CyhYoQheMwE0Ygs/B9SnAQdgZBl8DAHcS6wBogiLsgkl4CW8qbDU4iFUHWFl1SAbaoK2eD/XNjjKVrFuJbY7yIVkAnY7yMVkArbA6qLxPFkAGuoLKl8TdzB1YKK3rHWAf9MzrDg7XLUAq4kd3Gd7CADyCPuip1LLEANjttAEYgAEYgAEYgAEYgAEYgAEYgAEYgAH8W/sNwiZofrEfFL4AAAAASUVORK5CYII=\"}";
-    client_write_pkt((client_t*)client, &res);
+    size_t len;
+    const unsigned char *res = pktcache_get(pktcache_default, PKTCACHE_STATUS, sender->protocol_ver, &len);
+    if (res) client_write(sender, res, len);
 }
 
 void proto_status_ping(void *client, int32_t pktid, unsigned char *buf, struct read_context *ctx) {
@@ -104,15 +107,24 @@ void proto_status_ping(void *client, int32_t pktid, unsigned char *buf, struct r
     res.payload = num;
     client_write_pkt(sender, &res);
     sender->dc_on_write = true;
+    client_dc_reason(sender, METRICS_DC_CLOSED); // that's all a status ping is
 }
 
 #define CONFIG_ENABLE_IP_FORWARD (true)
 
+// The offline uuid is a single MD5 of the name, a few hundred ns: cheaper done right here than sent anywhere.
+void proto_login_hash(struct uuid *id, const char *name) {
+    char idstr[UUID_STRLEN+1];
+    uuid_gen_name(id, "OfflinePlayer:", name);
+    uuid_format(id, idstr, UUID_STRLEN+1);
+    log_info_limit("UUID of connecting player %s: %s", name, idstr);
+}
+
 void proto_login_start(void *client, int32_t pktid, unsigned char *buf, struct read_context *ctx) {
     UNUSED(pktid);
 
     client_t *sender = client;
-    char *rdname, name[17], idstr[UUID_STRLEN+1];
+    char *rdname, name[17];
     int32_t namelen = 16;
     struct uuid puuid;
     memset(name, 0, 17);
@@ -121,67 +133,52 @@ void proto_login_start(void *client, int32_t pktid, unsigned char *buf, struct r
     memcpy(name, rdname, namelen);
     free(rdname);
 
-    uuid_gen_name(&puuid, "OfflinePlayer:", name);
-    uuid_format(&puuid, idstr, UUID_STRLEN+1);
-    log_info("UUID of connecting player %s: %s", name, idstr);
+    proto_login_hash(&puuid, name);
+    const char *err = proto_join_player(sender, &puuid, name, true);
+    if (err) PROTOCOL_ERROR(ctx, "%s (%s)", err, name);
+}
 
+const char *proto_join_player(client_t *sender, const struct uuid *id, const char *name, bool login_success) {
     player_t *player = malloc(sizeof(player_t));
-    if (!player) PROTOCOL_ERROR(ctx, "Unable to allocate player_t object: malloc returned NULL");
+    if (!player) return "Unable to allocate player_t object: malloc returned NULL";
     memset(player, 0, sizeof(player_t));
     sender->player = player;
 
     player->conn = sender;
-    memcpy(&player->profile.id, &puuid, sizeof(struct uuid));
-    memcpy(&player->profile.name, name, 17);
-
-    struct packet_login_success res;
-    res.id = PKTID_WRITE_LOGIN_SUCCESS;
-    res.profile = &player->profile;
-    client_write_pkt(sender, &res);
-    sender->protocol = PROTOCOL_PLAY;
-
-    // TODO: send play packets to initialize the player
-    struct packet_play_join_game jgpkt = {
-        .id = PKTID_WRITE_PLAY_JOIN_GAME,
-        .peid = 1,
-        .gamemode = 0,
-        .dimension = 1,
-        .difficulty = 2,
-        .max_players = 60,
-        .level_type = "default",
-        .reduced_dbg_info = false
-    };
-
-    struct packet_play_spawn_position sppkt = {
-        .id = PKTID_WRITE_PLAY_SPAWN_POS,
-        .pos = {
-            .x = 0,
-            .y = 64,
-            .z = 0
-        }
-    };
+    memcpy(&player->profile.id, id, sizeof(struct uuid));
+    strncpy(player->profile.name, name, sizeof(player->profile.name) - 1);
+
+    // a player can only be online once, the newest login wins (proxies reconnect before the old one times out)
+    client_t *evicted[2];
+    int nevicted = playerindex_claim(&sender->registry->players, player, evicted);
+    if (nevicted < 0) return "Unable to index player: out of memory";
+    for (int i = 0; i < nevicted; ++i) {
+        client_kick_remote_w(evicted[i], L"You logged in from another location");
+        client_release(evicted[i]);
+    }
 
-    struct packet_play_player_position_look pplpkt = {
-        .id = PKTID_WRITE_PLAY_PLAYER_POS_LOOK,
-        .x = 0,
-        .y = 64,
-        .z = 0,
-        .yaw = 0,
-        .pitch = 0,
-        .flags = 0x0
-    };
+    if (login_success) {
+        struct packet_login_success res;
+        res.id = PKTID_WRITE_LOGIN_SUCCESS;
+        res.profile = &player->profile;
+        client_write_pkt(sender, &res);
+    }
+    client_set_protocol(sender, PROTOCOL_PLAY);
 
     int64_t mil = sched_rt_millis();
-    if (mil < 0) log_warn("proto_login_start: sched_rt_millis failed: %s", strerror((int32_t)-mil));
+    if (mil < 0) log_warn("proto_join_player: sched_rt_millis failed: %s", strerror((int32_t)-mil));
     struct packet_play_keep_alive kapkt = {
         .id = PKTID_WRITE_PLAY_KEEP_ALIVE,
         .payload = (int32_t)mil
     };
 
-    client_write_pkt(sender, &jgpkt);
-    client_write_pkt(sender, &sppkt);
-    client_write_pkt(sender, &pplpkt);
+    // join game, spawn position, chunks and position are the same for everyone
+    size_t joinlen;
+    const unsigned char *join = pktcache_get(pktcache_default, PKTCACHE_JOIN, sender->protocol_ver, &joinlen);
+    if (join) client_write(sender, join, joinlen);
+
     client_write_pkt(sender, &kapkt);
+    return NULL;
 }
 
 void proto_play_keep_alive(void *client, int32_t pktid, unsigned char *buf, struct read_context *ctx) {
@@ -201,6 +198,7 @@ void proto_play_keep_alive(void *client, int32_t pktid, unsigned char *buf, stru
     sched_timespec_sub(&now, &sender->lastping, &diff);
     memcpy(&sender->lastping, &now, sizeof(struct timespec));
     sender->latency_ms = diff.tv_sec * 1000 + diff.tv_nsec / 1000000;
+    metrics_rtt(sender->latency_ms);
 }
 
 packet_proc *const client_proto_handshake[] = {
@@ -303,6 +301,18 @@ void proto_write_play_player_pos_look(void *client, struct auto_buffer *buf, str
     proto_write_ubyte(buf, rpkt->flags);
 }
 
+void proto_write_play_chunk_data(void *client, struct auto_buffer *buf, struct packet_base *pkt) {
+    UNUSED(client);
+    struct packet_play_chunk_data *rpkt = (struct packet_play_chunk_data *)pkt;
+
+    proto_write_int(buf, rpkt->x);
+    proto_write_int(buf, rpkt->z);
+    proto_write_bool(buf, rpkt->full);
+    proto_write_ushort(buf, rpkt->mask);
+    proto_write_varint(buf, (int32_t)rpkt->datalen);
+    proto_write_bytes(buf, rpkt->data, rpkt->datalen);
+}
+
 packet_write_proc *const client_write_proto_status[] = {
     &proto_write_status_response, &proto_write_status_pong
 };
@@ -322,7 +332,7 @@ packet_write_proc *const client_write_proto_play[] = {
     /*0x05*/ &proto_write_play_spawn_pos, TWO_NULLS,
     /*0x08*/ &proto_write_play_player_pos_look, FOUR_NULLS, TWO_NULLS, NULL,
     /*0x10*/ SIXTEEN_NULLS,
-    /*0x20*/ SIXTEEN_NULLS,
+    /*0x20*/ NULL, &proto_write_play_chunk_data, EIGHT_NULLS, FOUR_NULLS, TWO_NULLS,
     /*0x30*/ SIXTEEN_NULLS,
     /*0x40*/ &proto_write_disconnect
 };
@@ -333,3 +343,113 @@ packet_write_proc *const *client_write_protos[] = {
     client_write_proto_login,
     client_write_proto_play
 };
+
+int proto_frame_pkt(struct auto_buffer *dest, unsigned protocol, void *client, void *pkt) {
+    struct packet_base *bpkt = pkt;
+    packet_write_proc *proc = client_write_protos[protocol] ? client_write_protos[protocol][bpkt->id] : NULL;
+    if (!proc) return -1;
+
+    struct auto_buffer body;
+    ab_init(&body, 0, 0);
+    proto_write_varint(&body, bpkt->id);
+    (*proc)(client, &body, bpkt);
+
+    size_t len = ab_getwrcur(&body);
+    int res = proto_write_varint(dest, (int32_t)len);
+    if (res == 0) res = ab_push(dest, body.buf, len);
+
+    ab_free(&body);
+    return res;
+}
+
+const protover_t proto_versions[] = { PROTOVER_1_8 };
+const size_t proto_version_count = sizeof(proto_versions) / sizeof(proto_versions[0]);
+
+// Bump whenever the pre-encoded packets below change shape, this invalidates packet caches
+#define PROTO_TABLES_REV (3)
+
+const wchar_t *const proto_status_text = L"{\"version\":{\"name\":\"TODO\",\"protocol\":47},\"players\":{\"max\":20,\"online\":0,\"sample\":[]},\"description\":{\"text\":\"\u00A7ehello \u2022 world\"},\"favicon\":\"data:image/png;base64,iVBORw0KGgoAAAANSUhEUgAAAEAAAABACAIAAAAlC+aJAAABhGlDQ1BJQ0MgcHJvZmlsZQAAKJF9kT1Iw0AcxV9TS0UqDhYRdchQnSyIijhKFYtgobQVWnUwufQLmjQkKS6OgmvBwY/FqoOLs64OroIg+AHi6OSk6CIl/i8ptIjx4Lgf7+497t4BQqPCVLNrAlA1y0jFY2I2tyoGXxHAAAQMY0Bipp5IL2bgOb7u4ePrXZRneZ/7c/QqeZMBPpF4jumGRbxBPLNp6Zz3icOsJCnE58TjBl2Q+JHrsstvnIsOCzwzbGRS88RhYrHYwXIHs5KhEk8TRxRVo3wh67LCeYuzWqmx1j35C0N5bSXNdZojiGMJCSQhQkYNZVRgIUqrRoqJFO3HPPxDjj9JLplcZTByLKAKFZLjB/+D392ahalJNykUAwIvtv0xCgR3gWbdtr+Pbbt5AvifgSut7a82gNlP0uttLXIE9G0DF9dtTd4DLneAwSddMiRH8tMUCgXg/Yy+KQf03wI9a25vrX2cPgAZ6mr5Bjg4BMaKlL3u8e7uzt7+PdPq7wdSPnKaY03N2AAAAAlwSFlzAAAuIwAALiMBeKU/dgAAAAd0SU1FB+YFFgIcA82hDYUAAAAZdEVYdENvbW1lbnQAQ3JlYXRlZCB3aXRoIEdJTVBXgQ4XAAACY0lEQVRo3u2ZTUhUURTHfzPlWDFki8SsGC2ECAqZwI1ENTCV6yhKgkiiRR9bIWjdpkXQKqJltLBFH4tMkCAigjKTVn1ROSVoi0CjQAfq3yIGfNz3xifWnXl0Dm/1f+ce7o97zzvn3peSRJItTcLNAAzAAAzAAAzAAAzgfwZYHs+tDJPwDB7AGHyDXxX+LGyGrbADOqEVMj4BUmHt9FcYhVFogQ4owQDcixFtN5yFvdDkj0AhdkvaI6WlRqlZYpHPCakkXxYKcEpKLX7e85+8NChNewAITeKfsMRj2hich+e1SuJshHM7FKAbcrACgFmYgnfwFJ7AjyBDP9yBnOccmJOKzpbYLw1X3RLT0qCUdwae858D42F7+nq8aCWpzxnrOwdeh63Tp3jLmYPTNa/EpTC3iXjRJuBCUMn7B5gNc7sN92GmaqgZuAJ3g+Ih/4XsavTXvSDdkMalOSfvR6ReKR3075Be+U/ioYWKVLd0rYLxZ+onpazj1iBddFD/vrm9UAnaY6zcBtgOwGP47rxdBmegHzb6b+bK0Li0mKvgEhzx09K5SZwJq53rYwdsgcveZh91oFnrKMdhGHphTXSoBjgKD+GYz3Y6tBfaBC+CyhYoQheMwE0Ygs/B9SnAQdgZBl8DAHcS6wBogiLsgkl4CW8qbDU4iFUHWFl1SAbaoK2eD/XNjjKVrFuJbY7yIVkAnY7yMVkArbA6qLxPFkAGuoLKl8TdzB1YKK3rHWAf9MzrDg7XLUAq4kd3Gd7CADyCPuip1LLEANjttAEYgAEYgAEYgAEYgAEYgAEYgAEYgAH8W/sNwiZofrEfFL4AAAAASUVORK5CYII=\"}";
+
+/* Legacy ping replies: 1.4-1.6 take NUL separated fields after the \u00A71 marker
+ * (the protocol here is one no old client speaks, so they show the version name),
+ * beta 1.8-1.3 only know "motd\u00A7online\u00A7max". */
+const wchar_t proto_legacy_ping_text[] = L"\u00A71\0" L"127\0" L"1.8\0" L"\u00A7ehello \u2022 world\0" L"0\0" L"20";
+const wchar_t proto_legacy_ping_beta_text[] = L"hello \u2022 world\u00A70\u00A720";
+
+// TODO: config file
+#define JOIN_PEID        (1)
+#define JOIN_GAMEMODE    (0)
+#define JOIN_DIFFICULTY  (2)
+#define JOIN_MAX_PLAYERS (60)
+#define JOIN_LEVEL_TYPE  "default"
+
+int proto_cache_inputs(struct auto_buffer *out) {
+    int32_t fields[] = { PROTO_TABLES_REV, JOIN_PEID, JOIN_GAMEMODE, JOIN_DIFFICULTY, JOIN_MAX_PLAYERS };
+    int res;
+
+    if ((res = ab_push(out, fields, sizeof(fields))) < 0) return res;
+    if ((res = ab_push(out, proto_versions, sizeof(proto_versions))) < 0) return res;
+    if ((res = ab_push(out, JOIN_LEVEL_TYPE, sizeof(JOIN_LEVEL_TYPE))) < 0) return res;
+    if ((res = ab_push(out, proto_legacy_ping_text, sizeof(proto_legacy_ping_text))) < 0) return res;
+    if ((res = ab_push(out, proto_legacy_ping_beta_text, sizeof(proto_legacy_ping_beta_text))) < 0) return res;
+    return ab_push(out, proto_status_text, wcslen(proto_status_text) * sizeof(wchar_t));
+}
+
+int proto_encode_status(struct auto_buffer *out, protover_t protover) {
+    UNUSED(protover);
+    struct packet_status_response res = {
+        .id = PKTID_WRITE_STATUS_RESPONSE,
+        .text = proto_status_text
+    };
+    return proto_frame_pkt(out, PROTOCOL_STATUS, NULL, &res);
+}
+
+int proto_encode_legacy_ping(struct auto_buffer *out, bool beta) {
+    const wchar_t *text = beta ? proto_legacy_ping_beta_text : proto_legacy_ping_text;
+    int32_t len = (int32_t)(beta ? sizeof(proto_legacy_ping_beta_text) : sizeof(proto_legacy_ping_text)) / (int32_t)sizeof(wchar_t) - 1;
+
+    int res;
+    if ((res = proto_write_ubyte(out, 0xFF)) < 0) return res;
+    return proto_write_utf16be_lenstr(out, text, len); // the fields are NUL separated, so no wcslen
+}
+
+int proto_encode_join(struct auto_buffer *out, protover_t protover, world_t *world) {
+    struct block_position spawn = { .x = 0, .y = 64, .z = 0 };
+    if (world) spawn = world->spawn;
+
+    struct packet_play_join_game jgpkt = {
+        .id = PKTID_WRITE_PLAY_JOIN_GAME,
+        .peid = JOIN_PEID,
+        .gamemode = JOIN_GAMEMODE,
+        .dimension = WORLD_DIM_END,
+        .difficulty = JOIN_DIFFICULTY,
+        .max_players = JOIN_MAX_PLAYERS,
+        .level_type = JOIN_LEVEL_TYPE,
+        .reduced_dbg_info = false
+    };
+
+    struct packet_play_spawn_position sppkt = {
+        .id = PKTID_WRITE_PLAY_SPAWN_POS,
+        .pos = spawn
+    };
+
+    struct packet_play_player_position_look pplpkt = {
+        .id = PKTID_WRITE_PLAY_PLAYER_POS_LOOK,
+        .x = spawn.x + 0.5,
+        .y = spawn.y,
+        .z = spawn.z + 0.5,
+        .yaw = 0,
+        .pitch = 0,
+        .flags = 0x0
+    };
+
+    int res;
+    if ((res = proto_frame_pkt(out, PROTOCOL_PLAY, NULL, &jgpkt)) < 0) return res;
+    if ((res = proto_frame_pkt(out, PROTOCOL_PLAY, NULL, &sppkt)) < 0) return res;
+
+    // chunks go out before the position so the player does not fall through the build
+    const struct world_packets *chunks = world ? world_get_packets(world, protover) : NULL;
+    if (chunks && (res = ab_push(out, chunks->buf, chunks->len)) < 0) return res;
+
+    return proto_frame_pkt(out, PROTOCOL_PLAY, NULL, &pplpkt);
+}
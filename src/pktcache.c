@@ -0,0 +1,291 @@
+#include "pktcache.h"
+#include "protocol.h"
+#include "world.h"
+#include "utils.h"
+#include "log.h"
+#include "md5.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+pktcache_t *pktcache_default = NULL;
+
+const char pktcache_magic[8] = "LMBPKTC";
+
+// hashes everything the cached packets depend on: this format, the protocol tables and the world file
+bool pktcache_digest(const char *worldpath, unsigned char digest[16]) {
+    MD5_CTX md5;
+    MD5Init(&md5);
+
+    uint32_t format = PKTCACHE_FORMAT;
+    MD5Update(&md5, (const unsigned char *)&format, sizeof(format));
+
+    struct auto_buffer inputs;
+    ab_init(&inputs, 0, 0);
+    if (proto_cache_inputs(&inputs) < 0) {
+        ab_free(&inputs);
+        return false;
+    }
+    MD5Update(&md5, inputs.buf, (unsigned)ab_getwrcur(&inputs));
+    ab_free(&inputs);
+
+    int fd = open(worldpath, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            log_error("pktcache_digest(%s): open: %s", worldpath, strerror(errno));
+            return false;
+        }
+        MD5Update(&md5, (const unsigned char *)"", 1); // no world
+        goto done;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        log_error("pktcache_digest(%s): fstat: %s", worldpath, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    if (st.st_size > 0) {
+        size_t len = (size_t)st.st_size;
+        const unsigned char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            log_error("pktcache_digest(%s): mmap: %s", worldpath, strerror(errno));
+            close(fd);
+            return false;
+        }
+
+        madvise((void *)map, len, MADV_SEQUENTIAL);
+        for (size_t off = 0; off < len; off += 1u << 30) {
+            size_t part = len - off < (1u << 30) ? len - off : (1u << 30);
+            MD5Update(&md5, map + off, (unsigned)part);
+        }
+        munmap((void *)map, len);
+    }
+    close(fd);
+
+done:
+    MD5Final(digest, &md5);
+    return true;
+}
+
+pktcache_t *pktcache_wrap(const unsigned char *base, size_t len, bool mapped, const unsigned char digest[16]) {
+    const struct pktcache_header *hdr = (const struct pktcache_header *)base;
+    if (len < sizeof(struct pktcache_header)) return NULL;
+    if (memcmp(hdr->magic, pktcache_magic, sizeof(pktcache_magic)) || hdr->format != PKTCACHE_FORMAT) return NULL;
+    if (memcmp(hdr->digest, digest, sizeof(hdr->digest))) return NULL;
+    if (hdr->count > (len - sizeof(struct pktcache_header)) / sizeof(struct pktcache_entry)) return NULL;
+
+    const struct pktcache_entry *entries = (const struct pktcache_entry *)(base + sizeof(struct pktcache_header));
+    for (uint32_t i = 0; i < hdr->count; ++i) {
+        if (entries[i].offset > len || entries[i].len > len - entries[i].offset) return NULL;
+    }
+
+    pktcache_t *cache = malloc(sizeof(pktcache_t));
+    if (!cache) return NULL;
+    cache->base = base;
+    cache->len = len;
+    cache->mapped = mapped;
+    cache->hdr = hdr;
+    cache->entries = entries;
+    return cache;
+}
+
+pktcache_t *pktcache_map(const char *path, const unsigned char digest[16]) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) log_warn("pktcache_map(%s): open: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t len = (size_t)st.st_size;
+    const unsigned char *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_warn("pktcache_map(%s): mmap: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    pktcache_t *cache = pktcache_wrap(map, len, true, digest);
+    if (!cache) munmap((void *)map, len);
+    return cache;
+}
+
+bool pktcache_build(const char *worldpath, const unsigned char digest[16], struct auto_buffer *out) {
+    world_t *world = NULL;
+    if (access(worldpath, F_OK) == 0) {
+        world = world_load(worldpath);
+        if (!world) return false;
+    } else {
+        log_info("No world at %s, players will spawn in the void.", worldpath);
+    }
+
+    size_t count = proto_version_count * PKTCACHE_KINDS;
+    struct pktcache_entry *entries = calloc(count, sizeof(struct pktcache_entry));
+    struct auto_buffer blobs;
+    ab_init(&blobs, 0, 0);
+    bool success = entries != NULL;
+
+    size_t base = sizeof(struct pktcache_header) + count * sizeof(struct pktcache_entry);
+    for (size_t i = 0, e = 0; i < proto_version_count && success; ++i) {
+        for (unsigned kind = 0; kind < PKTCACHE_KINDS; ++kind, ++e) {
+            size_t start = ab_getwrcur(&blobs);
+            int res;
+            switch (kind) {
+                case PKTCACHE_STATUS:
+                    res = proto_encode_status(&blobs, proto_versions[i]);
+                    break;
+                case PKTCACHE_JOIN:
+                    res = proto_encode_join(&blobs, proto_versions[i], world);
+                    break;
+                default:
+                    res = proto_encode_legacy_ping(&blobs, kind == PKTCACHE_LEGACY_BETA);
+            }
+            if (res < 0) {
+                log_error("pktcache_build: encoding packets for protocol %u failed (%d)", proto_versions[i], res);
+                success = false;
+                break;
+            }
+
+            entries[e].protover = proto_versions[i];
+            entries[e].kind = kind;
+            entries[e].offset = base + start;
+            entries[e].len = ab_getwrcur(&blobs) - start;
+        }
+    }
+
+    if (success) {
+        struct pktcache_header hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, pktcache_magic, sizeof(pktcache_magic));
+        hdr.format = PKTCACHE_FORMAT;
+        hdr.count = (uint32_t)count;
+        memcpy(hdr.digest, digest, sizeof(hdr.digest));
+
+        success = ab_expect(out, base + ab_getwrcur(&blobs)) >= 0
+               && ab_push(out, &hdr, sizeof(hdr)) >= 0
+               && ab_push(out, entries, count * sizeof(struct pktcache_entry)) >= 0
+               && ab_push(out, blobs.buf, ab_getwrcur(&blobs)) >= 0;
+    }
+
+    ab_free(&blobs);
+    free(entries);
+    world_free(world);
+    return success;
+}
+
+bool pktcache_write(const char *path, const unsigned char *buf, size_t len) {
+    char *tmppath = NULL;
+    if (sprintf_alloc(&tmppath, "%s.tmp", path) < 0) return false;
+
+    int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log_warn("pktcache_write(%s): open: %s", tmppath, strerror(errno));
+        free(tmppath);
+        return false;
+    }
+
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            log_warn("pktcache_write(%s): write: %s", tmppath, strerror(errno));
+            goto fail;
+        }
+        buf += written;
+        len -= (size_t)written;
+    }
+
+    if (fsync(fd) < 0) log_warn("pktcache_write(%s): fsync: %s", tmppath, strerror(errno));
+    close(fd);
+
+    // rename is atomic, a crash never leaves a half-written cache behind
+    if (rename(tmppath, path) < 0) {
+        log_warn("pktcache_write: rename(%s, %s): %s", tmppath, path, strerror(errno));
+        unlink(tmppath);
+        free(tmppath);
+        return false;
+    }
+
+    free(tmppath);
+    return true;
+
+fail:
+    close(fd);
+    unlink(tmppath);
+    free(tmppath);
+    return false;
+}
+
+pktcache_t *pktcache_open(const char *path, const char *worldpath) {
+    unsigned char digest[16];
+    if (!pktcache_digest(worldpath, digest)) return NULL;
+
+    pktcache_t *cache = pktcache_map(path, digest);
+    if (cache) {
+        log_info("Using packet cache %s (%u blobs, %lu bytes)", path, cache->hdr->count, cache->len);
+        return cache;
+    }
+
+    log_info("Packet cache %s is missing or stale, rebuilding.", path);
+
+    struct auto_buffer built;
+    ab_init(&built, 0, 0);
+    if (!pktcache_build(worldpath, digest, &built)) {
+        log_error("pktcache_open(%s): unable to build packet cache", path);
+        ab_free(&built);
+        return NULL;
+    }
+
+    size_t len = ab_getwrcur(&built);
+    if (pktcache_write(path, built.buf, len) && (cache = pktcache_map(path, digest))) {
+        ab_free(&built);
+        log_info("Wrote packet cache %s (%u blobs, %lu bytes)", path, cache->hdr->count, cache->len);
+        return cache;
+    }
+
+    // could not persist it, serve from memory this time
+    log_warn("pktcache_open(%s): the cache could not be saved, it will be rebuilt on the next start", path);
+    cache = pktcache_wrap(built.buf, len, false, digest);
+    if (!cache) ab_free(&built);
+    return cache;
+}
+
+void pktcache_close(pktcache_t *cache) {
+    if (!cache) return;
+
+    if (cache->mapped) munmap((void *)cache->base, cache->len);
+    else free((void *)cache->base);
+    free(cache);
+}
+
+const unsigned char *pktcache_get(pktcache_t *cache, unsigned kind, protover_t protover, size_t *len) {
+    if (!cache) return NULL;
+
+    const struct pktcache_entry *match = NULL;
+    for (uint32_t i = 0; i < cache->hdr->count; ++i) {
+        const struct pktcache_entry *ent = cache->entries + i;
+        if (ent->kind != kind) continue;
+        if (ent->protover == protover) {
+            match = ent;
+            break;
+        }
+        if (ent->protover == proto_versions[0]) match = ent;
+    }
+
+    if (!match) return NULL;
+    *len = (size_t)match->len;
+    return cache->base + match->offset;
+}
@@ -0,0 +1,216 @@
+#include "playerindex.h"
+#include "client.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#define PLAYERINDEX_INITIAL_CAP (64)
+
+uint64_t playerindex_mix(uint64_t x) { // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x ? x : 1; // 0 marks an empty slot
+}
+
+uint64_t playerindex_hash_id(const struct uuid *id) {
+    return playerindex_mix(id->mostsig ^ (id->leastsig * 0x9e3779b97f4a7c15ull));
+}
+
+uint64_t playerindex_hash_name(const char *name) {
+    uint64_t hash = 0xcbf29ce484222325ull; // FNV-1a
+    for (; *name; ++name) {
+        hash ^= (unsigned char)tolower((unsigned char)*name);
+        hash *= 0x100000001b3ull;
+    }
+    return playerindex_mix(hash);
+}
+
+bool playerindex_key_eq(const struct playerindex_table *table, const struct playerindex_table *byid, const player_t *a, const player_t *b) {
+    if (table == byid) return !memcmp(&a->profile.id, &b->profile.id, sizeof(struct uuid));
+    return !strcasecmp(a->profile.name, b->profile.name);
+}
+
+int playerindex_table_init(struct playerindex_table *table) {
+    table->slots = calloc(PLAYERINDEX_INITIAL_CAP, sizeof(struct playerindex_slot));
+    if (!table->slots) return -1;
+    table->cap = PLAYERINDEX_INITIAL_CAP;
+    table->len = 0;
+    return 0;
+}
+
+// plain insert, the key must not be present
+void playerindex_table_place(struct playerindex_table *table, uint64_t hash, player_t *player) {
+    size_t mask = table->cap - 1;
+    size_t i = hash & mask;
+    while (table->slots[i].hash) i = (i + 1) & mask;
+    table->slots[i].hash = hash;
+    table->slots[i].player = player;
+    ++table->len;
+}
+
+int playerindex_table_grow(struct playerindex_table *table) {
+    struct playerindex_table grown;
+    grown.cap = table->cap * 2;
+    grown.len = 0;
+    grown.slots = calloc(grown.cap, sizeof(struct playerindex_slot));
+    if (!grown.slots) return -1;
+
+    for (size_t i = 0; i < table->cap; ++i) {
+        if (table->slots[i].hash) playerindex_table_place(&grown, table->slots[i].hash, table->slots[i].player);
+    }
+
+    free(table->slots);
+    *table = grown;
+    return 0;
+}
+
+// Returns the slot holding key (matched against the player's own fields), or the empty slot it would go in.
+struct playerindex_slot *playerindex_table_find(player_index_t *idx, struct playerindex_table *table, uint64_t hash, const player_t *key) {
+    size_t mask = table->cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct playerindex_slot *slot = table->slots + i;
+        if (!slot->hash) return slot;
+        if (slot->hash == hash && playerindex_key_eq(table, &idx->byid, slot->player, key)) return slot;
+    }
+}
+
+void playerindex_table_erase(struct playerindex_table *table, struct playerindex_slot *slot) {
+    size_t mask = table->cap - 1;
+    size_t hole = (size_t)(slot - table->slots);
+
+    // shift later members of the probe run back so lookups never stop early
+    for (size_t i = (hole + 1) & mask; table->slots[i].hash; i = (i + 1) & mask) {
+        size_t home = table->slots[i].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            table->slots[hole] = table->slots[i];
+            hole = i;
+        }
+    }
+
+    table->slots[hole].hash = 0;
+    table->slots[hole].player = NULL;
+    --table->len;
+}
+
+int playerindex_init(player_index_t *idx) {
+    memset(idx, 0, sizeof(player_index_t));
+    if (playerindex_table_init(&idx->byid) < 0) return -1;
+    if (playerindex_table_init(&idx->byname) < 0) {
+        free(idx->byid.slots);
+        return -1;
+    }
+
+    pthread_rwlock_init(&idx->lock, NULL);
+    return 0;
+}
+
+void playerindex_destroy(player_index_t *idx) {
+    pthread_rwlock_destroy(&idx->lock);
+    free(idx->byid.slots);
+    free(idx->byname.slots);
+}
+
+int playerindex_table_claim(player_index_t *idx, struct playerindex_table *table, uint64_t hash, player_t *player, player_t **old) {
+    *old = NULL;
+    if ((table->len + 1) * 2 > table->cap && playerindex_table_grow(table) < 0) return -1;
+
+    struct playerindex_slot *slot = playerindex_table_find(idx, table, hash, player);
+    if (slot->hash) {
+        *old = slot->player;
+        slot->player = player;
+        return 0;
+    }
+
+    slot->hash = hash;
+    slot->player = player;
+    ++table->len;
+    return 0;
+}
+
+int playerindex_claim(player_index_t *idx, player_t *player, client_t *evicted[2]) {
+    player_t *oldid, *oldname;
+    int count = 0;
+
+    pthread_rwlock_wrlock(&idx->lock);
+    if (playerindex_table_claim(idx, &idx->byid, playerindex_hash_id(&player->profile.id), player, &oldid) < 0) {
+        pthread_rwlock_unlock(&idx->lock);
+        return -1;
+    }
+
+    if (playerindex_table_claim(idx, &idx->byname, playerindex_hash_name(player->profile.name), player, &oldname) < 0) {
+        // undo the first half so both tables keep agreeing
+        struct playerindex_slot *slot = playerindex_table_find(idx, &idx->byid, playerindex_hash_id(&player->profile.id), player);
+        if (oldid) slot->player = oldid;
+        else playerindex_table_erase(&idx->byid, slot);
+        pthread_rwlock_unlock(&idx->lock);
+        return -1;
+    }
+
+    /* A replaced player may still sit in the other table under its other key
+     * (same uuid, different name casing). Drop it there too. */
+    player_t *old[2] = { oldid, oldname != oldid ? oldname : NULL };
+    for (int i = 0; i < 2; ++i) {
+        if (!old[i]) continue;
+
+        struct playerindex_slot *slot = playerindex_table_find(idx, &idx->byid, playerindex_hash_id(&old[i]->profile.id), old[i]);
+        if (slot->hash && slot->player == old[i]) playerindex_table_erase(&idx->byid, slot);
+        slot = playerindex_table_find(idx, &idx->byname, playerindex_hash_name(old[i]->profile.name), old[i]);
+        if (slot->hash && slot->player == old[i]) playerindex_table_erase(&idx->byname, slot);
+
+        client_retain(old[i]->conn);
+        evicted[count++] = old[i]->conn;
+    }
+    pthread_rwlock_unlock(&idx->lock);
+
+    return count;
+}
+
+void playerindex_remove(player_index_t *idx, player_t *player) {
+    pthread_rwlock_wrlock(&idx->lock);
+
+    struct playerindex_slot *slot = playerindex_table_find(idx, &idx->byid, playerindex_hash_id(&player->profile.id), player);
+    if (slot->hash && slot->player == player) playerindex_table_erase(&idx->byid, slot);
+    slot = playerindex_table_find(idx, &idx->byname, playerindex_hash_name(player->profile.name), player);
+    if (slot->hash && slot->player == player) playerindex_table_erase(&idx->byname, slot);
+
+    pthread_rwlock_unlock(&idx->lock);
+}
+
+client_t *playerindex_find(player_index_t *idx, struct playerindex_table *table, uint64_t hash, const player_t *key) {
+    client_t *found = NULL;
+
+    pthread_rwlock_rdlock(&idx->lock);
+    struct playerindex_slot *slot = playerindex_table_find(idx, table, hash, key);
+    if (slot->hash) {
+        found = slot->player->conn;
+        client_retain(found);
+    }
+    pthread_rwlock_unlock(&idx->lock);
+
+    return found;
+}
+
+client_t *playerindex_find_id(player_index_t *idx, const struct uuid *id) {
+    player_t key;
+    memcpy(&key.profile.id, id, sizeof(struct uuid));
+    return playerindex_find(idx, &idx->byid, playerindex_hash_id(id), &key);
+}
+
+client_t *playerindex_find_name(player_index_t *idx, const char *name) {
+    player_t key;
+    strncpy(key.profile.name, name, sizeof(key.profile.name) - 1);
+    key.profile.name[sizeof(key.profile.name) - 1] = '\0';
+    return playerindex_find(idx, &idx->byname, playerindex_hash_name(key.profile.name), &key);
+}
+
+size_t playerindex_count(player_index_t *idx) {
+    pthread_rwlock_rdlock(&idx->lock);
+    size_t count = idx->byid.len;
+    pthread_rwlock_unlock(&idx->lock);
+    return count;
+}
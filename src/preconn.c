@@ -0,0 +1,388 @@
+#include "preconn.h"
+#include "client.h"
+#include "protocol.h"
+#include "pktcache.h"
+#include "log.h"
+#include "macros.h"
+#include "metrics.h"
+#include "capture.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+void preconn_read_handler(file_descriptor_t *fd, void *handler_data);
+void preconn_error_handler(file_descriptor_t *fd, int error, void *handler_data);
+void preconn_handle_complete(file_descriptor_t *fd, void *handler_data);
+
+uint64_t preconn_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+preconn_t *preconn_start(int sockfd, const struct sockaddr *saddr, socklen_t saddrlen, client_registry_t *registry,
+                         admission_t *admission, const struct admission_key *admkey) {
+    preconn_t *pre = malloc(sizeof(preconn_t));
+    if (!pre) {
+        log_error("preconn_start: unable to allocate a connection record: malloc returned NULL");
+        admission_release(admission, admkey);
+        close(sockfd);
+        return NULL;
+    }
+    memset(pre, 0, offsetof(preconn_t, buf)); // the buffer needs no clearing
+
+    pre->fd.fd = sockfd;
+    pre->fd.loop = event_loop_current();
+    pre->fd.handler_data = pre;
+    pre->fd.read_handler = &preconn_read_handler;
+    pre->fd.error_handler = &preconn_error_handler;
+    pre->fd.handle_complete = &preconn_handle_complete;
+
+    pre->registry = registry;
+    pre->admission = admission;
+    pre->admkey = *admkey;
+    pre->saddrlen = saddrlen;
+    memcpy(&pre->saddr.base, saddr, saddrlen);
+
+    pre->born_ms = preconn_now_ms();
+    atomic_init(&pre->legacy_wait, false);
+    atomic_init(&pre->timed_out, false);
+    pre->capid = capture_conn_open(capture_default);
+    pre->protover = PROTOVER_UNSET;
+    pre->protocol = PROTOCOL_HANDSHAKE;
+    metrics_phase(METRICS_PHASE_NONE, PROTOCOL_HANDSHAKE);
+
+    // pending connections are tracked only so the tick can time them out
+    struct registry_shard *shard = registry_shard(registry, pre->fd.loop);
+    pthread_mutex_lock(&shard->mutex);
+    ilist_addend(&shard->pending, &pre->hook);
+    pre->shard = shard;
+    pthread_mutex_unlock(&shard->mutex);
+    atomic_fetch_add_explicit(&registry->npending, 1, memory_order_relaxed);
+
+    event_loop_want(&pre->fd, FD_WANT_READ);
+    return pre;
+}
+
+void preconn_unlink(preconn_t *pre) {
+    if (!pre->shard) return;
+
+    pthread_mutex_lock(&pre->shard->mutex);
+    ilist_remove(&pre->shard->pending, &pre->hook);
+    pthread_mutex_unlock(&pre->shard->mutex);
+    pre->shard = NULL;
+    atomic_fetch_sub_explicit(&pre->registry->npending, 1, memory_order_relaxed);
+}
+
+// Ends the connection (reason is an enum metrics_dc_reason), the event loop frees the record once the handler returns.
+void preconn_close(preconn_t *pre, unsigned reason) {
+    preconn_unlink(pre); // first, so a sweep can never shut down the fd after it has been reused
+
+    if (pre->fd.fd != -1) {
+        if (atomic_load_explicit(&pre->timed_out, memory_order_relaxed)) reason = METRICS_DC_TIMEOUT;
+        TRACE_DISCONNECT(pre->fd.fd, &pre->saddr.base, reason);
+
+        event_loop_delfd(&pre->fd);
+        close(pre->fd.fd);
+        pre->fd.fd = -1;
+        admission_release(pre->admission, &pre->admkey);
+        capture_conn_close(capture_default, pre->capid);
+
+        metrics_phase(pre->protocol, METRICS_PHASE_NONE);
+        metrics_disconnect(reason);
+    }
+
+    pre->fd.state |= FD_CALL_COMPLETE;
+}
+
+// Hands the socket to a full client, which goes on from the unconsumed bytes at consumed.
+void preconn_promote(preconn_t *pre, unsigned protocol, size_t consumed) {
+    preconn_unlink(pre);
+    event_loop_delfd(&pre->fd);
+
+    // the client counts the connection from here on
+    metrics_phase(pre->protocol, METRICS_PHASE_NONE);
+    client_t *client = client_init(pre->fd.fd, &pre->saddr.base, pre->saddrlen);
+    client->fd->loop = pre->fd.loop;
+    client_set_protocol(client, protocol);
+    client->protocol_ver = pre->protover;
+    client->admission = pre->admission;
+    client->admkey = pre->admkey;
+    client->capid = pre->capid;
+
+    // the socket and the admission slot belong to the client now
+    pre->fd.fd = -1;
+    pre->fd.state |= FD_CALL_COMPLETE;
+
+    registry_add(pre->registry, client);
+    client_start(client, pre->buf + consumed, pre->len - consumed);
+}
+
+/* Status replies are small. A peer whose socket cannot take one in a single go
+ * is not worth a send queue. pktid is only for the packet stats. */
+bool preconn_send(preconn_t *pre, int32_t pktid, const unsigned char *buf, size_t len) {
+    uint64_t start = metrics_now_ns();
+    size_t total = len;
+    metrics_add(METRIC_PACKETS_OUT, 1);
+    metrics_packet(pre->protocol, pktid, METRICS_PKT_OUT, len);
+    while (len > 0) {
+        ssize_t written = write(pre->fd.fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            TRACE_WRITE(pre->fd.fd, &pre->saddr.base, total - len, len); // nothing is queued, the rest goes with the connection
+            return false;
+        }
+        metrics_add(METRIC_BYTES_OUT, written);
+        buf += written;
+        len -= (size_t)written;
+    }
+    TRACE_WRITE(pre->fd.fd, &pre->saddr.base, total, (size_t)0);
+    metrics_packet_time(pre->protocol, pktid, METRICS_PKT_OUT, start);
+    return true;
+}
+
+// Returns 1 and fills val/used if a whole VarInt is there, 0 if more bytes are needed, -1 if it is too long.
+int preconn_peek_varint(const unsigned char *buf, size_t len, int32_t *val, size_t *used) {
+    uint32_t ret = 0;
+    for (size_t i = 0; i < 5; ++i) {
+        if (i >= len) return 0;
+        ret |= (uint32_t)(buf[i] & 0x7f) << (7 * i);
+        if (!(buf[i] & 0x80)) {
+            *val = (int32_t)ret;
+            *used = i + 1;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+// Returns false once the preconn is finished with (closed or promoted).
+bool preconn_handle_frame(preconn_t *pre, unsigned char *buf, int32_t len, size_t consumed) {
+    volatile struct read_context ctx;
+    struct read_context *ctxp = (struct read_context *)&ctx; // see client_read_common
+    jmp_buf errlbl;
+
+    ctx.remain = len;
+    ctx.protover = (int32_t)pre->protover;
+    ctx.reason = NULL;
+    ctx.reasonw = NULL;
+    ctx.errlbl = ctx.dclbl = &errlbl;
+
+    if (setjmp(errlbl)) { // malformed, this is not a client worth telling why
+        free(ctx.reason);
+        preconn_close(pre, METRICS_DC_PROTOCOL);
+        return false;
+    }
+
+    TRACE_FRAME(pre->fd.fd, &pre->saddr.base, len);
+    int32_t pktid = proto_read_varint(&buf, ctxp);
+    TRACE_DISPATCH(pre->fd.fd, &pre->saddr.base, pre->protocol, pktid, len);
+
+    if (pre->protocol == PROTOCOL_HANDSHAKE) {
+        if (pktid != 0) goto junk;
+
+        int32_t pvn = proto_read_varint(&buf, ctxp);
+        int32_t hostlen = proto_read_varint(&buf, ctxp);
+        if (hostlen < 0) goto junk;
+
+        const char *host = (const char *)buf;
+        proto_read_bytes(&buf, NULL, (size_t)hostlen, ctxp);
+        uint16_t port = proto_read_ushort(&buf, ctxp);
+        int32_t nextproto = proto_read_varint(&buf, ctxp);
+        if (ctx.remain != 0) goto junk;
+
+        log_debug_limit("Received handshake: pvn %d, host %.*s, port %hu, nextproto: %d", pvn, hostlen, host, port, nextproto);
+        pre->protover = (protover_t)pvn;
+
+        switch (nextproto) {
+            case PROTOCOL_STATUS:
+                metrics_phase(PROTOCOL_HANDSHAKE, PROTOCOL_STATUS);
+                pre->protocol = PROTOCOL_STATUS;
+                return true;
+            case PROTOCOL_LOGIN:
+                preconn_promote(pre, PROTOCOL_LOGIN, consumed);
+                return false;
+            default:
+                goto junk;
+        }
+    }
+
+    if (pktid == 0 && ctx.remain == 0) { // Status Request
+        size_t resplen;
+        const unsigned char *resp = pktcache_get(pktcache_default, PKTCACHE_STATUS, pre->protover, &resplen);
+        if (!resp || !preconn_send(pre, PKTID_WRITE_STATUS_RESPONSE, resp, resplen)) goto junk;
+        return true;
+    }
+
+    if (pktid == 1 && ctx.remain == 8) { // Ping, answered with the same payload and then we are done
+        unsigned char pong[10] = { 9, PKTID_WRITE_STATUS_PONG };
+        memcpy(pong + 2, buf, 8);
+        preconn_send(pre, PKTID_WRITE_STATUS_PONG, pong, sizeof(pong));
+        preconn_close(pre, METRICS_DC_CLOSED);
+        return false;
+    }
+
+junk:
+    preconn_close(pre, METRICS_DC_PROTOCOL);
+    return false;
+}
+
+#define PRECONN_LEGACY_MAYBE (-2)
+
+/* Old clients open with 0xFE instead of a VarInt length: beta sends it alone,
+ * 1.4-1.6 follow it with 0x01 (and 1.6 with an 0xFA plugin message). Those are
+ * also how a modern frame of 254 bytes or more starts, so only 0xFE 0x01 0xFA
+ * settles it right away; 0xFE 0x01 followed by anything else is a modern frame.
+ * Returns the cache kind to answer with, -1 if this is not a legacy ping, or
+ * PRECONN_LEGACY_MAYBE if it can't be told yet. A beta or 1.4-1.5 client sends
+ * nothing more, it is answered once it has gone quiet (see preconn_sweep). */
+int preconn_legacy_kind(const preconn_t *pre) {
+    if (pre->buf[0] != 0xFE) return -1;
+    if (pre->len == 1) return PRECONN_LEGACY_MAYBE;
+    if (pre->buf[1] != 0x01) return -1;
+    if (pre->len == 2) return PRECONN_LEGACY_MAYBE;
+    return pre->buf[2] == 0xFA ? PKTCACHE_LEGACY : -1;
+}
+
+// Answers a legacy ping with a kick carrying the server list entry, and closes.
+void preconn_legacy_reply(preconn_t *pre, unsigned kind) {
+    size_t resplen;
+    const unsigned char *resp = pktcache_get(pktcache_default, kind, pre->protover, &resplen);
+    metrics_add(METRIC_PACKETS_IN, 1);
+    metrics_packet(PROTOCOL_HANDSHAKE, 0xFE, METRICS_PKT_IN, pre->len);
+    if (resp) preconn_send(pre, 0xFF, resp, resplen); // legacy kick
+    preconn_close(pre, METRICS_DC_CLOSED);
+}
+
+// Handles every complete frame in the buffer. Returns false once the preconn is finished with.
+bool preconn_process(preconn_t *pre) {
+    size_t off = 0;
+
+    if (pre->protocol == PROTOCOL_HANDSHAKE) { // nothing consumed yet, this is the start of the stream
+        int kind = preconn_legacy_kind(pre);
+        atomic_store_explicit(&pre->legacy_wait, kind == PRECONN_LEGACY_MAYBE, memory_order_relaxed);
+        if (kind >= 0) {
+            preconn_legacy_reply(pre, (unsigned)kind);
+            return false;
+        }
+    }
+
+    while (off < pre->len) {
+        int32_t framelen;
+        size_t hdrlen;
+        int res = preconn_peek_varint(pre->buf + off, pre->len - off, &framelen, &hdrlen);
+        if (res == 0) break;
+        if (res < 0 || framelen <= 0) {
+            preconn_close(pre, METRICS_DC_PROTOCOL);
+            return false;
+        }
+
+        if (hdrlen + (size_t)framelen > PRECONN_BUF_SIZE) {
+            // never fits, e.g. a handshake carrying forwarded player info
+            if (pre->protocol == PROTOCOL_HANDSHAKE) preconn_promote(pre, PROTOCOL_HANDSHAKE, off);
+            else preconn_close(pre, METRICS_DC_PROTOCOL);
+            return false;
+        }
+
+        size_t next = off + hdrlen + (size_t)framelen;
+        if (next > pre->len) break;
+
+        // the id is only peeked for the packet stats, the frame handler reads it again
+        int32_t pktid = -1;
+        size_t idlen;
+        uint8_t phase = pre->protocol;
+        preconn_peek_varint(pre->buf + off + hdrlen, (size_t)framelen, &pktid, &idlen);
+        metrics_add(METRIC_PACKETS_IN, 1);
+        metrics_packet(phase, pktid, METRICS_PKT_IN, (size_t)framelen);
+
+        uint64_t start = metrics_now_ns();
+        bool more = preconn_handle_frame(pre, pre->buf + off + hdrlen, framelen, next);
+        metrics_packet_time(phase, pktid, METRICS_PKT_IN, start);
+        if (!more) return false;
+        off = next;
+    }
+
+    if (off > 0) {
+        memmove(pre->buf, pre->buf + off, pre->len - off);
+        pre->len -= (uint16_t)off;
+    }
+    return true;
+}
+
+void preconn_read_handler(file_descriptor_t *fd, void *handler_data) {
+    preconn_t *pre = handler_data;
+
+    while (true) {
+        ssize_t readcnt = read(fd->fd, pre->buf + pre->len, PRECONN_BUF_SIZE - pre->len);
+        if (readcnt == 0) {
+            // the sweep stops reading once an old client has been waiting on its reply long enough
+            if (atomic_load_explicit(&pre->legacy_wait, memory_order_relaxed)) {
+                preconn_legacy_reply(pre, pre->len == 1 ? PKTCACHE_LEGACY_BETA : PKTCACHE_LEGACY);
+                return;
+            }
+            preconn_close(pre, METRICS_DC_CLOSED);
+            return;
+        } else if (readcnt < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) fd->state &= ~FD_CAN_READ;
+            else preconn_close(pre, METRICS_DC_IO);
+            return;
+        }
+        metrics_add(METRIC_BYTES_IN, readcnt);
+        capture_data(capture_default, pre->capid, pre->buf + pre->len, (size_t)readcnt);
+
+        pre->len += (uint16_t)readcnt;
+        if (!preconn_process(pre)) return;
+    }
+}
+
+void preconn_error_handler(file_descriptor_t *fd, int error, void *handler_data) {
+    UNUSED(fd);
+    preconn_close(handler_data, error == 0 ? METRICS_DC_CLOSED : METRICS_DC_IO);
+}
+
+void preconn_handle_complete(file_descriptor_t *fd, void *handler_data) {
+    UNUSED(fd);
+    preconn_t *pre = handler_data;
+
+    preconn_close(pre, METRICS_DC_OTHER); // already closed, unless the handler left it open
+    free(pre);
+}
+
+void preconn_sweep(client_registry_t *registry, unsigned timeout) {
+    uint64_t now = preconn_now_ms();
+    if (now < timeout * 1000ull) return;
+    uint64_t cutoff = now - timeout * 1000ull, quiet = now - PRECONN_LEGACY_QUIET_MS;
+
+    for (unsigned i = 0; i < registry->nshards; ++i) {
+        struct registry_shard *shard = registry->shards + i;
+        pthread_mutex_lock(&shard->mutex);
+        ILIST_FOREACH(&shard->pending, hook) {
+            preconn_t *pre = LIST_CONTAINER(hook, preconn_t, hook);
+
+            // the owning thread sees the hangup and closes it, the fd can't be closed while we hold the lock
+            if (pre->born_ms <= cutoff) {
+                atomic_store_explicit(&pre->timed_out, true, memory_order_relaxed); // its disconnect probe and metric say so
+                shutdown(pre->fd.fd, SHUT_RDWR);
+            } else if (atomic_load_explicit(&pre->legacy_wait, memory_order_relaxed) && pre->born_ms <= quiet) {
+                shutdown(pre->fd.fd, SHUT_RD); // it reads the end of the stream and answers, the write side stays open
+            }
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+void preconn_close_all(client_registry_t *registry) {
+    for (unsigned i = 0; i < registry->nshards; ++i) {
+        struct registry_shard *shard = registry->shards + i;
+        ILIST_FOREACH(&shard->pending, hook) {
+            preconn_t *pre = LIST_CONTAINER(hook, preconn_t, hook);
+            preconn_close(pre, METRICS_DC_SHUTDOWN);
+            free(pre);
+        }
+    }
+}
@@ -3,6 +3,8 @@
 #include "log.h"
 #include "client.h"
 #include "endianutils.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include <string.h> // for memcpy
 #include <stdlib.h>
@@ -154,15 +156,21 @@ void proto_read_blockpos(unsigned char **buf, struct block_position *pos, struct
 
 void proto_handle_incoming(void *client, unsigned char *buf, struct read_context *ctx) {
     client_t *sender = client;
+    size_t len = (size_t)ctx->remain;
+    unsigned phase = sender->protocol; // the handler may well move the client on
 
     int32_t pktid = proto_read_varint(&buf, ctx);
     if (pktid < 0) {
         PROTOCOL_ERROR(ctx, "Suspicious packet ID: %d < 0", pktid);
     }
+    metrics_packet(phase, pktid, METRICS_PKT_IN, len);
+    TRACE_DISPATCH(sender->fd->fd, &sender->saddr.base, phase, pktid, len);
 
     packet_proc *target_func = client_protos[sender->protocol][client_proto_maxids[sender->protocol] < pktid ? 0 : pktid+1];
     if (target_func) {
+        uint64_t start = metrics_now_ns();
         (*target_func)(client, pktid, buf, ctx);
+        metrics_packet_time(phase, pktid, METRICS_PKT_IN, start);
     }
 }
 
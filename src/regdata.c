@@ -0,0 +1,208 @@
+#include "regdata.h"
+#include "nbt.h"
+#include "utils.h"
+#include "world.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+
+struct regdata_dimension {
+    const char *name;
+    int dimension; // WORLD_DIM_*
+    bool piglin_safe, natural, respawn_anchor_works, has_skylight, bed_works, has_raids, ultrawarm, has_ceiling;
+    float ambient_light;
+    int64_t fixed_time; // -1 if the sun moves
+    const char *infiniburn; // block tag, without the leading '#'
+    const char *effects;
+    int32_t logical_height;
+    double coordinate_scale;
+};
+
+struct regdata_biome {
+    const char *name;
+    const char *precipitation, *category;
+    float depth, scale, temperature, downfall;
+    int32_t sky_color, fog_color, water_color, water_fog_color;
+};
+
+const struct regdata_dimension regdata_dimensions[] = {
+    { "minecraft:overworld",  WORLD_DIM_OVERWORLD, false, true,  false, true,  true,  true,  false, false, 0.0f, -1,    "minecraft:infiniburn_overworld", "minecraft:overworld",  WORLD_HEIGHT, 1.0 },
+    { "minecraft:the_nether", WORLD_DIM_NETHER,    true,  false, true,  false, false, false, true,  true,  0.1f, 18000, "minecraft:infiniburn_nether",    "minecraft:the_nether", 128,          8.0 },
+    { "minecraft:the_end",    WORLD_DIM_END,       false, false, false, false, false, true,  false, false, 0.0f, 6000,  "minecraft:infiniburn_end",       "minecraft:the_end",    WORLD_HEIGHT, 1.0 }
+};
+
+// the client refuses to join without plains, its fallback biome
+const struct regdata_biome regdata_biomes[] = {
+    { "minecraft:plains",    "rain", "plains",  0.125f, 0.05f, 0.8f, 0.4f, 7907327, 12638463, 4159204, 329011 },
+    { "minecraft:the_void",  "none", "none",    0.1f,   0.2f,  0.5f, 0.5f, 8103167, 12638463, 4159204, 329011 },
+    { "minecraft:the_end",   "none", "theend",  0.1f,   0.2f,  0.5f, 0.5f, 0,       10518688, 4159204, 329011 }
+};
+
+#define REGDATA_DIMENSION_CNT (sizeof(regdata_dimensions) / sizeof(regdata_dimensions[0]))
+#define REGDATA_BIOME_CNT     (sizeof(regdata_biomes) / sizeof(regdata_biomes[0]))
+
+bool regdata_needed(protover_t protover) {
+    return protover >= PROTOVER_1_16_2 && protover <= PROTOVER_1_18_2;
+}
+
+#define REGDATA_CHECK(_expr) do { int _res = (_expr); if (_res < 0) return _res; } while (0)
+
+int regdata_write_dimension(struct auto_buffer *out, protover_t protover, const struct regdata_dimension *dim) {
+    REGDATA_CHECK(nbt_write_byte(out, "piglin_safe", dim->piglin_safe));
+    REGDATA_CHECK(nbt_write_byte(out, "natural", dim->natural));
+    REGDATA_CHECK(nbt_write_float(out, "ambient_light", dim->ambient_light));
+    if (dim->fixed_time >= 0) REGDATA_CHECK(nbt_write_long(out, "fixed_time", dim->fixed_time));
+
+    if (protover >= PROTOVER_1_18_2) {
+        char tag[64];
+        snprintf(tag, sizeof(tag), "#%s", dim->infiniburn);
+        REGDATA_CHECK(nbt_write_string(out, "infiniburn", tag));
+    } else {
+        REGDATA_CHECK(nbt_write_string(out, "infiniburn", dim->infiniburn));
+    }
+
+    REGDATA_CHECK(nbt_write_byte(out, "respawn_anchor_works", dim->respawn_anchor_works));
+    REGDATA_CHECK(nbt_write_byte(out, "has_skylight", dim->has_skylight));
+    REGDATA_CHECK(nbt_write_byte(out, "bed_works", dim->bed_works));
+    REGDATA_CHECK(nbt_write_string(out, "effects", dim->effects));
+    REGDATA_CHECK(nbt_write_byte(out, "has_raids", dim->has_raids));
+
+    // 1.17 made the build height configurable, the world we send never leaves 0-255
+    if (protover >= PROTOVER_1_17) {
+        REGDATA_CHECK(nbt_write_int(out, "min_y", 0));
+        REGDATA_CHECK(nbt_write_int(out, "height", WORLD_HEIGHT));
+    }
+
+    REGDATA_CHECK(nbt_write_int(out, "logical_height", dim->logical_height));
+    REGDATA_CHECK(nbt_write_double(out, "coordinate_scale", dim->coordinate_scale));
+    REGDATA_CHECK(nbt_write_byte(out, "ultrawarm", dim->ultrawarm));
+    REGDATA_CHECK(nbt_write_byte(out, "has_ceiling", dim->has_ceiling));
+    return 0;
+}
+
+int regdata_write_biome(struct auto_buffer *out, protover_t protover, const struct regdata_biome *biome) {
+    REGDATA_CHECK(nbt_write_string(out, "precipitation", biome->precipitation));
+    if (protover < PROTOVER_1_18) {
+        REGDATA_CHECK(nbt_write_float(out, "depth", biome->depth));
+        REGDATA_CHECK(nbt_write_float(out, "scale", biome->scale));
+    }
+    REGDATA_CHECK(nbt_write_float(out, "temperature", biome->temperature));
+    REGDATA_CHECK(nbt_write_float(out, "downfall", biome->downfall));
+    REGDATA_CHECK(nbt_write_string(out, "category", biome->category));
+
+    REGDATA_CHECK(nbt_write_compound(out, "effects"));
+    REGDATA_CHECK(nbt_write_int(out, "sky_color", biome->sky_color));
+    REGDATA_CHECK(nbt_write_int(out, "fog_color", biome->fog_color));
+    REGDATA_CHECK(nbt_write_int(out, "water_color", biome->water_color));
+    REGDATA_CHECK(nbt_write_int(out, "water_fog_color", biome->water_fog_color));
+    return nbt_write_end(out);
+}
+
+int regdata_encode_codec(struct auto_buffer *out, protover_t protover) {
+    REGDATA_CHECK(nbt_write_root(out, "", false));
+
+    REGDATA_CHECK(nbt_write_compound(out, "minecraft:dimension_type"));
+    REGDATA_CHECK(nbt_write_string(out, "type", "minecraft:dimension_type"));
+    REGDATA_CHECK(nbt_write_list(out, "value", NBT_COMPOUND, (int32_t)REGDATA_DIMENSION_CNT));
+    for (size_t i = 0; i < REGDATA_DIMENSION_CNT; ++i) {
+        REGDATA_CHECK(nbt_write_string(out, "name", regdata_dimensions[i].name));
+        REGDATA_CHECK(nbt_write_int(out, "id", (int32_t)i));
+        REGDATA_CHECK(nbt_write_compound(out, "element"));
+        REGDATA_CHECK(regdata_write_dimension(out, protover, regdata_dimensions + i));
+        REGDATA_CHECK(nbt_write_end(out)); // element
+        REGDATA_CHECK(nbt_write_end(out)); // list entry
+    }
+    REGDATA_CHECK(nbt_write_end(out));
+
+    REGDATA_CHECK(nbt_write_compound(out, "minecraft:worldgen/biome"));
+    REGDATA_CHECK(nbt_write_string(out, "type", "minecraft:worldgen/biome"));
+    REGDATA_CHECK(nbt_write_list(out, "value", NBT_COMPOUND, (int32_t)REGDATA_BIOME_CNT));
+    for (size_t i = 0; i < REGDATA_BIOME_CNT; ++i) {
+        REGDATA_CHECK(nbt_write_string(out, "name", regdata_biomes[i].name));
+        REGDATA_CHECK(nbt_write_int(out, "id", (int32_t)i));
+        REGDATA_CHECK(nbt_write_compound(out, "element"));
+        REGDATA_CHECK(regdata_write_biome(out, protover, regdata_biomes + i));
+        REGDATA_CHECK(nbt_write_end(out));
+        REGDATA_CHECK(nbt_write_end(out));
+    }
+    REGDATA_CHECK(nbt_write_end(out));
+
+    return nbt_write_end(out); // root
+}
+
+int regdata_encode_dimension(struct auto_buffer *out, protover_t protover, int dimension) {
+    for (size_t i = 0; i < REGDATA_DIMENSION_CNT; ++i) {
+        if (regdata_dimensions[i].dimension != dimension) continue;
+
+        REGDATA_CHECK(nbt_write_root(out, "", false));
+        REGDATA_CHECK(regdata_write_dimension(out, protover, regdata_dimensions + i));
+        return nbt_write_end(out);
+    }
+    return -1;
+}
+
+#undef REGDATA_CHECK
+
+// one codec per protocol version, the tables never change after startup
+struct regdata_blob {
+    protover_t protover;
+    unsigned char *buf;
+    size_t len;
+    struct regdata_blob *next;
+};
+
+pthread_mutex_t regdata_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct regdata_blob *regdata_blobs = NULL;
+
+const unsigned char *regdata_codec(protover_t protover, size_t *len) {
+    if (!regdata_needed(protover)) return NULL;
+
+    pthread_mutex_lock(&regdata_mutex);
+    struct regdata_blob *blob;
+    for (blob = regdata_blobs; blob; blob = blob->next) {
+        if (blob->protover == protover) goto found;
+    }
+
+    blob = malloc(sizeof(struct regdata_blob));
+    if (!blob) goto fail;
+
+    struct auto_buffer buf;
+    ab_init(&buf, 0, 0);
+    int res = regdata_encode_codec(&buf, protover);
+    if (res < 0) {
+        log_error("regdata_codec: encoding the codec for protocol %u failed (%d)", protover, res);
+        ab_free(&buf);
+        free(blob);
+        goto fail;
+    }
+
+    blob->protover = protover;
+    blob->buf = buf.buf;
+    blob->len = ab_getwrcur(&buf);
+    blob->next = regdata_blobs;
+    regdata_blobs = blob;
+    log_debug("Encoded the dimension codec for protocol %u (%lu bytes)", protover, blob->len);
+
+found:
+    pthread_mutex_unlock(&regdata_mutex);
+    *len = blob->len;
+    return blob->buf;
+
+fail:
+    pthread_mutex_unlock(&regdata_mutex);
+    return NULL;
+}
+
+void regdata_cleanup(void) {
+    pthread_mutex_lock(&regdata_mutex);
+    while (regdata_blobs) {
+        struct regdata_blob *next = regdata_blobs->next;
+        free(regdata_blobs->buf);
+        free(regdata_blobs);
+        regdata_blobs = next;
+    }
+    pthread_mutex_unlock(&regdata_mutex);
+}
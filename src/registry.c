@@ -0,0 +1,135 @@
+#include "registry.h"
+#include "client.h"
+#include "log.h"
+#include "epoch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+client_registry_t *registry_create(unsigned nshards) {
+    if (nshards == 0) nshards = 1;
+
+    client_registry_t *reg = malloc(sizeof(client_registry_t));
+    if (!reg) return NULL;
+    memset(reg, 0, sizeof(client_registry_t));
+
+    reg->shards = aligned_alloc(64, nshards * sizeof(struct registry_shard));
+    if (!reg->shards) {
+        free(reg);
+        return NULL;
+    }
+
+    if (playerindex_init(&reg->players) < 0) {
+        free(reg->shards);
+        free(reg);
+        return NULL;
+    }
+
+    reg->nshards = nshards;
+    for (unsigned i = 0; i < nshards; ++i) {
+        pthread_mutex_init(&reg->shards[i].mutex, NULL);
+        ilist_init(&reg->shards[i].clients);
+        ilist_init(&reg->shards[i].pending);
+    }
+
+    atomic_init(&reg->count, 0);
+    atomic_init(&reg->npending, 0);
+    return reg;
+}
+
+void registry_free(client_registry_t *reg) {
+    if (!reg) return;
+
+    for (unsigned i = 0; i < reg->nshards; ++i) {
+        pthread_mutex_destroy(&reg->shards[i].mutex);
+    }
+
+    playerindex_destroy(&reg->players);
+    free(reg->shards);
+    free(reg);
+}
+
+void registry_add(client_registry_t *reg, client_t *cli) {
+    struct registry_shard *shard = registry_shard(reg, cli->fd->loop);
+    pthread_mutex_lock(&shard->mutex);
+    ilist_addend_rcu(&shard->clients, &cli->reghook);
+    cli->registry = reg;
+    atomic_store_explicit(&cli->shard, shard, memory_order_release);
+    pthread_mutex_unlock(&shard->mutex);
+
+    atomic_fetch_add_explicit(&reg->count, 1, memory_order_relaxed);
+}
+
+void registry_remove(client_t *cli) {
+    // whoever swaps the shard out owns the removal
+    struct registry_shard *shard = atomic_exchange_explicit(&cli->shard, NULL, memory_order_acq_rel);
+    if (!shard) return;
+
+    pthread_mutex_lock(&shard->mutex);
+    ilist_remove_rcu(&shard->clients, &cli->reghook);
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (cli->player) playerindex_remove(&cli->registry->players, cli->player);
+
+    atomic_fetch_sub_explicit(&cli->registry->count, 1, memory_order_relaxed);
+}
+
+// Appends the clients of one shard, inside an epoch section. Returns false if the snapshot could not grow.
+bool registry_snapshot_append(struct registry_shard *shard, struct registry_snapshot *snap) {
+    ILIST_FOREACH_RCU(&shard->clients, hook) {
+        client_t *cli = LIST_CONTAINER(hook, client_t, reghook);
+        if (!client_tryretain(cli)) continue; // on its way out
+
+        if (snap->len == snap->cap) {
+            size_t newcap = snap->cap ? snap->cap * 2 : 64;
+            client_t **newclients = realloc(snap->clients, newcap * sizeof(client_t *));
+            if (!newclients) {
+                client_release(cli);
+                log_error("registry_snapshot: unable to grow the snapshot to %lu clients", newcap);
+                return false;
+            }
+            snap->clients = newclients;
+            snap->cap = newcap;
+        }
+
+        snap->clients[snap->len++] = cli;
+    }
+
+    return true;
+}
+
+size_t registry_snapshot(client_registry_t *reg, struct registry_snapshot *snap) {
+    snap->len = 0;
+
+    epoch_enter();
+    for (unsigned i = 0; i < reg->nshards; ++i) {
+        if (!registry_snapshot_append(reg->shards + i, snap)) break;
+    }
+    epoch_exit();
+
+    return snap->len;
+}
+
+size_t registry_snapshot_shard(client_registry_t *reg, unsigned idx, struct registry_snapshot *snap) {
+    snap->len = 0;
+
+    epoch_enter();
+    registry_snapshot_append(registry_shard(reg, idx), snap);
+    epoch_exit();
+
+    return snap->len;
+}
+
+void registry_snapshot_release(struct registry_snapshot *snap) {
+    for (size_t i = 0; i < snap->len; ++i) {
+        client_release(snap->clients[i]);
+    }
+    snap->len = 0;
+}
+
+void registry_snapshot_free(struct registry_snapshot *snap) {
+    registry_snapshot_release(snap);
+    free(snap->clients);
+    snap->clients = NULL;
+    snap->cap = 0;
+}
@@ -9,57 +9,146 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <unistd.h>
-#include <fcntl.h>
 #include <sys/un.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
+#include <linux/filter.h>
+#include <sys/syscall.h>
 #include <stdbool.h>
 
 #include "log.h"
 #include "client.h"
+#include "preconn.h"
+#include "handoff.h"
+#include "metrics.h"
+#include "trace.h"
 
 void server_handle_read(file_descriptor_t *fd, void *handler_info);
 
-int make_fd_nonblock(int fd) {
-    int flags = fcntl(fd, F_GETFL);
-    if (flags < 0) return flags;
-    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+/* glibc only declares accept4 under _GNU_SOURCE, and that breaks pthread.h here
+ * (include/sched.h shadows the system one), so call it directly. */
+int server_accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+    return (int)syscall(SYS_accept4, sockfd, addr, addrlen, flags);
 }
 
-server_t *server_init_common(int sockfd, struct sockaddr *saddr, socklen_t saddrlen) {
-/*        server_t *server = malloc(sizeof(server_t));
-        memset(server, 0, sizeof(server_t));
-        *target = server;
-
-        file_descriptor_t *fd = malloc(sizeof(file_descriptor_t));
-        memset(fd, 0, sizeof(file_descriptor_t));
-        fd->fd = sockfd;
-        fd->handler_data = server;
-        fd->read_handler = &server_handle_read;
-        server->fd = fd;
-
-        server->saddrlen = cursor->ai_addrlen;
-        memcpy(&server->saddr, cursor->ai_addr, cursor->ai_addrlen);*/
+server_t *server_init_common(const int *sockfds, unsigned nfds, struct sockaddr *saddr, socklen_t saddrlen) {
     server_t *server = malloc(sizeof(server_t));
     memset(server, 0, sizeof(server_t));
 
-    file_descriptor_t *fd = malloc(sizeof(file_descriptor_t));
-    memset(fd, 0, sizeof(file_descriptor_t));
-    fd->fd = sockfd;
-    fd->handler_data = server;
-    fd->read_handler = &server_handle_read;
-    server->fd = fd;
+    file_descriptor_t *fds = calloc(nfds, sizeof(file_descriptor_t));
+    for (unsigned i = 0; i < nfds; ++i) {
+        fds[i].fd = sockfds[i];
+        fds[i].loop = i; // one listener per IO thread, the connections it accepts stay there
+        fds[i].handler_data = server;
+        fds[i].read_handler = &server_handle_read;
+    }
+    server->fds = fds;
+    server->nfds = nfds;
 
     server->saddrlen = saddrlen;
     memcpy(&server->saddr.base, saddr, saddrlen);
     return server;
 }
 
-bool server_init(const char *host, unsigned short port, unsigned flags, server_t **target) {
+/* Opens one listening socket on ai, or returns -1. reuseport lets several of them share the address; if the
+ * kernel won't have that, it returns -2 instead so the caller can make do with one plain listener. */
+int server_listen_socket(const struct addrinfo *ai, unsigned flags, bool reuseport, int backlog, const char *host, unsigned short port) {
+    int sockfd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 /*or IPPROTO_TCP*/);
+    if (sockfd < 0) {
+        log_error("server_init(%s, %hu): socket: %s", host, port, strerror(errno));
+        return -1;
+    }
+
+    // enable reuseaddr
+    int reuseaddr = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof(int)) < 0) {
+        log_warn("server_init(%s, %hu): setsockopt(SOL_SOCKET, SO_REUSEADDR, %d): %s", host, port, reuseaddr, strerror(errno));
+    }
+
+    if (reuseport) {
+        int val = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(int)) < 0) {
+            log_warn("server_init(%s, %hu): setsockopt(SOL_SOCKET, SO_REUSEPORT, %d): %s", host, port, val, strerror(errno));
+            close(sockfd);
+            return -2;
+        }
+    }
+
+    // enable/disable IPV6_V6ONLY depending on the flag (different systems have different defaults, see ipv6(7))
+    if (ai->ai_family == AF_INET6) {
+        int val = !!(flags & SERVER_IPV6ONLY);
+        if (setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &val, sizeof(int)) < 0) {
+            log_warn("server_init(%s, %hu): setsockopt(IPPROTO_IPV6, IPV6_V6ONLY, %d): %s", host, port, val, strerror(errno));
+        }
+    } else if (flags & SERVER_IPV6ONLY) {
+        log_warn("server_init(%s, %hu): server has flag SERVER_IPV6ONLY but host has family AF_INET, ignoring flag.", host, port);
+    }
+
+    // actually do the bind
+    if (bind(sockfd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        log_error("server_init(%s, %hu): bind: %s", host, port, strerror(errno));
+        goto fail;
+    }
+
+    // and start listening for connections (none will be accepted until this is added to the event loop, though)
+    if (listen(sockfd, backlog) < 0) {
+        log_error("server_init(%s, %hu): listen: %s", host, port, strerror(errno));
+        goto fail;
+    }
+
+    return sockfd;
+
+fail:
+    close(sockfd);
+    return -1;
+}
+
+/* The kernel picks the listener of a reuseport group by the returned index, so
+ * a connection lands on the listener whose index is the CPU that received it. */
+bool server_steer_by_cpu(int sockfd, unsigned nfds) {
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, nfds },
+        { BPF_RET | BPF_A, 0, 0, 0 }
+    };
+    struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+    return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+}
+
+bool server_steer_to_cpus(server_t *server, const int *cpus) {
+    if (server->nfds < 2) return true;
+
+    // a compare and a return per listener, then the plain modulo for CPUs no listener is on
+    struct sock_filter *code = calloc(2 * server->nfds + 3, sizeof(struct sock_filter));
+    if (!code) return false;
+
+    unsigned len = 0;
+    code[len++] = (struct sock_filter){ BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) };
+    for (unsigned i = 0; i < server->nfds; ++i) {
+        bool seen = false; // a CPU shared by several listeners only goes to the first
+        for (unsigned j = 0; j < i; ++j) seen = seen || cpus[j] == cpus[i];
+        if (seen || cpus[i] < 0) continue;
+
+        code[len++] = (struct sock_filter){ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, (uint32_t)cpus[i] };
+        code[len++] = (struct sock_filter){ BPF_RET | BPF_K, 0, 0, i };
+    }
+    code[len++] = (struct sock_filter){ BPF_ALU | BPF_MOD | BPF_K, 0, 0, server->nfds };
+    code[len++] = (struct sock_filter){ BPF_RET | BPF_A, 0, 0, 0 };
+
+    struct sock_fprog prog = { .len = (unsigned short)len, .filter = code };
+    bool success = setsockopt(server->fds[0].fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+    free(code);
+    return success;
+}
+
+bool server_init(const char *host, unsigned short port, unsigned flags, unsigned nlisteners, int backlog, server_t **target) {
     struct addrinfo *res = NULL, hints;
     memset(&hints, 0, sizeof(hints));
     bool success = true;
 
+    if (nlisteners == 0) nlisteners = 1;
+    int *sockfds = calloc(nlisteners, sizeof(int));
+
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_protocol = IPPROTO_TCP;
@@ -79,67 +168,45 @@ bool server_init(const char *host, unsigned short port, unsigned flags, server_t
         goto done;
     }
 
-    struct addrinfo *cursor = res;
-    while (cursor) {
+    for (struct addrinfo *cursor = res; cursor; cursor = cursor->ai_next) {
         // ignore weird address families
         if (cursor->ai_family != AF_INET && cursor->ai_family != AF_INET6) continue;
 
         // try binding to hosts until it works
-        int sockfd = socket(cursor->ai_family, SOCK_STREAM, 0 /*or IPPROTO_TCP*/);
-        if (sockfd < 0) {
-            log_error("server_init(%s, %hu): socket: %s", host, port, strerror(errno));
-            success = false;
-            goto done;
-        }
-
-        // make the socket nonblocking
-        if (make_fd_nonblock(sockfd) < 0) {
-            log_error("server_init(%s, %hu): fcntl: %s", host, port, strerror(errno));
-            close(sockfd);
-            success = false;
-            goto done;
-        }
-
-        // enable reuseaddr
-        int reuseaddr = 1;
-        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof(int)) < 0) {
-            log_warn("server_init(%s, %hu): setsockopt(SOL_SOCKET, SO_REUSEADDR, %d): %s", host, port, reuseaddr, strerror(errno));
-        }
-
-        // enable/disable IPV6_V6ONLY depending on the flag (different systems have different defaults, see ipv6(7))
-        if (cursor->ai_family == AF_INET6) {
-            int val = !!(flags & SERVER_IPV6ONLY);
-            if (setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &val, sizeof(int)) < 0) {
-                log_warn("server_init(%s, %hu): setsockopt(IPPROTO_IPV6, IPV6_V6ONLY, %d): %s", host, port, val, strerror(errno));
+        unsigned nwant = nlisteners;
+        bool reuseport = nwant > 1;
+        unsigned nfds = 0;
+        while (nfds < nwant) {
+            int sockfd = server_listen_socket(cursor, flags, reuseport, backlog, host, port);
+            if (sockfd == -2 && nfds == 0) { // no SO_REUSEPORT here, so have the one listener the address allows
+                log_warn("server_init(%s, %hu): SO_REUSEPORT is unavailable, falling back to a single listener", host, port);
+                reuseport = false;
+                nwant = 1;
+                continue;
             }
-        } else if (flags & SERVER_IPV6ONLY) {
-            log_warn("server_init(%s, %hu): server has flag SERVER_IPV6ONLY but host has family AF_INET, ignoring flag.", host, port);
+            if (sockfd < 0) break;
+            sockfds[nfds++] = sockfd;
         }
 
-        // actually do the bind
-        if (bind(sockfd, cursor->ai_addr, cursor->ai_addrlen) < 0) {
-            log_error("server_init(%s, %hu): bind: %s", host, port, strerror(errno));
-            goto failcontinue;
+        if (nfds == 0) continue;
+        if (nfds < nwant) { // a lone listener still works, just without spreading the accept load
+            log_warn("server_init(%s, %hu): only %u of %u listeners could be opened", host, port, nfds, nwant);
         }
 
-        // and start listening for connections (none will be accepted until this is added to the event loop, though)
-        if (listen(sockfd, 20) < 0) {
-            log_error("server_init(%s, %hu): listen: %s", host, port, strerror(errno));
-            goto failcontinue;
+        if (nfds > 1 && (flags & SERVER_STEER_CPU) && !server_steer_by_cpu(sockfds[0], nfds)) {
+            log_warn("server_init(%s, %hu): setsockopt(SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF): %s", host, port, strerror(errno));
         }
 
-        // wrap our file descriptor in a new server object
-        *target = server_init_common(sockfd, cursor->ai_addr, cursor->ai_addrlen);
+        // wrap our file descriptors in a new server object
+        *target = server_init_common(sockfds, nfds, cursor->ai_addr, cursor->ai_addrlen);
+        (*target)->metrics = !!(flags & SERVER_METRICS);
         goto done;
-
-failcontinue:
-        close(sockfd);
-        cursor = cursor->ai_next;
     }
 
     success = false;
 
 done:
+    free(sockfds);
     if (res) freeaddrinfo(res);
     return success;
 }
@@ -166,9 +233,8 @@ bool ensure_sockfile_avail(const char *path) {
 }
 #endif
 
-bool server_init_unix(const char *path, unsigned flags, server_t **target) {
+bool server_init_unix(const char *path, unsigned flags, int backlog, server_t **target) {
     //if (!ensure_sockfile_avail(path)) return false;
-    (void)flags;
 
     struct sockaddr_un addr;
     memset(&addr, 0, sizeof(addr));
@@ -178,14 +244,15 @@ bool server_init_unix(const char *path, unsigned flags, server_t **target) {
     strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
     addr.sun_path[sizeof(addr.sun_path)-1] = '\0';
 
-    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sockfd < 0) {
         log_error("server_init_unix(%s): socket: %s", path, strerror(errno));
         return false;
     }
 
-    if (make_fd_nonblock(sockfd) < 0) {
-        log_error("server_init_unix(%s): fcntl: %s", path, strerror(errno));
+    // bind creates the file with the socket's mode (less the umask), so nobody else ever gets to connect
+    if (fchmod(sockfd, S_IRUSR | S_IWUSR) < 0) {
+        log_error("server_init_unix(%s): fchmod: %s", path, strerror(errno));
         close(sockfd);
         return false;
     }
@@ -197,32 +264,53 @@ bool server_init_unix(const char *path, unsigned flags, server_t **target) {
         return false;
     }
 
-    if (listen(sockfd, 20) < 0) {
+    if (listen(sockfd, backlog) < 0) {
         log_error("server_init_unix(%s): listen: %s", path, strerror(errno));
         close(sockfd);
         return false;
     }
 
-    *target = server_init_common(sockfd, (struct sockaddr *)&addr, sizeof(addr));
+    *target = server_init_common(&sockfd, 1, (struct sockaddr *)&addr, sizeof(addr));
+    (*target)->proxy_handoff = !!(flags & SERVER_PROXY_HANDOFF);
 
     return true;
 }
 
+server_t *server_adopt(const int *sockfds, unsigned nfds) {
+    sockaddrs saddr;
+    socklen_t saddrlen = sizeof(saddr);
+    if (getsockname(sockfds[0], &saddr.base, &saddrlen) < 0) {
+        log_warn("server_adopt: getsockname: %s", strerror(errno));
+        memset(&saddr, 0, sizeof(saddr));
+        saddrlen = sizeof(saddr.base);
+    }
+
+    return server_init_common(sockfds, nfds, &saddr.base, saddrlen);
+}
+
 void server_free(server_t *server) {
     if (!server) return;
-    if (server->fd) close(server->fd->fd);
+    for (unsigned i = 0; i < server->nfds; ++i) close(server->fds[i].fd);
 
-    if (server->saddr.base.sa_family == AF_UNIX) {
+    if (server->saddr.base.sa_family == AF_UNIX && !server->handed_off) {
         char *path = server->saddr.un.sun_path;
         if (unlink(path) < 0) {
             log_error("server_free: Unable to unlink '%s': %s", path, strerror(errno));
         }
     }
 
-    free(server->fd);
+    free(server->fds);
     free(server);
 }
 
+void server_start(server_t *server) {
+    for (unsigned i = 0; i < server->nfds; ++i) event_loop_want(server->fds + i, FD_WANT_READ);
+}
+
+void server_stop(server_t *server) {
+    for (unsigned i = 0; i < server->nfds; ++i) event_loop_delfd(server->fds + i);
+}
+
 void server_handle_read(file_descriptor_t *fd, void *handler_info) {
     server_t *server = (server_t *)handler_info;
 
@@ -232,7 +320,7 @@ void server_handle_read(file_descriptor_t *fd, void *handler_info) {
     while (true) {
         saddrlen = sizeof(saddr);
         accattempt = 0;
-        int accfd = accept(fd->fd, (struct sockaddr *)&saddr, &saddrlen);
+        int accfd = server_accept4(fd->fd, (struct sockaddr *)&saddr, &saddrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (accfd < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) { // no more peers to accept
                 fd->state &= ~FD_CAN_READ;
@@ -247,21 +335,36 @@ void server_handle_read(file_descriptor_t *fd, void *handler_info) {
             }
         }
 
-        if (make_fd_nonblock(accfd) < 0) {
-            log_error("server_handle_read: fcntl: %s", strerror(errno));
+        if (server->proxy_handoff) { // a proxy on this host running as this user, see handoff_proxy_accept
+            handoff_proxy_accept(accfd, server->clients);
+            continue;
+        }
+
+        if (server->metrics) {
+            metrics_http_accept(accfd);
+            continue;
+        }
+
+        // before anything is allocated for the peer, a flood must stay cheap to turn away
+        struct admission_key admkey = { 0 };
+        if (server->admission && admission_admit(server->admission, (struct sockaddr *)&saddr, &admkey) != ADMISSION_OK) {
+            struct linger lin = { .l_onoff = 1, .l_linger = 0 }; // reset, don't leave a TIME_WAIT behind
+            setsockopt(accfd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
             close(accfd);
+            metrics_add(METRIC_ADMISSION_REJECTS, 1);
             continue;
         }
 
         if (!server->clients) {
             log_error("I've got nowhere to put my users! Closing connection %d.", accfd);
+            admission_release(server->admission, &admkey);
             close(accfd);
             continue;
         }
 
-        client_t *client = client_init(accfd, (struct sockaddr *)&saddr, saddrlen);
-        client->clients = server->clients;
-        client->mypos = dll_addend(server->clients, client);
-        event_loop_want(client->fd, FD_WANT_READ | FD_WANT_WRITE);
+        // a full client_t is only made once the peer wants to log in
+        metrics_add(METRIC_ACCEPTS, 1);
+        TRACE_ACCEPT(accfd, (struct sockaddr *)&saddr);
+        preconn_start(accfd, (struct sockaddr *)&saddr, saddrlen, server->clients, server->admission, &admkey);
     }
 }
@@ -21,8 +21,9 @@ size_t utf8_encode_bmp(wchar_t cp, unsigned char *out) {
 }
 
 void utf_supp_to_surrogates(wchar_t in, wchar_t *high, wchar_t *low) {
+    in -= 0x10000;
     *high = 0xD800 | (in >> 10);
-    *low  = 0xDC00 | (in & 0x02FF);
+    *low  = 0xDC00 | (in & 0x03FF);
 }
 
 int proto_write_wlenstr(struct auto_buffer *buf, const wchar_t *str, int32_t chlen) {
@@ -86,10 +87,7 @@ int proto_write_utf16be_lenstr(struct auto_buffer *buf, const wchar_t *str, int3
         chlen = (int32_t)chlen2;
     }
 
-    /* UTF-16 is a fixed-length encoding and the length is in characters
-     * so we only need one length check (this one).
-     */
-    if (chlen > 0x7FFF) return -3;
+    // the length is in UTF-16 code units, checked once everything is encoded
 
     struct auto_buffer strbuf;
     ab_init(&strbuf, 0, 0);
@@ -115,7 +113,13 @@ int proto_write_utf16be_lenstr(struct auto_buffer *buf, const wchar_t *str, int3
         }
     }
 
-    proto_write_short(buf, (int16_t)chlen);
+    size_t units = ab_getwrcur(&strbuf) / 2;
+    if (units > 0x7FFF) {
+        res = -3;
+        goto fcomplete;
+    }
+
+    proto_write_short(buf, (int16_t)units);
     res = ab_copy(buf, &strbuf, 0);
 
 fcomplete:
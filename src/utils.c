@@ -104,7 +104,7 @@ int ab_push(struct auto_buffer *ab, const void *buf, size_t sz) {
 
 int ab_expect(struct auto_buffer *ab, size_t newsz) {
     if (newsz <= ab->capacity) return 0;
-    if (newsz > ab->limit) return -2;
+    if (ab->limit > 0 && newsz > ab->limit) return -2;
     size_t wused = ab->writecur - ab->buf;
     size_t rused = ab->readcur - ab->buf;
 
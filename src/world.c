@@ -0,0 +1,947 @@
+#include "world.h"
+#include "nbt.h"
+#include "log.h"
+#include "utils.h"
+#include "protocol.h"
+#include "endianutils.h"
+
+#include <zlib.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Schematics are placed with their lowest layer here (centered on x = z = 0)
+#define WORLD_SCHEM_BASE_Y (64)
+
+// Refuse to inflate anything bigger than this (zip bombs)
+#define WORLD_MAX_INFLATE (256ul * 1024 * 1024)
+
+#define WORLD_MAX_STATES (65536)
+
+// Anvil data version of 20w17a (1.16), the first to stop packing indices across longs
+#define ANVIL_DV_NO_SPANNING (2527)
+
+/* -- block states and chunks -- */
+
+uint16_t world_intern_state(world_t *world, const char *name, size_t len) {
+    const char *props = memchr(name, '[', len);
+    if (props) len = props - name; // block properties are not kept
+
+    for (size_t i = 0; i < world->nstates; ++i) {
+        if (strlen(world->states[i]) == len && !memcmp(world->states[i], name, len)) return (uint16_t)i;
+    }
+
+    if (world->nstates >= WORLD_MAX_STATES) {
+        log_warn("world_intern_state: too many block states, %.*s will be air", (int)len, name);
+        return WORLD_STATE_AIR;
+    }
+
+    if (world->nstates == world->statecap) {
+        size_t newcap = world->statecap ? world->statecap * 2 : 64;
+        char **newstates = realloc(world->states, newcap * sizeof(char *));
+        if (!newstates) return WORLD_STATE_AIR;
+        world->states = newstates;
+        world->statecap = newcap;
+    }
+
+    char *str = malloc(len + 1);
+    if (!str) return WORLD_STATE_AIR;
+    memcpy(str, name, len);
+    str[len] = '\0';
+
+    world->states[world->nstates] = str;
+    return (uint16_t)world->nstates++;
+}
+
+struct world_chunk *world_get_chunk(world_t *world, int32_t cx, int32_t cz, bool create) {
+    for (size_t i = 0; i < world->nchunks; ++i) {
+        if (world->chunks[i].x == cx && world->chunks[i].z == cz) return world->chunks + i;
+    }
+
+    if (!create) return NULL;
+
+    if (world->nchunks == world->chunkcap) {
+        size_t newcap = world->chunkcap ? world->chunkcap * 2 : 16;
+        struct world_chunk *newchunks = realloc(world->chunks, newcap * sizeof(struct world_chunk));
+        if (!newchunks) return NULL;
+        world->chunks = newchunks;
+        world->chunkcap = newcap;
+    }
+
+    struct world_chunk *chunk = world->chunks + world->nchunks++;
+    memset(chunk, 0, sizeof(struct world_chunk));
+    chunk->x = cx;
+    chunk->z = cz;
+    return chunk;
+}
+
+// returns the dense (unpacked) array for the section at sy, allocating it if needed
+uint16_t *world_dense_section(struct world_chunk *chunk, int32_t sy) {
+    if (!chunk->dense[sy]) {
+        chunk->dense[sy] = calloc(WORLD_SECTION_BLOCKS, sizeof(uint16_t));
+    }
+    return chunk->dense[sy];
+}
+
+#define SECTION_INDEX(_x, _y, _z) ((((_y) & 0xF) << 8) | (((_z) & 0xF) << 4) | ((_x) & 0xF))
+
+void world_set_block_dense(world_t *world, struct world_chunk **cache, int32_t x, int32_t y, int32_t z, uint16_t state) {
+    if (y < 0 || y >= WORLD_HEIGHT) return;
+
+    int32_t cx = x >> 4, cz = z >> 4;
+    struct world_chunk *chunk = *cache;
+    if (!chunk || chunk->x != cx || chunk->z != cz) {
+        chunk = *cache = world_get_chunk(world, cx, cz, true);
+        if (!chunk) return;
+    }
+
+    uint16_t *dense = world_dense_section(chunk, y >> 4);
+    if (dense) dense[SECTION_INDEX(x, y, z)] = state;
+}
+
+unsigned world_bits_for(size_t count) {
+    unsigned bits = 0;
+    while (((size_t)1 << bits) < count) ++bits;
+    return bits;
+}
+
+uint16_t world_section_get(const struct world_section *sec, unsigned idx) {
+    if (sec->bits == 0) return sec->palette[0];
+
+    unsigned per = 64 / sec->bits;
+    uint64_t packed = sec->data[idx / per];
+    return sec->palette[(packed >> ((idx % per) * sec->bits)) & ((1ull << sec->bits) - 1)];
+}
+
+// converts the dense sections of every chunk into palette + packed form
+bool world_pack(world_t *world) {
+    uint16_t *palidx = malloc(world->nstates * sizeof(uint16_t));
+    uint16_t *palette = malloc(WORLD_SECTION_BLOCKS * sizeof(uint16_t));
+    bool success = palidx && palette;
+    if (!success) goto done;
+
+    for (size_t ci = 0; ci < world->nchunks; ++ci) {
+        struct world_chunk *chunk = world->chunks + ci;
+        for (int sy = 0; sy < WORLD_SECTIONS; ++sy) {
+            uint16_t *dense = chunk->dense[sy];
+            if (!dense) continue;
+            chunk->dense[sy] = NULL;
+
+            struct world_section *sec = chunk->sections + sy;
+            size_t pallen = 0;
+            unsigned nonair = 0;
+            memset(palidx, 0xFF, world->nstates * sizeof(uint16_t));
+
+            for (unsigned i = 0; i < WORLD_SECTION_BLOCKS; ++i) {
+                if (palidx[dense[i]] == 0xFFFF) {
+                    palidx[dense[i]] = (uint16_t)pallen;
+                    palette[pallen++] = dense[i];
+                }
+                if (dense[i] != WORLD_STATE_AIR) ++nonair;
+            }
+
+            if (nonair == 0) { // nothing but air, drop it
+                free(dense);
+                continue;
+            }
+
+            sec->palette = malloc(pallen * sizeof(uint16_t));
+            if (!sec->palette) {
+                free(dense);
+                success = false;
+                goto done;
+            }
+            memcpy(sec->palette, palette, pallen * sizeof(uint16_t));
+            sec->palette_len = (uint16_t)pallen;
+            sec->nonair = (uint16_t)nonair;
+            sec->bits = (uint8_t)world_bits_for(pallen);
+
+            if (sec->bits > 0) {
+                unsigned per = 64 / sec->bits;
+                size_t nlongs = (WORLD_SECTION_BLOCKS + per - 1) / per;
+                sec->data = calloc(nlongs, sizeof(uint64_t));
+                if (!sec->data) {
+                    free(dense);
+                    success = false;
+                    goto done;
+                }
+
+                for (unsigned i = 0; i < WORLD_SECTION_BLOCKS; ++i) {
+                    sec->data[i / per] |= (uint64_t)palidx[dense[i]] << ((i % per) * sec->bits);
+                }
+            }
+
+            chunk->mask |= (uint16_t)(1u << sy);
+            free(dense);
+        }
+    }
+
+done:
+    free(palidx);
+    free(palette);
+    return success;
+}
+
+uint16_t world_get_block(world_t *world, int32_t x, int32_t y, int32_t z) {
+    if (y < 0 || y >= WORLD_HEIGHT) return WORLD_STATE_AIR;
+
+    struct world_chunk *chunk = world_get_chunk(world, x >> 4, z >> 4, false);
+    if (!chunk || !(chunk->mask & (1u << (y >> 4)))) return WORLD_STATE_AIR;
+
+    return world_section_get(chunk->sections + (y >> 4), SECTION_INDEX(x, y, z));
+}
+
+void world_find_spawn(world_t *world) {
+    world->spawn.x = world->spawn.z = 0;
+    world->spawn.y = WORLD_SCHEM_BASE_Y;
+    if (world->nchunks == 0) return;
+
+    int32_t minx = world->chunks[0].x, maxx = minx, minz = world->chunks[0].z, maxz = minz;
+    for (size_t i = 1; i < world->nchunks; ++i) {
+        if (world->chunks[i].x < minx) minx = world->chunks[i].x;
+        if (world->chunks[i].x > maxx) maxx = world->chunks[i].x;
+        if (world->chunks[i].z < minz) minz = world->chunks[i].z;
+        if (world->chunks[i].z > maxz) maxz = world->chunks[i].z;
+    }
+
+    world->spawn.x = (minx * 16 + maxx * 16 + 16) / 2;
+    world->spawn.z = (minz * 16 + maxz * 16 + 16) / 2;
+
+    for (int32_t y = WORLD_HEIGHT - 1; y >= 0; --y) {
+        if (world_get_block(world, world->spawn.x, y, world->spawn.z) != WORLD_STATE_AIR) {
+            world->spawn.y = y + 1;
+            return;
+        }
+    }
+}
+
+void world_free_chunk(struct world_chunk *chunk) {
+    for (int sy = 0; sy < WORLD_SECTIONS; ++sy) {
+        free(chunk->sections[sy].palette);
+        free(chunk->sections[sy].data);
+        free(chunk->dense[sy]);
+    }
+}
+
+struct world_chunk_order {
+    int64_t dist;
+    size_t idx;
+};
+
+int world_chunk_order_cmp(const void *a, const void *b) {
+    const struct world_chunk_order *oa = a, *ob = b;
+    if (oa->dist != ob->dist) return oa->dist < ob->dist ? -1 : 1;
+    return oa->idx < ob->idx ? -1 : (oa->idx > ob->idx);
+}
+
+// Drops the chunks further than WORLD_VIEW_RADIUS from spawn and sorts the rest nearest first.
+bool world_clamp_view(world_t *world) {
+    if (world->nchunks == 0) return true;
+
+    struct world_chunk_order *order = malloc(world->nchunks * sizeof(struct world_chunk_order));
+    if (!order) return false;
+
+    int64_t scx = world->spawn.x >> 4, scz = world->spawn.z >> 4;
+    size_t kept = 0;
+    for (size_t i = 0; i < world->nchunks; ++i) {
+        int64_t dx = llabs(world->chunks[i].x - scx), dz = llabs(world->chunks[i].z - scz);
+        int64_t dist = dx > dz ? dx : dz;
+        if (dist > WORLD_VIEW_RADIUS) {
+            world_free_chunk(world->chunks + i);
+            continue;
+        }
+        order[kept].dist = dist;
+        order[kept++].idx = i;
+    }
+    qsort(order, kept, sizeof(struct world_chunk_order), &world_chunk_order_cmp);
+
+    struct world_chunk *sorted = malloc((kept ? kept : 1) * sizeof(struct world_chunk));
+    if (!sorted) {
+        free(order);
+        return false;
+    }
+    for (size_t i = 0; i < kept; ++i) sorted[i] = world->chunks[order[i].idx];
+    free(order);
+
+    if (kept < world->nchunks) {
+        log_warn("world_clamp_view: %lu of %lu chunks are more than %d chunks away from spawn and are left out",
+                 world->nchunks - kept, world->nchunks, WORLD_VIEW_RADIUS);
+    }
+
+    free(world->chunks);
+    world->chunks = sorted;
+    world->nchunks = world->chunkcap = kept;
+    return true;
+}
+
+/* -- file loading -- */
+
+// inflates a zlib or gzip stream (detected automatically) into a new buffer
+bool world_inflate(const unsigned char *src, size_t srclen, unsigned char **out, size_t *outlen) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 15 + 32) != Z_OK) return false;
+
+    size_t cap = srclen * 4 < 65536 ? 65536 : srclen * 4;
+    unsigned char *buf = malloc(cap);
+    bool success = false;
+    if (!buf) goto done;
+
+    strm.next_in = (unsigned char *)src;
+    strm.avail_in = (uInt)srclen;
+    strm.next_out = buf;
+    strm.avail_out = (uInt)cap;
+
+    while (true) {
+        int res = inflate(&strm, Z_NO_FLUSH);
+        if (res == Z_STREAM_END) break;
+        if (res != Z_OK && res != Z_BUF_ERROR) goto done;
+
+        if (strm.avail_out == 0) {
+            if (cap * 2 > WORLD_MAX_INFLATE) goto done;
+            unsigned char *newbuf = realloc(buf, cap * 2);
+            if (!newbuf) goto done;
+            buf = newbuf;
+            strm.next_out = buf + cap;
+            strm.avail_out = (uInt)cap;
+            cap *= 2;
+        } else if (strm.avail_in == 0) {
+            goto done; // truncated stream
+        }
+    }
+
+    *out = buf;
+    *outlen = strm.total_out;
+    buf = NULL;
+    success = true;
+
+done:
+    free(buf);
+    inflateEnd(&strm);
+    return success;
+}
+
+bool world_read_varint(const unsigned char **cur, const unsigned char *end, uint32_t *out) {
+    uint32_t val = 0;
+    for (int shift = 0; shift < 32; shift += 7) {
+        if (*cur >= end) return false;
+        unsigned char b = *((*cur)++);
+        val |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *out = val;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Sponge schematic, versions 1 through 3
+bool world_load_schem(world_t *world, const unsigned char *buf, size_t len) {
+    struct nbt_reader rd, sub;
+    struct nbt_value root, val, palette, blockdata;
+    const char *name;
+    uint16_t namelen;
+    int32_t width = -1, height = -1, length = -1;
+    int res;
+
+    nbt_reader_init(&rd, buf, len);
+    if (!nbt_read_root(&rd, &root)) {
+        log_error("world_load_schem: not an NBT compound");
+        return false;
+    }
+
+    memset(&palette, 0, sizeof(palette));
+    memset(&blockdata, 0, sizeof(blockdata));
+    nbt_reader_at(&sub, &rd, &root);
+
+rescan:
+    while ((res = nbt_compound_next(&sub, &name, &namelen, &val)) > 0) {
+        if (nbt_name_eq(name, namelen, "Schematic") && val.tag == NBT_COMPOUND) { // version 3 nests everything
+            struct nbt_reader inner;
+            nbt_reader_at(&inner, &sub, &val);
+            sub = inner;
+            goto rescan;
+        } else if (nbt_name_eq(name, namelen, "Width") && val.tag == NBT_SHORT) {
+            width = (uint16_t)val.v.i;
+        } else if (nbt_name_eq(name, namelen, "Height") && val.tag == NBT_SHORT) {
+            height = (uint16_t)val.v.i;
+        } else if (nbt_name_eq(name, namelen, "Length") && val.tag == NBT_SHORT) {
+            length = (uint16_t)val.v.i;
+        } else if (nbt_name_eq(name, namelen, "Palette") && val.tag == NBT_COMPOUND) {
+            palette = val;
+        } else if (nbt_name_eq(name, namelen, "BlockData") && val.tag == NBT_BYTE_ARRAY) {
+            blockdata = val;
+        } else if (nbt_name_eq(name, namelen, "Blocks") && val.tag == NBT_COMPOUND) {
+            struct nbt_reader blocks;
+            struct nbt_value bval;
+            nbt_reader_at(&blocks, &sub, &val);
+            while (nbt_compound_next(&blocks, &name, &namelen, &bval) > 0) {
+                if (nbt_name_eq(name, namelen, "Palette") && bval.tag == NBT_COMPOUND) palette = bval;
+                else if (nbt_name_eq(name, namelen, "Data") && bval.tag == NBT_BYTE_ARRAY) blockdata = bval;
+            }
+        }
+    }
+
+    if (res < 0 || width <= 0 || height <= 0 || length <= 0 || palette.tag == NBT_END || blockdata.tag == NBT_END) {
+        log_error("world_load_schem: missing or malformed schematic fields");
+        return false;
+    }
+
+    // map schematic palette indices to world block states
+    uint16_t *pmap = calloc(WORLD_MAX_STATES, sizeof(uint16_t));
+    if (!pmap) return false;
+
+    nbt_reader_at(&sub, &rd, &palette);
+    while ((res = nbt_compound_next(&sub, &name, &namelen, &val)) > 0) {
+        if (val.tag != NBT_INT || val.v.i < 0 || val.v.i >= WORLD_MAX_STATES) continue;
+        pmap[val.v.i] = world_intern_state(world, name, namelen);
+    }
+
+    int32_t basey = WORLD_SCHEM_BASE_Y;
+    if (basey + height > WORLD_HEIGHT) basey = height > WORLD_HEIGHT ? 0 : WORLD_HEIGHT - height;
+    int32_t basex = -width / 2, basez = -length / 2;
+
+    const unsigned char *cur = blockdata.v.arr.data, *end = cur + blockdata.v.arr.len;
+    size_t total = (size_t)width * height * length;
+    struct world_chunk *cache = NULL;
+    bool success = true;
+
+    for (size_t i = 0; i < total; ++i) {
+        uint32_t idx;
+        if (!world_read_varint(&cur, end, &idx)) {
+            log_error("world_load_schem: block data ends after %lu of %lu blocks", i, total);
+            success = false;
+            break;
+        }
+
+        uint16_t state = idx < WORLD_MAX_STATES ? pmap[idx] : WORLD_STATE_AIR;
+        if (state == WORLD_STATE_AIR) continue;
+
+        int32_t x = (int32_t)(i % width), z = (int32_t)((i / width) % length), y = (int32_t)(i / ((size_t)width * length));
+        world_set_block_dense(world, &cache, basex + x, basey + y, basez + z, state);
+    }
+
+    free(pmap);
+    return success;
+}
+
+// decodes one section of an anvil chunk (1.13+ palette format) into the dense arrays
+void world_load_anvil_section(world_t *world, struct world_chunk *chunk, struct nbt_reader *rd, const struct nbt_value *secval, int32_t dataver) {
+    struct nbt_reader sub, inner;
+    struct nbt_value val, palette, states;
+    const char *name;
+    uint16_t namelen;
+    int32_t sy = -1;
+
+    palette.tag = states.tag = NBT_END;
+    nbt_reader_at(&sub, rd, secval);
+    while (nbt_compound_next(&sub, &name, &namelen, &val) > 0) {
+        if (nbt_name_eq(name, namelen, "Y") && val.tag == NBT_BYTE) {
+            sy = (int32_t)val.v.i;
+        } else if (nbt_name_eq(name, namelen, "Palette") && val.tag == NBT_LIST) {
+            palette = val;
+        } else if (nbt_name_eq(name, namelen, "BlockStates") && val.tag == NBT_LONG_ARRAY) {
+            states = val;
+        } else if (nbt_name_eq(name, namelen, "block_states") && val.tag == NBT_COMPOUND) { // 1.18+
+            struct nbt_value bval;
+            nbt_reader_at(&inner, &sub, &val);
+            while (nbt_compound_next(&inner, &name, &namelen, &bval) > 0) {
+                if (nbt_name_eq(name, namelen, "palette") && bval.tag == NBT_LIST) palette = bval;
+                else if (nbt_name_eq(name, namelen, "data") && bval.tag == NBT_LONG_ARRAY) states = bval;
+            }
+        }
+    }
+
+    if (sy < 0 || sy >= WORLD_SECTIONS || palette.tag == NBT_END || palette.v.nest.elemtag != NBT_COMPOUND) return;
+
+    int32_t pallen = palette.v.nest.len, remain = pallen;
+    if (pallen <= 0 || pallen > WORLD_SECTION_BLOCKS) return;
+
+    uint16_t map[WORLD_SECTION_BLOCKS];
+    nbt_reader_at(&sub, rd, &palette);
+    for (int32_t i = 0; nbt_list_next(&sub, NBT_COMPOUND, &remain, &val) > 0; ++i) {
+        struct nbt_value nval;
+        map[i] = WORLD_STATE_AIR;
+        nbt_reader_at(&inner, &sub, &val);
+        while (nbt_compound_next(&inner, &name, &namelen, &nval) > 0) {
+            if (nbt_name_eq(name, namelen, "Name") && nval.tag == NBT_STRING) {
+                map[i] = world_intern_state(world, nval.v.s.str, nval.v.s.len);
+            }
+        }
+    }
+    if (remain > 0) return;
+
+    if (pallen == 1) { // single state, data is omitted
+        if (map[0] == WORLD_STATE_AIR) return;
+        uint16_t *dense = world_dense_section(chunk, sy);
+        if (!dense) return;
+        for (unsigned i = 0; i < WORLD_SECTION_BLOCKS; ++i) dense[i] = map[0];
+        return;
+    }
+
+    unsigned bits = world_bits_for((size_t)pallen);
+    if (bits < 4) bits = 4;
+    bool spanning = dataver < ANVIL_DV_NO_SPANNING;
+    unsigned per = 64 / bits;
+    size_t needed = spanning ? (WORLD_SECTION_BLOCKS * bits + 63) / 64 : (WORLD_SECTION_BLOCKS + per - 1) / per;
+
+    if (states.tag == NBT_END || (size_t)states.v.arr.len < needed) {
+        log_warn("world_load_anvil_section: chunk %d, %d section %d has short block data, skipping", chunk->x, chunk->z, sy);
+        return;
+    }
+
+    uint16_t *dense = world_dense_section(chunk, sy);
+    if (!dense) return;
+
+    uint64_t mask = (1ull << bits) - 1;
+    for (unsigned i = 0; i < WORLD_SECTION_BLOCKS; ++i) {
+        uint64_t idx;
+        if (spanning) {
+            size_t bitpos = (size_t)i * bits;
+            unsigned off = bitpos % 64;
+            idx = (uint64_t)nbt_array_get(&states, (int32_t)(bitpos / 64)) >> off;
+            if (off + bits > 64) idx |= (uint64_t)nbt_array_get(&states, (int32_t)(bitpos / 64 + 1)) << (64 - off);
+        } else {
+            idx = (uint64_t)nbt_array_get(&states, (int32_t)(i / per)) >> ((i % per) * bits);
+        }
+        idx &= mask;
+        dense[i] = idx < (uint64_t)pallen ? map[idx] : WORLD_STATE_AIR;
+    }
+}
+
+struct world_anvil_fields {
+    int32_t cx, cz;
+    bool havex, havez;
+    struct nbt_value sections;
+};
+
+// Takes the position and the sections from a chunk's fields: the root's since 1.18, those of "Level" before.
+void world_anvil_chunk_field(struct world_anvil_fields *f, const char *name, uint16_t namelen, const struct nbt_value *val) {
+    if (nbt_name_eq(name, namelen, "xPos") && val->tag == NBT_INT) {
+        f->cx = (int32_t)val->v.i;
+        f->havex = true;
+    } else if (nbt_name_eq(name, namelen, "zPos") && val->tag == NBT_INT) {
+        f->cz = (int32_t)val->v.i;
+        f->havez = true;
+    } else if ((nbt_name_eq(name, namelen, "Sections") || nbt_name_eq(name, namelen, "sections")) && val->tag == NBT_LIST) {
+        f->sections = *val;
+    }
+}
+
+bool world_load_anvil_chunk(world_t *world, const unsigned char *buf, size_t len) {
+    struct nbt_reader rd, sub, level;
+    struct nbt_value root, val, lval;
+    const char *name, *lname;
+    uint16_t namelen, lnamelen;
+    int32_t dataver = 0;
+    struct world_anvil_fields f;
+
+    nbt_reader_init(&rd, buf, len);
+    if (!nbt_read_root(&rd, &root)) return false;
+
+    memset(&f, 0, sizeof(f));
+    f.sections.tag = NBT_END;
+
+    /* NBT doesn't order a compound's fields, so "Level" is walked on its own and
+     * the root goes on: "DataVersion" (which decides the block layout) may come after it. */
+    nbt_reader_at(&sub, &rd, &root);
+    while (nbt_compound_next(&sub, &name, &namelen, &val) > 0) {
+        if (nbt_name_eq(name, namelen, "DataVersion") && val.tag == NBT_INT) {
+            dataver = (int32_t)val.v.i;
+        } else if (nbt_name_eq(name, namelen, "Level") && val.tag == NBT_COMPOUND) { // pre-1.18
+            nbt_reader_at(&level, &sub, &val);
+            while (nbt_compound_next(&level, &lname, &lnamelen, &lval) > 0) {
+                world_anvil_chunk_field(&f, lname, lnamelen, &lval);
+            }
+            if (level.error) return false;
+        } else {
+            world_anvil_chunk_field(&f, name, namelen, &val);
+        }
+    }
+    if (sub.error) return false;
+
+    int32_t cx = f.cx, cz = f.cz;
+    struct nbt_value sections = f.sections;
+    if (!f.havex || !f.havez) return false;
+    if (sections.tag == NBT_END || sections.v.nest.elemtag != NBT_COMPOUND) return true; // empty chunk
+
+    struct world_chunk *chunk = world_get_chunk(world, cx, cz, true);
+    if (!chunk) return false;
+
+    int32_t remain = sections.v.nest.len;
+    nbt_reader_at(&sub, &rd, &sections);
+    while (nbt_list_next(&sub, NBT_COMPOUND, &remain, &val) > 0) {
+        world_load_anvil_section(world, chunk, &sub, &val, dataver);
+    }
+    return !sub.error;
+}
+
+#define REGION_SECTOR (4096)
+
+// Anvil region file (.mca), 1.13+ chunk format
+bool world_load_region(world_t *world, const unsigned char *buf, size_t len) {
+    if (len < 2 * REGION_SECTOR) {
+        log_error("world_load_region: file too short for a region header");
+        return false;
+    }
+
+    size_t loaded = 0;
+    for (unsigned i = 0; i < 1024; ++i) {
+        uint32_t loc;
+        memcpy(&loc, buf + i * 4, sizeof(loc));
+        loc = eu_betohu32(loc);
+
+        size_t offset = (size_t)(loc >> 8) * REGION_SECTOR;
+        if (offset == 0) continue; // chunk not present
+        if (offset + 5 > len) goto corrupt;
+
+        uint32_t clen;
+        memcpy(&clen, buf + offset, sizeof(clen));
+        clen = eu_betohu32(clen);
+        if (clen < 1 || offset + 4 + clen > len) goto corrupt;
+
+        const unsigned char *payload = buf + offset + 5;
+        size_t plen = clen - 1;
+        unsigned char *raw = NULL;
+        size_t rawlen = 0;
+        bool ok;
+
+        switch (buf[offset + 4]) {
+            case 1: // gzip
+            case 2: // zlib
+                if (!world_inflate(payload, plen, &raw, &rawlen)) goto corrupt;
+                ok = world_load_anvil_chunk(world, raw, rawlen);
+                free(raw);
+                break;
+            case 3: // uncompressed
+                ok = world_load_anvil_chunk(world, payload, plen);
+                break;
+            default:
+                log_warn("world_load_region: chunk %u uses unsupported compression %u, skipping", i, buf[offset + 4]);
+                continue;
+        }
+
+        if (!ok) log_warn("world_load_region: chunk %u could not be decoded, skipping", i);
+        else ++loaded;
+        continue;
+
+corrupt:
+        log_warn("world_load_region: chunk %u is corrupt, skipping", i);
+    }
+
+    log_debug("world_load_region: decoded %lu chunks", loaded);
+    return true;
+}
+
+bool world_prepare_packets(world_t *world);
+
+world_t *world_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_error("world_load(%s): open: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        log_error("world_load(%s): fstat: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size == 0) {
+        log_error("world_load(%s): empty file", path);
+        close(fd);
+        return NULL;
+    }
+
+    size_t len = (size_t)st.st_size;
+    unsigned char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_error("world_load(%s): mmap: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    world_t *world = malloc(sizeof(world_t));
+    if (!world) goto fail;
+    memset(world, 0, sizeof(world_t));
+    world_intern_state(world, "minecraft:air", 13);
+
+    size_t pathlen = strlen(path);
+    bool success;
+    if (pathlen > 4 && !strcmp(path + pathlen - 4, ".mca")) {
+        madvise(map, len, MADV_SEQUENTIAL);
+        success = world_load_region(world, map, len);
+    } else if (len >= 2 && map[0] == 0x1f && map[1] == 0x8b) { // gzipped schematic
+        unsigned char *raw = NULL;
+        size_t rawlen = 0;
+        success = world_inflate(map, len, &raw, &rawlen);
+        if (success) success = world_load_schem(world, raw, rawlen);
+        else log_error("world_load(%s): unable to decompress schematic", path);
+        free(raw);
+    } else {
+        success = world_load_schem(world, map, len);
+    }
+
+    if (!success || !world_pack(world)) goto fail;
+
+    world_find_spawn(world);
+    if (!world_clamp_view(world) || !world_prepare_packets(world)) goto fail;
+
+    munmap(map, len);
+
+    size_t packed = world->nchunks * sizeof(struct world_chunk), sections = 0;
+    for (size_t i = 0; i < world->nchunks; ++i) {
+        for (int sy = 0; sy < WORLD_SECTIONS; ++sy) {
+            struct world_section *sec = world->chunks[i].sections + sy;
+            if (!sec->palette) continue;
+            ++sections;
+            packed += sec->palette_len * sizeof(uint16_t);
+            if (sec->bits) packed += ((WORLD_SECTION_BLOCKS + 64 / sec->bits - 1) / (64 / sec->bits)) * sizeof(uint64_t);
+        }
+    }
+
+    log_info("Loaded world %s: %lu chunks, %lu sections, %lu block states, %lu bytes packed, spawn at %d %d %d",
+             path, world->nchunks, sections, world->nstates, packed, world->spawn.x, world->spawn.y, world->spawn.z);
+    return world;
+
+fail:
+    log_error("world_load(%s): unable to load world", path);
+    world_free(world);
+    munmap(map, len);
+    return NULL;
+}
+
+void world_free(world_t *world) {
+    if (!world) return;
+
+    for (size_t i = 0; i < world->nstates; ++i) {
+        free(world->states[i]);
+    }
+    free(world->states);
+
+    for (size_t i = 0; i < world->nchunks; ++i) {
+        world_free_chunk(world->chunks + i);
+    }
+    free(world->chunks);
+
+    for (size_t i = 0; i < world->npackets; ++i) {
+        free(world->packets[i].buf);
+    }
+    free(world->packets);
+
+    free(world);
+}
+
+/* -- per-version chunk encoding -- */
+
+struct world_legacy_block {
+    const char *name;
+    uint8_t id, meta;
+};
+
+#define DYED(_suffix, _id)                                                                           \
+{ "minecraft:white_" _suffix, _id, 0 },       { "minecraft:orange_" _suffix, _id, 1 },               \
+{ "minecraft:magenta_" _suffix, _id, 2 },     { "minecraft:light_blue_" _suffix, _id, 3 },           \
+{ "minecraft:yellow_" _suffix, _id, 4 },      { "minecraft:lime_" _suffix, _id, 5 },                 \
+{ "minecraft:pink_" _suffix, _id, 6 },        { "minecraft:gray_" _suffix, _id, 7 },                 \
+{ "minecraft:light_gray_" _suffix, _id, 8 },  { "minecraft:cyan_" _suffix, _id, 9 },                 \
+{ "minecraft:purple_" _suffix, _id, 10 },     { "minecraft:blue_" _suffix, _id, 11 },                \
+{ "minecraft:brown_" _suffix, _id, 12 },      { "minecraft:green_" _suffix, _id, 13 },               \
+{ "minecraft:red_" _suffix, _id, 14 },        { "minecraft:black_" _suffix, _id, 15 }
+
+// Flattened (1.13+) block names to pre-flattening id:meta, enough for typical lobby builds
+const struct world_legacy_block world_legacy_blocks[] = {
+    { "minecraft:air", 0, 0 }, { "minecraft:cave_air", 0, 0 }, { "minecraft:void_air", 0, 0 },
+    { "minecraft:stone", 1, 0 }, { "minecraft:granite", 1, 1 }, { "minecraft:polished_granite", 1, 2 },
+    { "minecraft:diorite", 1, 3 }, { "minecraft:polished_diorite", 1, 4 }, { "minecraft:andesite", 1, 5 },
+    { "minecraft:polished_andesite", 1, 6 }, { "minecraft:grass_block", 2, 0 }, { "minecraft:dirt", 3, 0 },
+    { "minecraft:coarse_dirt", 3, 1 }, { "minecraft:podzol", 3, 2 }, { "minecraft:cobblestone", 4, 0 },
+    { "minecraft:oak_planks", 5, 0 }, { "minecraft:spruce_planks", 5, 1 }, { "minecraft:birch_planks", 5, 2 },
+    { "minecraft:jungle_planks", 5, 3 }, { "minecraft:acacia_planks", 5, 4 }, { "minecraft:dark_oak_planks", 5, 5 },
+    { "minecraft:bedrock", 7, 0 }, { "minecraft:water", 9, 0 }, { "minecraft:lava", 11, 0 },
+    { "minecraft:sand", 12, 0 }, { "minecraft:red_sand", 12, 1 }, { "minecraft:gravel", 13, 0 },
+    { "minecraft:gold_ore", 14, 0 }, { "minecraft:iron_ore", 15, 0 }, { "minecraft:coal_ore", 16, 0 },
+    { "minecraft:oak_log", 17, 0 }, { "minecraft:spruce_log", 17, 1 }, { "minecraft:birch_log", 17, 2 },
+    { "minecraft:jungle_log", 17, 3 }, { "minecraft:oak_leaves", 18, 0 }, { "minecraft:spruce_leaves", 18, 1 },
+    { "minecraft:birch_leaves", 18, 2 }, { "minecraft:jungle_leaves", 18, 3 }, { "minecraft:sponge", 19, 0 },
+    { "minecraft:glass", 20, 0 }, { "minecraft:lapis_ore", 21, 0 }, { "minecraft:lapis_block", 22, 0 },
+    { "minecraft:sandstone", 24, 0 }, { "minecraft:chiseled_sandstone", 24, 1 }, { "minecraft:cut_sandstone", 24, 2 },
+    { "minecraft:dandelion", 37, 0 }, { "minecraft:poppy", 38, 0 }, { "minecraft:gold_block", 41, 0 },
+    { "minecraft:iron_block", 42, 0 }, { "minecraft:smooth_stone", 43, 8 }, { "minecraft:stone_slab", 44, 0 },
+    { "minecraft:smooth_stone_slab", 44, 0 }, { "minecraft:sandstone_slab", 44, 1 }, { "minecraft:cobblestone_slab", 44, 3 },
+    { "minecraft:brick_slab", 44, 4 }, { "minecraft:stone_brick_slab", 44, 5 }, { "minecraft:quartz_slab", 44, 7 },
+    { "minecraft:bricks", 45, 0 }, { "minecraft:tnt", 46, 0 }, { "minecraft:bookshelf", 47, 0 },
+    { "minecraft:mossy_cobblestone", 48, 0 }, { "minecraft:obsidian", 49, 0 }, { "minecraft:torch", 50, 5 },
+    { "minecraft:wall_torch", 50, 5 }, { "minecraft:oak_stairs", 53, 0 }, { "minecraft:chest", 54, 2 },
+    { "minecraft:diamond_ore", 56, 0 }, { "minecraft:diamond_block", 57, 0 }, { "minecraft:crafting_table", 58, 0 },
+    { "minecraft:farmland", 60, 0 }, { "minecraft:furnace", 61, 2 }, { "minecraft:ladder", 65, 2 },
+    { "minecraft:rail", 66, 0 }, { "minecraft:cobblestone_stairs", 67, 0 }, { "minecraft:redstone_ore", 73, 0 },
+    { "minecraft:snow", 78, 0 }, { "minecraft:ice", 79, 0 }, { "minecraft:snow_block", 80, 0 },
+    { "minecraft:cactus", 81, 0 }, { "minecraft:clay", 82, 0 }, { "minecraft:jukebox", 84, 0 },
+    { "minecraft:oak_fence", 85, 0 }, { "minecraft:pumpkin", 86, 0 }, { "minecraft:carved_pumpkin", 86, 0 },
+    { "minecraft:netherrack", 87, 0 }, { "minecraft:soul_sand", 88, 0 }, { "minecraft:glowstone", 89, 0 },
+    { "minecraft:jack_o_lantern", 91, 0 }, { "minecraft:stone_bricks", 98, 0 }, { "minecraft:mossy_stone_bricks", 98, 1 },
+    { "minecraft:cracked_stone_bricks", 98, 2 }, { "minecraft:chiseled_stone_bricks", 98, 3 }, { "minecraft:iron_bars", 101, 0 },
+    { "minecraft:glass_pane", 102, 0 }, { "minecraft:melon", 103, 0 }, { "minecraft:vine", 106, 0 },
+    { "minecraft:oak_fence_gate", 107, 0 }, { "minecraft:brick_stairs", 108, 0 }, { "minecraft:stone_brick_stairs", 109, 0 },
+    { "minecraft:mycelium", 110, 0 }, { "minecraft:lily_pad", 111, 0 }, { "minecraft:nether_bricks", 112, 0 },
+    { "minecraft:nether_brick_fence", 113, 0 }, { "minecraft:nether_brick_stairs", 114, 0 }, { "minecraft:end_stone", 121, 0 },
+    { "minecraft:redstone_lamp", 123, 0 }, { "minecraft:oak_slab", 126, 0 }, { "minecraft:spruce_slab", 126, 1 },
+    { "minecraft:birch_slab", 126, 2 }, { "minecraft:jungle_slab", 126, 3 }, { "minecraft:acacia_slab", 126, 4 },
+    { "minecraft:dark_oak_slab", 126, 5 }, { "minecraft:sandstone_stairs", 128, 0 }, { "minecraft:emerald_ore", 129, 0 },
+    { "minecraft:emerald_block", 133, 0 }, { "minecraft:spruce_stairs", 134, 0 }, { "minecraft:birch_stairs", 135, 0 },
+    { "minecraft:jungle_stairs", 136, 0 }, { "minecraft:beacon", 138, 0 }, { "minecraft:cobblestone_wall", 139, 0 },
+    { "minecraft:mossy_cobblestone_wall", 139, 1 }, { "minecraft:redstone_block", 152, 0 }, { "minecraft:quartz_block", 155, 0 },
+    { "minecraft:chiseled_quartz_block", 155, 1 }, { "minecraft:quartz_pillar", 155, 2 }, { "minecraft:quartz_stairs", 156, 0 },
+    { "minecraft:acacia_leaves", 161, 0 }, { "minecraft:dark_oak_leaves", 161, 1 }, { "minecraft:acacia_log", 162, 0 },
+    { "minecraft:dark_oak_log", 162, 1 }, { "minecraft:acacia_stairs", 163, 0 }, { "minecraft:dark_oak_stairs", 164, 0 },
+    { "minecraft:slime_block", 165, 0 }, { "minecraft:barrier", 166, 0 }, { "minecraft:prismarine", 168, 0 },
+    { "minecraft:prismarine_bricks", 168, 1 }, { "minecraft:dark_prismarine", 168, 2 }, { "minecraft:sea_lantern", 169, 0 },
+    { "minecraft:hay_block", 170, 0 }, { "minecraft:terracotta", 172, 0 }, { "minecraft:coal_block", 173, 0 },
+    { "minecraft:packed_ice", 174, 0 }, { "minecraft:red_sandstone", 179, 0 }, { "minecraft:chiseled_red_sandstone", 179, 1 },
+    { "minecraft:cut_red_sandstone", 179, 2 }, { "minecraft:red_sandstone_stairs", 180, 0 }, { "minecraft:spruce_fence", 188, 0 },
+    { "minecraft:birch_fence", 189, 0 }, { "minecraft:jungle_fence", 190, 0 }, { "minecraft:dark_oak_fence", 191, 0 },
+    { "minecraft:acacia_fence", 192, 0 },
+    DYED("wool", 35),
+    DYED("stained_glass", 95),
+    DYED("terracotta", 159),
+    DYED("stained_glass_pane", 160),
+    DYED("carpet", 171)
+};
+
+#undef DYED
+
+// fallback for states the table does not know
+#define WORLD_LEGACY_UNKNOWN ((1 << 4) | 0)
+
+uint16_t *world_legacy_remap(world_t *world) {
+    uint16_t *remap = malloc(world->nstates * sizeof(uint16_t));
+    if (!remap) return NULL;
+
+    for (size_t i = 0; i < world->nstates; ++i) {
+        remap[i] = WORLD_LEGACY_UNKNOWN;
+        for (size_t j = 0; j < sizeof(world_legacy_blocks) / sizeof(world_legacy_blocks[0]); ++j) {
+            if (!strcmp(world->states[i], world_legacy_blocks[j].name)) {
+                remap[i] = (uint16_t)((world_legacy_blocks[j].id << 4) | world_legacy_blocks[j].meta);
+                goto found;
+            }
+        }
+        log_debug("world_legacy_remap: no legacy id for %s, using stone", world->states[i]);
+found:;
+    }
+    return remap;
+}
+
+// 1.8 (protocol 47): ushort (id << 4 | meta) per block little-endian, then block light, then biomes
+bool world_encode_legacy(world_t *world, protover_t protover, struct auto_buffer *out) {
+    uint16_t *remap = world_legacy_remap(world);
+    if (!remap) return false;
+
+    struct auto_buffer data, frame;
+    ab_init(&data, 0, 0);
+    ab_init(&frame, 0, 0);
+    bool success = true;
+
+    for (size_t ci = 0; ci < world->nchunks && success; ++ci) {
+        struct world_chunk *chunk = world->chunks + ci;
+        if (!chunk->mask) continue;
+        ab_rewind(&data, AB_REWIND_RDWR);
+
+        for (int sy = 0; sy < WORLD_SECTIONS; ++sy) {
+            if (!(chunk->mask & (1u << sy))) continue;
+            unsigned char blocks[WORLD_SECTION_BLOCKS * 2];
+            for (unsigned i = 0; i < WORLD_SECTION_BLOCKS; ++i) {
+                uint16_t id = remap[world_section_get(chunk->sections + sy, i)];
+                blocks[i * 2] = (unsigned char)(id & 0xFF);
+                blocks[i * 2 + 1] = (unsigned char)(id >> 8);
+            }
+            if (ab_push(&data, blocks, sizeof(blocks)) < 0) success = false;
+        }
+
+        // full block light everywhere, the end has no sky light
+        unsigned char light[WORLD_SECTION_BLOCKS / 2];
+        memset(light, 0xFF, sizeof(light));
+        for (int sy = 0; sy < WORLD_SECTIONS; ++sy) {
+            if (chunk->mask & (1u << sy) && ab_push(&data, light, sizeof(light)) < 0) success = false;
+        }
+
+        unsigned char biomes[256];
+        memset(biomes, 1, sizeof(biomes));
+        if (ab_push(&data, biomes, sizeof(biomes)) < 0) success = false;
+
+        struct packet_play_chunk_data pkt = {
+            .id = PKTID_WRITE_PLAY_CHUNK_DATA,
+            .x = chunk->x,
+            .z = chunk->z,
+            .full = true,
+            .mask = chunk->mask,
+            .data = data.buf,
+            .datalen = ab_getwrcur(&data)
+        };
+        ab_rewind(&frame, AB_REWIND_RDWR);
+        if (proto_frame_pkt(&frame, PROTOCOL_PLAY, NULL, &pkt) < 0) {
+            success = false;
+            break;
+        }
+
+        // the chunks are nearest first, the ones that don't fit are the furthest away
+        if (ab_getwrcur(out) + ab_getwrcur(&frame) > WORLD_PACKETS_MAX) {
+            log_warn("world_encode_legacy(%u): the chunk packets would not fit in a send queue, only the %lu nearest of %lu chunks are sent",
+                     protover, ci, world->nchunks);
+            break;
+        }
+        if (ab_push(out, frame.buf, ab_getwrcur(&frame)) < 0) success = false;
+    }
+
+    if (!success) log_error("world_encode_legacy(%u): out of memory", protover);
+    ab_free(&frame);
+    ab_free(&data);
+    free(remap);
+    return success;
+}
+
+struct world_encoder {
+    protover_t protover;
+    bool (*encode)(world_t *world, protover_t protover, struct auto_buffer *out);
+};
+
+const struct world_encoder world_encoders[] = {
+    { PROTOVER_1_8, &world_encode_legacy }
+};
+
+#define WORLD_ENCODER_COUNT (sizeof(world_encoders) / sizeof(world_encoders[0]))
+
+// encodes the chunk packets for every supported version once, so logins only copy bytes
+bool world_prepare_packets(world_t *world) {
+    world->packets = calloc(WORLD_ENCODER_COUNT, sizeof(struct world_packets));
+    if (!world->packets) return false;
+
+    for (size_t i = 0; i < WORLD_ENCODER_COUNT; ++i) {
+        struct auto_buffer out;
+        ab_init(&out, 0, 0);
+        if (!(*world_encoders[i].encode)(world, world_encoders[i].protover, &out)) {
+            ab_free(&out);
+            return false;
+        }
+
+        struct world_packets *pkts = world->packets + world->npackets++;
+        pkts->protover = world_encoders[i].protover;
+        pkts->buf = out.buf;
+        pkts->len = ab_getwrcur(&out);
+        log_debug("world_prepare_packets: %lu bytes of chunk data for protocol %u", pkts->len, pkts->protover);
+    }
+    return true;
+}
+
+const struct world_packets *world_get_packets(world_t *world, protover_t protover) {
+    for (size_t i = 0; i < world->npackets; ++i) {
+        if (world->packets[i].protover == protover) return world->packets + i;
+    }
+    return NULL;
+}